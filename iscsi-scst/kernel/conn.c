@@ -929,6 +929,7 @@ int iscsi_init_conn(struct iscsi_session *session,
 		    struct iscsi_conn *conn)
 {
 	int res;
+	unsigned int i;
 
 	atomic_set(&conn->conn_ref_cnt, 0);
 	conn->session = session;
@@ -949,6 +950,8 @@ int iscsi_init_conn(struct iscsi_session *session,
 	conn->target = session->target;
 	spin_lock_init(&conn->cmd_list_lock);
 	INIT_LIST_HEAD(&conn->cmd_list);
+	for (i = 0; i < ARRAY_SIZE(conn->cmd_itt_hash); i++)
+		INIT_LIST_HEAD(&conn->cmd_itt_hash[i]);
 	spin_lock_init(&conn->write_list_lock);
 	INIT_LIST_HEAD(&conn->write_list);
 	INIT_LIST_HEAD(&conn->write_timeout_list);
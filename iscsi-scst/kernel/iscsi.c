@@ -327,6 +327,7 @@ void iscsi_cmnd_init(struct iscsi_conn *conn, struct iscsi_cmnd *cmnd,
 
 		INIT_LIST_HEAD(&cmnd->rsp_cmd_list);
 		INIT_LIST_HEAD(&cmnd->rx_ddigest_cmd_list);
+		INIT_LIST_HEAD(&cmnd->cmd_itt_hash_entry);
 		cmnd->target_task_tag = ISCSI_RESERVED_TAG_CPU32;
 
 		spin_lock_bh(&conn->cmd_list_lock);
@@ -450,6 +451,7 @@ void cmnd_done(struct iscsi_cmnd *cmnd)
 
 		spin_lock_bh(&conn->cmd_list_lock);
 		list_del(&cmnd->cmd_list_entry);
+		list_del(&cmnd->cmd_itt_hash_entry);
 		spin_unlock_bh(&conn->cmd_list_lock);
 
 		conn_put(conn);
@@ -1319,12 +1321,28 @@ static void update_stat_sn(struct iscsi_cmnd *cmnd)
 	return;
 }
 
+static void cmnd_insert_itt_hash(struct iscsi_cmnd *cmnd)
+{
+	struct iscsi_conn *conn = cmnd->conn;
+	struct list_head *head;
+
+	head = &conn->cmd_itt_hash[cmnd_hashfn((__force u32)cmnd->pdu.bhs.itt)];
+
+	spin_lock_bh(&conn->cmd_list_lock);
+	list_add_tail(&cmnd->cmd_itt_hash_entry, head);
+	spin_unlock_bh(&conn->cmd_list_lock);
+	return;
+}
+
 static struct iscsi_cmnd *cmnd_find_itt_get(struct iscsi_conn *conn, __be32 itt)
 {
 	struct iscsi_cmnd *cmnd, *found_cmnd = NULL;
+	struct list_head *head;
+
+	head = &conn->cmd_itt_hash[cmnd_hashfn((__force u32)itt)];
 
 	spin_lock_bh(&conn->cmd_list_lock);
-	list_for_each_entry(cmnd, &conn->cmd_list, cmd_list_entry) {
+	list_for_each_entry(cmnd, head, cmd_itt_hash_entry) {
 		if ((cmnd->pdu.bhs.itt == itt) && !cmnd_get_check(cmnd)) {
 			found_cmnd = cmnd;
 			break;
@@ -3224,6 +3242,13 @@ int cmnd_rx_start(struct iscsi_cmnd *cmnd)
 
 	cmnd->pdu.bhs.sn = be32_to_cpu((__force __be32)cmnd->pdu.bhs.sn);
 
+	/*
+	 * Data-Out PDUs carry ITT of the command they belong to, so they
+	 * must not shadow it in the ITT hash.
+	 */
+	if (cmnd_opcode(cmnd) != ISCSI_OP_SCSI_DATA_OUT)
+		cmnd_insert_itt_hash(cmnd);
+
 	switch (cmnd_opcode(cmnd)) {
 	case ISCSI_OP_SCSI_CMD:
 		res = scsi_cmnd_start(cmnd);
@@ -215,6 +215,12 @@ struct iscsi_conn {
 	/* Protected by cmd_list_lock */
 	struct list_head cmd_list; /* in/outcoming pdus */
 
+	/*
+	 * Received request PDUs, except Data-Out, hashed by ITT for task
+	 * management lookups. Protected by cmd_list_lock.
+	 */
+	struct list_head cmd_itt_hash[1 << ISCSI_HASH_ORDER];
+
 	atomic_t conn_ref_cnt;
 
 	spinlock_t write_list_lock;
@@ -513,6 +519,7 @@ struct iscsi_cmnd {
 	__be32 ddigest;
 
 	struct list_head cmd_list_entry;
+	struct list_head cmd_itt_hash_entry;
 	struct list_head nop_req_list_entry;
 
 	unsigned int not_received_data_len;
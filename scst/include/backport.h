@@ -70,6 +70,14 @@ static inline unsigned int queue_max_hw_sectors(struct request_queue *q)
 #endif
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37) && !defined(__rcu)
+#define __rcu
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 33) && !defined(__percpu)
+#define __percpu
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0) && !defined(READ_ONCE)
 /*
  * See also patch "kernel: Provide READ_ONCE and ASSIGN_ONCE" (commit ID
@@ -78,6 +86,10 @@ static inline unsigned int queue_max_hw_sectors(struct request_queue *q)
 #define READ_ONCE(x) (*(volatile typeof(x) *)&(x))
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0) && !defined(WRITE_ONCE)
+#define WRITE_ONCE(x, val) (*(volatile typeof(x) *)&(x) = (val))
+#endif
+
 /* <linux/cpumask.h> */
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 20) && !defined(BACKPORT_LINUX_CPUMASK_H)
@@ -515,6 +527,15 @@ typedef void (*rcu_callback_t)(struct rcu_head *);
 	__kfree_rcu(&((ptr)->rcu_head), offsetof(typeof(*(ptr)), rcu_head))
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 34) && !defined(rcu_access_pointer)
+#define rcu_access_pointer(p) ACCESS_ONCE(p)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 34) &&	\
+	!defined(rcu_dereference_protected)
+#define rcu_dereference_protected(p, c) (p)
+#endif
+
 /* <rdma/ib_verbs.h> */
 /* commit ed082d36 */
 #ifndef ib_alloc_pd
@@ -624,6 +645,16 @@ static inline void *kmalloc_array(size_t n, size_t size, gfp_t flags)
 }
 #endif
 
+/* <linux/spinlock.h> */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 27) && !defined(spin_lock_nest_lock)
+/*
+ * See also patch "lockdep: annotate mm_take_all_locks()" (commit ID
+ * b7d3622a39fde7658170b7f3cf6c6889bb8db30d).
+ */
+#define spin_lock_nest_lock(lock, nest_lock) spin_lock(lock)
+#endif
+
 /* <linux/t10-pi.h> */
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 18, 0)
@@ -38,6 +38,7 @@
 #include <linux/blkdev.h>
 #include <linux/interrupt.h>
 #include <linux/wait.h>
+#include <linux/rcupdate.h>
 #include <linux/cpumask.h>
 #include <linux/dlm.h>
 #ifdef CONFIG_SCST_MEASURE_LATENCY
@@ -796,6 +797,13 @@ struct scst_tgt_template {
 	 */
 	unsigned multithreaded_init_done:1;
 
+	/*
+	 * True, if tgt_devs for all LUNs must be allocated at the session
+	 * registration, even if SCST is configured to allocate them on the
+	 * first access to their LUNs.
+	 */
+	unsigned eager_tgt_devs:1;
+
 	/*
 	 * True, if this target driver supports T10-PI (DIF), i.e. sending and
 	 * receiving DIF PI tags. If false, SCST will not allow to add
@@ -1766,6 +1774,17 @@ struct scst_tgt {
 	struct scst_acg *default_acg; /* default acg for this target */
 
 	struct list_head tgt_acg_list; /* target ACG groups */
+
+	/*
+	 * Index of the names of all ACGs in tgt_acg_list for ACG lookups.
+	 * Rebuilt by scst_tgt_update_acn_index() under scst_mutex and read
+	 * under rcu_read_lock(). NULL, if not built, then ACG lookups walk
+	 * the lists.
+	 */
+	struct scst_acn_index __rcu *tgt_acn_index;
+
+	/* Set if tgt_acn_index should be rebuilt at the batch commit */
+	bool tgt_acn_index_stale;
 #endif
 
 	/*
@@ -1809,6 +1828,22 @@ struct scst_tgt {
 	/* Used to wait until session finished to unregister */
 	wait_queue_head_t unreg_waitQ;
 
+	/*
+	 * Per target activity suspending, see scst_suspend_tgt_activity().
+	 * tgt_suspend_count is protected by scst_suspend_mutex, the flags
+	 * are checked without locks on the commands processing path.
+	 */
+	int tgt_suspend_count;
+	bool tgt_suspending;
+	bool tgt_suspended;
+
+	/*
+	 * Per CPU counters of this target's commands and TM commands inside
+	 * scst_get(). A command may be counted up on one CPU and down on
+	 * another, so only their sum is meaningful.
+	 */
+	atomic_t __percpu *tgt_cmd_counts;
+
 #ifdef CONFIG_SCST_PROC
 	/* Device number in /proc */
 	int proc_num;
@@ -1910,15 +1945,55 @@ struct scst_session {
 	/* session's async flags */
 	unsigned long sess_aflags;
 
+	/*
+	 * Index of the init queue, which all commands of this session are
+	 * passed through, if they can't be inited directly. Constant.
+	 */
+	unsigned int sess_init_queue;
+
 	/*
 	 * Hash list for tgt_dev's for this session with size and fn. It isn't
 	 * hlist_entry, because we need ability to go over the list in the
-	 * reverse order. Protected by scst_mutex and suspended activity.
+	 * reverse order. Protected by scst_mutex and suspended activity,
+	 * except that tgt_devs allocated on the first access to their LUNs
+	 * are added RCU-style under scst_mutex and sess_tgt_dev_add_lock.
 	 */
 #define	SESS_TGT_DEV_LIST_HASH_SIZE (1 << 5)
 #define	SESS_TGT_DEV_LIST_HASH_FN(val) ((val) & (SESS_TGT_DEV_LIST_HASH_SIZE - 1))
 	struct list_head sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_SIZE];
 
+	/*
+	 * Serializes adding tgt_devs on the first access to their LUNs with
+	 * paths locking all tgt_devs of this session without scst_mutex.
+	 */
+	spinlock_t sess_tgt_dev_add_lock;
+
+	/*
+	 * Generation of the session-wide REPORTED LUNS DATA CHANGED UA and
+	 * the last generation delivered to the initiator. The UA itself is
+	 * queued to a tgt_dev only on its next command, if the tgt_dev's
+	 * tgt_dev_luns_changed_gen lags behind. Protected by
+	 * sess_tgt_dev_add_lock.
+	 */
+	unsigned int sess_luns_changed_gen;
+	unsigned int sess_luns_changed_done_gen;
+
+	/* Number of UAs not queued, because the same UA was pending */
+	atomic_t sess_ua_suppressed;
+
+	/*
+	 * Commands to LUNs, which don't have tgt_dev yet, waiting for
+	 * sess_lazy_tgt_dev_work to allocate it. Protected by sess_list_lock.
+	 */
+	struct list_head sess_lazy_cmd_list;
+	struct work_struct sess_lazy_tgt_dev_work;
+
+	/*
+	 * Number of parked commands, which haven't got their SN yet. While
+	 * it isn't 0, new commands are parked as well to keep the order.
+	 */
+	atomic_t sess_lazy_cmd_cnt;
+
 	/*
 	 * List of cmds in this session. Protected by sess_list_lock.
 	 *
@@ -1928,6 +2003,16 @@ struct scst_session {
 	 */
 	struct list_head sess_cmd_list ____cacheline_aligned_in_smp;
 
+	/*
+	 * Same commands as in sess_cmd_list, hashed by their tag, so TM
+	 * functions can find them without scanning the whole list. Inside
+	 * each bucket commands are kept in the arrival order. Protected by
+	 * sess_list_lock.
+	 */
+#define	SESS_CMD_TAG_HASH_SIZE (1 << 7)
+#define	SESS_CMD_TAG_HASH_FN(tag) ((u32)(tag) & (SESS_CMD_TAG_HASH_SIZE - 1))
+	struct list_head sess_cmd_tag_hash[SESS_CMD_TAG_HASH_SIZE];
+
 	spinlock_t sess_list_lock; /* protects sess_cmd_list, etc */
 
 	atomic_t refcnt;		/* get/put counter */
@@ -2014,6 +2099,13 @@ struct scst_session {
 	struct kobject sess_kobj; /* session sysfs entry */
 #endif
 
+	/*
+	 * Set if tgt_devs of this session are allocated on the first access
+	 * to their LUNs instead of at the session registration. Constant
+	 * after the registration.
+	 */
+	unsigned int sess_lazy_tgt_devs:1;
+
 	/*
 	 * Functions and data for user callbacks from scst_register_session()
 	 * and scst_unregister_session()
@@ -2059,6 +2151,24 @@ struct scst_pr_abort_all_pending_mgmt_cmds_counter {
 /*
  * Structure to control commands' queuing and threads pool processing the queue
  */
+/*
+ * QoS token bucket. Tokens are scaled by HZ, i.e. accounted in 1/HZ of
+ * a command or a byte, so they can be refilled every jiffy without
+ * rounding losses. Protected by the lock of the owning object.
+ */
+struct scst_qos_bucket {
+	/* Limits, 0 - unlimited */
+	unsigned int qb_iops_limit;	/* commands per second */
+	unsigned int qb_bw_limit;	/* KB per second */
+
+	s64 qb_iops_tokens;
+	s64 qb_bw_tokens;
+	unsigned long qb_last_refill;
+
+	/* Number of commands delayed because of this bucket */
+	u64 qb_throttled;
+};
+
 struct scst_cmd_threads {
 	spinlock_t cmd_list_lock;
 	struct list_head active_cmd_list; /* commands queue */
@@ -2077,6 +2187,31 @@ struct scst_cmd_threads {
 	int nr_threads; /* number of processing threads */
 	struct list_head threads_list; /* processing threads */
 
+	/*
+	 * Number of threads with enough commands on their own lists for
+	 * idle threads to steal some of them.
+	 */
+	atomic_t nr_backlogged_threads;
+
+	/*
+	 * Adaptive sizing of the pool, see scst_thr_tune_work_fn(). All
+	 * fields below are protected by scst_cmd_threads_mutex.
+	 */
+
+	/* Max number of threads the pool can grow to, 0 - not adaptive */
+	int thr_adaptive_max;
+	/* Arguments for scst_add_threads() when growing the pool */
+	struct scst_device *thr_dev;
+	struct scst_tgt_dev *thr_tgt_dev;
+	/* Consecutive samples with all threads busy and commands queued */
+	int thr_busy_samples;
+	/* Consecutive samples with less than half of the threads busy */
+	int thr_idle_samples;
+	/* Exported decisions statistics */
+	unsigned long thr_grown, thr_shrunk;
+	const char *thr_last_decision;
+	unsigned long thr_last_decision_time;
+
 	struct list_head lists_list_entry;
 };
 
@@ -2224,6 +2359,12 @@ struct scst_cmd {
 	/* Set if cmd is on dev's exec_cmd_list */
 	unsigned int on_dev_exec_list:1;
 
+	/* Set if the cmd passed QoS limits, see scst_qos_admit() */
+	unsigned int qos_admitted:1;
+
+	/* Set if cmd is counted in sess_lazy_cmd_cnt */
+	unsigned int lazy_parked:1;
+
 	/* Set if this cmd passed check for SCSI atomicity */
 	unsigned int scsi_atomicity_checked:1;
 
@@ -2380,6 +2521,9 @@ struct scst_cmd {
 	/* List entry for sess's sess_cmd_list */
 	struct list_head sess_cmd_list_entry;
 
+	/* List entry for sess's sess_cmd_tag_hash */
+	struct list_head sess_cmd_tag_hash_entry;
+
 	/*
 	 * Used to found the cmd by scst_find_cmd_by_tag(). Set by the
 	 * target driver on the cmd's initialization time
@@ -2523,6 +2667,12 @@ struct scst_cmd {
 	unsigned short sense_valid_len; /* length of valid sense data */
 	unsigned short sense_buflen; /* length of the sense buffer, if any */
 
+	/*
+	 * Sense buffer used instead of an allocated one for short sense.
+	 * Aligned, because target drivers may copy sense by 32-bit words.
+	 */
+	uint8_t sense_inline[SCST_INLINE_SENSE_BUFFERSIZE] __aligned(4);
+
 	/* Start time when cmd was sent to rdy_to_xfer() or xmit_response() */
 	unsigned long hw_pending_start;
 
@@ -2532,6 +2682,12 @@ struct scst_cmd {
 	/* Used for storage of dev handler private stuff */
 	void *dh_priv;
 
+	/*
+	 * List entry for dev handler's private use, e.g. to queue the cmd
+	 * until an asynchronous operation on its behalf finished.
+	 */
+	struct list_head dh_list_entry;
+
 	/*
 	 * Number of waiting for this cmd to finish commands
 	 * with SCSI atomic guarantees. Protected by dev->dev_lock.
@@ -2717,6 +2873,8 @@ struct scst_dev_registrant {
 
 	/* For registrant information managed via the DLM. */
 	int dlm_idx;
+	/* Whether an asynchronous DLM request for lksb is outstanding. */
+	bool dlm_pending;
 	struct scst_lksb lksb;
 	char lvb[PR_DLM_LVB_LEN];
 };
@@ -2739,6 +2897,7 @@ struct scst_dev_registrant {
  *                   reservation on @dev.
  * @reserve:         Apply an SPC-2 reservation for session @sess on @dev if
  *                   @sess != NULL or clear that reservation if @ses == NULL.
+ * @pr_show_stats:   Format cluster synchronization statistics into @buf.
  */
 struct scst_cl_ops {
 	int  (*pr_init)(struct scst_device *dev, const char *cl_dev_id);
@@ -2761,6 +2920,7 @@ struct scst_cl_ops {
 	bool (*is_not_rsv_holder)(struct scst_device *dev,
 				  struct scst_session *sess);
 	void (*reserve)(struct scst_device *dev, struct scst_session *sess);
+	ssize_t (*pr_show_stats)(struct scst_device *dev, char *buf);
 };
 
 /*
@@ -3100,6 +3260,29 @@ struct scst_device {
 	/* Threads pool type of the device. Valid only if threads_num > 0. */
 	enum scst_dev_type_threads_pool_type threads_pool_type;
 
+	/*
+	 * Max number of threads each of the device's threads pools can
+	 * adaptively grow to, 0 - no adaptive sizing. Valid only if
+	 * threads_num > 0.
+	 */
+	int threads_max;
+
+	/*
+	 * QoS scheduler of the device. Dev_qos_lock protects the device's
+	 * and all its tgt_devs' QoS buckets and queues of the delayed
+	 * commands.
+	 */
+	spinlock_t dev_qos_lock;
+	struct scst_qos_bucket dev_qos_bucket;
+	/* List of tgt_devs with delayed commands, in the serving order */
+	struct list_head dev_qos_active_list;
+	int dev_qos_nr_active;
+	/* Number of delayed commands */
+	int dev_qos_parked;
+	/* Set if the delayed commands are waiting for dev_qos_bucket */
+	bool dev_qos_dev_blocked;
+	struct timer_list dev_qos_timer;
+
 #ifndef CONFIG_SCST_PROC
 	/* sysfs release completion */
 	struct completion *dev_kobj_release_cmpl;
@@ -3190,11 +3373,14 @@ struct scst_tgt_dev {
 	/* How many cmds alive on this dev in this session */
 	atomic_t tgt_dev_cmd_count ____cacheline_aligned_in_smp;
 
-	/* ALUA command filter */
+	/*
+	 * Target group whose ALUA command filter applies to this tgt_dev or
+	 * NULL, if none. RCU protected, changed under scst_dg_mutex.
+	 */
 #define SCST_ALUA_CHECK_OK	0
 #define SCST_ALUA_CHECK_DELAYED 1
 #define SCST_ALUA_CHECK_ERROR	-1
-	int (*alua_filter)(struct scst_cmd *cmd);
+	struct scst_target_group __rcu *alua_tg;
 
 	struct scst_order_data *curr_order_data;
 	struct scst_order_data tgt_dev_order_data;
@@ -3220,6 +3406,13 @@ struct scst_tgt_dev {
 	/* List of UA's for this device, protected by tgt_dev_lock */
 	struct list_head UA_list;
 
+	/*
+	 * The last sess_luns_changed_gen, for which REPORTED LUNS DATA
+	 * CHANGED UA was queued to UA_list or delivered. Protected by
+	 * tgt_dev_lock.
+	 */
+	unsigned int tgt_dev_luns_changed_gen;
+
 	struct scst_session *sess;	/* corresponding session */
 	struct scst_acg_dev *acg_dev;	/* corresponding acg_dev */
 
@@ -3247,6 +3440,18 @@ struct scst_tgt_dev {
 	unsigned short tgt_dev_valid_sense_len;
 	uint8_t tgt_dev_sense[SCST_SENSE_BUFFERSIZE];
 
+	/*
+	 * QoS state, protected by dev->dev_qos_lock. Limits and weight are
+	 * copied from acg_dev.
+	 */
+	struct scst_qos_bucket tgt_dev_qos_bucket;
+	unsigned int tgt_dev_qos_weight;
+	int tgt_dev_qos_deficit;
+	/* Commands delayed by QoS */
+	struct list_head tgt_dev_qos_cmd_list;
+	/* Entry in dev_qos_active_list */
+	struct list_head tgt_dev_qos_list_entry;
+
 	/*
 	 * LUN thread index assigned by scst_add_threads(). Exported via
 	 * sysfs. Can be used to look up which export thread is serving which
@@ -3288,6 +3493,14 @@ struct scst_acg_dev {
 	/* Guard tags format, one of SCST_DIF_GUARD_FORMAT_* constants */
 	int acg_dev_dif_guard_format;
 
+	/*
+	 * QoS limits for each tgt_dev of this LUN, 0 - unlimited, and its
+	 * weight, when sharing the device's bandwidth.
+	 */
+	unsigned int acg_dev_qos_iops_limit;
+	unsigned int acg_dev_qos_bw_limit;
+	unsigned int acg_dev_qos_weight;
+
 	struct scst_acg *acg; /* parent acg */
 
 	/* List entry in dev->dev_acg_dev_list */
@@ -3324,10 +3537,16 @@ struct scst_acg {
 	/* List of attached sessions, protected by scst_mutex */
 	struct list_head acg_sess_list;
 
-	/* List of attached acn's, protected by scst_mutex */
+	/*
+	 * List of attached acn's, protected by scst_mutex. Can also be read
+	 * under rcu_read_lock().
+	 */
 	struct list_head acn_list;
 
-	/* List entry in acg_lists (procfs) or tgt_acg_list (sysfs) */
+	/*
+	 * List entry in acg_lists (procfs) or tgt_acg_list (sysfs). Both lists
+	 * can also be read under rcu_read_lock().
+	 */
 	struct list_head acg_list_entry;
 
 	/* Name of this acg */
@@ -3346,6 +3565,12 @@ struct scst_acg {
 
 	unsigned int tgt_acg:1;
 
+	/*
+	 * Set if REPORTED LUNS DATA HAS CHANGED UA was deferred until the
+	 * commit of the open configuration batch. Protected by scst_mutex.
+	 */
+	bool acg_luns_changed_pending;
+
 /* Not a black hole */
 #define SCST_ACG_BLACK_HOLE_NONE	0
 
@@ -3386,6 +3611,10 @@ struct scst_acg {
 	/* LUNS addressing method for all LUNs in this ACG */
 	enum scst_lun_addr_method addr_method;
 
+	/* QoS limits for all commands of all sessions in this ACG */
+	spinlock_t acg_qos_lock;
+	struct scst_qos_bucket acg_qos_bucket;
+
 	/* Private stuff for target drivers */
 	void *acg_tgt_priv;
 };
@@ -3399,11 +3628,25 @@ struct scst_acn {
 
 	const char *name; /* initiator's name */
 
+	/*
+	 * How name is matched against initiator names, one of SCST_ACN_MATCH_*
+	 * constants, and, for SCST_ACN_MATCH_PREFIX, the prefix length.
+	 * Precomputed from name by scst_acn_compile().
+	 */
+#define SCST_ACN_MATCH_EXACT		0
+#define SCST_ACN_MATCH_PREFIX		1
+#define SCST_ACN_MATCH_WILDCARD		2
+	int acn_match_type;
+	int acn_prefix_len;
+
 	/* List entry in acg->acn_list */
 	struct list_head acn_list_entry;
 
 	/* sysfs file attributes */
 	struct kobj_attribute *acn_attr;
+
+	/* Frees this structure after the ACG lookups stopped using it */
+	struct rcu_head rcu_head;
 };
 
 /**
@@ -3447,10 +3690,18 @@ struct scst_dg_dev {
  * @name:        Name of this target group.
  * @group_id:    SPC-4 target port group ID.
  * @state:       SPC-4 target port group ALUA state.
+ * @alua_filter: ALUA command filter for @state. Read without locks by the
+ *               command path via scst_tgt_dev.alua_tg.
  * @preferred:   Value of the SPC-4 target port group PREF attribute.
  * @entry:       Entry in scst_dev_group.tg_list.
  * @tgt_list:    list of scst_tg_tgt elements; protected by scst_mutex.
  * @kobj:        For making this object visible in sysfs.
+ * @state_changed: Time in jiffies of the last ALUA state change.
+ * @state_changes: Number of ALUA state changes.
+ * @transitions: Number of completed transitioning periods.
+ * @last_transition_ms: Duration of the last transitioning period.
+ * @max_transition_ms: Longest transitioning period.
+ * @rcu_head:    Frees this structure after the command path stopped using it.
  *
  * Such a group is either a primary target port group or a secondary
  * port group. See also SPC-4 for more information.
@@ -3460,10 +3711,17 @@ struct scst_target_group {
 	char			*name;
 	uint16_t		group_id;
 	enum scst_tg_state	state;
+	int			(*alua_filter)(struct scst_cmd *cmd);
 	bool			preferred;
 	struct list_head	entry;
 	struct list_head	tgt_list;
 	struct kobject		kobj;
+	unsigned long		state_changed;
+	unsigned int		state_changes;
+	unsigned int		transitions;
+	unsigned int		last_transition_ms;
+	unsigned int		max_transition_ms;
+	struct rcu_head		rcu_head;
 };
 
 /**
@@ -5252,6 +5510,10 @@ extern struct lockdep_map scst_suspend_dep_map;
 
 int scst_suspend_activity(unsigned long timeout);
 void scst_resume_activity(void);
+int scst_suspend_tgt_activity(struct scst_tgt *tgt, unsigned long timeout);
+void scst_resume_tgt_activity(struct scst_tgt *tgt);
+int scst_suspend_dev_activity(struct scst_device *dev);
+void scst_resume_dev_activity(struct scst_device *dev);
 
 void scst_process_active_cmd(struct scst_cmd *cmd, bool atomic);
 
@@ -5620,6 +5882,18 @@ struct scst_sysfs_work_item {
 	 */
 	struct lockdep_map *dep_map;
 
+	/*
+	 * Identifies the object modified by the work. Not read only works
+	 * with the same key are executed one by one in the order they were
+	 * queued, while works with different keys can be executed in
+	 * parallel. Works not setting it are serialized with each other.
+	 */
+	unsigned long obj_key;
+
+	/* Private, for the per work type statistics */
+	struct scst_sysfs_work_stat *stat;
+	uint64_t queue_time_us;
+
 	union {
 		struct scst_dev_type *devt;
 		struct scst_tgt_template *tgtt;
@@ -5640,6 +5914,7 @@ struct scst_sysfs_work_item {
 				bool default_val;
 			};
 			enum scst_dev_type_threads_pool_type new_threads_pool_type;
+			int new_threads_max;
 		};
 		struct scst_session *sess;
 		struct {
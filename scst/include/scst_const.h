@@ -81,6 +81,12 @@
 /* Max size of sense */
 #define SCST_SENSE_BUFFERSIZE        252
 
+/*
+ * Size of the sense buffer embedded in struct scst_cmd. Sufficient for all
+ * sense data generated by SCST itself, both fixed and descriptor format.
+ */
+#define SCST_INLINE_SENSE_BUFFERSIZE 32
+
 /*************************************************************
  ** Allowed delivery statuses for cmd's delivery_status
  *************************************************************/
@@ -85,11 +85,28 @@ struct scst_event_notify_done {
 	int status;
 };
 
+/*
+ * Batched SCST_EVENT_NOTIFY_DONE + SCST_EVENT_GET_NEXT_EVENT. Events are
+ * returned in pevents as records of event_size bytes each, i.e. event i
+ * starts at offset i * event_size. If the first event doesn't fit, the
+ * ioctl fails with ENOSPC and event_size is set to the needed size.
+ */
+struct scst_event_get_multi {
+	aligned_u64 pnotify_done; /* in, struct scst_event_notify_done[] */
+	aligned_u64 pevents; /* in */
+	int32_t event_size; /* in/out */
+	int16_t notify_done_cnt; /* in */
+	int16_t notify_done_done; /* out */
+	int16_t events_cnt; /* in/out */
+	int16_t pad[3];
+};
+
 /* IOCTLs */
 #define SCST_EVENT_ALLOW_EVENT		_IOW('u', 1, struct scst_event)
 #define SCST_EVENT_DISALLOW_EVENT	_IOW('u', 2, struct scst_event)
 #define SCST_EVENT_GET_NEXT_EVENT	_IOWR('u', 3, struct scst_event_user)
 #define SCST_EVENT_NOTIFY_DONE		_IOW('u', 4, struct scst_event_notify_done)
+#define SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI _IOWR('u', 5, struct scst_event_get_multi)
 
 #ifdef __KERNEL__
 void scst_event_queue(uint32_t event_code, const char *issuer_name,
@@ -52,6 +52,8 @@
 #include <linux/bio.h>
 #include <linux/crc32c.h>
 #include <linux/swap.h>
+#include <linux/rbtree.h>
+#include <linux/radix-tree.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
 #include <linux/falloc.h>
 #endif
@@ -173,6 +175,8 @@ struct scst_vdisk_dev {
 	unsigned int media_changed:1;
 	unsigned int prevent_allow_medium_removal:1;
 	unsigned int nullio:1;
+	/* vdisk_ramdisk device, nullio is set as well */
+	unsigned int ramdisk:1;
 	unsigned int blockio:1;
 	unsigned int blk_integrity:1;
 	unsigned int cdrom_empty:1;
@@ -190,6 +194,8 @@ struct scst_vdisk_dev {
 	unsigned int expl_alua:1;
 	unsigned int reexam_pending:1;
 	unsigned int size_key:1;
+	/* Set if file_size etc. were filled by vdisk_probe_backing_store() */
+	unsigned int backing_probed:1;
 
 	struct file *fd;
 	struct file *dif_fd;
@@ -198,6 +204,18 @@ struct scst_vdisk_dev {
 	struct bio_set *vdisk_bioset;
 #endif
 
+	/* BLOCKIO write-back cache, NULL if disabled */
+	struct vdisk_wbc *wbc;
+	unsigned int wbc_size_mb;
+
+	/* BLOCKIO read-ahead, NULL if disabled */
+	struct vdisk_ra *ra;
+	unsigned int ra_size_kb;
+
+	/* Backing store of a vdisk_ramdisk device */
+	struct vdisk_rd *rd;
+	unsigned int rd_mem_limit_mb;
+
 	uint64_t format_progress_to_do, format_progress_done;
 
 	int virt_id;
@@ -246,8 +264,26 @@ struct scst_vdisk_dev {
 
 	struct work_struct vdev_inq_changed_work;
 
+	/*
+	 * SYNCHRONIZE CACHE coalescing, see vdisk_flush_queue(). Can be taken
+	 * on IRQ context. Commands are linked by their dh_list_entry, because
+	 * their vdisk_cmd_params can be on the stack of blockio_exec().
+	 */
+	spinlock_t flush_lock;
+	/* All protected by flush_lock */
+	unsigned int flush_in_progress:1;
+	unsigned int flush_needed:1;
+	/* Commands waiting for the next flush */
+	struct list_head flush_next_list;
+	unsigned long flush_cmds, flushes;
+
+	/* Commands waiting for the flush in progress, owned by its issuer */
+	struct list_head flush_list;
+
 	/* Only to pass it to attach() callback. Don't use them anywhere else! */
 	int blk_shift;
+	int probe_res;
+	uint64_t probe_time_us;
 	int numa_node_id;
 	enum scst_dif_mode dif_mode;
 	int dif_type;
@@ -265,6 +301,149 @@ struct vdisk_cmd_params {
 	bool use_zero_copy;
 };
 
+/* Max number of blocks in a write-back cache unit */
+#define VDISK_WBC_UNIT_MAX_BLOCKS	(PAGE_SIZE >> 9)
+/* Max size of a single destage write */
+#define VDISK_WBC_DESTAGE_SIZE		(1024 * 1024)
+/* Max time dirty data stay in the write-back cache */
+#define VDISK_WBC_EXPIRE		(5 * HZ)
+
+/* Caches PAGE_SIZE bytes of a BLOCKIO device at offset idx << PAGE_SHIFT */
+struct vdisk_wbc_unit {
+	struct rb_node unit_node;
+	/* Entry in clean_lru of vdisk_wbc, if neither dirty, nor in writeback */
+	struct list_head lru_entry;
+	uint64_t idx;
+	struct page *page;
+	unsigned int writeback:1;
+	DECLARE_BITMAP(valid, VDISK_WBC_UNIT_MAX_BLOCKS);
+	DECLARE_BITMAP(dirty, VDISK_WBC_UNIT_MAX_BLOCKS);
+};
+
+/* Part of a destage run, see vdisk_wbc_collect_run() */
+struct vdisk_wbc_run_part {
+	struct vdisk_wbc_unit *unit;
+	unsigned int first, cnt;
+};
+
+/*
+ * Write-back cache of a BLOCKIO device. Absorbs WRITEs in RAM and destages
+ * them in the background in the LBA order, coalescing adjacent dirty blocks
+ * into large sequential writes. SYNCHRONIZE CACHE and FUA are always
+ * honored, i.e. there's no assumption that the RAM is battery backed.
+ */
+struct vdisk_wbc {
+	struct scst_vdisk_dev *virt_dev;
+
+	/* Protects all below, except the destage fields. Thread context only. */
+	spinlock_t wbc_lock;
+	struct rb_root units;
+	struct list_head clean_lru;
+	unsigned int units_cnt, units_max, dirty_units;
+	unsigned long read_hits, read_misses, write_hits, writes, full_waits;
+	unsigned long destage_runs;
+	uint64_t destaged_bytes;
+	/* Set if the last destage run failed */
+	bool destage_failed;
+
+	/* Woken up when units become clean or destaging fails */
+	wait_queue_head_t wbc_wait;
+
+	/* Serializes destaging and protects all below */
+	struct mutex destage_mutex;
+	void *destage_buf;
+	struct vdisk_wbc_run_part *run;
+
+	struct work_struct destage_work;
+	struct delayed_work expire_work;
+};
+
+/* Number of prefetch buffers of a BLOCKIO device */
+#define VDISK_RA_SLOTS			8
+/* Number of sequential streams tracked per tgt_dev */
+#define VDISK_RA_STREAMS		4
+/* Number of sequential reads after which a stream is prefetched */
+#define VDISK_RA_SEQ_MIN		2
+/* Max read-ahead window size */
+#define VDISK_RA_MAX_SIZE_KB		8192
+
+enum vdisk_ra_slot_state {
+	VDISK_RA_EMPTY,
+	VDISK_RA_READING,
+	VDISK_RA_VALID,
+};
+
+/* A prefetch buffer holding a read-ahead window */
+struct vdisk_ra_slot {
+	struct vdisk_ra *ra;
+	enum vdisk_ra_slot_state state;
+	/* Set if overwritten while being read or copied */
+	unsigned int stale:1;
+	/* Number of commands copying data from this slot */
+	int refcnt;
+	loff_t loff;
+	size_t len;
+	unsigned long last_used;
+	void *buf;
+	struct work_struct ra_work;
+};
+
+/*
+ * Read-ahead of a BLOCKIO device. Sequential READ streams are detected per
+ * tgt_dev, see struct vdisk_ra_stream, and the windows following them are
+ * prefetched asynchronously into slots, from which the next READs of the
+ * streams are served.
+ */
+struct vdisk_ra {
+	struct scst_vdisk_dev *virt_dev;
+	size_t size;
+
+	/* Protects all below. Can be taken on IRQ context. */
+	spinlock_t ra_lock;
+	struct vdisk_ra_slot slots[VDISK_RA_SLOTS];
+	unsigned long streams, prefetches, hits, waits, misses;
+	uint64_t prefetched_bytes;
+
+	/* Woken up when prefetches finish */
+	wait_queue_head_t ra_wait;
+};
+
+/* A sequential READ stream, protected by ra_lock */
+struct vdisk_ra_stream {
+	/* Offset of the next sequential READ */
+	loff_t next_loff;
+	/* Offset of the next read-ahead window */
+	loff_t ra_loff;
+	unsigned int seq_cnt;
+	unsigned long last_used;
+};
+
+/* Private data of a tgt_dev of a BLOCKIO device with read-ahead */
+struct vdisk_ra_tgt_dev {
+	struct vdisk_ra_stream streams[VDISK_RA_STREAMS];
+};
+
+/*
+ * Sparse in-memory backing store of a vdisk_ramdisk device. Pages are
+ * allocated on the first write to them, holes read as zeros.
+ */
+struct vdisk_rd {
+	/*
+	 * Protects pages updates. Lookups are done under RCU and take the
+	 * page references speculatively, see vdisk_rd_find_get_page(),
+	 * because WRITEs replace lent pages by their copies.
+	 */
+	spinlock_t rd_lock;
+	/* Page index -> struct page */
+	struct radix_tree_root pages;
+	int numa_node_id;
+
+	/* All protected by rd_lock */
+	unsigned long pages_cnt;
+	unsigned long max_pages;	/* 0 - unlimited */
+	unsigned long limit_hits;
+};
+
 static bool vdev_saved_mode_pages_enabled = true;
 
 enum compl_status_e {
@@ -307,6 +486,7 @@ static int vcdrom_get_supported_opcodes(struct scst_cmd *cmd,
 	const struct scst_opcode_descriptor ***out_supp_opcodes,
 	int *out_supp_opcodes_cnt);
 static int fileio_alloc_data_buf(struct scst_cmd *cmd);
+static int ramdisk_alloc_data_buf(struct scst_cmd *cmd);
 static int vdisk_parse(struct scst_cmd *);
 static int vcdrom_parse(struct scst_cmd *);
 static int non_fileio_parse(struct scst_cmd *);
@@ -322,20 +502,39 @@ static void fileio_on_free_cmd(struct scst_cmd *cmd);
 static enum compl_status_e nullio_exec_read(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_read(struct vdisk_cmd_params *p);
 static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p);
+static enum compl_status_e ramdisk_exec_read(struct vdisk_cmd_params *p);
 static enum compl_status_e nullio_exec_write(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_write(struct vdisk_cmd_params *p);
 static enum compl_status_e fileio_exec_write(struct vdisk_cmd_params *p);
+static enum compl_status_e ramdisk_exec_write(struct vdisk_cmd_params *p);
 static enum compl_status_e nullio_exec_var_len_cmd(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_var_len_cmd(struct vdisk_cmd_params *p);
 static enum compl_status_e fileio_exec_var_len_cmd(struct vdisk_cmd_params *p);
+static enum compl_status_e ramdisk_exec_var_len_cmd(struct vdisk_cmd_params *p);
 static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua);
+static ssize_t vdev_read_sync(struct scst_vdisk_dev *virt_dev, void *buf,
+			      size_t len, loff_t *loff);
+static ssize_t vdev_write_sync(struct scst_vdisk_dev *virt_dev, void *buf,
+			       size_t len, loff_t *loff, bool fua);
+static int vdisk_wbc_destage_range(struct vdisk_wbc *wbc, uint64_t first,
+	uint64_t last, bool fua);
+static void vdisk_wbc_drop(struct vdisk_wbc *wbc);
+static bool vdisk_wbc_check_cmd(struct vdisk_cmd_params *p);
+static void vdisk_ra_invalidate_cmd(struct scst_cmd *cmd);
+static void vdisk_ra_drop(struct vdisk_ra *ra);
 static int vdisk_blockio_flush(struct block_device *bdev, gfp_t gfp_mask,
 	bool report_error, struct scst_cmd *cmd, bool async);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+static void vdisk_blockio_flush_coalesced(struct scst_vdisk_dev *virt_dev,
+	struct scst_cmd *cmd, gfp_t gfp_mask);
+#endif
 static enum compl_status_e vdev_exec_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_write_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e fileio_exec_write_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e nullio_exec_write_verify(struct vdisk_cmd_params *p);
 static enum compl_status_e nullio_exec_verify(struct vdisk_cmd_params *p);
+static enum compl_status_e ramdisk_exec_write_verify(struct vdisk_cmd_params *p);
+static enum compl_status_e vdisk_exec_caw(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_read_capacity(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_read_capacity16(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p);
@@ -366,6 +565,7 @@ static int vcdrom_write_proc(char *buffer, char **start, off_t offset,
 static ssize_t vdisk_add_fileio_device(const char *device_name, char *params);
 static ssize_t vdisk_add_blockio_device(const char *device_name, char *params);
 static ssize_t vdisk_add_nullio_device(const char *device_name, char *params);
+static ssize_t vdisk_add_ramdisk_device(const char *device_name, char *params);
 static ssize_t vdisk_del_device(const char *device_name);
 static ssize_t vcdrom_add_device(const char *device_name, char *params);
 static ssize_t vcdrom_del_device(const char *device_name);
@@ -432,6 +632,20 @@ static ssize_t vdisk_sysfs_resync_size_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count);
 static ssize_t vdisk_sysfs_sync_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_sysfs_flush_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_wb_cache_size_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_wb_cache_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_read_ahead_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_read_ahead_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_mem_limit_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_mem_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
 static ssize_t vdev_sysfs_t10_vend_id_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count);
 static ssize_t vdev_sysfs_t10_vend_id_show(struct kobject *kobj,
@@ -479,6 +693,8 @@ static ssize_t vdev_dif_filename_show(struct kobject *kobj,
 
 static ssize_t vcdrom_sysfs_filename_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_sysfs_attach_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
 
 static struct kobj_attribute vdev_size_ro_attr =
 	__ATTR(size, S_IRUGO, vdev_sysfs_size_show, NULL);
@@ -528,6 +744,24 @@ static struct kobj_attribute vdisk_resync_size_attr =
 	__ATTR(resync_size, S_IWUSR, NULL, vdisk_sysfs_resync_size_store);
 static struct kobj_attribute vdisk_sync_attr =
 	__ATTR(sync, S_IWUSR, NULL, vdisk_sysfs_sync_store);
+static struct kobj_attribute vdisk_flush_stats_attr =
+	__ATTR(flush_stats, S_IRUGO, vdisk_sysfs_flush_stats_show, NULL);
+static struct kobj_attribute vdisk_wb_cache_size_mb_attr =
+	__ATTR(wb_cache_size_mb, S_IRUGO, vdisk_sysfs_wb_cache_size_mb_show,
+	       NULL);
+static struct kobj_attribute vdisk_wb_cache_stats_attr =
+	__ATTR(wb_cache_stats, S_IRUGO, vdisk_sysfs_wb_cache_stats_show, NULL);
+static struct kobj_attribute vdisk_read_ahead_kb_attr =
+	__ATTR(read_ahead_kb, S_IRUGO, vdisk_sysfs_read_ahead_kb_show, NULL);
+static struct kobj_attribute vdisk_read_ahead_stats_attr =
+	__ATTR(read_ahead_stats, S_IRUGO, vdisk_sysfs_read_ahead_stats_show,
+	       NULL);
+static struct kobj_attribute vdisk_mem_limit_mb_attr =
+	__ATTR(mem_limit_mb, S_IRUGO, vdisk_sysfs_mem_limit_mb_show, NULL);
+static struct kobj_attribute vdisk_mem_stats_attr =
+	__ATTR(mem_stats, S_IRUGO, vdisk_sysfs_mem_stats_show, NULL);
+static struct kobj_attribute vdisk_attach_stats_attr =
+	__ATTR(attach_stats, S_IRUGO, vdisk_sysfs_attach_stats_show, NULL);
 static struct kobj_attribute vdev_t10_vend_id_attr =
 	__ATTR(t10_vend_id, S_IWUSR|S_IRUGO, vdev_sysfs_t10_vend_id_show,
 	       vdev_sysfs_t10_vend_id_store);
@@ -585,6 +819,7 @@ static const struct attribute *vdisk_fileio_attrs[] = {
 	&vdisk_cluster_mode_attr.attr,
 	&vdisk_resync_size_attr.attr,
 	&vdisk_sync_attr.attr,
+	&vdisk_flush_stats_attr.attr,
 	&vdev_t10_vend_id_attr.attr,
 	&vdev_vend_specific_id_attr.attr,
 	&vdev_prod_id_attr.attr,
@@ -614,6 +849,11 @@ static const struct attribute *vdisk_blockio_attrs[] = {
 	&vdisk_cluster_mode_attr.attr,
 	&vdisk_resync_size_attr.attr,
 	&vdisk_sync_attr.attr,
+	&vdisk_flush_stats_attr.attr,
+	&vdisk_wb_cache_size_mb_attr.attr,
+	&vdisk_wb_cache_stats_attr.attr,
+	&vdisk_read_ahead_kb_attr.attr,
+	&vdisk_read_ahead_stats_attr.attr,
 	&vdev_t10_vend_id_attr.attr,
 	&vdev_vend_specific_id_attr.attr,
 	&vdev_prod_id_attr.attr,
@@ -652,6 +892,31 @@ static const struct attribute *vdisk_nullio_attrs[] = {
 	NULL,
 };
 
+static const struct attribute *vdisk_ramdisk_attrs[] = {
+	&vdev_size_rw_attr.attr,
+	&vdev_size_mb_rw_attr.attr,
+	&vdisk_blocksize_attr.attr,
+	&vdisk_rd_only_attr.attr,
+	&vdisk_tst_attr.attr,
+	&vdisk_removable_attr.attr,
+	&vdisk_rotational_attr.attr,
+	&vdisk_cluster_mode_attr.attr,
+	&vdisk_mem_limit_mb_attr.attr,
+	&vdisk_mem_stats_attr.attr,
+	&vdev_zero_copy_attr.attr,
+	&vdev_t10_vend_id_attr.attr,
+	&vdev_vend_specific_id_attr.attr,
+	&vdev_prod_id_attr.attr,
+	&vdev_prod_rev_lvl_attr.attr,
+	&vdev_scsi_device_name_attr.attr,
+	&vdev_t10_dev_id_attr.attr,
+	&vdev_naa_id_attr.attr,
+	&vdev_eui64_id_attr.attr,
+	&vdev_usn_attr.attr,
+	&vdev_inq_vend_specific_attr.attr,
+	NULL,
+};
+
 static const struct attribute *vcdrom_attrs[] = {
 	&vdev_size_ro_attr.attr,
 	&vdev_size_mb_ro_attr.attr,
@@ -670,6 +935,12 @@ static const struct attribute *vcdrom_attrs[] = {
 	NULL,
 };
 
+/* Shared by vdisk_fileio and vdisk_blockio */
+static const struct attribute *vdisk_devt_attrs[] = {
+	&vdisk_attach_stats_attr.attr,
+	NULL,
+};
+
 #endif /* CONFIG_SCST_PROC */
 
 /*
@@ -687,12 +958,35 @@ static DEFINE_RWLOCK(vdisk_serial_rwlock);
 
 /* Protected by scst_vdisk_mutex */
 static LIST_HEAD(vdev_list);
+/*
+ * Devices being added, whose backing store is being probed with
+ * scst_vdisk_mutex released. Protected by scst_vdisk_mutex.
+ */
+static LIST_HEAD(vdev_pending_list);
+
+/* Statistics of devices attach, protected by vdev_attach_stats_lock */
+static DEFINE_SPINLOCK(vdev_attach_stats_lock);
+static struct {
+	unsigned int pending;
+	unsigned int burst_cnt;
+	ktime_t burst_start;
+	unsigned long attached, failed;
+	uint64_t total_probe_us, max_probe_us;
+	char max_probe_name[64+1];
+} vdev_attach_stats;
 
 static struct kmem_cache *vdisk_cmd_param_cachep;
 
+/*
+ * Runs write-back cache destaging, which can be needed to reclaim memory,
+ * and read-ahead, which waits for the destaging
+ */
+static struct workqueue_struct *vdisk_bg_wq;
+
 static vdisk_op_fn fileio_ops[256];
 static vdisk_op_fn blockio_ops[256];
 static vdisk_op_fn nullio_ops[256];
+static vdisk_op_fn ramdisk_ops[256];
 
 /*
  * Be careful changing "name" field, since it is the name of the corresponding
@@ -728,6 +1022,7 @@ static struct scst_dev_type vdisk_file_devtype = {
 	.add_device =		vdisk_add_fileio_device,
 	.del_device =		vdisk_del_device,
 	.dev_attrs =		vdisk_fileio_attrs,
+	.devt_attrs =		vdisk_devt_attrs,
 	.add_device_parameters =
 		"blocksize, "
 		"filename, "
@@ -784,6 +1079,7 @@ static struct scst_dev_type vdisk_blk_devtype = {
 	.add_device =		vdisk_add_blockio_device,
 	.del_device =		vdisk_del_device,
 	.dev_attrs =		vdisk_blockio_attrs,
+	.devt_attrs =		vdisk_devt_attrs,
 	.add_device_parameters =
 		"blocksize, "
 		"dif_mode, "
@@ -794,11 +1090,13 @@ static struct scst_dev_type vdisk_blk_devtype = {
 		"numa_node_id, "
 		"nv_cache, "
 		"cluster_mode, "
+		"read_ahead_kb, "
 		"read_only, "
 		"removable, "
 		"rotational, "
 		"thin_provisioned, "
 		"tst, "
+		"wb_cache_size_mb, "
 		"write_through",
 #endif
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
@@ -859,6 +1157,55 @@ static struct scst_dev_type vdisk_null_devtype = {
 #endif
 };
 
+static struct scst_dev_type vdisk_ramdisk_devtype = {
+	.name =			"vdisk_ramdisk",
+	.type =			TYPE_DISK,
+	.exec_sync =		1,
+	.threads_num =		-1,
+	.parse_atomic =		1,
+	.dev_done_atomic =	1,
+#ifdef CONFIG_SCST_PROC
+	.no_proc =		1,
+#endif
+	.auto_cm_assignment_possible = 1,
+	.attach =		vdisk_attach,
+	.detach =		vdisk_detach,
+	.attach_tgt =		vdisk_attach_tgt,
+	.detach_tgt =		vdisk_detach_tgt,
+	.parse =		vdisk_parse,
+	.dev_alloc_data_buf =	ramdisk_alloc_data_buf,
+	.exec =			fileio_exec,
+	.on_free_cmd =		fileio_on_free_cmd,
+	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
+	.devt_priv =		(void *)ramdisk_ops,
+	.get_supported_opcodes = vdisk_get_supported_opcodes,
+#ifndef CONFIG_SCST_PROC
+	.add_device =		vdisk_add_ramdisk_device,
+	.del_device =		vdisk_del_device,
+	.dev_attrs =		vdisk_ramdisk_attrs,
+	.add_device_parameters =
+		"blocksize, "
+		"cluster_mode, "
+		"mem_limit_mb, "
+		"numa_node_id, "
+		"read_only, "
+		"removable, "
+		"rotational, "
+		"size, "
+		"size_mb, "
+		"tst, "
+		"zero_copy",
+#endif
+#if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
+	.default_trace_flags =	SCST_DEFAULT_DEV_LOG_FLAGS,
+	.trace_flags =		&trace_flag,
+	.trace_tbl =		vdisk_local_trace_tbl,
+#ifndef CONFIG_SCST_PROC
+	.trace_tbl_help =	VDISK_TRACE_TBL_HELP,
+#endif
+#endif
+};
+
 static struct scst_dev_type vcdrom_devtype = {
 	.name =			"vcdrom",
 	.type =			TYPE_ROM,
@@ -924,9 +1271,17 @@ static const char *vdev_get_filename(const struct scst_vdisk_dev *virt_dev)
 		return "none";
 }
 
-/* Returns fd, use IS_ERR(fd) to get error status */
+/*
+ * Returns fd, use IS_ERR(fd) to get error status. @direct requests O_DIRECT.
+ *
+ * The DIF tags file is always opened buffered, i.e. without O_DIRECT, so
+ * tags are accessed through its page cache: tags of a command are only
+ * 8 bytes per block, too small and unaligned for direct I/O, and a page
+ * of tags covers 512 blocks, so neighbouring commands share it and their
+ * tags writes are merged by the writeback.
+ */
 static struct file *vdev_open_fd(const struct scst_vdisk_dev *virt_dev,
-	const char *name, bool read_only)
+	const char *name, bool read_only, bool direct)
 {
 	int open_flags = 0;
 	struct file *fd;
@@ -939,7 +1294,7 @@ static struct file *vdev_open_fd(const struct scst_vdisk_dev *virt_dev,
 		open_flags |= O_RDONLY;
 	else
 		open_flags |= O_RDWR;
-	if (virt_dev->o_direct_flag)
+	if (direct)
 		open_flags |= O_DIRECT;
 	if (virt_dev->wt_flag && !virt_dev->nv_cache)
 		open_flags |= O_DSYNC;
@@ -1451,7 +1806,8 @@ static int vdisk_init_block_integrity(struct scst_vdisk_dev *virt_dev)
 
 	TRACE_ENTRY();
 
-	fd = vdev_open_fd(virt_dev, virt_dev->filename, virt_dev->rd_only);
+	fd = vdev_open_fd(virt_dev, virt_dev->filename, virt_dev->rd_only,
+			  virt_dev->o_direct_flag);
 	if (IS_ERR(fd)) {
 		res = -EINVAL;
 		goto out;
@@ -1551,6 +1907,46 @@ static int vdisk_init_block_integrity(struct scst_vdisk_dev *virt_dev)
 }
 #endif /* defined(CONFIG_BLK_DEV_INTEGRITY) */
 
+/* Reads size, flush and thin provisioning support of the backing store */
+static int vdisk_examine_backing_store(struct scst_vdisk_dev *virt_dev)
+{
+	int res;
+	loff_t file_size;
+
+	res = vdisk_get_file_size(virt_dev->filename, virt_dev->blockio,
+				  &file_size);
+	if (res < 0)
+		goto out;
+
+	virt_dev->file_size = file_size;
+	vdisk_blockio_check_flush_support(virt_dev);
+	vdisk_check_tp_support(virt_dev);
+
+out:
+	return res;
+}
+
+/*
+ * Examines the backing store of a device being added before it is
+ * registered, so vdisk_attach() doesn't need to do it under scst_mutex.
+ * Called without scst_vdisk_mutex held, so backing stores of devices added
+ * by parallel sysfs works are opened in parallel. The result is kept in
+ * probe_res and reported by vdisk_attach().
+ */
+static void vdisk_probe_backing_store(struct scst_vdisk_dev *virt_dev)
+{
+	ktime_t start = ktime_get();
+
+	virt_dev->probe_res = vdisk_examine_backing_store(virt_dev);
+	virt_dev->probe_time_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	virt_dev->backing_probed = 1;
+
+	TRACE_DBG("Backing store of dev %s probed in %lld us (res %d)",
+		virt_dev->name, (unsigned long long)virt_dev->probe_time_us,
+		virt_dev->probe_res);
+	return;
+}
+
 /*
  * Reexamine size, flush support and thin provisioning support for
  * vdisk_fileio, vdisk_blockio and vdisk_cdrom devices. Do not modify the size
@@ -1561,10 +1957,11 @@ static int vdisk_reexamine(struct scst_vdisk_dev *virt_dev)
 	int res = 0;
 
 	if (!virt_dev->nullio && !virt_dev->cdrom_empty) {
-		loff_t file_size;
-
-		res = vdisk_get_file_size(virt_dev->filename, virt_dev->blockio,
-					  &file_size);
+		if (virt_dev->backing_probed) {
+			virt_dev->backing_probed = 0;
+			res = virt_dev->probe_res;
+		} else
+			res = vdisk_examine_backing_store(virt_dev);
 		if (res < 0) {
 			if ((res == -EMEDIUMTYPE) && virt_dev->blockio) {
 				TRACE_DBG("Reexam pending (dev %s)", virt_dev->name);
@@ -1573,9 +1970,6 @@ static int vdisk_reexamine(struct scst_vdisk_dev *virt_dev)
 			}
 			goto out;
 		}
-		virt_dev->file_size = file_size;
-		vdisk_blockio_check_flush_support(virt_dev);
-		vdisk_check_tp_support(virt_dev);
 	} else if (virt_dev->cdrom_empty) {
 		virt_dev->file_size = 0;
 	}
@@ -1656,8 +2050,8 @@ next:
 
 	if (virt_dev->dif_filename != NULL) {
 		/* Check if it can be used */
-		struct file *dfd = vdev_open_fd(virt_dev, virt_dev->dif_filename,
-					virt_dev->rd_only);
+		struct file *dfd = vdev_open_fd(virt_dev,
+			virt_dev->dif_filename, virt_dev->rd_only, false);
 		if (IS_ERR(dfd)) {
 			res = PTR_ERR(dfd);
 			goto out;
@@ -1790,7 +2184,8 @@ static int vdisk_open_fd(struct scst_vdisk_dev *virt_dev, bool read_only)
 	sBUG_ON(!virt_dev->filename);
 	sBUG_ON(virt_dev->fd);
 
-	virt_dev->fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only);
+	virt_dev->fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only,
+				    virt_dev->o_direct_flag);
 	if (IS_ERR(virt_dev->fd)) {
 		res = PTR_ERR(virt_dev->fd);
 		virt_dev->fd = NULL;
@@ -1802,7 +2197,7 @@ static int vdisk_open_fd(struct scst_vdisk_dev *virt_dev, bool read_only)
 
 	if (virt_dev->dif_filename != NULL) {
 		virt_dev->dif_fd = vdev_open_fd(virt_dev,
-			virt_dev->dif_filename, read_only);
+			virt_dev->dif_filename, read_only, false);
 		if (IS_ERR(virt_dev->dif_fd)) {
 			res = PTR_ERR(virt_dev->dif_fd);
 			virt_dev->dif_fd = NULL;
@@ -1821,11 +2216,22 @@ out_close_fd:
 
 static void vdisk_close_fd(struct scst_vdisk_dev *virt_dev)
 {
+	struct vdisk_wbc *wbc = virt_dev->wbc;
+
+	/* Prefetching and destaging must not race with closing the device */
+	if (virt_dev->ra != NULL)
+		vdisk_ra_drop(virt_dev->ra);
+	if (wbc != NULL)
+		mutex_lock(&wbc->destage_mutex);
 	if (virt_dev->fd) {
+		if (wbc != NULL)
+			vdisk_wbc_drop(wbc);
 		filp_close(virt_dev->fd, NULL);
 		virt_dev->fd = NULL;
 		virt_dev->bdev = NULL;
 	}
+	if (wbc != NULL)
+		mutex_unlock(&wbc->destage_mutex);
 	if (virt_dev->dif_fd) {
 		filp_close(virt_dev->dif_fd, NULL);
 		virt_dev->dif_fd = NULL;
@@ -1842,6 +2248,15 @@ static int vdisk_attach_tgt(struct scst_tgt_dev *tgt_dev)
 
 	lockdep_assert_held(&scst_mutex);
 
+	if (virt_dev->ra != NULL) {
+		tgt_dev->dh_priv = kzalloc(sizeof(struct vdisk_ra_tgt_dev),
+					   GFP_KERNEL);
+		if (tgt_dev->dh_priv == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+	}
+
 	virt_dev->tgt_dev_cnt++;
 
 	if (virt_dev->fd != NULL)
@@ -1855,6 +2270,8 @@ static int vdisk_attach_tgt(struct scst_tgt_dev *tgt_dev)
 				res = 0;
 			} else {
 				virt_dev->tgt_dev_cnt--;
+				kfree(tgt_dev->dh_priv);
+				tgt_dev->dh_priv = NULL;
 				goto out;
 			}
 		}
@@ -1880,6 +2297,9 @@ static void vdisk_detach_tgt(struct scst_tgt_dev *tgt_dev)
 	if (--virt_dev->tgt_dev_cnt == 0)
 		vdisk_close_fd(virt_dev);
 
+	kfree(tgt_dev->dh_priv);
+	tgt_dev->dh_priv = NULL;
+
 	TRACE_EXIT();
 	return;
 }
@@ -2753,6 +3173,7 @@ static vdisk_op_fn blockio_ops[256] = {
 	[WRITE_VERIFY] = blockio_exec_write_verify,
 	[WRITE_VERIFY_12] = blockio_exec_write_verify,
 	[WRITE_VERIFY_16] = blockio_exec_write_verify,
+	[COMPARE_AND_WRITE] = vdisk_exec_caw,
 	[VARIABLE_LENGTH_CMD] = blockio_exec_var_len_cmd,
 	[VERIFY] = vdev_exec_verify,
 	[VERIFY_12] = vdev_exec_verify,
@@ -2780,6 +3201,7 @@ static vdisk_op_fn fileio_ops[256] = {
 	[WRITE_VERIFY] = fileio_exec_write_verify,
 	[WRITE_VERIFY_12] = fileio_exec_write_verify,
 	[WRITE_VERIFY_16] = fileio_exec_write_verify,
+	[COMPARE_AND_WRITE] = vdisk_exec_caw,
 	[VARIABLE_LENGTH_CMD] = fileio_exec_var_len_cmd,
 	[VERIFY] = vdev_exec_verify,
 	[VERIFY_12] = vdev_exec_verify,
@@ -2806,6 +3228,7 @@ static vdisk_op_fn nullio_ops[256] = {
 	[WRITE_VERIFY] = nullio_exec_write_verify,
 	[WRITE_VERIFY_12] = nullio_exec_write_verify,
 	[WRITE_VERIFY_16] = nullio_exec_write_verify,
+	[COMPARE_AND_WRITE] = vdisk_exec_caw,
 	[VARIABLE_LENGTH_CMD] = nullio_exec_var_len_cmd,
 	[VERIFY] = nullio_exec_verify,
 	[VERIFY_12] = nullio_exec_verify,
@@ -2813,6 +3236,34 @@ static vdisk_op_fn nullio_ops[256] = {
 	SHARED_OPS
 };
 
+static const vdisk_op_fn ramdisk_var_len_ops[] = {
+	[SUBCODE_READ_32] = ramdisk_exec_read,
+	[SUBCODE_WRITE_32] = ramdisk_exec_write,
+	[SUBCODE_WRITE_VERIFY_32] = ramdisk_exec_write_verify,
+	[SUBCODE_VERIFY_32] = vdev_exec_verify,
+	[SUBCODE_WRITE_SAME_32] = vdisk_exec_write_same,
+};
+
+static vdisk_op_fn ramdisk_ops[256] = {
+	[READ_6] = ramdisk_exec_read,
+	[READ_10] = ramdisk_exec_read,
+	[READ_12] = ramdisk_exec_read,
+	[READ_16] = ramdisk_exec_read,
+	[WRITE_6] = ramdisk_exec_write,
+	[WRITE_10] = ramdisk_exec_write,
+	[WRITE_12] = ramdisk_exec_write,
+	[WRITE_16] = ramdisk_exec_write,
+	[WRITE_VERIFY] = ramdisk_exec_write_verify,
+	[WRITE_VERIFY_12] = ramdisk_exec_write_verify,
+	[WRITE_VERIFY_16] = ramdisk_exec_write_verify,
+	[COMPARE_AND_WRITE] = vdisk_exec_caw,
+	[VARIABLE_LENGTH_CMD] = ramdisk_exec_var_len_cmd,
+	[VERIFY] = vdev_exec_verify,
+	[VERIFY_12] = vdev_exec_verify,
+	[VERIFY_16] = vdev_exec_verify,
+	SHARED_OPS
+};
+
 #define VDISK_OPCODE_DESCRIPTORS					\
 	/* &scst_op_descr_get_lba_status, */				\
 	&scst_op_descr_read_capacity16,					\
@@ -2987,6 +3438,7 @@ static bool vdisk_parse_offset(struct vdisk_cmd_params *p, struct scst_cmd *cmd)
 	case WRITE_10:
 	case WRITE_12:
 	case WRITE_16:
+	case COMPARE_AND_WRITE:
 		fua = (cdb[1] & 0x8);
 		if (fua) {
 			TRACE(TRACE_ORDER, "FUA: loff=%lld, "
@@ -3037,6 +3489,24 @@ out_err:
 	goto out;
 }
 
+/*
+ * COMPARE AND WRITE is executed by vdisk_exec_caw() instead of the SCST core
+ * emulation, which passes internal READ and WRITE commands through the
+ * whole commands processing. Devices with DIF stay on the emulation,
+ * because it processes PI of both parts of the command.
+ */
+static void vdisk_parse_caw(struct scst_cmd *cmd)
+{
+	if (likely(cmd->cdb[0] != COMPARE_AND_WRITE) ||
+	    (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE))
+		return;
+
+	TRACE_DBG("Clearing LOCAL CMD flag for cmd %p (op %s)", cmd,
+		cmd->op_name);
+	cmd->op_flags &= ~SCST_LOCAL_CMD;
+	return;
+}
+
 static int vdisk_parse(struct scst_cmd *cmd)
 {
 	int res, rc;
@@ -3047,6 +3517,8 @@ static int vdisk_parse(struct scst_cmd *cmd)
 		goto out;
 	}
 
+	vdisk_parse_caw(cmd);
+
 	res = fileio_alloc_and_parse(cmd);
 out:
 	return res;
@@ -3077,3036 +3549,4925 @@ static int non_fileio_parse(struct scst_cmd *cmd)
 		res = scst_get_cmd_abnormal_done_state(cmd);
 		goto out;
 	}
+
+	vdisk_parse_caw(cmd);
 out:
 	return res;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
-/**
- * finish_read - Release the pages referenced by prepare_read().
+/*
+ * Returns the referenced page of @rd with index @idx or NULL, if it's a
+ * hole. The page can be replaced by vdisk_rd_cow_page() and freed in
+ * parallel, hence the reference is taken only if it's still in use and
+ * then the page is rechecked.
  */
-static void finish_read(struct scatterlist *sg, int sg_cnt)
+static struct page *vdisk_rd_find_get_page(struct vdisk_rd *rd,
+	unsigned long idx)
 {
 	struct page *page;
-	int i;
-
-	TRACE_ENTRY();
 
-	for (i = 0; i < sg_cnt; ++i) {
-		page = sg_page(&sg[i]);
-		EXTRACHECKS_BUG_ON(!page);
-		put_page(page);
+	rcu_read_lock();
+again:
+	page = radix_tree_lookup(&rd->pages, idx);
+	if (page != NULL) {
+		if (!get_page_unless_zero(page))
+			goto again;
+		if (unlikely(page != radix_tree_lookup(&rd->pages, idx))) {
+			put_page(page);
+			goto again;
+		}
 	}
+	rcu_read_unlock();
 
-	TRACE_EXIT();
-	return;
+	return page;
 }
 
-/**
- * prepare_read_page - Bring a single page into the page cache.
- *
- * @filp: file pointer
- * @len: number of bytes to read from the file
- * @offset: offset of first byte to read (from start of file)
- * @last: offset of first byte that will not be read - used for readahead
- * @pageptr: page pointer output variable.
- *
- * Returns a negative number if an error occurred, zero upon EOF or a positive
- * number - the number of bytes that can be read from the file via the returned
- * page. If a positive number is returned, it is the responsibility of the
- * caller to release the returned page.
- *
- * Based on do_generic_file_read().
+/*
+ * Returns the referenced page of @rd with index @idx, allocating it if
+ * needed, or ERR_PTR(-ENOSPC), if the memory limit of @rd has been reached.
  */
-static int prepare_read_page(struct file *filp, int len,
-			     loff_t offset, loff_t last, struct page **pageptr)
+static struct page *vdisk_rd_get_page(struct vdisk_rd *rd, unsigned long idx)
 {
-	struct address_space *mapping = filp->f_mapping;
-	struct inode *inode = mapping->host;
-	struct file_ra_state *ra = &filp->f_ra;
-	struct page *page;
-	unsigned long index, last_index;
-	long end_index, nr;
-	loff_t isize;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
-	read_descriptor_t desc = { .count = len };
-#endif
-	int error;
+	struct page *page, *new_page;
+	int res;
 
-	TRACE_ENTRY();
+	page = vdisk_rd_find_get_page(rd, idx);
+	if (page != NULL)
+		goto out;
 
-	WARN((offset & ~PAGE_MASK) + len > PAGE_SIZE,
-	     "offset = %lld + %lld, len = %d\n", offset & PAGE_MASK,
-	     offset & ~PAGE_MASK, len);
-	sBUG_ON(!mapping->a_ops);
+	spin_lock(&rd->rd_lock);
+	if ((rd->max_pages != 0) && (rd->pages_cnt >= rd->max_pages)) {
+		rd->limit_hits++;
+		spin_unlock(&rd->rd_lock);
+		page = ERR_PTR(-ENOSPC);
+		goto out;
+	}
+	/* Reserve it, so concurrent writers can't overshoot max_pages */
+	rd->pages_cnt++;
+	spin_unlock(&rd->rd_lock);
 
-	index = offset >> PAGE_SHIFT;
-	last_index = (last + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	new_page = alloc_pages_node(rd->numa_node_id, GFP_KERNEL | __GFP_ZERO, 0);
+	if (new_page == NULL) {
+		res = -ENOMEM;
+		goto out_unreserve;
+	}
+	/* For vdisk_rd_truncate() */
+	new_page->index = idx;
 
-find_page:
-	page = find_get_page(mapping, index);
-	if (!page) {
-		page_cache_sync_readahead(mapping, ra, filp, index,
-					  last_index - index);
-		page = find_get_page(mapping, index);
-		if (unlikely(!page)) {
-			/*
-			 * Not cached so create a new page.
-			 */
-			page = page_cache_alloc_cold(mapping);
-			if (!page) {
-				error = -ENOMEM;
-				goto err;
-			}
-			error = add_to_page_cache_lru(page, mapping, index,
-						      GFP_KERNEL);
-			if (error) {
-				put_page(page);
-				if (error == -EEXIST)
-					goto find_page;
-				else
-					goto err;
-			} else {
-				goto readpage;
-			}
-		}
-	}
-	if (PageReadahead(page))
-		page_cache_async_readahead(mapping, ra, filp, page,
-					   index, last_index - index);
-	if (!PageUptodate(page)) {
-		if (inode->i_blkbits == PAGE_SHIFT ||
-		    !mapping->a_ops->is_partially_uptodate)
-			goto page_not_up_to_date;
-		if (!trylock_page(page))
-			goto page_not_up_to_date;
-		/* Did it get truncated before we got the lock? */
-		if (!page->mapping)
-			goto page_not_up_to_date_locked;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
-		if (!mapping->a_ops->is_partially_uptodate(page,
-						offset & ~PAGE_MASK, len))
-#else
-		if (!mapping->a_ops->is_partially_uptodate(page, &desc,
-						offset & ~PAGE_MASK))
-#endif
-			goto page_not_up_to_date_locked;
-		unlock_page(page);
-	}
-page_ok:
-	/*
-	 * i_size must be checked after we know the page is Uptodate.
-	 *
-	 * Checking i_size after the check allows us to calculate the correct
-	 * value for "nr", which means the zero-filled part of the page is not
-	 * accessed (unless another truncate extends the file - this is
-	 * desired though).
-	 */
+	res = radix_tree_preload(GFP_KERNEL);
+	if (res != 0)
+		goto out_free;
 
-	isize = i_size_read(inode);
-	end_index = (isize - 1) >> PAGE_SHIFT;
-	if (unlikely(isize == 0 || index > end_index)) {
-		put_page(page);
-		goto eof;
+	spin_lock(&rd->rd_lock);
+	page = radix_tree_lookup(&rd->pages, idx);
+	if (page == NULL) {
+		res = radix_tree_insert(&rd->pages, idx, new_page);
+		page = (res == 0) ? new_page : ERR_PTR(res);
 	}
+	if (page != new_page)
+		rd->pages_cnt--;
+	/* Pages are replaced only under rd_lock, so it can't be freed here */
+	if (!IS_ERR(page))
+		get_page(page);
+	spin_unlock(&rd->rd_lock);
+	radix_tree_preload_end();
 
-	/* nr is the maximum number of bytes to copy from this page */
-	if (index < end_index) {
-		nr = PAGE_SIZE - (offset & ~PAGE_MASK);
-	} else {
-		nr = ((isize - 1) & ~PAGE_MASK) + 1 - (offset & ~PAGE_MASK);
-		if (nr <= 0) {
-			put_page(page);
-			goto eof;
-		}
-	}
+	if (page != new_page)
+		__free_page(new_page);
 
-	/*
-	 * If users can be writing to this page using arbitrary virtual
-	 * addresses, take care about potential aliasing before reading the
-	 * page on the kernel side.
-	 */
-	if (mapping_writably_mapped(mapping))
-		flush_dcache_page(page);
+out:
+	return page;
 
-	mark_page_accessed(page);
+out_free:
+	__free_page(new_page);
 
-	/* Ok, we have the page and it's up to date. */
-	*pageptr = page;
-	TRACE_EXIT_RES(nr);
-	return nr;
-eof:
-	TRACE_EXIT();
-	return 0;
-err:
-	TRACE_EXIT_RES(error);
-	return error;
+out_unreserve:
+	spin_lock(&rd->rd_lock);
+	rd->pages_cnt--;
+	spin_unlock(&rd->rd_lock);
+	page = ERR_PTR(res);
+	goto out;
+}
 
-page_not_up_to_date:
-	/* Try to get exclusive access to the page. */
-	error = lock_page_killable(page);
-	if (unlikely(error != 0)) {
-		put_page(page);
-		goto err;
+/*
+ * Replaces @page of @rd with index @idx, which is lent to READs by
+ * vdisk_rd_lend(), by its copy, so the data they are transferring don't
+ * change under them. @page must be locked and referenced by the caller.
+ * Returns the copy locked and referenced instead of @page, or ERR_PTR()
+ * with @page left as it was.
+ */
+static struct page *vdisk_rd_cow_page(struct vdisk_rd *rd, unsigned long idx,
+	struct page *page)
+{
+	struct page *new_page;
+	int res;
+
+	new_page = alloc_pages_node(rd->numa_node_id, GFP_KERNEL, 0);
+	if (new_page == NULL) {
+		res = -ENOMEM;
+		goto out_err;
 	}
+	copy_highpage(new_page, page);
+	/* For vdisk_rd_truncate() */
+	new_page->index = idx;
+	/* Nobody else can see it yet, so it can't fail */
+	WARN_ON(!trylock_page(new_page));
 
-page_not_up_to_date_locked:
-	/* Did it get truncated before we got the lock? */
-	if (!page->mapping) {
-		unlock_page(page);
-		put_page(page);
-		goto find_page;
+	res = radix_tree_preload(GFP_KERNEL);
+	if (res != 0)
+		goto out_free;
+
+	/* Only the holder of the page lock replaces the page */
+	spin_lock(&rd->rd_lock);
+	radix_tree_delete(&rd->pages, idx);
+	res = radix_tree_insert(&rd->pages, idx, new_page);
+	WARN_ON(res != 0);
+	get_page(new_page);
+	spin_unlock(&rd->rd_lock);
+	radix_tree_preload_end();
+
+	TRACE_DBG("Replaced lent page %p of idx %lu by %p", page, idx,
+		new_page);
+
+	unlock_page(page);
+	/* The caller's and rd's references */
+	put_page(page);
+	put_page(page);
+	return new_page;
+
+out_free:
+	unlock_page(new_page);
+	__free_page(new_page);
+
+out_err:
+	return ERR_PTR(res);
+}
+
+/*
+ * Copies @len bytes of @buf to page @idx of @rd at offset @offs. Returns 0
+ * on success or a negative error code, if a page could not be allocated.
+ */
+static int vdisk_rd_write_page(struct vdisk_rd *rd, unsigned long idx,
+	unsigned int offs, const void *buf, unsigned int len)
+{
+	struct page *page, *p;
+	void *addr;
+	int res = 0;
+
+again:
+	page = vdisk_rd_get_page(rd, idx);
+	if (IS_ERR(page)) {
+		res = PTR_ERR(page);
+		goto out;
 	}
 
-	/* Did somebody else fill it already? */
-	if (PageUptodate(page)) {
+	lock_page(page);
+
+	rcu_read_lock();
+	p = radix_tree_lookup(&rd->pages, idx);
+	rcu_read_unlock();
+	if (unlikely(p != page)) {
+		/* Replaced while we were waiting for the lock */
 		unlock_page(page);
-		goto page_ok;
+		put_page(page);
+		goto again;
 	}
 
-readpage:
 	/*
-	 * A previous I/O error may have been due to temporary
-	 * failures, eg. multipath errors.
-	 * PG_error will be set again if readpage fails.
+	 * Besides rd and us, the page can be referenced by READs, which it
+	 * is lent to, or, rarely, by other commands accessing it. A copy
+	 * isn't needed for the latter, but it doesn't hurt either.
 	 */
-	ClearPageError(page);
-	/* Start the actual read. The read will unlock the page. */
-	error = mapping->a_ops->readpage(filp, page);
-	if (unlikely(error)) {
-		if (error == AOP_TRUNCATED_PAGE) {
-			put_page(page);
-			goto find_page;
+	if (page_count(page) > 2) {
+		p = vdisk_rd_cow_page(rd, idx, page);
+		if (IS_ERR(p)) {
+			res = PTR_ERR(p);
+			goto out_unlock;
 		}
-		WARN(error >= 0, "error = %d\n", error);
-		put_page(page);
-		goto err;
+		page = p;
 	}
 
-	if (!PageUptodate(page)) {
-		error = lock_page_killable(page);
-		if (unlikely(error != 0)) {
-			put_page(page);
-			goto err;
-		}
-		if (!PageUptodate(page)) {
-			if (page->mapping == NULL) {
-				/*
-				 * invalidate_mapping_pages got it
-				 */
-				unlock_page(page);
+	addr = kmap(page);
+	memcpy(addr + offs, buf, len);
+	kunmap(page);
+
+out_unlock:
+	unlock_page(page);
+	put_page(page);
+
+out:
+	return res;
+}
+
+/*
+ * Copies @len bytes between @buf and @rd at offset @loff. Holes read as
+ * zeros. Returns 0 on success or a negative error code, if a page for the
+ * write could not be allocated.
+ */
+static int vdisk_rd_copy(struct vdisk_rd *rd, void *buf, size_t len,
+	loff_t loff, bool write)
+{
+	struct page *page;
+	unsigned int offs, l;
+	void *addr;
+	int res = 0;
+
+	while (len > 0) {
+		offs = loff & ~PAGE_MASK;
+		l = min_t(size_t, len, PAGE_SIZE - offs);
+
+		if (write) {
+			res = vdisk_rd_write_page(rd, loff >> PAGE_SHIFT, offs,
+				buf, l);
+			if (res != 0)
+				goto out;
+		} else {
+			page = vdisk_rd_find_get_page(rd, loff >> PAGE_SHIFT);
+			if (page != NULL) {
+				addr = kmap(page);
+				memcpy(buf, addr + offs, l);
+				kunmap(page);
 				put_page(page);
-				goto find_page;
-			}
-			unlock_page(page);
-			put_page(page);
-			error = -EIO;
-			goto err;
+			} else
+				memset(buf, 0, l);
 		}
-		unlock_page(page);
+
+		buf += l;
+		loff += l;
+		len -= l;
 	}
 
-	goto page_ok;
+out:
+	return res;
 }
 
-/**
- * prepare_read - Lock page cache pages corresponding to an sg vector
- * @filp: file the sg vector applies to
- * @sg: sg vector
- * @sg_cnt: sg vector size
- * @offset: file offset the first byte of the first sg element corresponds to
+/*
+ * Frees the pages of @rd beyond @size and zeroes the tail of the last one,
+ * so it reads zeros, if the device grows back. The device must have its
+ * activity suspended or not be registered. Pages lent to commands by
+ * vdisk_rd_lend() are freed, when the last of them is finished.
  */
-static int prepare_read(struct file *filp, struct scatterlist *sg, int sg_cnt,
-			pgoff_t offset)
+static void vdisk_rd_truncate(struct vdisk_rd *rd, loff_t size)
 {
-	struct page *page = NULL;
-	int i, res;
-	loff_t off, last = ((offset + sg_cnt - 1) << PAGE_SHIFT) +
-		sg[sg_cnt - 1].offset + sg[sg_cnt - 1].length;
+	unsigned long idx = size >> PAGE_SHIFT;
+	unsigned int offs = size & ~PAGE_MASK;
+	struct page *pages[16];
+	int i, n;
 
 	TRACE_ENTRY();
 
-	for (i = 0; i < sg_cnt; ++i) {
-		off = (offset + i) << PAGE_SHIFT | sg[i].offset;
-		res = prepare_read_page(filp, sg[i].length, off, last, &page);
-		if (res <= 0)
-			goto err;
-		if (res < sg[i].length) {
-			put_page(page);
-			goto err;
-		}
-		sg_assign_page(&sg[i], page);
+	if (offs != 0) {
+		rcu_read_lock();
+		pages[0] = radix_tree_lookup(&rd->pages, idx);
+		rcu_read_unlock();
+		if (pages[0] != NULL)
+			zero_user(pages[0], offs, PAGE_SIZE - offs);
+		idx++;
 	}
 
-	file_accessed(filp);
-
-out:
-	TRACE_EXIT_RES(i);
-	return i;
+	do {
+		spin_lock(&rd->rd_lock);
+		n = radix_tree_gang_lookup(&rd->pages, (void **)pages, idx,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < n; i++) {
+			idx = pages[i]->index;
+			radix_tree_delete(&rd->pages, idx);
+			put_page(pages[i]);
+			rd->pages_cnt--;
+		}
+		spin_unlock(&rd->rd_lock);
+		idx++;
+		cond_resched();
+	} while (n > 0);
 
-err:
-	finish_read(sg, i);
-	i = -EIO;
-	goto out;
+	TRACE_EXIT();
+	return;
 }
 
-/**
- * alloc_sg - Allocate an SG vector.
- * @size: number of bytes that will be stored in the pages of the sg vector
- * @off: first page data offset
- * @gfp_mask: allocation flags for dynamic sg vector allocation
- * @small_sg: pointer to a candidate sg vector
- * @small_sg_size: size of @small_sg
- * @p_sg_cnt: pointer to an int where the sg vector size will be written
- */
-static struct scatterlist *alloc_sg(size_t size, unsigned int off,
-				    gfp_t gfp_mask,
-				    struct scatterlist *small_sg,
-				    int small_sg_size, int *p_sg_cnt)
+static int vdisk_rd_create(struct scst_vdisk_dev *virt_dev)
 {
-	struct scatterlist *sg;
-	int i, sg_cnt, remaining_sz, sg_sz, sg_off;
+	struct vdisk_rd *rd;
+	int res = 0;
 
 	TRACE_ENTRY();
 
-	sg_cnt = PAGE_ALIGN(size + off) >> PAGE_SHIFT;
-	sg = sg_cnt <= small_sg_size ? small_sg :
-		kmalloc_array(sg_cnt, sizeof(*sg), gfp_mask);
-	if (!sg)
+	rd = kzalloc_node(sizeof(*rd), GFP_KERNEL, virt_dev->numa_node_id);
+	if (rd == NULL) {
+		PRINT_ERROR("Unable to allocate ramdisk (device %s)",
+			virt_dev->name);
+		res = -ENOMEM;
 		goto out;
-
-	sg_init_table(sg, sg_cnt);
-	remaining_sz = size;
-	sg_off = off;
-	for (i = 0; i < sg_cnt; ++i) {
-		sg_sz = min_t(int, PAGE_SIZE - sg_off, remaining_sz);
-		sg_set_page(&sg[i], NULL, sg_sz, sg_off);
-		remaining_sz -= sg_sz;
-		sg_off = 0;
 	}
-	*p_sg_cnt = sg_cnt;
+
+	spin_lock_init(&rd->rd_lock);
+	/* Nodes are preloaded by vdisk_rd_get_page() */
+	INIT_RADIX_TREE(&rd->pages, GFP_ATOMIC);
+	rd->numa_node_id = virt_dev->numa_node_id;
+	rd->max_pages = (unsigned long)virt_dev->rd_mem_limit_mb <<
+				(20 - PAGE_SHIFT);
+
+	virt_dev->rd = rd;
 
 out:
-	TRACE_EXIT();
-	return sg;
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-static int fileio_alloc_data_buf(struct scst_cmd *cmd)
+static void vdisk_rd_destroy(struct scst_vdisk_dev *virt_dev)
 {
-	struct vdisk_cmd_params *p;
-	struct scst_vdisk_dev *virt_dev;
-	int sg_cnt, nr;
-	const gfp_t gfp_mask = GFP_KERNEL;
-	struct scatterlist *sg;
+	struct vdisk_rd *rd = virt_dev->rd;
 
 	TRACE_ENTRY();
 
-	p = cmd->dh_priv;
-	EXTRACHECKS_BUG_ON(!p);
-	virt_dev = cmd->dev->dh_priv;
-	/*
-	 * If the target driver (e.g. scst_local) allocates the sg vector
-	 * itself or the command is a write or bidi command, don't use zero
-	 * copy.
-	 */
-	if (cmd->tgt_i_data_buf_alloced ||
-	    (cmd->data_direction & SCST_DATA_READ) == 0 ||
-	    (virt_dev->fd && !virt_dev->fd->f_mapping->a_ops->readpage)) {
-		p->use_zero_copy = false;
-	}
-	if (!p->use_zero_copy)
-		goto out;
-
-	EXTRACHECKS_BUG_ON(!(cmd->data_direction & SCST_DATA_READ));
+	vdisk_rd_truncate(rd, 0);
+	WARN_ON(rd->pages_cnt != 0);
 
-	scst_cmd_set_dh_data_buff_alloced(cmd);
+	kfree(rd);
+	virt_dev->rd = NULL;
 
-	cmd->sg = alloc_sg(cmd->bufflen, p->loff & ~PAGE_MASK, gfp_mask,
-			   p->small_sg, ARRAY_SIZE(p->small_sg), &cmd->sg_cnt);
-	if (!cmd->sg) {
-		PRINT_ERROR("sg allocation failed (bufflen = %d, off = %lld)\n",
-			    cmd->bufflen, p->loff & ~PAGE_MASK);
-		goto enomem;
-	}
-	sg_cnt = scst_cmd_get_sg_cnt(cmd);
-	sg = cmd->sg;
-	nr = prepare_read(virt_dev->fd, sg, sg_cnt, p->loff >> PAGE_SHIFT);
-	if (nr < 0) {
-		PRINT_ERROR("prepare_read() failed: %d", nr);
-		goto out_free_sg;
-	}
-out:
 	TRACE_EXIT();
-	return SCST_CMD_STATE_DEFAULT;
-
-out_free_sg:
-	kfree(cmd->sg);
-	cmd->sg = NULL;
-	cmd->sg_cnt = 0;
-
-enomem:
-	scst_set_busy(cmd);
-	TRACE_EXIT_RES(-ENOMEM);
-	return scst_get_cmd_abnormal_done_state(cmd);
+	return;
 }
 
-#else
-
-static int fileio_alloc_data_buf(struct scst_cmd *cmd)
+/* Copies data of a READ or WRITE, which isn't done in zero copy mode */
+static enum compl_status_e ramdisk_exec_rw(struct vdisk_cmd_params *p,
+	bool write)
 {
-	struct vdisk_cmd_params *p;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	loff_t loff = p->loff;
+	uint8_t *address;
+	int length, res;
 
 	TRACE_ENTRY();
 
-	p = cmd->dh_priv;
-	EXTRACHECKS_BUG_ON(!p);
-	p->use_zero_copy = false;
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		res = vdisk_rd_copy(virt_dev->rd, address, length, loff, write);
+		scst_put_buf(cmd, address);
+		if (unlikely(res != 0))
+			goto out_err;
+		loff += length;
+		length = scst_get_buf_next(cmd, &address);
+	}
+
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf() failed: %d", length);
+		scst_set_cmd_error(cmd,
+		    SCST_LOAD_SENSE(scst_sense_internal_failure));
+	}
 
+out:
 	TRACE_EXIT();
-	return SCST_CMD_STATE_DEFAULT;
-}
+	return CMD_SUCCEEDED;
 
-static void finish_read(struct scatterlist *sg, int sg_cnt)
-{
+out_err:
+	if (res == -ENOSPC) {
+		TRACE(TRACE_MINOR, "Memory limit of ramdisk %s reached",
+			virt_dev->name);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_space_allocation_failed_write_protect));
+	} else
+		scst_set_busy(cmd);
+	goto out;
 }
 
-#endif
-
-static int vdev_do_job(struct scst_cmd *cmd, const vdisk_op_fn *ops)
+/*
+ * The pages are lent by ramdisk_alloc_data_buf(), i.e. before the cmd was
+ * serialized with the preceding WRITEs. Since then, those WRITEs could
+ * allocate pages for the holes, lent as the zero page, or replace the lent
+ * pages by their copies, see vdisk_rd_cow_page(). Lends the current pages
+ * instead.
+ */
+static void vdisk_rd_relend(struct vdisk_rd *rd, struct scatterlist *sg,
+	int sg_cnt, unsigned long idx)
 {
-	int res;
-	uint8_t *cdb = cmd->cdb;
-	int opcode = cdb[0];
-	struct vdisk_cmd_params *p = cmd->dh_priv;
-	struct scst_vdisk_dev *virt_dev;
-	vdisk_op_fn op = ops[opcode];
-	enum compl_status_e s;
-
-	TRACE_ENTRY();
-
-	EXTRACHECKS_BUG_ON(!p);
-
-	virt_dev = cmd->dev->dh_priv;
-
-	EXTRACHECKS_BUG_ON(p->cmd != cmd);
-	EXTRACHECKS_BUG_ON(ops != blockio_ops && ops != fileio_ops && ops != nullio_ops);
+	struct page *page;
+	int i;
 
-	/*
-	 * No need to make it volatile, because at worst we will have a couple
-	 * of extra commands refused after formatting actually finished, which
-	 * is acceptable.
-	 */
-	if (unlikely(virt_dev->format_active)) {
-		switch (cmd->cdb[0]) {
-		case INQUIRY:
-		case REPORT_LUNS:
-		case REQUEST_SENSE:
-			break;
-		default:
-			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_format_in_progress));
-			goto out_compl;
+	for (i = 0; i < sg_cnt; ++i) {
+		page = vdisk_rd_find_get_page(rd, idx + i);
+		if (page == NULL)
+			continue;
+		if (page == sg_page(&sg[i])) {
+			put_page(page);
+			continue;
 		}
+		put_page(sg_page(&sg[i]));
+		sg_assign_page(&sg[i], page);
 	}
+}
 
-	s = op(p);
-	if (s == CMD_SUCCEEDED)
-		;
-	else if (s == RUNNING_ASYNC)
-		goto out_thr;
-	else if (s == CMD_FAILED)
-		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
-	else if (s == INVALID_OPCODE)
-		goto out_invalid_opcode;
-	else
-		WARN_ON(true);
-
-out_compl:
-	cmd->completed = 1;
-	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
-
-out_thr:
-	res = SCST_EXEC_COMPLETED;
+static enum compl_status_e ramdisk_exec_read(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
 
-	TRACE_EXIT_RES(res);
-	return res;
+	if (!p->use_zero_copy)
+		return ramdisk_exec_rw(p, false);
 
-out_invalid_opcode:
-	TRACE_DBG("Invalid opcode %s", scst_get_opcode_name(cmd));
-	scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-	goto out_compl;
+	/* The pages are already lent by ramdisk_alloc_data_buf() */
+	vdisk_rd_relend(virt_dev->rd, cmd->sg, cmd->sg_cnt,
+			p->loff >> PAGE_SHIFT);
+	return CMD_SUCCEEDED;
 }
 
-static int fileio_exec(struct scst_cmd *cmd)
+static enum compl_status_e ramdisk_exec_write(struct vdisk_cmd_params *p)
 {
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
-
-	EXTRACHECKS_BUG_ON(!ops);
-	return vdev_do_job(cmd, ops);
+	return ramdisk_exec_rw(p, true);
 }
 
-static void vdisk_on_free_cmd_params(const struct vdisk_cmd_params *p)
+/* Data are written straight to RAM, so there is nothing to verify */
+static enum compl_status_e ramdisk_exec_write_verify(struct vdisk_cmd_params *p)
 {
-	if (p->iv != p->small_iv)
-		kfree(p->iv);
+	return ramdisk_exec_rw(p, true);
 }
 
-static void fileio_on_free_cmd(struct scst_cmd *cmd)
+static enum compl_status_e ramdisk_exec_var_len_cmd(struct vdisk_cmd_params *p)
 {
-	struct vdisk_cmd_params *p = cmd->dh_priv;
-	struct scst_vdisk_dev *virt_dev;
+	struct scst_cmd *cmd = p->cmd;
+	int res;
 
 	TRACE_ENTRY();
 
-	if (!p)
-		goto out;
+	res = ramdisk_var_len_ops[cmd->cdb[9]](p);
 
-	virt_dev = cmd->dev->dh_priv;
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-	if (p->use_zero_copy) {
-		if ((cmd->data_direction & SCST_DATA_READ) &&
-		    virt_dev->zero_copy)
-			finish_read(cmd->sg, cmd->sg_cnt);
-		if (cmd->sg != p->small_sg)
-			kfree(cmd->sg);
-		cmd->sg_cnt = 0;
-		cmd->sg = NULL;
-		cmd->bufflen = 0;
-		cmd->data_len = 0;
-	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
+/**
+ * finish_read - Release the pages referenced by prepare_read().
+ */
+static void finish_read(struct scatterlist *sg, int sg_cnt)
+{
+	struct page *page;
+	int i;
 
-	vdisk_on_free_cmd_params(p);
+	TRACE_ENTRY();
 
-	kmem_cache_free(vdisk_cmd_param_cachep, p);
+	for (i = 0; i < sg_cnt; ++i) {
+		page = sg_page(&sg[i]);
+		EXTRACHECKS_BUG_ON(!page);
+		put_page(page);
+	}
 
-out:
 	TRACE_EXIT();
 	return;
 }
 
-/*
- * Functionally identical to scst_tg_accept_standby(), but separated, because,
- * generally, they are checking for different things. Better to keep different
- * things separately.
+/**
+ * prepare_read_page - Bring a single page into the page cache.
+ *
+ * @filp: file pointer
+ * @len: number of bytes to read from the file
+ * @offset: offset of first byte to read (from start of file)
+ * @last: offset of first byte that will not be read - used for readahead
+ * @pageptr: page pointer output variable.
+ *
+ * Returns a negative number if an error occurred, zero upon EOF or a positive
+ * number - the number of bytes that can be read from the file via the returned
+ * page. If a positive number is returned, it is the responsibility of the
+ * caller to release the returned page.
+ *
+ * Based on do_generic_file_read().
  */
-static bool vdisk_no_fd_allowed_commands(const struct scst_cmd *cmd)
+static int prepare_read_page(struct file *filp, int len,
+			     loff_t offset, loff_t last, struct page **pageptr)
 {
-	bool res;
+	struct address_space *mapping = filp->f_mapping;
+	struct inode *inode = mapping->host;
+	struct file_ra_state *ra = &filp->f_ra;
+	struct page *page;
+	unsigned long index, last_index;
+	long end_index, nr;
+	loff_t isize;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+	read_descriptor_t desc = { .count = len };
+#endif
+	int error;
 
 	TRACE_ENTRY();
 
-	switch (cmd->cdb[0]) {
-	case TEST_UNIT_READY:
-	case INQUIRY:
-	case MODE_SENSE:
-	case MODE_SENSE_10:
-	case READ_CAPACITY:
-	case REPORT_LUNS:
-	case REQUEST_SENSE:
-	case RELEASE:
-	case RELEASE_10:
-	case RESERVE:
-	case RESERVE_10:
-	case READ_BUFFER:
-	case WRITE_BUFFER:
-	case MODE_SELECT:
-	case MODE_SELECT_10:
-	case LOG_SELECT:
-	case LOG_SENSE:
-	case RECEIVE_DIAGNOSTIC:
-	case SEND_DIAGNOSTIC:
-	case PERSISTENT_RESERVE_IN:
-	case PERSISTENT_RESERVE_OUT:
-		res = true;
-		goto out;
-	case SERVICE_ACTION_IN_16:
-		switch (cmd->cdb[1] & 0x1f) {
-		case SAI_READ_CAPACITY_16:
+	WARN((offset & ~PAGE_MASK) + len > PAGE_SIZE,
+	     "offset = %lld + %lld, len = %d\n", offset & PAGE_MASK,
+	     offset & ~PAGE_MASK, len);
+	sBUG_ON(!mapping->a_ops);
+
+	index = offset >> PAGE_SHIFT;
+	last_index = (last + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+find_page:
+	page = find_get_page(mapping, index);
+	if (!page) {
+		page_cache_sync_readahead(mapping, ra, filp, index,
+					  last_index - index);
+		page = find_get_page(mapping, index);
+		if (unlikely(!page)) {
+			/*
+			 * Not cached so create a new page.
+			 */
+			page = page_cache_alloc_cold(mapping);
+			if (!page) {
+				error = -ENOMEM;
+				goto err;
+			}
+			error = add_to_page_cache_lru(page, mapping, index,
+						      GFP_KERNEL);
+			if (error) {
+				put_page(page);
+				if (error == -EEXIST)
+					goto find_page;
+				else
+					goto err;
+			} else {
+				goto readpage;
+			}
+		}
+	}
+	if (PageReadahead(page))
+		page_cache_async_readahead(mapping, ra, filp, page,
+					   index, last_index - index);
+	if (!PageUptodate(page)) {
+		if (inode->i_blkbits == PAGE_SHIFT ||
+		    !mapping->a_ops->is_partially_uptodate)
+			goto page_not_up_to_date;
+		if (!trylock_page(page))
+			goto page_not_up_to_date;
+		/* Did it get truncated before we got the lock? */
+		if (!page->mapping)
+			goto page_not_up_to_date_locked;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+		if (!mapping->a_ops->is_partially_uptodate(page,
+						offset & ~PAGE_MASK, len))
+#else
+		if (!mapping->a_ops->is_partially_uptodate(page, &desc,
+						offset & ~PAGE_MASK))
+#endif
+			goto page_not_up_to_date_locked;
+		unlock_page(page);
+	}
+page_ok:
+	/*
+	 * i_size must be checked after we know the page is Uptodate.
+	 *
+	 * Checking i_size after the check allows us to calculate the correct
+	 * value for "nr", which means the zero-filled part of the page is not
+	 * accessed (unless another truncate extends the file - this is
+	 * desired though).
+	 */
+
+	isize = i_size_read(inode);
+	end_index = (isize - 1) >> PAGE_SHIFT;
+	if (unlikely(isize == 0 || index > end_index)) {
+		put_page(page);
+		goto eof;
+	}
+
+	/* nr is the maximum number of bytes to copy from this page */
+	if (index < end_index) {
+		nr = PAGE_SIZE - (offset & ~PAGE_MASK);
+	} else {
+		nr = ((isize - 1) & ~PAGE_MASK) + 1 - (offset & ~PAGE_MASK);
+		if (nr <= 0) {
+			put_page(page);
+			goto eof;
+		}
+	}
+
+	/*
+	 * If users can be writing to this page using arbitrary virtual
+	 * addresses, take care about potential aliasing before reading the
+	 * page on the kernel side.
+	 */
+	if (mapping_writably_mapped(mapping))
+		flush_dcache_page(page);
+
+	mark_page_accessed(page);
+
+	/* Ok, we have the page and it's up to date. */
+	*pageptr = page;
+	TRACE_EXIT_RES(nr);
+	return nr;
+eof:
+	TRACE_EXIT();
+	return 0;
+err:
+	TRACE_EXIT_RES(error);
+	return error;
+
+page_not_up_to_date:
+	/* Try to get exclusive access to the page. */
+	error = lock_page_killable(page);
+	if (unlikely(error != 0)) {
+		put_page(page);
+		goto err;
+	}
+
+page_not_up_to_date_locked:
+	/* Did it get truncated before we got the lock? */
+	if (!page->mapping) {
+		unlock_page(page);
+		put_page(page);
+		goto find_page;
+	}
+
+	/* Did somebody else fill it already? */
+	if (PageUptodate(page)) {
+		unlock_page(page);
+		goto page_ok;
+	}
+
+readpage:
+	/*
+	 * A previous I/O error may have been due to temporary
+	 * failures, eg. multipath errors.
+	 * PG_error will be set again if readpage fails.
+	 */
+	ClearPageError(page);
+	/* Start the actual read. The read will unlock the page. */
+	error = mapping->a_ops->readpage(filp, page);
+	if (unlikely(error)) {
+		if (error == AOP_TRUNCATED_PAGE) {
+			put_page(page);
+			goto find_page;
+		}
+		WARN(error >= 0, "error = %d\n", error);
+		put_page(page);
+		goto err;
+	}
+
+	if (!PageUptodate(page)) {
+		error = lock_page_killable(page);
+		if (unlikely(error != 0)) {
+			put_page(page);
+			goto err;
+		}
+		if (!PageUptodate(page)) {
+			if (page->mapping == NULL) {
+				/*
+				 * invalidate_mapping_pages got it
+				 */
+				unlock_page(page);
+				put_page(page);
+				goto find_page;
+			}
+			unlock_page(page);
+			put_page(page);
+			error = -EIO;
+			goto err;
+		}
+		unlock_page(page);
+	}
+
+	goto page_ok;
+}
+
+/**
+ * prepare_read - Lock page cache pages corresponding to an sg vector
+ * @filp: file the sg vector applies to
+ * @sg: sg vector
+ * @sg_cnt: sg vector size
+ * @offset: file offset the first byte of the first sg element corresponds to
+ */
+static int prepare_read(struct file *filp, struct scatterlist *sg, int sg_cnt,
+			pgoff_t offset)
+{
+	struct page *page = NULL;
+	int i, res;
+	loff_t off, last = ((offset + sg_cnt - 1) << PAGE_SHIFT) +
+		sg[sg_cnt - 1].offset + sg[sg_cnt - 1].length;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < sg_cnt; ++i) {
+		off = (offset + i) << PAGE_SHIFT | sg[i].offset;
+		res = prepare_read_page(filp, sg[i].length, off, last, &page);
+		if (res <= 0)
+			goto err;
+		if (res < sg[i].length) {
+			put_page(page);
+			goto err;
+		}
+		sg_assign_page(&sg[i], page);
+	}
+
+	file_accessed(filp);
+
+out:
+	TRACE_EXIT_RES(i);
+	return i;
+
+err:
+	finish_read(sg, i);
+	i = -EIO;
+	goto out;
+}
+
+/**
+ * alloc_sg - Allocate an SG vector.
+ * @size: number of bytes that will be stored in the pages of the sg vector
+ * @off: first page data offset
+ * @gfp_mask: allocation flags for dynamic sg vector allocation
+ * @small_sg: pointer to a candidate sg vector
+ * @small_sg_size: size of @small_sg
+ * @p_sg_cnt: pointer to an int where the sg vector size will be written
+ */
+static struct scatterlist *alloc_sg(size_t size, unsigned int off,
+				    gfp_t gfp_mask,
+				    struct scatterlist *small_sg,
+				    int small_sg_size, int *p_sg_cnt)
+{
+	struct scatterlist *sg;
+	int i, sg_cnt, remaining_sz, sg_sz, sg_off;
+
+	TRACE_ENTRY();
+
+	sg_cnt = PAGE_ALIGN(size + off) >> PAGE_SHIFT;
+	sg = sg_cnt <= small_sg_size ? small_sg :
+		kmalloc_array(sg_cnt, sizeof(*sg), gfp_mask);
+	if (!sg)
+		goto out;
+
+	sg_init_table(sg, sg_cnt);
+	remaining_sz = size;
+	sg_off = off;
+	for (i = 0; i < sg_cnt; ++i) {
+		sg_sz = min_t(int, PAGE_SIZE - sg_off, remaining_sz);
+		sg_set_page(&sg[i], NULL, sg_sz, sg_off);
+		remaining_sz -= sg_sz;
+		sg_off = 0;
+	}
+	*p_sg_cnt = sg_cnt;
+
+out:
+	TRACE_EXIT();
+	return sg;
+}
+
+static int fileio_alloc_data_buf(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p;
+	struct scst_vdisk_dev *virt_dev;
+	int sg_cnt, nr;
+	const gfp_t gfp_mask = GFP_KERNEL;
+	struct scatterlist *sg;
+
+	TRACE_ENTRY();
+
+	p = cmd->dh_priv;
+	EXTRACHECKS_BUG_ON(!p);
+	virt_dev = cmd->dev->dh_priv;
+	/*
+	 * If the target driver (e.g. scst_local) allocates the sg vector
+	 * itself or the command is a write or bidi command, don't use zero
+	 * copy.
+	 */
+	if (cmd->tgt_i_data_buf_alloced ||
+	    (cmd->data_direction & SCST_DATA_READ) == 0 ||
+	    (virt_dev->fd && !virt_dev->fd->f_mapping->a_ops->readpage)) {
+		p->use_zero_copy = false;
+	}
+	if (!p->use_zero_copy)
+		goto out;
+
+	EXTRACHECKS_BUG_ON(!(cmd->data_direction & SCST_DATA_READ));
+
+	scst_cmd_set_dh_data_buff_alloced(cmd);
+
+	cmd->sg = alloc_sg(cmd->bufflen, p->loff & ~PAGE_MASK, gfp_mask,
+			   p->small_sg, ARRAY_SIZE(p->small_sg), &cmd->sg_cnt);
+	if (!cmd->sg) {
+		PRINT_ERROR("sg allocation failed (bufflen = %d, off = %lld)\n",
+			    cmd->bufflen, p->loff & ~PAGE_MASK);
+		goto enomem;
+	}
+	sg_cnt = scst_cmd_get_sg_cnt(cmd);
+	sg = cmd->sg;
+	nr = prepare_read(virt_dev->fd, sg, sg_cnt, p->loff >> PAGE_SHIFT);
+	if (nr < 0) {
+		PRINT_ERROR("prepare_read() failed: %d", nr);
+		goto out_free_sg;
+	}
+out:
+	TRACE_EXIT();
+	return SCST_CMD_STATE_DEFAULT;
+
+out_free_sg:
+	kfree(cmd->sg);
+	cmd->sg = NULL;
+	cmd->sg_cnt = 0;
+
+enomem:
+	scst_set_busy(cmd);
+	TRACE_EXIT_RES(-ENOMEM);
+	return scst_get_cmd_abnormal_done_state(cmd);
+}
+
+/*
+ * Lends the pages of @rd starting at index @idx to @sg, holes are backed by
+ * the zero page. The references are dropped by finish_read().
+ */
+static void vdisk_rd_lend(struct vdisk_rd *rd, struct scatterlist *sg,
+	int sg_cnt, unsigned long idx)
+{
+	struct page *page;
+	int i;
+
+	for (i = 0; i < sg_cnt; ++i) {
+		page = vdisk_rd_find_get_page(rd, idx + i);
+		if (page == NULL) {
+			page = ZERO_PAGE(0);
+			get_page(page);
+		}
+		sg_assign_page(&sg[i], page);
+	}
+}
+
+static int ramdisk_alloc_data_buf(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	p = cmd->dh_priv;
+	EXTRACHECKS_BUG_ON(!p);
+	virt_dev = cmd->dev->dh_priv;
+	/* See fileio_alloc_data_buf() */
+	if (cmd->tgt_i_data_buf_alloced ||
+	    (cmd->data_direction & SCST_DATA_READ) == 0)
+		p->use_zero_copy = false;
+	if (!p->use_zero_copy)
+		goto out;
+
+	scst_cmd_set_dh_data_buff_alloced(cmd);
+
+	cmd->sg = alloc_sg(cmd->bufflen, p->loff & ~PAGE_MASK, GFP_KERNEL,
+			   p->small_sg, ARRAY_SIZE(p->small_sg), &cmd->sg_cnt);
+	if (!cmd->sg) {
+		PRINT_ERROR("sg allocation failed (bufflen = %d, off = %lld)\n",
+			    cmd->bufflen, p->loff & ~PAGE_MASK);
+		scst_set_busy(cmd);
+		TRACE_EXIT_RES(-ENOMEM);
+		return scst_get_cmd_abnormal_done_state(cmd);
+	}
+
+	vdisk_rd_lend(virt_dev->rd, cmd->sg, cmd->sg_cnt,
+		      p->loff >> PAGE_SHIFT);
+
+out:
+	TRACE_EXIT();
+	return SCST_CMD_STATE_DEFAULT;
+}
+
+#else
+
+static int fileio_alloc_data_buf(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p;
+
+	TRACE_ENTRY();
+
+	p = cmd->dh_priv;
+	EXTRACHECKS_BUG_ON(!p);
+	p->use_zero_copy = false;
+
+	TRACE_EXIT();
+	return SCST_CMD_STATE_DEFAULT;
+}
+
+static int ramdisk_alloc_data_buf(struct scst_cmd *cmd)
+{
+	return fileio_alloc_data_buf(cmd);
+}
+
+static void finish_read(struct scatterlist *sg, int sg_cnt)
+{
+}
+
+#endif
+
+static int vdev_do_job(struct scst_cmd *cmd, const vdisk_op_fn *ops)
+{
+	int res;
+	uint8_t *cdb = cmd->cdb;
+	int opcode = cdb[0];
+	struct vdisk_cmd_params *p = cmd->dh_priv;
+	struct scst_vdisk_dev *virt_dev;
+	vdisk_op_fn op = ops[opcode];
+	enum compl_status_e s;
+
+	TRACE_ENTRY();
+
+	EXTRACHECKS_BUG_ON(!p);
+
+	virt_dev = cmd->dev->dh_priv;
+
+	EXTRACHECKS_BUG_ON(p->cmd != cmd);
+	EXTRACHECKS_BUG_ON(ops != blockio_ops && ops != fileio_ops &&
+			   ops != nullio_ops && ops != ramdisk_ops);
+
+	/*
+	 * No need to make it volatile, because at worst we will have a couple
+	 * of extra commands refused after formatting actually finished, which
+	 * is acceptable.
+	 */
+	if (unlikely(virt_dev->format_active)) {
+		switch (cmd->cdb[0]) {
+		case INQUIRY:
+		case REPORT_LUNS:
+		case REQUEST_SENSE:
+			break;
+		default:
+			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_format_in_progress));
+			goto out_compl;
+		}
+	}
+
+	s = op(p);
+	if (s == CMD_SUCCEEDED)
+		;
+	else if (s == RUNNING_ASYNC)
+		goto out_thr;
+	else if (s == CMD_FAILED)
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
+	else if (s == INVALID_OPCODE)
+		goto out_invalid_opcode;
+	else
+		WARN_ON(true);
+
+out_compl:
+	if (unlikely(virt_dev->ra != NULL) &&
+	    (cmd->op_flags & SCST_WRITE_MEDIUM))
+		vdisk_ra_invalidate_cmd(cmd);
+
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+
+out_thr:
+	res = SCST_EXEC_COMPLETED;
+
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_invalid_opcode:
+	TRACE_DBG("Invalid opcode %s", scst_get_opcode_name(cmd));
+	scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+	goto out_compl;
+}
+
+static int fileio_exec(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
+
+	EXTRACHECKS_BUG_ON(!ops);
+	return vdev_do_job(cmd, ops);
+}
+
+static void vdisk_on_free_cmd_params(const struct vdisk_cmd_params *p)
+{
+	if (p->iv != p->small_iv)
+		kfree(p->iv);
+}
+
+static void fileio_on_free_cmd(struct scst_cmd *cmd)
+{
+	struct vdisk_cmd_params *p = cmd->dh_priv;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	if (!p)
+		goto out;
+
+	virt_dev = cmd->dev->dh_priv;
+
+	if (p->use_zero_copy) {
+		if ((cmd->data_direction & SCST_DATA_READ) &&
+		    virt_dev->zero_copy)
+			finish_read(cmd->sg, cmd->sg_cnt);
+		if (cmd->sg != p->small_sg)
+			kfree(cmd->sg);
+		cmd->sg_cnt = 0;
+		cmd->sg = NULL;
+		cmd->bufflen = 0;
+		cmd->data_len = 0;
+	}
+
+	vdisk_on_free_cmd_params(p);
+
+	kmem_cache_free(vdisk_cmd_param_cachep, p);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Functionally identical to scst_tg_accept_standby(), but separated, because,
+ * generally, they are checking for different things. Better to keep different
+ * things separately.
+ */
+static bool vdisk_no_fd_allowed_commands(const struct scst_cmd *cmd)
+{
+	bool res;
+
+	TRACE_ENTRY();
+
+	switch (cmd->cdb[0]) {
+	case TEST_UNIT_READY:
+	case INQUIRY:
+	case MODE_SENSE:
+	case MODE_SENSE_10:
+	case READ_CAPACITY:
+	case REPORT_LUNS:
+	case REQUEST_SENSE:
+	case RELEASE:
+	case RELEASE_10:
+	case RESERVE:
+	case RESERVE_10:
+	case READ_BUFFER:
+	case WRITE_BUFFER:
+	case MODE_SELECT:
+	case MODE_SELECT_10:
+	case LOG_SELECT:
+	case LOG_SENSE:
+	case RECEIVE_DIAGNOSTIC:
+	case SEND_DIAGNOSTIC:
+	case PERSISTENT_RESERVE_IN:
+	case PERSISTENT_RESERVE_OUT:
+		res = true;
+		goto out;
+	case SERVICE_ACTION_IN_16:
+		switch (cmd->cdb[1] & 0x1f) {
+		case SAI_READ_CAPACITY_16:
+			res = true;
+			goto out;
+		}
+		break;
+	case MAINTENANCE_IN:
+		switch (cmd->cdb[1] & 0x1f) {
+		case MI_REPORT_TARGET_PGS:
+			res = true;
+			goto out;
+		}
+		break;
+	case MAINTENANCE_OUT:
+		switch (cmd->cdb[1] & 0x1f) {
+		case MO_SET_TARGET_PGS:
 			res = true;
 			goto out;
 		}
-		break;
-	case MAINTENANCE_IN:
-		switch (cmd->cdb[1] & 0x1f) {
-		case MI_REPORT_TARGET_PGS:
-			res = true;
-			goto out;
+		break;
+	}
+
+	res = false;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int blockio_exec(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
+	struct vdisk_cmd_params p;
+	int res;
+
+	EXTRACHECKS_BUG_ON(!ops);
+
+	memset(&p, 0, sizeof(p));
+	if (unlikely(!vdisk_parse_offset(&p, cmd)))
+		goto err;
+
+	if (unlikely(virt_dev->fd == NULL)) {
+		if (!vdisk_no_fd_allowed_commands(cmd)) {
+			/*
+			 * We should not get here, unless the user space
+			 * misconfiguring something, e.g. set optimized
+			 * ALUA state for secondary DRBD device. See
+			 * "DRBD and other replication/failover SW
+			 * compatibility" section in SCST README.
+			 */
+			PRINT_WARNING("Closed FD on exec. Not active ALUA state "
+				"or not blocked dev before ALUA state change? "
+				"(cmd %p, op %s, dev %s)", cmd, cmd->op_name,
+				cmd->dev->virt_name);
+			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
+			goto err;
+		}
+	}
+
+	if ((virt_dev->wbc != NULL) && unlikely(!vdisk_wbc_check_cmd(&p)))
+		goto err;
+
+	if ((virt_dev->ra != NULL) && (cmd->op_flags & SCST_WRITE_MEDIUM))
+		vdisk_ra_invalidate_cmd(cmd);
+
+	cmd->dh_priv = &p;
+	res = vdev_do_job(cmd, ops);
+	cmd->dh_priv = NULL;
+
+out:
+	vdisk_on_free_cmd_params(&p);
+	return res;
+
+err:
+	res = SCST_EXEC_COMPLETED;
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+	goto out;
+}
+
+static int nullio_exec(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
+	struct vdisk_cmd_params p;
+	int res;
+
+	EXTRACHECKS_BUG_ON(!ops);
+
+	memset(&p, 0, sizeof(p));
+	if (unlikely(!vdisk_parse_offset(&p, cmd)))
+		goto err;
+
+	cmd->dh_priv = &p;
+	res = vdev_do_job(cmd, ops);
+	cmd->dh_priv = NULL;
+
+out:
+	vdisk_on_free_cmd_params(&p);
+	return res;
+
+err:
+	res = SCST_EXEC_COMPLETED;
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+	goto out;
+}
+
+static int vcdrom_exec(struct scst_cmd *cmd)
+{
+	int res = SCST_EXEC_COMPLETED;
+	int opcode = cmd->cdb[0];
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	cmd->status = 0;
+	cmd->msg_status = 0;
+	cmd->host_status = DID_OK;
+	cmd->driver_status = 0;
+
+	if (virt_dev->cdrom_empty && (opcode != INQUIRY)) {
+		TRACE_DBG("%s", "CDROM empty");
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
+		goto out_done;
+	}
+
+	if (virt_dev->media_changed && ((cmd->op_flags & SCST_SKIP_UA) == 0)) {
+		spin_lock(&virt_dev->flags_lock);
+		if (virt_dev->media_changed) {
+			virt_dev->media_changed = 0;
+			TRACE_DBG("%s", "Reporting media changed");
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_medium_changed_UA));
+			spin_unlock(&virt_dev->flags_lock);
+			goto out_done;
+		}
+		spin_unlock(&virt_dev->flags_lock);
+	}
+
+	res = vdev_do_job(cmd, virt_dev->blockio ? blockio_ops : fileio_ops);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_done:
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+	goto out;
+}
+
+static uint64_t vdisk_gen_dev_id_num(const char *virt_dev_name)
+{
+	uint32_t dev_id_num;
+
+	dev_id_num = crc32c(0, virt_dev_name, strlen(virt_dev_name)+1);
+
+#ifdef CONFIG_SCST_PROC
+	return ((uint64_t)scst_vdisk_ID << 32) | dev_id_num;
+#else
+	return ((uint64_t)scst_get_setup_id() << 32) | dev_id_num;
+#endif
+}
+
+static int vdisk_unmap_file_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, loff_t off, loff_t len,
+	struct file *fd)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+	TRACE_DBG("Fallocating range %lld, len %lld",
+		(unsigned long long)off, (unsigned long long)len);
+
+	res = fd->f_op->fallocate(fd,
+		FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+	if (unlikely(res != 0)) {
+		PRINT_ERROR("fallocate() for %lld, len %lld "
+			"failed: %d", (unsigned long long)off,
+			(unsigned long long)len, res);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_write_error));
+		res = -EIO;
+	}
+#else
+	res = 0;
+#endif
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int vdisk_unmap_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, uint64_t start_lba, uint32_t blocks)
+{
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
+	int res, err;
+#else
+	int res;
+#endif
+	struct file *fd = virt_dev->fd;
+
+	TRACE_ENTRY();
+
+	if (blocks == 0)
+		goto success;
+
+	if ((start_lba > virt_dev->nblocks) ||
+	    ((start_lba + blocks) > virt_dev->nblocks)) {
+		PRINT_ERROR("Device %s: attempt to write beyond max "
+			"size", virt_dev->name);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+		res = -EINVAL;
+		goto out;
+	}
+
+	TRACE_DBG("Unmapping lba %lld (blocks %lld)",
+		(unsigned long long)start_lba, (unsigned long long)blocks);
+
+	if (virt_dev->blockio) {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
+		sector_t start_sector = start_lba << (cmd->dev->block_shift - 9);
+		sector_t nr_sects = blocks << (cmd->dev->block_shift - 9);
+		struct inode *inode = file_inode(fd);
+		gfp_t gfp = cmd->cmd_gfp_mask;
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 31)
+		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects, gfp);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35)       \
+      && !(LINUX_VERSION_CODE == KERNEL_VERSION(2, 6, 34) \
+	   && defined(CONFIG_SUSE_KERNEL))
+		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects,
+				gfp, DISCARD_FL_WAIT);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
+		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects,
+				gfp, BLKDEV_IFL_WAIT);
+#else
+		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects, gfp, 0);
+#endif
+		if (unlikely(err != 0)) {
+			PRINT_ERROR("blkdev_issue_discard() for "
+				"LBA %lld, blocks %d failed: %d",
+				(unsigned long long)start_lba, blocks, err);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+			res = -EIO;
+			goto out;
+		}
+#else
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		res = -EIO;
+		goto out;
+#endif
+	} else {
+		loff_t off = start_lba << cmd->dev->block_shift;
+		loff_t len = (u64)blocks << cmd->dev->block_shift;
+
+		res = vdisk_unmap_file_range(cmd, virt_dev, off, len, fd);
+		if (unlikely(res != 0))
+			goto out;
+	}
+
+	if (virt_dev->dif_fd != NULL) {
+		res = vdisk_format_dif(cmd, start_lba, blocks);
+		if (unlikely(res != 0))
+			goto out;
+	}
+
+success:
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void vdisk_exec_write_same_unmap(struct vdisk_cmd_params *p)
+{
+	int rc;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	if (unlikely(!virt_dev->thin_provisioned)) {
+		TRACE_DBG("%s", "Device not thin provisioned");
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		goto out;
+	}
+
+	if (unlikely((uint64_t)cmd->data_len > cmd->dev->max_write_same_len)) {
+		PRINT_WARNING("Invalid WRITE SAME data len %lld (max allowed "
+			"%lld)", (long long)cmd->data_len,
+			(long long)cmd->dev->max_write_same_len);
+		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
+		goto out;
+	}
+
+	rc = vdisk_unmap_range(cmd, virt_dev, cmd->lba,
+		cmd->data_len >> dev->block_shift);
+	if (rc != 0)
+		goto out;
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Copy a zero-terminated string into a fixed-size byte array and fill the
+ * trailing bytes with @fill_byte.
+ */
+static void scst_copy_and_fill_b(char *dst, const char *src, int len,
+				 uint8_t fill_byte)
+{
+	int cpy_len = min_t(int, strlen(src), len);
+
+	memcpy(dst, src, cpy_len);
+	memset(dst + cpy_len, fill_byte, len - cpy_len);
+}
+
+/*
+ * Copy a zero-terminated string into a fixed-size char array and fill the
+ * trailing characters with spaces.
+ */
+static void scst_copy_and_fill(char *dst, const char *src, int len)
+{
+	scst_copy_and_fill_b(dst, src, len, ' ');
+}
+
+static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	enum compl_status_e res = CMD_SUCCEEDED;
+	uint8_t ctrl_offs = (cmd->cdb_len < 32) ? 1 : 10;
+
+	TRACE_ENTRY();
+
+	if (unlikely(cmd->cdb[ctrl_offs] & 0x10)) {
+		TRACE_DBG("%s", "ANCHOR not supported");
+		scst_set_invalid_field_in_cdb(cmd, ctrl_offs,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+		goto out;
+	}
+
+	if (unlikely(cmd->data_len <= 0)) {
+		PRINT_ERROR("WRITE SAME: refused data_len = %#llx",
+			    cmd->data_len);
+		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
+		goto out;
+	}
+
+	if (cmd->cdb[ctrl_offs] & 0x8)
+		vdisk_exec_write_same_unmap(p);
+	else {
+		scst_write_same(cmd, NULL);
+		res = RUNNING_ASYNC;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static enum compl_status_e vdisk_exec_unmap(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct scst_data_descriptor *pd = cmd->cmd_data_descriptors;
+	int i, cnt = cmd->cmd_data_descriptors_cnt;
+	uint32_t blocks_to_unmap;
+
+	TRACE_ENTRY();
+
+	if (unlikely(!virt_dev->thin_provisioned)) {
+		TRACE_DBG("%s", "Device not thin provisioned");
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		goto out;
+	}
+
+	if (unlikely(cmd->cdb[1] & 1)) {
+		TRACE_DBG("%s", "ANCHOR not supported");
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+		goto out;
+	}
+
+	if (pd == NULL)
+		goto out;
+
+	/* Sanity check to avoid too long latencies */
+	blocks_to_unmap = 0;
+	for (i = 0; i < cnt; i++) {
+		blocks_to_unmap += pd[i].sdd_blocks;
+		if (blocks_to_unmap > virt_dev->unmap_max_lba_cnt) {
+			PRINT_WARNING("Too many UNMAP LBAs %u (max allowed %u, "
+				"dev %s)", blocks_to_unmap,
+				virt_dev->unmap_max_lba_cnt,
+				virt_dev->dev->virt_name);
+			scst_set_invalid_field_in_parm_list(cmd, 0, 0);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < cnt; i++) {
+		int rc;
+
+		if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
+			TRACE_MGMT_DBG("ABORTED set, aborting cmd %p", cmd);
+			goto out;
+		}
+
+		rc = vdisk_unmap_range(cmd, virt_dev, pd[i].sdd_lba,
+			pd[i].sdd_blocks);
+		if (rc != 0)
+			goto out;
+	}
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
+
+/* Supported VPD Pages VPD page (00h). */
+static int vdisk_sup_vpd(uint8_t *buf, struct scst_cmd *cmd,
+			 struct scst_vdisk_dev *virt_dev)
+{
+	char *page_list = &buf[4], *p = page_list;
+
+	*p++ = 0x0; /* this page */
+	*p++ = 0x80; /* unit serial number */
+	*p++ = 0x83; /* device identification */
+	*p++ = 0x86; /* extended inquiry */
+	if (cmd->dev->type == TYPE_DISK) {
+		*p++ = 0xB0; /* block limits */
+		*p++ = 0xB1; /* block device characteristics */
+		if (virt_dev->thin_provisioned)
+			*p++ = 0xB2; /* thin provisioning */
+	}
+	buf[3] = p - page_list; /* page length */
+
+	return buf[3] + 4;
+}
+
+/* Unit Serial Number VPD page (80h) */
+static int vdisk_usn_vpd(uint8_t *buf, struct scst_cmd *cmd,
+			 struct scst_vdisk_dev *virt_dev)
+{
+	buf[1] = 0x80;
+	if (cmd->tgtt->get_serial) {
+		buf[3] = cmd->tgtt->get_serial(cmd->tgt_dev, &buf[4],
+					       INQ_BUF_SZ - 4);
+	} else {
+		int usn_len;
+
+		read_lock(&vdisk_serial_rwlock);
+		usn_len = strlen(virt_dev->usn);
+		buf[3] = usn_len;
+		strncpy(&buf[4], virt_dev->usn, usn_len);
+		read_unlock(&vdisk_serial_rwlock);
+	}
+	return buf[3] + 4;
+}
+
+/* Device Identification VPD page (83h) */
+static int vdisk_dev_id_vpd(uint8_t *buf, struct scst_cmd *cmd,
+			    struct scst_vdisk_dev *virt_dev)
+{
+	int i, eui64_len = 0, naa_len = 0, resp_len, num = 4;
+	uint16_t tg_id;
+	u8 *eui64_id = NULL, *naa_id = NULL;
+
+	buf[1] = 0x83;
+
+	read_lock(&vdisk_serial_rwlock);
+	i = strlen(virt_dev->scsi_device_name);
+	if (i > 0) {
+		/* SCSI target device name */
+		buf[num + 0] = 0x3;	/* ASCII */
+		buf[num + 1] = 0x20 | 0x8; /* Target device SCSI name */
+		i += 4 - i % 4; /* align to required 4 bytes */
+		scst_copy_and_fill_b(&buf[num + 4], virt_dev->scsi_device_name,
+				     i, '\0');
+
+		buf[num + 3] = i;
+		num += buf[num + 3];
+
+		num += 4;
+	}
+	read_unlock(&vdisk_serial_rwlock);
+
+	/* T10 vendor identifier field format (faked) */
+	buf[num + 0] = 0x2;	/* ASCII */
+	buf[num + 1] = 0x1;	/* Vendor ID */
+	read_lock(&vdisk_serial_rwlock);
+	scst_copy_and_fill(&buf[num + 4], virt_dev->t10_vend_id, 8);
+	i = strlen(virt_dev->vend_specific_id);
+	memcpy(&buf[num + 12], virt_dev->vend_specific_id, i);
+	read_unlock(&vdisk_serial_rwlock);
+
+	buf[num + 3] = 8 + i;
+	num += buf[num + 3];
+
+	num += 4;
+
+	/*
+	 * Relative target port identifier
+	 */
+	buf[num + 0] = 0x01; /* binary */
+	/* Relative target port id */
+	buf[num + 1] = 0x10 | 0x04;
+
+	put_unaligned_be16(cmd->tgt->rel_tgt_id, &buf[num + 4 + 2]);
+
+	buf[num + 3] = 4;
+	num += buf[num + 3];
+
+	num += 4;
+
+	tg_id = scst_lookup_tg_id(cmd->dev, cmd->tgt);
+	if (tg_id) {
+		/*
+		 * Target port group designator
+		 */
+		buf[num + 0] = 0x01; /* binary */
+		/* Target port group id */
+		buf[num + 1] = 0x10 | 0x05;
+
+		put_unaligned_be16(tg_id, &buf[num + 4 + 2]);
+
+		buf[num + 3] = 4;
+		num += 4 + buf[num + 3];
+	}
+
+	read_lock(&vdisk_serial_rwlock);
+
+	if (virt_dev->eui64_id_len == 0 && virt_dev->naa_id_len == 0) {
+		/*
+		 * Compatibility mode: export the first eight bytes of the
+		 * t10_dev_id as an EUI-64 ID. This is not entirely standards
+		 * compliant since t10_dev_id contains an ASCII string and the
+		 * first three bytes of an eight-byte EUI-64 ID are a OUI.
+		 */
+		eui64_len = 8;
+		eui64_id  = virt_dev->t10_dev_id;
+	} else {
+		if (virt_dev->eui64_id_len) {
+			eui64_len = virt_dev->eui64_id_len;
+			eui64_id  = virt_dev->eui64_id;
+		}
+		if (virt_dev->naa_id_len) {
+			naa_len = virt_dev->naa_id_len;
+			naa_id  = virt_dev->naa_id;
 		}
-		break;
-	case MAINTENANCE_OUT:
-		switch (cmd->cdb[1] & 0x1f) {
-		case MO_SET_TARGET_PGS:
-			res = true;
-			goto out;
+	}
+	if (eui64_len) {
+		buf[num + 0] = 0x01; /* binary */
+		buf[num + 1] = 0x02; /* EUI-64 */
+		buf[num + 2] = 0x00; /* reserved */
+		buf[num + 3] = eui64_len;
+		memcpy(&buf[num + 4], eui64_id, eui64_len);
+		num += 4 + eui64_len;
+	}
+	if (naa_len) {
+		buf[num + 0] = 0x01; /* binary */
+		buf[num + 1] = 0x03; /* NAA */
+		buf[num + 2] = 0x00; /* reserved */
+		buf[num + 3] = naa_len;
+		memcpy(&buf[num + 4], naa_id, naa_len);
+		num += 4 + naa_len;
+	}
+
+	read_unlock(&vdisk_serial_rwlock);
+
+	resp_len = num - 4;
+
+	put_unaligned_be16(resp_len, &buf[2]);
+	resp_len += 4;
+
+	return resp_len;
+}
+
+/* Extended INQUIRY Data (86h) */
+static int vdisk_ext_inq(uint8_t *buf, struct scst_cmd *cmd,
+			 struct scst_vdisk_dev *virt_dev)
+{
+	struct scst_device *dev = cmd->dev;
+
+	buf[1] = 0x86;
+	buf[3] = 0x3C;
+	if (dev->dev_dif_mode != SCST_DIF_MODE_NONE) {
+		switch (dev->dev_dif_type) {
+		case 1:
+			buf[4] = 0; /* SPT=0, type 1 only supported */
+			break;
+		case 2:
+			buf[4] = 0x10; /* SPT=010, type 2 only supported */
+			break;
+		case 3:
+			buf[4] = 0x20; /* SPT=100, type 3 only supported */
+			break;
+		default:
+			sBUG_ON(1);
+			break;
 		}
-		break;
+		buf[4] |= 4; /* GRD_CHK */
+		if (dev->dif_app_chk)
+			buf[4] |= 2; /* APP_CHK */
+		if (dev->dif_ref_chk)
+			buf[4] |= 1; /* REF_CHK */
+	}
+	buf[5] = 7; /* HEADSUP=1, ORDSUP=1, SIMPSUP=1 */
+	buf[6] = (virt_dev->wt_flag || virt_dev->nv_cache) ? 0 : 1; /* V_SUP */
+	buf[7] = 1; /* LUICLR=1 */
+	return buf[3] + 4;
+}
+
+/* Block Limits VPD page (B0h) */
+static int vdisk_block_limits(uint8_t *buf, struct scst_cmd *cmd,
+			      struct scst_vdisk_dev *virt_dev)
+{
+	struct scst_device *dev = cmd->dev;
+	int max_transfer;
+
+	buf[1] = 0xB0;
+	buf[3] = 0x3C;
+	buf[4] = 1; /* WSNZ set */
+	buf[5] = 0xFF; /* No MAXIMUM COMPARE AND WRITE LENGTH limit */
+	/* Optimal transfer granuality is PAGE_SIZE */
+	put_unaligned_be16(max_t(int, PAGE_SIZE / dev->block_size, 1), &buf[6]);
+
+	/* Max transfer len is min of sg limit and 8M */
+	max_transfer = min_t(int, cmd->tgt_dev->max_sg_cnt << PAGE_SHIFT,
+			     8*1024*1024) / dev->block_size;
+	put_unaligned_be32(max_transfer, &buf[8]);
+
+	/*
+	 * Let's have optimal transfer len 512KB. Better to not
+	 * set it at all, because we don't have such limit,
+	 * but some initiators may not understand that (?).
+	 * From other side, too big transfers  are not optimal,
+	 * because SGV cache supports only <4M buffers.
+	 */
+	put_unaligned_be32(min_t(int, max_transfer, 512*1024 / dev->block_size),
+			   &buf[12]);
+
+	if (virt_dev->thin_provisioned) {
+		/* MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT is UNLIMITED */
+		put_unaligned_be32(0xFFFFFFFF, &buf[24]);
+		/*
+		 * MAXIMUM UNMAP LBA COUNT, OPTIMAL UNMAP
+		 * GRANULARITY and ALIGNMENT
+		 */
+		put_unaligned_be32(virt_dev->unmap_max_lba_cnt, &buf[20]);
+		put_unaligned_be32(virt_dev->unmap_opt_gran, &buf[28]);
+		if (virt_dev->unmap_align != 0) {
+			put_unaligned_be32(virt_dev->unmap_align, &buf[32]);
+			buf[32] |= 0x80;
+		}
+	}
+
+	/* MAXIMUM WRITE SAME LENGTH (measured in blocks) */
+	put_unaligned_be64(dev->max_write_same_len >> dev->block_shift,
+			   &buf[36]);
+
+	return buf[3] + 4;
+}
+
+/* Block Device Characteristics VPD Page (B1h) */
+static int vdisk_bdev_char(uint8_t *buf, struct scst_cmd *cmd,
+			   struct scst_vdisk_dev *virt_dev)
+{
+	buf[1] = 0xB1;
+	buf[3] = 0x3C;
+	if (virt_dev->rotational) {
+		/* 15K RPM */
+		put_unaligned_be16(0x3A98, &buf[4]);
+	} else
+		put_unaligned_be16(1, &buf[4]);
+	return buf[3] + 4;
+}
+
+/* Logical Block Provisioning a.k.a. Thin Provisioning VPD page (B2h) */
+static int vdisk_tp_vpd(uint8_t *buf, struct scst_cmd *cmd,
+			struct scst_vdisk_dev *virt_dev)
+{
+	buf[1] = 0xB2;
+	buf[3] = 4;
+	buf[5] = 0xE0;
+	if (virt_dev->discard_zeroes_data)
+		buf[5] |= 0x4; /* LBPRZ */
+	buf[6] = 2; /* thin provisioned */
+	return buf[3] + 4;
+}
+
+/* Standard INQUIRY response */
+static int vdisk_inq(uint8_t *buf, struct scst_cmd *cmd,
+		     struct scst_vdisk_dev *virt_dev)
+{
+	int num;
+
+	if (virt_dev->removable)
+		buf[1] = 0x80;      /* removable */
+	buf[2] = 6; /* Device complies to SPC-4 */
+	buf[3] = 0x02;	/* Data in format specified in SPC */
+	buf[3] |= 0x20; /* ACA supported */
+	buf[4] = 31;/* n - 4 = 35 - 4 = 31 for full 36 byte data */
+	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE)
+		buf[5] |= 1; /* PROTECT */
+	if (scst_alua_configured(cmd->dev)) {
+		buf[5] |= SCST_INQ_TPGS_MODE_IMPLICIT;
+		if (virt_dev->expl_alua)
+			buf[5] |= SCST_INQ_TPGS_MODE_EXPLICIT;
 	}
+	buf[5] |= 8; /* 3PC */
+	buf[6] = 0x10; /* MultiP 1 */
+	buf[7] = 2; /* CMDQUE 1, BQue 0 => commands queuing supported */
 
-	res = false;
+	read_lock(&vdisk_serial_rwlock);
 
-out:
-	TRACE_EXIT_RES(res);
-	return res;
-}
+	/*
+	 * 8 byte ASCII Vendor Identification of the target
+	 * - left aligned.
+	 */
+	scst_copy_and_fill(&buf[8], virt_dev->t10_vend_id, 8);
 
-static int blockio_exec(struct scst_cmd *cmd)
-{
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
-	struct vdisk_cmd_params p;
-	int res;
+	/*
+	 * 16 byte ASCII Product Identification of the target - left
+	 * aligned.
+	 */
+	scst_copy_and_fill(&buf[16], virt_dev->prod_id, 16);
 
-	EXTRACHECKS_BUG_ON(!ops);
+	/*
+	 * 4 byte ASCII Product Revision Level of the target - left
+	 * aligned.
+	 */
+	scst_copy_and_fill(&buf[32], virt_dev->prod_rev_lvl, 4);
 
-	memset(&p, 0, sizeof(p));
-	if (unlikely(!vdisk_parse_offset(&p, cmd)))
-		goto err;
+	/* Vendor specific information. */
+	if (virt_dev->inq_vend_specific_len <= 20)
+		memcpy(&buf[36], virt_dev->inq_vend_specific,
+		       virt_dev->inq_vend_specific_len);
 
-	if (unlikely(virt_dev->fd == NULL)) {
-		if (!vdisk_no_fd_allowed_commands(cmd)) {
-			/*
-			 * We should not get here, unless the user space
-			 * misconfiguring something, e.g. set optimized
-			 * ALUA state for secondary DRBD device. See
-			 * "DRBD and other replication/failover SW
-			 * compatibility" section in SCST README.
-			 */
-			PRINT_WARNING("Closed FD on exec. Not active ALUA state "
-				"or not blocked dev before ALUA state change? "
-				"(cmd %p, op %s, dev %s)", cmd, cmd->op_name,
-				cmd->dev->virt_name);
-			scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
-			goto err;
+	/** Version descriptors **/
+
+	buf[4] += 58 - 36;
+	num = 0;
+
+	/* SAM-4 T10/1683-D revision 14 */
+	buf[58 + num] = 0x0;
+	buf[58 + num + 1] = 0x8B;
+	num += 2;
+
+	/* Physical transport */
+	if (cmd->tgtt->get_phys_transport_version != NULL) {
+		uint16_t v = cmd->tgtt->get_phys_transport_version(cmd->tgt);
+
+		if (v != 0) {
+			put_unaligned_be16(v, &buf[58 + num]);
+			num += 2;
 		}
 	}
 
-	cmd->dh_priv = &p;
-	res = vdev_do_job(cmd, ops);
-	cmd->dh_priv = NULL;
+	/* SCSI transport */
+	if (cmd->tgtt->get_scsi_transport_version != NULL) {
+		put_unaligned_be16(
+			cmd->tgtt->get_scsi_transport_version(cmd->tgt),
+			&buf[58 + num]);
+		num += 2;
+	}
 
-out:
-	vdisk_on_free_cmd_params(&p);
-	return res;
+	/* SPC-4 T10/1731-D revision 23 */
+	buf[58 + num] = 0x4;
+	buf[58 + num + 1] = 0x63;
+	num += 2;
 
-err:
-	res = SCST_EXEC_COMPLETED;
-	cmd->completed = 1;
-	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
-	goto out;
+	/* Device command set */
+	if (virt_dev->command_set_version != 0) {
+		put_unaligned_be16(virt_dev->command_set_version,
+				   &buf[58 + num]);
+		num += 2;
+	}
+
+	/* Vendor specific information. */
+	if (virt_dev->inq_vend_specific_len > 20) {
+		memcpy(&buf[96], virt_dev->inq_vend_specific,
+		       virt_dev->inq_vend_specific_len);
+		num = 96 - 58 + virt_dev->inq_vend_specific_len;
+	}
+
+	read_unlock(&vdisk_serial_rwlock);
+
+	buf[4] += num;
+	return buf[4] + 5;
 }
 
-static int nullio_exec(struct scst_cmd *cmd)
+static enum compl_status_e vdisk_exec_inquiry(struct vdisk_cmd_params *p)
 {
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	const vdisk_op_fn *ops = virt_dev->vdev_devt->devt_priv;
-	struct vdisk_cmd_params p;
-	int res;
+	struct scst_cmd *cmd = p->cmd;
+	int32_t length, resp_len;
+	uint8_t *address;
+	uint8_t *buf;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	enum scst_tg_state alua_state;
 
-	EXTRACHECKS_BUG_ON(!ops);
+	TRACE_ENTRY();
 
-	memset(&p, 0, sizeof(p));
-	if (unlikely(!vdisk_parse_offset(&p, cmd)))
-		goto err;
+	buf = kzalloc(INQ_BUF_SZ, cmd->cmd_gfp_mask);
+	if (buf == NULL) {
+		scst_set_busy(cmd);
+		goto out;
+	}
 
-	cmd->dh_priv = &p;
-	res = vdev_do_job(cmd, ops);
-	cmd->dh_priv = NULL;
+	length = scst_get_buf_full_sense(cmd, &address);
+	TRACE_DBG("length %d", length);
+	if (unlikely(length <= 0))
+		goto out_free;
 
-out:
-	vdisk_on_free_cmd_params(&p);
-	return res;
+	if (cmd->cdb[1] & CMDDT) {
+		TRACE_DBG("%s", "INQUIRY: CMDDT is unsupported");
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
+		goto out_put;
+	}
 
-err:
-	res = SCST_EXEC_COMPLETED;
-	cmd->completed = 1;
-	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
-	goto out;
+	alua_state = scst_get_alua_state(cmd->dev, cmd->tgt);
+	if ((alua_state == SCST_TG_STATE_UNAVAILABLE) ||
+	    (alua_state == SCST_TG_STATE_OFFLINE))
+		buf[0] = SCSI_INQ_PQ_NOT_CON << 5 | dev->type;
+	else
+		buf[0] = virt_dev->dummy ? SCSI_INQ_PQ_NOT_CON << 5 | 0x1f :
+			 SCSI_INQ_PQ_CON << 5 | dev->type;
+	/* Vital Product */
+	if (cmd->cdb[1] & EVPD) {
+		if (cmd->cdb[2] == 0) {
+			resp_len = vdisk_sup_vpd(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0x80) {
+			resp_len = vdisk_usn_vpd(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0x83) {
+			resp_len = vdisk_dev_id_vpd(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0x86) {
+			resp_len = vdisk_ext_inq(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0xB0 && dev->type == TYPE_DISK) {
+			resp_len = vdisk_block_limits(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0xB1 && dev->type == TYPE_DISK) {
+			resp_len = vdisk_bdev_char(buf, cmd, virt_dev);
+		} else if (cmd->cdb[2] == 0xB2 && dev->type == TYPE_DISK &&
+			   virt_dev->thin_provisioned) {
+			resp_len = vdisk_tp_vpd(buf, cmd, virt_dev);
+		} else {
+			TRACE_DBG("INQUIRY: Unsupported EVPD page %x", cmd->cdb[2]);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+			goto out_put;
+		}
+	} else {
+		if (cmd->cdb[2] != 0) {
+			TRACE_DBG("INQUIRY: Unsupported page %x", cmd->cdb[2]);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+			goto out_put;
+		}
+		resp_len = vdisk_inq(buf, cmd, virt_dev);
+	}
+
+	sBUG_ON(resp_len > INQ_BUF_SZ);
+
+	if (length > resp_len)
+		length = resp_len;
+	memcpy(address, buf, length);
+
+out_put:
+	scst_put_buf_full(cmd, address);
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
+out_free:
+	kfree(buf);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-static int vcdrom_exec(struct scst_cmd *cmd)
+static enum compl_status_e vdisk_exec_request_sense(struct vdisk_cmd_params *p)
 {
-	int res = SCST_EXEC_COMPLETED;
-	int opcode = cmd->cdb[0];
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	int32_t length, sl;
+	uint8_t *address;
+	uint8_t b[SCST_STANDARD_SENSE_LEN];
 
 	TRACE_ENTRY();
 
-	cmd->status = 0;
-	cmd->msg_status = 0;
-	cmd->host_status = DID_OK;
-	cmd->driver_status = 0;
+	/*
+	 * No need to make it volatile, because at worst we will have a couple
+	 * of extra commands refused after formatting actually finished, which
+	 * is acceptable.
+	 */
+	if (virt_dev->format_active) {
+		uint64_t d, div;
+		uint16_t v;
+
+		div = virt_dev->format_progress_to_do >> 16;
+		d = virt_dev->format_progress_done;
+		do_div(d, div);
+		v = d;
+
+		TRACE_DBG("Format progress %d", v);
 
-	if (virt_dev->cdrom_empty && (opcode != INQUIRY)) {
-		TRACE_DBG("%s", "CDROM empty");
-		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_no_medium));
-		goto out_done;
-	}
+		sl = scst_set_sense(b, sizeof(b), dev->d_sense,
+			SCST_LOAD_SENSE(scst_sense_format_in_progress));
 
-	if (virt_dev->media_changed && ((cmd->op_flags & SCST_SKIP_UA) == 0)) {
-		spin_lock(&virt_dev->flags_lock);
-		if (virt_dev->media_changed) {
-			virt_dev->media_changed = 0;
-			TRACE_DBG("%s", "Reporting media changed");
-			scst_set_cmd_error(cmd,
-				SCST_LOAD_SENSE(scst_sense_medium_changed_UA));
-			spin_unlock(&virt_dev->flags_lock);
-			goto out_done;
+		BUILD_BUG_ON(SCST_STANDARD_SENSE_LEN < 18);
+		if (dev->d_sense) {
+			uint8_t *p = &b[7];
+			int o = 8;
+			*p += 8;
+			b[o] = 2;
+			b[o+1] = 6;
+			b[o+4] = 0x80;
+			put_unaligned_be16(v, &b[o+5]);
+		} else {
+			b[15] = 0x80;
+			put_unaligned_be16(v, &b[16]);
 		}
-		spin_unlock(&virt_dev->flags_lock);
-	}
+		TRACE_BUFF_FLAG(TRACE_DEBUG, "Format sense", b, sizeof(b));
+	} else
+		sl = scst_set_sense(b, sizeof(b), cmd->dev->d_sense,
+			SCST_LOAD_SENSE(scst_sense_no_sense));
 
-	res = vdev_do_job(cmd, virt_dev->blockio ? blockio_ops : fileio_ops);
+	length = scst_get_buf_full_sense(cmd, &address);
+	TRACE_DBG("length %d", length);
+	if (length <= 0)
+		goto out;
 
-out:
-	TRACE_EXIT_RES(res);
-	return res;
+	length = min(sl, length);
+	memcpy(address, b, length);
+	scst_set_resp_data_len(cmd, length);
 
-out_done:
-	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
-	goto out;
+	scst_put_buf_full(cmd, address);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-static uint64_t vdisk_gen_dev_id_num(const char *virt_dev_name)
-{
-	uint32_t dev_id_num;
+static int vdisk_err_recov_pg(unsigned char *p, int pcontrol,
+			       struct scst_vdisk_dev *virt_dev)
+{	/* Read-Write Error Recovery page for mode_sense */
+	const unsigned char err_recov_pg[] = {0x1, 0xa, 0xc0, 1, 0, 0, 0, 0,
+					      1, 0, 0xff, 0xff};
 
-	dev_id_num = crc32c(0, virt_dev_name, strlen(virt_dev_name)+1);
+	memcpy(p, err_recov_pg, sizeof(err_recov_pg));
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(err_recov_pg) - 2);
+	return sizeof(err_recov_pg);
+}
 
-#ifdef CONFIG_SCST_PROC
-	return ((uint64_t)scst_vdisk_ID << 32) | dev_id_num;
-#else
-	return ((uint64_t)scst_get_setup_id() << 32) | dev_id_num;
-#endif
+static int vdisk_disconnect_pg(unsigned char *p, int pcontrol,
+				struct scst_vdisk_dev *virt_dev)
+{	/* Disconnect-Reconnect page for mode_sense */
+	const unsigned char disconnect_pg[] = {0x2, 0xe, 128, 128, 0, 10, 0, 0,
+					       0, 0, 0, 0, 0, 0, 0, 0};
+
+	memcpy(p, disconnect_pg, sizeof(disconnect_pg));
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(disconnect_pg) - 2);
+	return sizeof(disconnect_pg);
 }
 
-static int vdisk_unmap_file_range(struct scst_cmd *cmd,
-	struct scst_vdisk_dev *virt_dev, loff_t off, loff_t len,
-	struct file *fd)
+static int vdisk_rigid_geo_pg(unsigned char *p, int pcontrol,
+	struct scst_vdisk_dev *virt_dev)
 {
-	int res;
-
-	TRACE_ENTRY();
+	unsigned char geo_m_pg[] = {0x04, 0x16, 0, 0, 0, DEF_HEADS, 0, 0,
+				    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+				    0x3a, 0x98/* 15K RPM */, 0, 0};
+	int32_t ncyl, n, rem;
+	uint64_t dividend;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
-	TRACE_DBG("Fallocating range %lld, len %lld",
-		(unsigned long long)off, (unsigned long long)len);
+	memcpy(p, geo_m_pg, sizeof(geo_m_pg));
+	/*
+	 * Divide virt_dev->nblocks by (DEF_HEADS * DEF_SECTORS) and store
+	 * the quotient in ncyl and the remainder in rem.
+	 */
+	dividend = virt_dev->nblocks;
+	rem = do_div(dividend, DEF_HEADS * DEF_SECTORS);
+	ncyl = dividend;
+	if (rem != 0)
+		ncyl++;
+	memcpy(&n, p + 2, sizeof(u32));
+	n = n | ((__force u32)cpu_to_be32(ncyl) >> 8);
+	memcpy(p + 2, &n, sizeof(u32));
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(geo_m_pg) - 2);
+	return sizeof(geo_m_pg);
+}
 
-	res = fd->f_op->fallocate(fd,
-		FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
-	if (unlikely(res != 0)) {
-		PRINT_ERROR("fallocate() for %lld, len %lld "
-			"failed: %d", (unsigned long long)off,
-			(unsigned long long)len, res);
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_write_error));
-		res = -EIO;
-	}
-#else
-	res = 0;
-#endif
+static int vdisk_format_pg(unsigned char *p, int pcontrol,
+			    struct scst_vdisk_dev *virt_dev)
+{       /* Format device page for mode_sense */
+	const unsigned char format_pg[] = {0x3, 0x16, 0, 0, 0, 0, 0, 0,
+					   0, 0, 0, 0, 0, 0, 0, 0,
+					   0, 0, 0, 0, 0x40, 0, 0, 0};
 
-	TRACE_EXIT_RES(res);
-	return res;
+	memcpy(p, format_pg, sizeof(format_pg));
+	put_unaligned_be16(DEF_SECTORS, &p[10]);
+	put_unaligned_be16(virt_dev->dev->block_size, &p[12]);
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(format_pg) - 2);
+	return sizeof(format_pg);
 }
 
-static int vdisk_unmap_range(struct scst_cmd *cmd,
-	struct scst_vdisk_dev *virt_dev, uint64_t start_lba, uint32_t blocks)
+static int vdisk_caching_pg(unsigned char *p, int pcontrol,
+			     struct scst_vdisk_dev *virt_dev)
 {
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
-	int res, err;
-#else
-	int res;
-#endif
-	struct file *fd = virt_dev->fd;
+	/* Caching page for mode_sense */
+	static const unsigned char caching_pg[] = {
+		0x8, 0x12, 0x0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0x80, 0x14, 0, 0,
+		0, 0, 0, 0
+	};
 
-	TRACE_ENTRY();
+	memcpy(p, caching_pg, sizeof(caching_pg));
 
-	if (blocks == 0)
-		goto success;
+	if (!virt_dev->nv_cache && vdev_saved_mode_pages_enabled)
+		p[0] |= 0x80;
 
-	if ((start_lba > virt_dev->nblocks) ||
-	    ((start_lba + blocks) > virt_dev->nblocks)) {
-		PRINT_ERROR("Device %s: attempt to write beyond max "
-			"size", virt_dev->name);
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
-		res = -EINVAL;
-		goto out;
+	switch (pcontrol) {
+	case 0: /* current */
+		p[2] |= (virt_dev->wt_flag || virt_dev->nv_cache) ? 0 : WCE;
+		break;
+	case 1: /* changeable */
+		memset(p + 2, 0, sizeof(caching_pg) - 2);
+		if (!virt_dev->nv_cache)
+			p[2] |= WCE;
+		break;
+	case 2: /* default */
+		p[2] |= (DEF_WRITE_THROUGH || virt_dev->nv_cache) ? 0 : WCE;
+		break;
+	case 3: /* saved */
+		p[2] |= (virt_dev->wt_flag_saved || virt_dev->nv_cache) ? 0 : WCE;
+		break;
+	default:
+		sBUG();
+		break;
 	}
 
-	TRACE_DBG("Unmapping lba %lld (blocks %lld)",
-		(unsigned long long)start_lba, (unsigned long long)blocks);
+	return sizeof(caching_pg);
+}
 
-	if (virt_dev->blockio) {
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
-		sector_t start_sector = start_lba << (cmd->dev->block_shift - 9);
-		sector_t nr_sects = blocks << (cmd->dev->block_shift - 9);
-		struct inode *inode = file_inode(fd);
-		gfp_t gfp = cmd->cmd_gfp_mask;
+static int vdisk_ctrl_m_pg(unsigned char *p, int pcontrol,
+			    struct scst_vdisk_dev *virt_dev)
+{	/* Control mode page for mode_sense */
+	unsigned char ctrl_m_pg[] = {0xa, 0xa, 0, 0, 0, 0, 0, 0,
+					   0, 0, 0x2, 0x4b};
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 31)
-		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects, gfp);
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35)       \
-      && !(LINUX_VERSION_CODE == KERNEL_VERSION(2, 6, 34) \
-	   && defined(CONFIG_SUSE_KERNEL))
-		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects,
-				gfp, DISCARD_FL_WAIT);
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
-		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects,
-				gfp, BLKDEV_IFL_WAIT);
-#else
-		err = blkdev_issue_discard(inode->i_bdev, start_sector, nr_sects, gfp, 0);
+	if (vdev_saved_mode_pages_enabled)
+		ctrl_m_pg[0] |= 0x80;
+
+	memcpy(p, ctrl_m_pg, sizeof(ctrl_m_pg));
+	switch (pcontrol) {
+	case 0: /* current */
+		p[2] |= virt_dev->dev->tst << 5;
+		p[2] |= virt_dev->dev->d_sense << 2;
+		p[2] |= virt_dev->dev->dpicz << 3;
+		p[2] |= virt_dev->dev->tmf_only << 4;
+		p[3] |= virt_dev->dev->queue_alg << 4;
+		p[3] |= virt_dev->dev->qerr << 1;
+		p[4] |= virt_dev->dev->swp << 3;
+		p[5] |= virt_dev->dev->tas << 6;
+		p[5] |= virt_dev->dev->ato << 7;
+		break;
+	case 1: /* changeable */
+		memset(p + 2, 0, sizeof(ctrl_m_pg) - 2);
+#if 0	/*
+	 * See comment in struct scst_device definition.
+	 *
+	 * If enable it, fix the default and saved cases below!
+	 */
+		p[2] |= 7 << 5;		/* TST */
 #endif
-		if (unlikely(err != 0)) {
-			PRINT_ERROR("blkdev_issue_discard() for "
-				"LBA %lld, blocks %d failed: %d",
-				(unsigned long long)start_lba, blocks, err);
-			scst_set_cmd_error(cmd,
-				SCST_LOAD_SENSE(scst_sense_write_error));
-			res = -EIO;
-			goto out;
+		if (!virt_dev->dev->cluster_mode) {
+			p[2] |= 1 << 2;		/* D_SENSE */
+			p[2] |= 1 << 3;		/* DPICZ */
+			p[2] |= 1 << 4;		/* TMF_ONLY */
+			p[3] |= 0xF << 4;	/* QUEUE ALGORITHM MODIFIER */
+			p[3] |= 3 << 1;		/* QErr */
+			p[4] |= 1 << 3;		/* SWP */
+			p[5] |= 1 << 6;		/* TAS */
+			p[5] |= 0 << 7;		/* ATO */
 		}
-#else
-		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		res = -EIO;
-		goto out;
-#endif
-	} else {
-		loff_t off = start_lba << cmd->dev->block_shift;
-		loff_t len = (u64)blocks << cmd->dev->block_shift;
-
-		res = vdisk_unmap_file_range(cmd, virt_dev, off, len, fd);
-		if (unlikely(res != 0))
-			goto out;
-	}
-
-	if (virt_dev->dif_fd != NULL) {
-		res = vdisk_format_dif(cmd, start_lba, blocks);
-		if (unlikely(res != 0))
-			goto out;
+		break;
+	case 2: /* default */
+		p[2] |= virt_dev->tst << 5;
+		p[2] |= virt_dev->dev->d_sense_default << 2;
+		p[2] |= virt_dev->dev->dpicz_default << 3;
+		p[2] |= virt_dev->dev->tmf_only_default << 4;
+		p[3] |= virt_dev->dev->queue_alg_default << 4;
+		p[3] |= virt_dev->dev->qerr_default << 1;
+		p[4] |= virt_dev->dev->swp_default << 3;
+		p[5] |= virt_dev->dev->tas_default << 6;
+		p[5] |= virt_dev->dev->ato << 7;
+		break;
+	case 3: /* saved */
+		p[2] |= virt_dev->dev->tst << 5;
+		p[2] |= virt_dev->dev->d_sense_saved << 2;
+		p[2] |= virt_dev->dev->dpicz_saved << 3;
+		p[2] |= virt_dev->dev->tmf_only_default << 4;
+		p[3] |= virt_dev->dev->queue_alg_saved << 4;
+		p[3] |= virt_dev->dev->qerr_saved << 1;
+		p[4] |= virt_dev->dev->swp_saved << 3;
+		p[5] |= virt_dev->dev->tas_saved << 6;
+		p[5] |= virt_dev->dev->ato << 7;
+		break;
+	default:
+		sBUG();
 	}
+	return sizeof(ctrl_m_pg);
+}
 
-success:
-	res = 0;
-
-out:
-	TRACE_EXIT_RES(res);
-	return res;
+static int vdisk_iec_m_pg(unsigned char *p, int pcontrol,
+			   struct scst_vdisk_dev *virt_dev)
+{	/* Informational Exceptions control mode page for mode_sense */
+	const unsigned char iec_m_pg[] = {0x1c, 0xa, 0x08, 0, 0, 0, 0, 0,
+					  0, 0, 0x0, 0x0};
+	memcpy(p, iec_m_pg, sizeof(iec_m_pg));
+	if (pcontrol == 1)
+		memset(p + 2, 0, sizeof(iec_m_pg) - 2);
+	return sizeof(iec_m_pg);
 }
 
-static void vdisk_exec_write_same_unmap(struct vdisk_cmd_params *p)
+static enum compl_status_e vdisk_exec_mode_sense(struct vdisk_cmd_params *p)
 {
-	int rc;
 	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	int32_t length;
+	uint8_t *address;
+	uint8_t *buf;
+	struct scst_vdisk_dev *virt_dev;
+	uint32_t blocksize;
+	uint64_t nblocks;
+	unsigned char dbd, type;
+	int pcontrol, pcode, subpcode;
+	unsigned char dev_spec;
+	int msense_6, offset = 0, len;
+	unsigned char *bp;
 
 	TRACE_ENTRY();
 
-	if (unlikely(!virt_dev->thin_provisioned)) {
-		TRACE_DBG("%s", "Device not thin provisioned");
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		goto out;
-	}
-
-	if (unlikely((uint64_t)cmd->data_len > cmd->dev->max_write_same_len)) {
-		PRINT_WARNING("Invalid WRITE SAME data len %lld (max allowed "
-			"%lld)", (long long)cmd->data_len,
-			(long long)cmd->dev->max_write_same_len);
-		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
+	buf = kzalloc(MSENSE_BUF_SZ, cmd->cmd_gfp_mask);
+	if (buf == NULL) {
+		scst_set_busy(cmd);
 		goto out;
 	}
 
-	rc = vdisk_unmap_range(cmd, virt_dev, cmd->lba,
-		cmd->data_len >> dev->block_shift);
-	if (rc != 0)
-		goto out;
-
-out:
-	TRACE_EXIT();
-	return;
-}
-
-/*
- * Copy a zero-terminated string into a fixed-size byte array and fill the
- * trailing bytes with @fill_byte.
- */
-static void scst_copy_and_fill_b(char *dst, const char *src, int len,
-				 uint8_t fill_byte)
-{
-	int cpy_len = min_t(int, strlen(src), len);
-
-	memcpy(dst, src, cpy_len);
-	memset(dst + cpy_len, fill_byte, len - cpy_len);
-}
+	virt_dev = cmd->dev->dh_priv;
+	blocksize = cmd->dev->block_size;
+	nblocks = virt_dev->nblocks;
 
-/*
- * Copy a zero-terminated string into a fixed-size char array and fill the
- * trailing characters with spaces.
- */
-static void scst_copy_and_fill(char *dst, const char *src, int len)
-{
-	scst_copy_and_fill_b(dst, src, len, ' ');
-}
+	type = cmd->dev->type;
+	dbd = cmd->cdb[1] & DBD;
+	pcontrol = (cmd->cdb[2] & 0xc0) >> 6;
+	pcode = cmd->cdb[2] & 0x3f;
+	subpcode = cmd->cdb[3];
+	msense_6 = (cmd->cdb[0] == MODE_SENSE);
+	dev_spec = cmd->tgt_dev->tgt_dev_rd_only ? WP : 0;
 
-static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	enum compl_status_e res = CMD_SUCCEEDED;
-	uint8_t ctrl_offs = (cmd->cdb_len < 32) ? 1 : 10;
+	if (type != TYPE_ROM)
+		dev_spec |= DPOFUA;
 
-	TRACE_ENTRY();
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out_free;
 
-	if (unlikely(cmd->cdb[ctrl_offs] & 0x10)) {
-		TRACE_DBG("%s", "ANCHOR not supported");
-		scst_set_invalid_field_in_cdb(cmd, ctrl_offs,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
-		goto out;
+	if (!vdev_saved_mode_pages_enabled && (pcontrol == 0x3)) {
+		TRACE_DBG("%s", "MODE SENSE: Saving values not supported");
+		scst_set_cmd_error(cmd,
+		    SCST_LOAD_SENSE(scst_sense_saving_params_unsup));
+		goto out_put;
 	}
 
-	if (unlikely(cmd->data_len <= 0)) {
-		PRINT_ERROR("WRITE SAME: refused data_len = %#llx",
-			    cmd->data_len);
-		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
-		goto out;
+	if (msense_6) {
+		buf[1] = type;
+		buf[2] = dev_spec;
+		offset = 4;
+	} else {
+		buf[2] = type;
+		buf[3] = dev_spec;
+		offset = 8;
 	}
 
-	if (cmd->cdb[ctrl_offs] & 0x8)
-		vdisk_exec_write_same_unmap(p);
-	else {
-		scst_write_same(cmd, NULL);
-		res = RUNNING_ASYNC;
+	if (subpcode != 0) {
+		/* TODO: Control Extension page */
+		TRACE_DBG("%s", "MODE SENSE: Only subpage 0 is supported");
+		scst_set_invalid_field_in_cdb(cmd, 3, 0);
+		goto out_put;
 	}
 
-out:
-	TRACE_EXIT_RES(res);
-	return res;
-}
-
-static enum compl_status_e vdisk_exec_unmap(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	struct scst_data_descriptor *pd = cmd->cmd_data_descriptors;
-	int i, cnt = cmd->cmd_data_descriptors_cnt;
-	uint32_t blocks_to_unmap;
-
-	TRACE_ENTRY();
+	if (!dbd) {
+		/* Create block descriptor */
+		buf[offset - 1] = 0x08;		/* block descriptor length */
+		put_unaligned_be32(nblocks >> 32 ? 0xffffffffU : nblocks,
+				   &buf[offset]);
+		buf[offset + 4] = 0;			/* density code */
+		put_unaligned_be24(blocksize, &buf[offset + 5]); /* blklen */
 
-	if (unlikely(!virt_dev->thin_provisioned)) {
-		TRACE_DBG("%s", "Device not thin provisioned");
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		goto out;
+		offset += 8;			/* increment offset */
 	}
 
-	if (unlikely(cmd->cdb[1] & 1)) {
-		TRACE_DBG("%s", "ANCHOR not supported");
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-		goto out;
+	bp = buf + offset;
+
+	switch (pcode) {
+	case 0x1:	/* Read-Write error recovery page, direct access */
+		len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x2:	/* Disconnect-Reconnect page, all devices */
+		if (type == TYPE_ROM)
+			goto out_not_sup;
+		len = vdisk_disconnect_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x3:       /* Format device page, direct access */
+		if (type == TYPE_ROM)
+			goto out_not_sup;
+		len = vdisk_format_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x4:	/* Rigid disk geometry */
+		if (type == TYPE_ROM)
+			goto out_not_sup;
+		len = vdisk_rigid_geo_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x8:	/* Caching page, direct access */
+		if (type == TYPE_ROM)
+			goto out_not_sup;
+		len = vdisk_caching_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0xa:	/* Control Mode page, all devices */
+		len = vdisk_ctrl_m_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x1c:	/* Informational Exceptions Mode page, all devices */
+		len = vdisk_iec_m_pg(bp, pcontrol, virt_dev);
+		break;
+	case 0x3f:	/* Read all Mode pages */
+		if (type == TYPE_ROM) {
+			len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
+			len += vdisk_ctrl_m_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_iec_m_pg(bp + len, pcontrol, virt_dev);
+		} else {
+			len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
+			len += vdisk_disconnect_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_format_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_caching_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_ctrl_m_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_iec_m_pg(bp + len, pcontrol, virt_dev);
+			len += vdisk_rigid_geo_pg(bp + len, pcontrol, virt_dev);
+		}
+		break;
+	default:
+		goto out_not_sup;
 	}
 
-	if (pd == NULL)
-		goto out;
+	offset += len;
 
-	/* Sanity check to avoid too long latencies */
-	blocks_to_unmap = 0;
-	for (i = 0; i < cnt; i++) {
-		blocks_to_unmap += pd[i].sdd_blocks;
-		if (blocks_to_unmap > virt_dev->unmap_max_lba_cnt) {
-			PRINT_WARNING("Too many UNMAP LBAs %u (max allowed %u, "
-				"dev %s)", blocks_to_unmap,
-				virt_dev->unmap_max_lba_cnt,
-				virt_dev->dev->virt_name);
-			scst_set_invalid_field_in_parm_list(cmd, 0, 0);
-			goto out;
-		}
-	}
+	if (msense_6)
+		buf[0] = offset - 1;
+	else
+		put_unaligned_be16(offset - 2, &buf[0]);
 
-	for (i = 0; i < cnt; i++) {
-		int rc;
+	if (offset > length)
+		offset = length;
+	memcpy(address, buf, offset);
 
-		if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
-			TRACE_MGMT_DBG("ABORTED set, aborting cmd %p", cmd);
-			goto out;
-		}
+out_put:
+	scst_put_buf_full(cmd, address);
+	if (offset < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, offset);
 
-		rc = vdisk_unmap_range(cmd, virt_dev, pd[i].sdd_lba,
-			pd[i].sdd_blocks);
-		if (rc != 0)
-			goto out;
-	}
+out_free:
+	kfree(buf);
 
 out:
 	TRACE_EXIT();
 	return CMD_SUCCEEDED;
-}
-
-/* Supported VPD Pages VPD page (00h). */
-static int vdisk_sup_vpd(uint8_t *buf, struct scst_cmd *cmd,
-			 struct scst_vdisk_dev *virt_dev)
-{
-	char *page_list = &buf[4], *p = page_list;
-
-	*p++ = 0x0; /* this page */
-	*p++ = 0x80; /* unit serial number */
-	*p++ = 0x83; /* device identification */
-	*p++ = 0x86; /* extended inquiry */
-	if (cmd->dev->type == TYPE_DISK) {
-		*p++ = 0xB0; /* block limits */
-		*p++ = 0xB1; /* block device characteristics */
-		if (virt_dev->thin_provisioned)
-			*p++ = 0xB2; /* thin provisioning */
-	}
-	buf[3] = p - page_list; /* page length */
-
-	return buf[3] + 4;
-}
-
-/* Unit Serial Number VPD page (80h) */
-static int vdisk_usn_vpd(uint8_t *buf, struct scst_cmd *cmd,
-			 struct scst_vdisk_dev *virt_dev)
-{
-	buf[1] = 0x80;
-	if (cmd->tgtt->get_serial) {
-		buf[3] = cmd->tgtt->get_serial(cmd->tgt_dev, &buf[4],
-					       INQ_BUF_SZ - 4);
-	} else {
-		int usn_len;
 
-		read_lock(&vdisk_serial_rwlock);
-		usn_len = strlen(virt_dev->usn);
-		buf[3] = usn_len;
-		strncpy(&buf[4], virt_dev->usn, usn_len);
-		read_unlock(&vdisk_serial_rwlock);
-	}
-	return buf[3] + 4;
+out_not_sup:
+	TRACE(TRACE_MINOR, "MODE SENSE: Unsupported page %x", pcode);
+	scst_set_invalid_field_in_cdb(cmd, 2, SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+	goto out_put;
 }
 
-/* Device Identification VPD page (83h) */
-static int vdisk_dev_id_vpd(uint8_t *buf, struct scst_cmd *cmd,
-			    struct scst_vdisk_dev *virt_dev)
+static int vdisk_set_wt(struct scst_vdisk_dev *virt_dev, int wt, bool read_only)
 {
-	int i, eui64_len = 0, naa_len = 0, resp_len, num = 4;
-	uint16_t tg_id;
-	u8 *eui64_id = NULL, *naa_id = NULL;
-
-	buf[1] = 0x83;
-
-	read_lock(&vdisk_serial_rwlock);
-	i = strlen(virt_dev->scsi_device_name);
-	if (i > 0) {
-		/* SCSI target device name */
-		buf[num + 0] = 0x3;	/* ASCII */
-		buf[num + 1] = 0x20 | 0x8; /* Target device SCSI name */
-		i += 4 - i % 4; /* align to required 4 bytes */
-		scst_copy_and_fill_b(&buf[num + 4], virt_dev->scsi_device_name,
-				     i, '\0');
-
-		buf[num + 3] = i;
-		num += buf[num + 3];
+	int res = 0;
+	struct file *fd, *dif_fd = NULL;
+	bool old_wt = virt_dev->wt_flag;
 
-		num += 4;
-	}
-	read_unlock(&vdisk_serial_rwlock);
+	TRACE_ENTRY();
 
-	/* T10 vendor identifier field format (faked) */
-	buf[num + 0] = 0x2;	/* ASCII */
-	buf[num + 1] = 0x1;	/* Vendor ID */
-	read_lock(&vdisk_serial_rwlock);
-	scst_copy_and_fill(&buf[num + 4], virt_dev->t10_vend_id, 8);
-	i = strlen(virt_dev->vend_specific_id);
-	memcpy(&buf[num + 12], virt_dev->vend_specific_id, i);
-	read_unlock(&vdisk_serial_rwlock);
+	if ((virt_dev->wt_flag == wt) || virt_dev->nullio || virt_dev->nv_cache)
+		goto out;
 
-	buf[num + 3] = 8 + i;
-	num += buf[num + 3];
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->wt_flag = wt;
+	spin_unlock(&virt_dev->flags_lock);
 
-	num += 4;
+	if (virt_dev->fd == NULL)
+		goto out;
 
 	/*
-	 * Relative target port identifier
+	 * MODE SELECT is strictly serialized command, so it's safe here
+	 * to reopen fd.
 	 */
-	buf[num + 0] = 0x01; /* binary */
-	/* Relative target port id */
-	buf[num + 1] = 0x10 | 0x04;
-
-	put_unaligned_be16(cmd->tgt->rel_tgt_id, &buf[num + 4 + 2]);
-
-	buf[num + 3] = 4;
-	num += buf[num + 3];
-
-	num += 4;
-
-	tg_id = scst_lookup_tg_id(cmd->dev, cmd->tgt);
-	if (tg_id) {
-		/*
-		 * Target port group designator
-		 */
-		buf[num + 0] = 0x01; /* binary */
-		/* Target port group id */
-		buf[num + 1] = 0x10 | 0x05;
 
-		put_unaligned_be16(tg_id, &buf[num + 4 + 2]);
-
-		buf[num + 3] = 4;
-		num += 4 + buf[num + 3];
+	fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only,
+			  virt_dev->o_direct_flag);
+	if (IS_ERR(fd)) {
+		res = PTR_ERR(fd);
+		goto out_err;
 	}
 
-	read_lock(&vdisk_serial_rwlock);
-
-	if (virt_dev->eui64_id_len == 0 && virt_dev->naa_id_len == 0) {
-		/*
-		 * Compatibility mode: export the first eight bytes of the
-		 * t10_dev_id as an EUI-64 ID. This is not entirely standards
-		 * compliant since t10_dev_id contains an ASCII string and the
-		 * first three bytes of an eight-byte EUI-64 ID are a OUI.
-		 */
-		eui64_len = 8;
-		eui64_id  = virt_dev->t10_dev_id;
-	} else {
-		if (virt_dev->eui64_id_len) {
-			eui64_len = virt_dev->eui64_id_len;
-			eui64_id  = virt_dev->eui64_id;
-		}
-		if (virt_dev->naa_id_len) {
-			naa_len = virt_dev->naa_id_len;
-			naa_id  = virt_dev->naa_id;
+	if (virt_dev->dif_filename != NULL) {
+		dif_fd = vdev_open_fd(virt_dev, virt_dev->dif_filename,
+				      read_only, false);
+		if (IS_ERR(dif_fd)) {
+			res = PTR_ERR(dif_fd);
+			goto out_err_close_fd;
 		}
 	}
-	if (eui64_len) {
-		buf[num + 0] = 0x01; /* binary */
-		buf[num + 1] = 0x02; /* EUI-64 */
-		buf[num + 2] = 0x00; /* reserved */
-		buf[num + 3] = eui64_len;
-		memcpy(&buf[num + 4], eui64_id, eui64_len);
-		num += 4 + eui64_len;
-	}
-	if (naa_len) {
-		buf[num + 0] = 0x01; /* binary */
-		buf[num + 1] = 0x03; /* NAA */
-		buf[num + 2] = 0x00; /* reserved */
-		buf[num + 3] = naa_len;
-		memcpy(&buf[num + 4], naa_id, naa_len);
-		num += 4 + naa_len;
-	}
-
-	read_unlock(&vdisk_serial_rwlock);
 
-	resp_len = num - 4;
+	filp_close(virt_dev->fd, NULL);
+	if (virt_dev->dif_fd)
+		filp_close(virt_dev->dif_fd, NULL);
 
-	put_unaligned_be16(resp_len, &buf[2]);
-	resp_len += 4;
+	virt_dev->fd = fd;
+	virt_dev->dif_fd = dif_fd;
 
-	return resp_len;
-}
+out:
+	TRACE_EXIT_RES(res);
+	return res;
 
-/* Extended INQUIRY Data (86h) */
-static int vdisk_ext_inq(uint8_t *buf, struct scst_cmd *cmd,
-			 struct scst_vdisk_dev *virt_dev)
-{
-	struct scst_device *dev = cmd->dev;
+out_err_close_fd:
+	filp_close(fd, NULL);
 
-	buf[1] = 0x86;
-	buf[3] = 0x3C;
-	if (dev->dev_dif_mode != SCST_DIF_MODE_NONE) {
-		switch (dev->dev_dif_type) {
-		case 1:
-			buf[4] = 0; /* SPT=0, type 1 only supported */
-			break;
-		case 2:
-			buf[4] = 0x10; /* SPT=010, type 2 only supported */
-			break;
-		case 3:
-			buf[4] = 0x20; /* SPT=100, type 3 only supported */
-			break;
-		default:
-			sBUG_ON(1);
-			break;
-		}
-		buf[4] |= 4; /* GRD_CHK */
-		if (dev->dif_app_chk)
-			buf[4] |= 2; /* APP_CHK */
-		if (dev->dif_ref_chk)
-			buf[4] |= 1; /* REF_CHK */
-	}
-	buf[5] = 7; /* HEADSUP=1, ORDSUP=1, SIMPSUP=1 */
-	buf[6] = (virt_dev->wt_flag || virt_dev->nv_cache) ? 0 : 1; /* V_SUP */
-	buf[7] = 1; /* LUICLR=1 */
-	return buf[3] + 4;
+out_err:
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->wt_flag = old_wt;
+	spin_unlock(&virt_dev->flags_lock);
+	goto out;
 }
 
-/* Block Limits VPD page (B0h) */
-static int vdisk_block_limits(uint8_t *buf, struct scst_cmd *cmd,
-			      struct scst_vdisk_dev *virt_dev)
+static void vdisk_ctrl_m_pg_select(unsigned char *p,
+	struct scst_vdisk_dev *virt_dev, struct scst_cmd *cmd, bool save,
+	int param_offset)
 {
-	struct scst_device *dev = cmd->dev;
-	int max_transfer;
+	struct scst_device *dev = virt_dev->dev;
+	int old_swp = dev->swp, old_tas = dev->tas, old_dsense = dev->d_sense;
+	int old_queue_alg = dev->queue_alg, old_dpicz = dev->dpicz;
+	int rc, old_tmf_only = dev->tmf_only, old_qerr = dev->qerr;
+	int queue_alg, swp, tas, tmf_only, qerr, d_sense, dpicz;
 
-	buf[1] = 0xB0;
-	buf[3] = 0x3C;
-	buf[4] = 1; /* WSNZ set */
-	buf[5] = 0xFF; /* No MAXIMUM COMPARE AND WRITE LENGTH limit */
-	/* Optimal transfer granuality is PAGE_SIZE */
-	put_unaligned_be16(max_t(int, PAGE_SIZE / dev->block_size, 1), &buf[6]);
+	TRACE_ENTRY();
 
-	/* Max transfer len is min of sg limit and 8M */
-	max_transfer = min_t(int, cmd->tgt_dev->max_sg_cnt << PAGE_SHIFT,
-			     8*1024*1024) / dev->block_size;
-	put_unaligned_be32(max_transfer, &buf[8]);
+	if (save && !vdev_saved_mode_pages_enabled) {
+		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: saved control page "
+			"not supported");
+		scst_set_invalid_field_in_cdb(cmd, 2,
+				SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
+		goto out;
+	}
 
 	/*
-	 * Let's have optimal transfer len 512KB. Better to not
-	 * set it at all, because we don't have such limit,
-	 * but some initiators may not understand that (?).
-	 * From other side, too big transfers  are not optimal,
-	 * because SGV cache supports only <4M buffers.
+	 * MODE SELECT is a strictly serialized cmd, so it is safe to
+	 * perform direct assignment here.
 	 */
-	put_unaligned_be32(min_t(int, max_transfer, 512*1024 / dev->block_size),
-			   &buf[12]);
 
-	if (virt_dev->thin_provisioned) {
-		/* MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT is UNLIMITED */
-		put_unaligned_be32(0xFFFFFFFF, &buf[24]);
-		/*
-		 * MAXIMUM UNMAP LBA COUNT, OPTIMAL UNMAP
-		 * GRANULARITY and ALIGNMENT
-		 */
-		put_unaligned_be32(virt_dev->unmap_max_lba_cnt, &buf[20]);
-		put_unaligned_be32(virt_dev->unmap_opt_gran, &buf[28]);
-		if (virt_dev->unmap_align != 0) {
-			put_unaligned_be32(virt_dev->unmap_align, &buf[32]);
-			buf[32] |= 0x80;
-		}
+#if 0 /* Not implemented yet, see comment in struct scst_device */
+	dev->tst = (p[2] >> 5) & 7;
+	/* ToDo: check validity of the new value */
+#else
+	if (dev->tst != ((p[2] >> 5) & 7)) {
+		TRACE(TRACE_MINOR|TRACE_SCSI, "%s", "MODE SELECT: Changing of "
+			"TST not supported");
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
+		goto out;
 	}
+#endif
 
-	/* MAXIMUM WRITE SAME LENGTH (measured in blocks) */
-	put_unaligned_be64(dev->max_write_same_len >> dev->block_shift,
-			   &buf[36]);
+	queue_alg = p[3] >> 4;
+	if ((queue_alg != SCST_QUEUE_ALG_0_RESTRICTED_REORDER) &&
+	    (queue_alg != SCST_QUEUE_ALG_1_UNRESTRICTED_REORDER)) {
+		PRINT_WARNING("Attempt to set invalid Control mode page QUEUE "
+			"ALGORITHM MODIFIER value %d (initiator %s, dev %s)",
+			queue_alg, cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 3,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+		goto out;
+	}
 
-	return buf[3] + 4;
-}
+	swp = (p[4] & 0x8) >> 3;
+	if (swp > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page SWP "
+			"value %d (initiator %s, dev %s)", swp,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 4,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
+		goto out;
+	}
 
-/* Block Device Characteristics VPD Page (B1h) */
-static int vdisk_bdev_char(uint8_t *buf, struct scst_cmd *cmd,
-			   struct scst_vdisk_dev *virt_dev)
-{
-	buf[1] = 0xB1;
-	buf[3] = 0x3C;
-	if (virt_dev->rotational) {
-		/* 15K RPM */
-		put_unaligned_be16(0x3A98, &buf[4]);
-	} else
-		put_unaligned_be16(1, &buf[4]);
-	return buf[3] + 4;
-}
+	tas = (p[5] & 0x40) >> 6;
+	if (tas > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page TAS "
+			"value %d (initiator %s, dev %s)", tas,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 5,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 6);
+		goto out;
+	}
 
-/* Logical Block Provisioning a.k.a. Thin Provisioning VPD page (B2h) */
-static int vdisk_tp_vpd(uint8_t *buf, struct scst_cmd *cmd,
-			struct scst_vdisk_dev *virt_dev)
-{
-	buf[1] = 0xB2;
-	buf[3] = 4;
-	buf[5] = 0xE0;
-	if (virt_dev->discard_zeroes_data)
-		buf[5] |= 0x4; /* LBPRZ */
-	buf[6] = 2; /* thin provisioned */
-	return buf[3] + 4;
-}
+	tmf_only = (p[2] & 0x10) >> 4;
+	if (tmf_only > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page "
+			"TMF_ONLY value %d (initiator %s, dev %s)", tmf_only,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+		goto out;
+	}
 
-/* Standard INQUIRY response */
-static int vdisk_inq(uint8_t *buf, struct scst_cmd *cmd,
-		     struct scst_vdisk_dev *virt_dev)
-{
-	int num;
+	dpicz = (p[2] & 0x8) >> 3;
+	if (dpicz > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page "
+			"dpicz value %d (initiator %s, dev %s)", dpicz,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
+		goto out;
+	}
 
-	if (virt_dev->removable)
-		buf[1] = 0x80;      /* removable */
-	buf[2] = 6; /* Device complies to SPC-4 */
-	buf[3] = 0x02;	/* Data in format specified in SPC */
-	buf[3] |= 0x20; /* ACA supported */
-	buf[4] = 31;/* n - 4 = 35 - 4 = 31 for full 36 byte data */
-	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE)
-		buf[5] |= 1; /* PROTECT */
-	if (scst_alua_configured(cmd->dev)) {
-		buf[5] |= SCST_INQ_TPGS_MODE_IMPLICIT;
-		if (virt_dev->expl_alua)
-			buf[5] |= SCST_INQ_TPGS_MODE_EXPLICIT;
+	qerr = (p[3] & 0x6) >> 1;
+	if ((qerr == SCST_QERR_2_RESERVED) ||
+	    (qerr > SCST_QERR_3_ABORT_THIS_NEXUS_ONLY)) {
+		PRINT_WARNING("Attempt to set invalid Control mode page QErr "
+			"value %d (initiator %s, dev %s)", qerr,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 3,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
+		goto out;
 	}
-	buf[5] |= 8; /* 3PC */
-	buf[6] = 0x10; /* MultiP 1 */
-	buf[7] = 2; /* CMDQUE 1, BQue 0 => commands queuing supported */
 
-	read_lock(&vdisk_serial_rwlock);
+	d_sense = (p[2] & 0x4) >> 2;
+	if (d_sense > 1) {
+		PRINT_WARNING("Attempt to set invalid Control mode page D_SENSE "
+			"value %d (initiator %s, dev %s)", d_sense,
+			cmd->sess->initiator_name, dev->virt_name);
+		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 2);
+		goto out;
+	}
 
-	/*
-	 * 8 byte ASCII Vendor Identification of the target
-	 * - left aligned.
-	 */
-	scst_copy_and_fill(&buf[8], virt_dev->t10_vend_id, 8);
+	dev->queue_alg = queue_alg;
+	dev->swp = swp;
+	dev->tas = tas;
+	dev->tmf_only = tmf_only;
+	dev->dpicz = dpicz;
+	dev->qerr = qerr;
+	dev->d_sense = d_sense;
 
-	/*
-	 * 16 byte ASCII Product Identification of the target - left
-	 * aligned.
-	 */
-	scst_copy_and_fill(&buf[16], virt_dev->prod_id, 16);
+	if ((dev->swp == old_swp) && (dev->tas == old_tas) &&
+	    (dev->d_sense == old_dsense) && (dev->queue_alg == old_queue_alg) &&
+	    (dev->qerr == old_qerr) && (dev->tmf_only == old_tmf_only) &&
+	    (dev->dpicz == old_dpicz))
+		goto out;
 
-	/*
-	 * 4 byte ASCII Product Revision Level of the target - left
-	 * aligned.
-	 */
-	scst_copy_and_fill(&buf[32], virt_dev->prod_rev_lvl, 4);
+	if (!save)
+		goto out_ok;
 
-	/* Vendor specific information. */
-	if (virt_dev->inq_vend_specific_len <= 20)
-		memcpy(&buf[36], virt_dev->inq_vend_specific,
-		       virt_dev->inq_vend_specific_len);
+	rc = vdev_save_mode_pages(virt_dev);
+	if (rc != 0) {
+		dev->swp = old_swp;
+		dev->tas = old_tas;
+		dev->d_sense = old_dsense;
+		dev->queue_alg = old_queue_alg;
+		dev->tmf_only = old_tmf_only;
+		dev->qerr = old_qerr;
+		dev->dpicz = old_dpicz;
+		/* Hopefully, the error is temporary */
+		scst_set_busy(cmd);
+		goto out;
+	}
 
-	/** Version descriptors **/
+	dev->swp_saved = dev->swp;
+	dev->tas_saved = dev->tas;
+	dev->d_sense_saved = dev->d_sense;
+	dev->queue_alg_saved = dev->queue_alg;
+	dev->tmf_only_saved = dev->tmf_only;
+	dev->qerr_saved = dev->qerr;
+	dev->dpicz_saved = dev->dpicz;
 
-	buf[4] += 58 - 36;
-	num = 0;
+out_ok:
+	PRINT_INFO("Device %s: new control mode page parameters: SWP %x "
+		"(was %x), TAS %x (was %x), TMF_ONLY %d (was %x), QErr %x "
+		"(was %x), D_SENSE %d (was %d), QUEUE ALG %d (was %d), "
+		"DPICZ %d (was %d)", virt_dev->name, dev->swp, old_swp,
+		dev->tas, old_tas, dev->tmf_only, old_tmf_only, dev->qerr,
+		old_qerr, dev->d_sense, old_dsense, dev->queue_alg,
+		old_queue_alg, dev->dpicz, old_dpicz);
 
-	/* SAM-4 T10/1683-D revision 14 */
-	buf[58 + num] = 0x0;
-	buf[58 + num + 1] = 0x8B;
-	num += 2;
+out:
+	TRACE_EXIT();
+	return;
+}
+
+static void vdisk_caching_m_pg_select(unsigned char *p,
+	struct scst_vdisk_dev *virt_dev, struct scst_cmd *cmd, bool save,
+	bool read_only)
+{
+	int old_wt = virt_dev->wt_flag, new_wt, rc;
 
-	/* Physical transport */
-	if (cmd->tgtt->get_phys_transport_version != NULL) {
-		uint16_t v = cmd->tgtt->get_phys_transport_version(cmd->tgt);
+	TRACE_ENTRY();
 
-		if (v != 0) {
-			put_unaligned_be16(v, &buf[58 + num]);
-			num += 2;
-		}
+	if (save && (!vdev_saved_mode_pages_enabled || virt_dev->nv_cache)) {
+		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: saved cache page "
+			"not supported");
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+		goto out;
 	}
 
-	/* SCSI transport */
-	if (cmd->tgtt->get_scsi_transport_version != NULL) {
-		put_unaligned_be16(
-			cmd->tgtt->get_scsi_transport_version(cmd->tgt),
-			&buf[58 + num]);
-		num += 2;
-	}
+	new_wt = (p[2] & WCE) ? 0 : 1;
 
-	/* SPC-4 T10/1731-D revision 23 */
-	buf[58 + num] = 0x4;
-	buf[58 + num + 1] = 0x63;
-	num += 2;
+	if (new_wt == old_wt)
+		goto out;
 
-	/* Device command set */
-	if (virt_dev->command_set_version != 0) {
-		put_unaligned_be16(virt_dev->command_set_version,
-				   &buf[58 + num]);
-		num += 2;
+	if (vdisk_set_wt(virt_dev, new_wt, read_only) != 0) {
+		scst_set_busy(cmd);
+		goto out;
 	}
 
-	/* Vendor specific information. */
-	if (virt_dev->inq_vend_specific_len > 20) {
-		memcpy(&buf[96], virt_dev->inq_vend_specific,
-		       virt_dev->inq_vend_specific_len);
-		num = 96 - 58 + virt_dev->inq_vend_specific_len;
+	if (!save)
+		goto out_ok;
+
+	rc = vdev_save_mode_pages(virt_dev);
+	if (rc != 0) {
+		vdisk_set_wt(virt_dev, old_wt, read_only);
+		/* Hopefully, the error is temporary */
+		scst_set_busy(cmd);
+		goto out;
 	}
 
-	read_unlock(&vdisk_serial_rwlock);
+	virt_dev->wt_flag_saved = virt_dev->wt_flag;
 
-	buf[4] += num;
-	return buf[4] + 5;
+out_ok:
+	PRINT_INFO("Device %s: new wt_flag: %x (was %x)", virt_dev->name,
+		virt_dev->wt_flag, old_wt);
+
+out:
+	TRACE_EXIT();
+	return;
 }
 
-static enum compl_status_e vdisk_exec_inquiry(struct vdisk_cmd_params *p)
+static enum compl_status_e vdisk_exec_mode_select(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
-	int32_t length, resp_len;
+	int32_t length;
 	uint8_t *address;
-	uint8_t *buf;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	enum scst_tg_state alua_state;
+	struct scst_vdisk_dev *virt_dev;
+	int mselect_6, offset, bdl, type;
 
 	TRACE_ENTRY();
 
-	buf = kzalloc(INQ_BUF_SZ, cmd->cmd_gfp_mask);
-	if (buf == NULL) {
-		scst_set_busy(cmd);
+	virt_dev = cmd->dev->dh_priv;
+	if (cmd->dev->cluster_mode) {
+		PRINT_ERROR("MODE SELECT: not supported in cluster mode\n");
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
 		goto out;
 	}
 
+	mselect_6 = (cmd->cdb[0] == MODE_SELECT);
+	type = cmd->dev->type;
+
 	length = scst_get_buf_full_sense(cmd, &address);
-	TRACE_DBG("length %d", length);
 	if (unlikely(length <= 0))
-		goto out_free;
+		goto out;
 
-	if (cmd->cdb[1] & CMDDT) {
-		TRACE_DBG("%s", "INQUIRY: CMDDT is unsupported");
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
+	if (!(cmd->cdb[1] & PF)) {
+		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: Unsupported "
+			"PF bit zero (cdb[1]=%x)", cmd->cdb[1]);
+		scst_set_invalid_field_in_cdb(cmd, 1, 0);
 		goto out_put;
 	}
 
-	alua_state = scst_get_alua_state(cmd->dev, cmd->tgt);
-	if ((alua_state == SCST_TG_STATE_UNAVAILABLE) ||
-	    (alua_state == SCST_TG_STATE_OFFLINE))
-		buf[0] = SCSI_INQ_PQ_NOT_CON << 5 | dev->type;
-	else
-		buf[0] = virt_dev->dummy ? SCSI_INQ_PQ_NOT_CON << 5 | 0x1f :
-			 SCSI_INQ_PQ_CON << 5 | dev->type;
-	/* Vital Product */
-	if (cmd->cdb[1] & EVPD) {
-		if (cmd->cdb[2] == 0) {
-			resp_len = vdisk_sup_vpd(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0x80) {
-			resp_len = vdisk_usn_vpd(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0x83) {
-			resp_len = vdisk_dev_id_vpd(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0x86) {
-			resp_len = vdisk_ext_inq(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0xB0 && dev->type == TYPE_DISK) {
-			resp_len = vdisk_block_limits(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0xB1 && dev->type == TYPE_DISK) {
-			resp_len = vdisk_bdev_char(buf, cmd, virt_dev);
-		} else if (cmd->cdb[2] == 0xB2 && dev->type == TYPE_DISK &&
-			   virt_dev->thin_provisioned) {
-			resp_len = vdisk_tp_vpd(buf, cmd, virt_dev);
-		} else {
-			TRACE_DBG("INQUIRY: Unsupported EVPD page %x", cmd->cdb[2]);
-			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+	if (mselect_6) {
+		bdl = address[3];
+		offset = 4;
+	} else {
+		bdl = get_unaligned_be16(&address[6]);
+		offset = 8;
+	}
+
+	if (bdl == 8)
+		offset += 8;
+	else if (bdl != 0) {
+		PRINT_ERROR("%s", "MODE SELECT: Wrong parameters list length");
+		scst_set_invalid_field_in_parm_list(cmd, offset-1, 0);
+		goto out_put;
+	}
+
+	while (length > offset + 2) {
+		if (address[offset] & PS) {
+			PRINT_ERROR("%s", "MODE SELECT: Illegal PS bit");
+			scst_set_invalid_field_in_parm_list(cmd, offset,
+				SCST_INVAL_FIELD_BIT_OFFS_VALID | 7);
 			goto out_put;
 		}
-	} else {
-		if (cmd->cdb[2] != 0) {
-			TRACE_DBG("INQUIRY: Unsupported page %x", cmd->cdb[2]);
-			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+		if (((address[offset] & 0x3f) == 0x8) && (type != TYPE_ROM)) {
+			/* Caching page */
+			if (address[offset + 1] != 18) {
+				PRINT_ERROR("%s", "MODE SELECT: Invalid "
+					"caching page request");
+				scst_set_invalid_field_in_parm_list(cmd, offset+1, 0);
+				goto out_put;
+			}
+			vdisk_caching_m_pg_select(&address[offset], virt_dev,
+				cmd, cmd->cdb[1] & SP, cmd->tgt_dev->tgt_dev_rd_only);
+			break;
+		} else if ((address[offset] & 0x3f) == 0xA) {
+			/* Control page */
+			if (address[offset + 1] != 0xA) {
+				PRINT_ERROR("%s", "MODE SELECT: Invalid "
+					"control page request");
+				scst_set_invalid_field_in_parm_list(cmd, offset+1, 0);
+				goto out_put;
+			}
+			vdisk_ctrl_m_pg_select(&address[offset], virt_dev, cmd,
+				cmd->cdb[1] & SP, offset);
+		} else {
+			TRACE(TRACE_MINOR, "MODE SELECT: Invalid request %x",
+				address[offset] & 0x3f);
+			scst_set_invalid_field_in_parm_list(cmd, offset,
+				SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
 			goto out_put;
 		}
-		resp_len = vdisk_inq(buf, cmd, virt_dev);
+		offset += address[offset + 1];
 	}
 
-	sBUG_ON(resp_len > INQ_BUF_SZ);
-
-	if (length > resp_len)
-		length = resp_len;
-	memcpy(address, buf, length);
-
 out_put:
 	scst_put_buf_full(cmd, address);
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
-
-out_free:
-	kfree(buf);
 
 out:
 	TRACE_EXIT();
 	return CMD_SUCCEEDED;
 }
 
-static enum compl_status_e vdisk_exec_request_sense(struct vdisk_cmd_params *p)
+static enum compl_status_e vdisk_exec_log(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	int32_t length, sl;
-	uint8_t *address;
-	uint8_t b[SCST_STANDARD_SENSE_LEN];
 
 	TRACE_ENTRY();
 
-	/*
-	 * No need to make it volatile, because at worst we will have a couple
-	 * of extra commands refused after formatting actually finished, which
-	 * is acceptable.
-	 */
-	if (virt_dev->format_active) {
-		uint64_t d, div;
-		uint16_t v;
+	/* No log pages are supported */
+	scst_set_invalid_field_in_cdb(cmd, 2, SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
 
-		div = virt_dev->format_progress_to_do >> 16;
-		d = virt_dev->format_progress_done;
-		do_div(d, div);
-		v = d;
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
 
-		TRACE_DBG("Format progress %d", v);
+static enum compl_status_e vdisk_exec_read_capacity(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	int32_t length;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev;
+	uint32_t blocksize;
+	uint64_t nblocks;
+	uint8_t buffer[8];
 
-		sl = scst_set_sense(b, sizeof(b), dev->d_sense,
-			SCST_LOAD_SENSE(scst_sense_format_in_progress));
+	TRACE_ENTRY();
 
-		BUILD_BUG_ON(SCST_STANDARD_SENSE_LEN < 18);
-		if (dev->d_sense) {
-			uint8_t *p = &b[7];
-			int o = 8;
-			*p += 8;
-			b[o] = 2;
-			b[o+1] = 6;
-			b[o+4] = 0x80;
-			put_unaligned_be16(v, &b[o+5]);
-		} else {
-			b[15] = 0x80;
-			put_unaligned_be16(v, &b[16]);
+	virt_dev = cmd->dev->dh_priv;
+	blocksize = cmd->dev->block_size;
+	nblocks = virt_dev->nblocks;
+
+	if ((cmd->cdb[8] & 1) == 0) {
+		uint32_t lba = get_unaligned_be32(&cmd->cdb[2]);
+
+		if (lba != 0) {
+			TRACE_DBG("PMI zero and LBA not zero (cmd %p)", cmd);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+			goto out;
 		}
-		TRACE_BUFF_FLAG(TRACE_DEBUG, "Format sense", b, sizeof(b));
-	} else
-		sl = scst_set_sense(b, sizeof(b), cmd->dev->d_sense,
-			SCST_LOAD_SENSE(scst_sense_no_sense));
+	}
+
+	memset(buffer, 0, sizeof(buffer));
+
+	/* Last block on the virt_dev is (nblocks-1) */
+#if 0 /* we don't need this workaround anymore */
+	/*
+	 * If we are thinly provisioned, we must ensure that the initiator
+	 * issues a READ_CAPACITY(16) so we can return the LBPME bit. By
+	 * returning 0xFFFFFFFF we do that.
+	 */
+	put_unaligned_be32(nblocks >> 32 || virt_dev->thin_provisioned ?
+			   0xffffffffU : nblocks - 1, &buffer[0]);
+#else
+	put_unaligned_be32((nblocks >> 32) ? 0xffffffffU : nblocks - 1, &buffer[0]);
+#endif
+
+	put_unaligned_be32(blocksize, &buffer[4]);
 
 	length = scst_get_buf_full_sense(cmd, &address);
-	TRACE_DBG("length %d", length);
-	if (length <= 0)
+	if (unlikely(length <= 0))
 		goto out;
 
-	length = min(sl, length);
-	memcpy(address, b, length);
-	scst_set_resp_data_len(cmd, length);
+	length = min_t(int, length, sizeof(buffer));
+
+	memcpy(address, buffer, length);
 
 	scst_put_buf_full(cmd, address);
 
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
 out:
 	TRACE_EXIT();
 	return CMD_SUCCEEDED;
 }
 
-static int vdisk_err_recov_pg(unsigned char *p, int pcontrol,
-			       struct scst_vdisk_dev *virt_dev)
-{	/* Read-Write Error Recovery page for mode_sense */
-	const unsigned char err_recov_pg[] = {0x1, 0xa, 0xc0, 1, 0, 0, 0, 0,
-					      1, 0, 0xff, 0xff};
-
-	memcpy(p, err_recov_pg, sizeof(err_recov_pg));
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(err_recov_pg) - 2);
-	return sizeof(err_recov_pg);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31)
+/*
+ * See also patch "block: Export I/O topology for block devices and partitions"
+ * (commit ID c72758f33784).
+ */
+static inline unsigned int queue_physical_block_size(struct request_queue *q)
+{
+	return 4096;
 }
+#endif
 
-static int vdisk_disconnect_pg(unsigned char *p, int pcontrol,
-				struct scst_vdisk_dev *virt_dev)
-{	/* Disconnect-Reconnect page for mode_sense */
-	const unsigned char disconnect_pg[] = {0x2, 0xe, 128, 128, 0, 10, 0, 0,
-					       0, 0, 0, 0, 0, 0, 0, 0};
+static enum compl_status_e vdisk_exec_read_capacity16(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	int32_t length;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev;
+	struct block_device *bdev;
+	struct request_queue *q;
+	uint32_t blocksize, physical_blocksize;
+	uint64_t nblocks;
+	uint8_t buffer[32];
 
-	memcpy(p, disconnect_pg, sizeof(disconnect_pg));
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(disconnect_pg) - 2);
-	return sizeof(disconnect_pg);
-}
+	TRACE_ENTRY();
 
-static int vdisk_rigid_geo_pg(unsigned char *p, int pcontrol,
-	struct scst_vdisk_dev *virt_dev)
-{
-	unsigned char geo_m_pg[] = {0x04, 0x16, 0, 0, 0, DEF_HEADS, 0, 0,
-				    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-				    0x3a, 0x98/* 15K RPM */, 0, 0};
-	int32_t ncyl, n, rem;
-	uint64_t dividend;
+	virt_dev = cmd->dev->dh_priv;
+	bdev = virt_dev->bdev;
+	q = bdev ? bdev_get_queue(bdev) : NULL;
+	blocksize = cmd->dev->block_size;
+	nblocks = virt_dev->nblocks - 1;
 
-	memcpy(p, geo_m_pg, sizeof(geo_m_pg));
-	/*
-	 * Divide virt_dev->nblocks by (DEF_HEADS * DEF_SECTORS) and store
-	 * the quotient in ncyl and the remainder in rem.
-	 */
-	dividend = virt_dev->nblocks;
-	rem = do_div(dividend, DEF_HEADS * DEF_SECTORS);
-	ncyl = dividend;
-	if (rem != 0)
-		ncyl++;
-	memcpy(&n, p + 2, sizeof(u32));
-	n = n | ((__force u32)cpu_to_be32(ncyl) >> 8);
-	memcpy(p + 2, &n, sizeof(u32));
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(geo_m_pg) - 2);
-	return sizeof(geo_m_pg);
-}
+	if ((cmd->cdb[14] & 1) == 0) {
+		uint32_t lba = get_unaligned_be32(&cmd->cdb[2]);
 
-static int vdisk_format_pg(unsigned char *p, int pcontrol,
-			    struct scst_vdisk_dev *virt_dev)
-{       /* Format device page for mode_sense */
-	const unsigned char format_pg[] = {0x3, 0x16, 0, 0, 0, 0, 0, 0,
-					   0, 0, 0, 0, 0, 0, 0, 0,
-					   0, 0, 0, 0, 0x40, 0, 0, 0};
+		if (lba != 0) {
+			TRACE_DBG("PMI zero and LBA not zero (cmd %p)", cmd);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+			goto out;
+		}
+	}
 
-	memcpy(p, format_pg, sizeof(format_pg));
-	put_unaligned_be16(DEF_SECTORS, &p[10]);
-	put_unaligned_be16(virt_dev->dev->block_size, &p[12]);
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(format_pg) - 2);
-	return sizeof(format_pg);
-}
+	memset(buffer, 0, sizeof(buffer));
 
-static int vdisk_caching_pg(unsigned char *p, int pcontrol,
-			     struct scst_vdisk_dev *virt_dev)
-{
-	/* Caching page for mode_sense */
-	static const unsigned char caching_pg[] = {
-		0x8, 0x12, 0x0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0x80, 0x14, 0, 0,
-		0, 0, 0, 0
-	};
+	put_unaligned_be64(nblocks, &buffer[0]);
+	put_unaligned_be32(blocksize, &buffer[8]);
 
-	memcpy(p, caching_pg, sizeof(caching_pg));
+	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE) {
+		switch (cmd->dev->dev_dif_type) {
+		case 1:
+			buffer[12] = 1;
+			break;
+		case 2:
+			buffer[12] = 3;
+			break;
+		case 3:
+			buffer[12] = 5;
+			break;
+		default:
+			sBUG_ON(1);
+			break;
+		}
+	}
 
-	if (!virt_dev->nv_cache && vdev_saved_mode_pages_enabled)
-		p[0] |= 0x80;
+	/* LOGICAL BLOCKS PER PHYSICAL BLOCK EXPONENT */
+	physical_blocksize = q ? queue_physical_block_size(q) : 4096;
+	buffer[13] = max(ilog2(physical_blocksize) - ilog2(blocksize), 0);
 
-	switch (pcontrol) {
-	case 0: /* current */
-		p[2] |= (virt_dev->wt_flag || virt_dev->nv_cache) ? 0 : WCE;
-		break;
-	case 1: /* changeable */
-		memset(p + 2, 0, sizeof(caching_pg) - 2);
-		if (!virt_dev->nv_cache)
-			p[2] |= WCE;
-		break;
-	case 2: /* default */
-		p[2] |= (DEF_WRITE_THROUGH || virt_dev->nv_cache) ? 0 : WCE;
-		break;
-	case 3: /* saved */
-		p[2] |= (virt_dev->wt_flag_saved || virt_dev->nv_cache) ? 0 : WCE;
-		break;
-	default:
-		sBUG();
-		break;
+	if (virt_dev->thin_provisioned) {
+		buffer[14] |= 0x80;     /* LBPME */
+		if (virt_dev->discard_zeroes_data)
+			buffer[14] |= 0x40;     /* LBPRZ */
 	}
 
-	return sizeof(caching_pg);
-}
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
 
-static int vdisk_ctrl_m_pg(unsigned char *p, int pcontrol,
-			    struct scst_vdisk_dev *virt_dev)
-{	/* Control mode page for mode_sense */
-	unsigned char ctrl_m_pg[] = {0xa, 0xa, 0, 0, 0, 0, 0, 0,
-					   0, 0, 0x2, 0x4b};
+	length = min_t(int, length, sizeof(buffer));
 
-	if (vdev_saved_mode_pages_enabled)
-		ctrl_m_pg[0] |= 0x80;
+	memcpy(address, buffer, length);
 
-	memcpy(p, ctrl_m_pg, sizeof(ctrl_m_pg));
-	switch (pcontrol) {
-	case 0: /* current */
-		p[2] |= virt_dev->dev->tst << 5;
-		p[2] |= virt_dev->dev->d_sense << 2;
-		p[2] |= virt_dev->dev->dpicz << 3;
-		p[2] |= virt_dev->dev->tmf_only << 4;
-		p[3] |= virt_dev->dev->queue_alg << 4;
-		p[3] |= virt_dev->dev->qerr << 1;
-		p[4] |= virt_dev->dev->swp << 3;
-		p[5] |= virt_dev->dev->tas << 6;
-		p[5] |= virt_dev->dev->ato << 7;
-		break;
-	case 1: /* changeable */
-		memset(p + 2, 0, sizeof(ctrl_m_pg) - 2);
-#if 0	/*
-	 * See comment in struct scst_device definition.
-	 *
-	 * If enable it, fix the default and saved cases below!
-	 */
-		p[2] |= 7 << 5;		/* TST */
-#endif
-		if (!virt_dev->dev->cluster_mode) {
-			p[2] |= 1 << 2;		/* D_SENSE */
-			p[2] |= 1 << 3;		/* DPICZ */
-			p[2] |= 1 << 4;		/* TMF_ONLY */
-			p[3] |= 0xF << 4;	/* QUEUE ALGORITHM MODIFIER */
-			p[3] |= 3 << 1;		/* QErr */
-			p[4] |= 1 << 3;		/* SWP */
-			p[5] |= 1 << 6;		/* TAS */
-			p[5] |= 0 << 7;		/* ATO */
-		}
-		break;
-	case 2: /* default */
-		p[2] |= virt_dev->tst << 5;
-		p[2] |= virt_dev->dev->d_sense_default << 2;
-		p[2] |= virt_dev->dev->dpicz_default << 3;
-		p[2] |= virt_dev->dev->tmf_only_default << 4;
-		p[3] |= virt_dev->dev->queue_alg_default << 4;
-		p[3] |= virt_dev->dev->qerr_default << 1;
-		p[4] |= virt_dev->dev->swp_default << 3;
-		p[5] |= virt_dev->dev->tas_default << 6;
-		p[5] |= virt_dev->dev->ato << 7;
-		break;
-	case 3: /* saved */
-		p[2] |= virt_dev->dev->tst << 5;
-		p[2] |= virt_dev->dev->d_sense_saved << 2;
-		p[2] |= virt_dev->dev->dpicz_saved << 3;
-		p[2] |= virt_dev->dev->tmf_only_default << 4;
-		p[3] |= virt_dev->dev->queue_alg_saved << 4;
-		p[3] |= virt_dev->dev->qerr_saved << 1;
-		p[4] |= virt_dev->dev->swp_saved << 3;
-		p[5] |= virt_dev->dev->tas_saved << 6;
-		p[5] |= virt_dev->dev->ato << 7;
-		break;
-	default:
-		sBUG();
-	}
-	return sizeof(ctrl_m_pg);
-}
+	scst_put_buf_full(cmd, address);
 
-static int vdisk_iec_m_pg(unsigned char *p, int pcontrol,
-			   struct scst_vdisk_dev *virt_dev)
-{	/* Informational Exceptions control mode page for mode_sense */
-	const unsigned char iec_m_pg[] = {0x1c, 0xa, 0x08, 0, 0, 0, 0, 0,
-					  0, 0, 0x0, 0x0};
-	memcpy(p, iec_m_pg, sizeof(iec_m_pg));
-	if (pcontrol == 1)
-		memset(p + 2, 0, sizeof(iec_m_pg) - 2);
-	return sizeof(iec_m_pg);
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
-static enum compl_status_e vdisk_exec_mode_sense(struct vdisk_cmd_params *p)
+static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p)
+{
+	/* Changing it don't forget to add it to vdisk_opcode_descriptors! */
+	scst_set_invalid_field_in_cdb(p->cmd, 1,
+			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
+	return CMD_SUCCEEDED;
+}
+
+/* SPC-4 REPORT TARGET PORT GROUPS command */
+static enum compl_status_e vdisk_exec_report_tpgs(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
-	int32_t length;
+	struct scst_device *dev;
 	uint8_t *address;
-	uint8_t *buf;
-	struct scst_vdisk_dev *virt_dev;
-	uint32_t blocksize;
-	uint64_t nblocks;
-	unsigned char dbd, type;
-	int pcontrol, pcode, subpcode;
-	unsigned char dev_spec;
-	int msense_6, offset = 0, len;
-	unsigned char *bp;
+	void *buf;
+	int32_t buf_len;
+	uint32_t data_length, length;
+	uint8_t data_format;
+	int res;
 
 	TRACE_ENTRY();
 
-	buf = kzalloc(MSENSE_BUF_SZ, cmd->cmd_gfp_mask);
-	if (buf == NULL) {
+	buf_len = scst_get_buf_full_sense(cmd, &address);
+	if (buf_len <= 0)
+		goto out;
+
+	dev = cmd->dev;
+	data_format = cmd->cdb[1] >> 5;
+
+	res = scst_tg_get_group_info(&buf, &data_length, dev, data_format);
+	if (res == -ENOMEM) {
 		scst_set_busy(cmd);
+		goto out_put;
+	} else if (res < 0) {
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
+		goto out_put;
+	}
+
+	length = min_t(uint32_t, data_length, buf_len);
+	memcpy(address, buf, length);
+	kfree(buf);
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
+out_put:
+	scst_put_buf_full(cmd, address);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
+
+/* SPC-4 SET TARGET PORT GROUPS command */
+static enum compl_status_e vdisk_exec_set_tpgs(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	int res = CMD_SUCCEEDED, rc;
+
+	TRACE_ENTRY();
+
+	if (!virt_dev->expl_alua) {
+		PRINT_ERROR("SET TARGET PORT GROUPS: not explicit ALUA mode "
+			"(dev %s)", dev->virt_name);
+		/* Invalid opcode, i.e. SA field */
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
 		goto out;
 	}
 
-	virt_dev = cmd->dev->dh_priv;
-	blocksize = cmd->dev->block_size;
-	nblocks = virt_dev->nblocks;
+	rc = scst_tg_set_group_info(cmd);
+	if (rc == 0)
+		res = RUNNING_ASYNC;
+	else
+		scst_stpg_del_unblock_next(cmd);
 
-	type = cmd->dev->type;
-	dbd = cmd->cdb[1] & DBD;
-	pcontrol = (cmd->cdb[2] & 0xc0) >> 6;
-	pcode = cmd->cdb[2] & 0x3f;
-	subpcode = cmd->cdb[3];
-	msense_6 = (cmd->cdb[0] == MODE_SENSE);
-	dev_spec = cmd->tgt_dev->tgt_dev_rd_only ? WP : 0;
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-	if (type != TYPE_ROM)
-		dev_spec |= DPOFUA;
+static enum compl_status_e vdisk_exec_read_toc(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	int32_t length, off = 0;
+	uint8_t *address;
+	struct scst_vdisk_dev *virt_dev;
+	uint32_t nblocks;
+	uint8_t buffer[4+8+8] = { 0x00, 0x0a, 0x01, 0x01, 0x00, 0x14,
+				  0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
-		goto out_free;
+	TRACE_ENTRY();
 
-	if (!vdev_saved_mode_pages_enabled && (pcontrol == 0x3)) {
-		TRACE_DBG("%s", "MODE SENSE: Saving values not supported");
+	if (cmd->dev->type != TYPE_ROM) {
+		PRINT_ERROR("%s", "READ TOC for non-CDROM device");
 		scst_set_cmd_error(cmd,
-		    SCST_LOAD_SENSE(scst_sense_saving_params_unsup));
-		goto out_put;
+			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		goto out;
 	}
 
-	if (msense_6) {
-		buf[1] = type;
-		buf[2] = dev_spec;
-		offset = 4;
-	} else {
-		buf[2] = type;
-		buf[3] = dev_spec;
-		offset = 8;
+	if (cmd->cdb[2] & 0x0e/*Format*/) {
+		PRINT_ERROR("%s", "READ TOC: invalid requested data format");
+		scst_set_invalid_field_in_cdb(cmd, 2,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
+		goto out;
 	}
 
-	if (subpcode != 0) {
-		/* TODO: Control Extension page */
-		TRACE_DBG("%s", "MODE SENSE: Only subpage 0 is supported");
-		scst_set_invalid_field_in_cdb(cmd, 3, 0);
-		goto out_put;
+	if ((cmd->cdb[6] != 0 && (cmd->cdb[2] & 0x01)) ||
+	    (cmd->cdb[6] > 1 && cmd->cdb[6] != 0xAA)) {
+		PRINT_ERROR("READ TOC: invalid requested track number %x",
+			cmd->cdb[6]);
+		scst_set_invalid_field_in_cdb(cmd, 6, 0);
+		goto out;
 	}
 
-	if (!dbd) {
-		/* Create block descriptor */
-		buf[offset - 1] = 0x08;		/* block descriptor length */
-		put_unaligned_be32(nblocks >> 32 ? 0xffffffffU : nblocks,
-				   &buf[offset]);
-		buf[offset + 4] = 0;			/* density code */
-		put_unaligned_be24(blocksize, &buf[offset + 5]); /* blklen */
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
 
-		offset += 8;			/* increment offset */
+	virt_dev = cmd->dev->dh_priv;
+	/* ToDo when you have > 8TB ROM device. */
+	nblocks = (uint32_t)virt_dev->nblocks;
+
+	/* Header */
+	memset(buffer, 0, sizeof(buffer));
+	buffer[2] = 0x01;    /* First Track/Session */
+	buffer[3] = 0x01;    /* Last Track/Session */
+	off = 4;
+	if (cmd->cdb[6] <= 1) {
+		/* Fistr TOC Track Descriptor */
+		/*
+		 * ADDR    0x10 - Q Sub-channel encodes current position data
+		 * CONTROL 0x04 - Data track, recoreded uninterrupted
+		 */
+		buffer[off+1] = 0x14;
+		/* Track Number */
+		buffer[off+2] = 0x01;
+		off += 8;
+	}
+	if (!(cmd->cdb[2] & 0x01)) {
+		/* Lead-out area TOC Track Descriptor */
+		buffer[off+1] = 0x14;
+		/* Track Number */
+		buffer[off+2] = 0xAA;
+		/* Track Start Address */
+		put_unaligned_be32(nblocks, &buffer[off + 4]);
+		off += 8;
 	}
 
-	bp = buf + offset;
+	buffer[1] = off - 2;    /* Data  Length */
 
-	switch (pcode) {
-	case 0x1:	/* Read-Write error recovery page, direct access */
-		len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x2:	/* Disconnect-Reconnect page, all devices */
-		if (type == TYPE_ROM)
-			goto out_not_sup;
-		len = vdisk_disconnect_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x3:       /* Format device page, direct access */
-		if (type == TYPE_ROM)
-			goto out_not_sup;
-		len = vdisk_format_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x4:	/* Rigid disk geometry */
-		if (type == TYPE_ROM)
-			goto out_not_sup;
-		len = vdisk_rigid_geo_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x8:	/* Caching page, direct access */
-		if (type == TYPE_ROM)
-			goto out_not_sup;
-		len = vdisk_caching_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0xa:	/* Control Mode page, all devices */
-		len = vdisk_ctrl_m_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x1c:	/* Informational Exceptions Mode page, all devices */
-		len = vdisk_iec_m_pg(bp, pcontrol, virt_dev);
-		break;
-	case 0x3f:	/* Read all Mode pages */
-		if (type == TYPE_ROM) {
-			len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
-			len += vdisk_ctrl_m_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_iec_m_pg(bp + len, pcontrol, virt_dev);
-		} else {
-			len = vdisk_err_recov_pg(bp, pcontrol, virt_dev);
-			len += vdisk_disconnect_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_format_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_caching_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_ctrl_m_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_iec_m_pg(bp + len, pcontrol, virt_dev);
-			len += vdisk_rigid_geo_pg(bp + len, pcontrol, virt_dev);
-		}
-		break;
-	default:
-		goto out_not_sup;
-	}
+	if (off > length)
+		off = length;
+	memcpy(address, buffer, off);
+
+	scst_put_buf_full(cmd, address);
+
+	if (off < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, off);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
+
+static enum compl_status_e vdisk_exec_prevent_allow_medium_removal(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+
+	TRACE_DBG("PERSIST/PREVENT 0x%02x", cmd->cdb[4]);
+
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->prevent_allow_medium_removal = cmd->cdb[4] & 0x01 ? 1 : 0;
+	spin_unlock(&virt_dev->flags_lock);
 
-	offset += len;
+	return CMD_SUCCEEDED;
+}
 
-	if (msense_6)
-		buf[0] = offset - 1;
-	else
-		put_unaligned_be16(offset - 2, &buf[0]);
+/*
+ * SYNCHRONIZE CACHE coalescing ("group commit").
+ *
+ * A SYNCHRONIZE CACHE command needs a flush started after its arrival. If
+ * no flush is in progress, the caller becomes its issuer and starts one
+ * immediately. Otherwise the command is queued and all commands queued while
+ * that flush is in progress are completed by a single next flush, which the
+ * issuer of the current one starts as soon as it has finished.
+ *
+ * Returns true, if the caller must start a flush for the commands in @batch.
+ */
+static bool vdisk_flush_queue(struct scst_vdisk_dev *virt_dev,
+	struct scst_cmd *cmd, struct list_head *batch)
+{
+	unsigned long flags;
+	bool res;
 
-	if (offset > length)
-		offset = length;
-	memcpy(address, buf, offset);
+	spin_lock_irqsave(&virt_dev->flush_lock, flags);
+	virt_dev->flush_cmds++;
+	list_add_tail(&cmd->dh_list_entry, &virt_dev->flush_next_list);
+	res = !virt_dev->flush_in_progress;
+	if (res) {
+		list_splice_init(&virt_dev->flush_next_list, batch);
+		virt_dev->flush_in_progress = 1;
+		virt_dev->flushes++;
+	} else
+		virt_dev->flush_needed = 1;
+	spin_unlock_irqrestore(&virt_dev->flush_lock, flags);
 
-out_put:
-	scst_put_buf_full(cmd, address);
-	if (offset < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, offset);
+	return res;
+}
 
-out_free:
-	kfree(buf);
+/*
+ * Called by the issuer of a flush after it has finished. Returns true, if the
+ * caller must start the next flush for the commands in @batch.
+ *
+ * The issuer must not touch virt_dev after it completed the commands of the
+ * finished flush, unless this function returned true, because then nothing
+ * might protect the device from being unregistered.
+ */
+static bool vdisk_flush_finish(struct scst_vdisk_dev *virt_dev,
+	struct list_head *batch)
+{
+	unsigned long flags;
+	bool res;
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	spin_lock_irqsave(&virt_dev->flush_lock, flags);
+	res = virt_dev->flush_needed;
+	if (res) {
+		list_splice_init(&virt_dev->flush_next_list, batch);
+		virt_dev->flush_needed = 0;
+		virt_dev->flushes++;
+	} else
+		virt_dev->flush_in_progress = 0;
+	spin_unlock_irqrestore(&virt_dev->flush_lock, flags);
 
-out_not_sup:
-	TRACE(TRACE_MINOR, "MODE SENSE: Unsupported page %x", pcode);
-	scst_set_invalid_field_in_cdb(cmd, 2, SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-	goto out_put;
+	return res;
 }
 
-static int vdisk_set_wt(struct scst_vdisk_dev *virt_dev, int wt, bool read_only)
+static void vdisk_flush_complete_cmds(struct list_head *batch, int flush_res)
 {
-	int res = 0;
-	struct file *fd, *dif_fd = NULL;
-	bool old_wt = virt_dev->wt_flag;
+	struct scst_cmd *cmd, *t;
 
-	TRACE_ENTRY();
+	list_for_each_entry_safe(cmd, t, batch, dh_list_entry) {
+		list_del(&cmd->dh_list_entry);
+		if (unlikely(flush_res != 0)) {
+			if (flush_res == -ENOMEM)
+				scst_set_busy(cmd);
+			else
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
+		}
+		cmd->completed = 1;
+		cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+			scst_estimate_context());
+	}
+}
 
-	if ((virt_dev->wt_flag == wt) || virt_dev->nullio || virt_dev->nv_cache)
-		goto out;
+static int __vdisk_fsync_fileio(loff_t loff,
+	loff_t len, struct scst_device *dev, struct scst_cmd *cmd,
+	struct file *file)
+{
+	int res;
 
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->wt_flag = wt;
-	spin_unlock(&virt_dev->flags_lock);
+	TRACE_ENTRY();
 
-	if (virt_dev->fd == NULL)
-		goto out;
+	/**
+	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
+	 ** anything without checking for NULL at first !!!
+	 **/
 
-	/*
-	 * MODE SELECT is strictly serialized command, so it's safe here
-	 * to reopen fd.
-	 */
+	/* BLOCKIO can be here for DIF tags fsync */
 
-	fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only);
-	if (IS_ERR(fd)) {
-		res = PTR_ERR(fd);
-		goto out_err;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 32)
+	res = sync_page_range(file_inode(file), file->f_mapping, loff, len);
+#else
+#if 0	/* For sparse files we might need to sync metadata as well */
+	res = generic_write_sync(file, loff, len);
+#else
+	res = filemap_write_and_wait_range(file->f_mapping, loff, len);
+#endif
+#endif
+	if (unlikely(res != 0)) {
+		PRINT_ERROR("sync range failed (%d)", res);
+		if (cmd != NULL) {
+			if (res == -ENOMEM)
+				scst_set_busy(cmd);
+			else
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
+		}
 	}
 
-	if (virt_dev->dif_filename != NULL) {
-		dif_fd = vdev_open_fd(virt_dev, virt_dev->dif_filename, read_only);
-		if (IS_ERR(dif_fd)) {
-			res = PTR_ERR(dif_fd);
-			goto out_err_close_fd;
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int vdisk_fsync_blockio(loff_t loff,
+	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
+	struct scst_cmd *cmd, bool async)
+{
+	int res;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	/**
+	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
+	 ** anything without checking for NULL at first !!!
+	 **/
+
+	EXTRACHECKS_BUG_ON(!virt_dev->blockio);
+
+	/* Must be first, because vdisk_blockio_flush() can call scst_cmd_done()! */
+	if (virt_dev->dif_fd != NULL) {
+		loff = (loff >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
+		len = (len >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
+		res = __vdisk_fsync_fileio(loff, len, dev, cmd,
+			virt_dev->dif_fd);
+		if (unlikely(res != 0)) {
+			if (async && (cmd != NULL)) {
+				cmd->completed = 1;
+				cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+					scst_estimate_context());
+			}
+			goto out;
 		}
 	}
 
-	filp_close(virt_dev->fd, NULL);
-	if (virt_dev->dif_fd)
-		filp_close(virt_dev->dif_fd, NULL);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	if (async && (cmd != NULL)) {
+		vdisk_blockio_flush_coalesced(virt_dev, cmd, gfp_flags);
+		goto out;
+	}
+#endif
 
-	virt_dev->fd = fd;
-	virt_dev->dif_fd = dif_fd;
+	res = vdisk_blockio_flush(virt_dev->bdev, gfp_flags, true,
+		cmd, async);
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
-
-out_err_close_fd:
-	filp_close(fd, NULL);
-
-out_err:
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->wt_flag = old_wt;
-	spin_unlock(&virt_dev->flags_lock);
-	goto out;
 }
 
-static void vdisk_ctrl_m_pg_select(unsigned char *p,
-	struct scst_vdisk_dev *virt_dev, struct scst_cmd *cmd, bool save,
-	int param_offset)
+/*
+ * Writes back the whole file on behalf of @cmd and all SYNCHRONIZE CACHE
+ * commands coalesced with it, see vdisk_flush_queue().
+ */
+static void vdisk_fileio_flush_coalesced(struct scst_vdisk_dev *virt_dev,
+	struct scst_cmd *cmd)
 {
 	struct scst_device *dev = virt_dev->dev;
-	int old_swp = dev->swp, old_tas = dev->tas, old_dsense = dev->d_sense;
-	int old_queue_alg = dev->queue_alg, old_dpicz = dev->dpicz;
-	int rc, old_tmf_only = dev->tmf_only, old_qerr = dev->qerr;
-	int queue_alg, swp, tas, tmf_only, qerr, d_sense, dpicz;
+	LIST_HEAD(batch);
+	LIST_HEAD(next);
+	bool more;
+	int res;
 
 	TRACE_ENTRY();
 
-	if (save && !vdev_saved_mode_pages_enabled) {
-		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: saved control page "
-			"not supported");
-		scst_set_invalid_field_in_cdb(cmd, 2,
-				SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
+	if (!vdisk_flush_queue(virt_dev, cmd, &batch))
 		goto out;
-	}
 
-	/*
-	 * MODE SELECT is a strictly serialized cmd, so it is safe to
-	 * perform direct assignment here.
-	 */
+	do {
+		res = __vdisk_fsync_fileio(0, virt_dev->file_size, dev, NULL,
+			virt_dev->fd);
+		if ((res == 0) && (virt_dev->dif_fd != NULL))
+			res = __vdisk_fsync_fileio(0,
+				(virt_dev->file_size >> dev->block_shift) <<
+					SCST_DIF_TAG_SHIFT,
+				dev, NULL, virt_dev->dif_fd);
+		more = vdisk_flush_finish(virt_dev, &next);
+		vdisk_flush_complete_cmds(&batch, res);
+		list_splice_init(&next, &batch);
+	} while (more);
 
-#if 0 /* Not implemented yet, see comment in struct scst_device */
-	dev->tst = (p[2] >> 5) & 7;
-	/* ToDo: check validity of the new value */
-#else
-	if (dev->tst != ((p[2] >> 5) & 7)) {
-		TRACE(TRACE_MINOR|TRACE_SCSI, "%s", "MODE SELECT: Changing of "
-			"TST not supported");
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
+out:
+	TRACE_EXIT();
+	return;
+}
+
+static int vdisk_fsync_fileio(loff_t loff,
+	loff_t len, struct scst_device *dev, struct scst_cmd *cmd, bool async)
+{
+	int res;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	/**
+	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
+	 ** anything without checking for NULL at first !!!
+	 **/
+
+	if (async && (cmd != NULL)) {
+		vdisk_fileio_flush_coalesced(virt_dev, cmd);
+		res = 0;
 		goto out;
 	}
-#endif
 
-	queue_alg = p[3] >> 4;
-	if ((queue_alg != SCST_QUEUE_ALG_0_RESTRICTED_REORDER) &&
-	    (queue_alg != SCST_QUEUE_ALG_1_UNRESTRICTED_REORDER)) {
-		PRINT_WARNING("Attempt to set invalid Control mode page QUEUE "
-			"ALGORITHM MODIFIER value %d (initiator %s, dev %s)",
-			queue_alg, cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 3,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
-		goto out;
+	res = __vdisk_fsync_fileio(loff, len, dev, cmd, virt_dev->fd);
+	if (unlikely(res != 0))
+		goto done;
+
+	if (virt_dev->dif_fd != NULL) {
+		loff = (loff >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
+		len = (len >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
+		res = __vdisk_fsync_fileio(loff, len, dev, cmd,
+			virt_dev->dif_fd);
 	}
 
-	swp = (p[4] & 0x8) >> 3;
-	if (swp > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page SWP "
-			"value %d (initiator %s, dev %s)", swp,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 4,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
-		goto out;
+done:
+	if (async) {
+		if (cmd != NULL) {
+			cmd->completed = 1;
+			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+				scst_estimate_context());
+		}
 	}
 
-	tas = (p[5] & 0x40) >> 6;
-	if (tas > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page TAS "
-			"value %d (initiator %s, dev %s)", tas,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 5,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 6);
-		goto out;
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int vdisk_fsync(loff_t loff,
+	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
+	struct scst_cmd *cmd, bool async)
+{
+	int res = 0;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	/**
+	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
+	 ** anything without checking for NULL at first !!!
+	 **/
+
+	/* Dirty data of the write-back cache must be destaged regardless */
+	if (virt_dev->wbc != NULL) {
+		uint64_t first = 0, last = ULLONG_MAX;
+
+		if (len > 0) {
+			first = loff >> PAGE_SHIFT;
+			last = (loff + len - 1) >> PAGE_SHIFT;
+		}
+		res = vdisk_wbc_destage_range(virt_dev->wbc, first, last,
+			false);
+		if (unlikely(res != 0)) {
+			if (cmd != NULL) {
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
+				if (async) {
+					cmd->completed = 1;
+					cmd->scst_cmd_done(cmd,
+						SCST_CMD_STATE_DEFAULT,
+						scst_estimate_context());
+				}
+			}
+			goto out;
+		}
 	}
 
-	tmf_only = (p[2] & 0x10) >> 4;
-	if (tmf_only > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page "
-			"TMF_ONLY value %d (initiator %s, dev %s)", tmf_only,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 4);
+	/* It should be generated by compiler as a single comparison */
+	if (virt_dev->nv_cache || virt_dev->wt_flag ||
+	    virt_dev->o_direct_flag || virt_dev->nullio) {
+		if (async) {
+			cmd->completed = 1;
+			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+				scst_estimate_context());
+		}
 		goto out;
 	}
 
-	dpicz = (p[2] & 0x8) >> 3;
-	if (dpicz > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page "
-			"dpicz value %d (initiator %s, dev %s)", dpicz,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 3);
-		goto out;
-	}
+	if (virt_dev->nullio)
+		;
+	else if (virt_dev->blockio)
+		res = vdisk_fsync_blockio(loff, len, dev, gfp_flags, cmd, async);
+	else
+		res = vdisk_fsync_fileio(loff, len, dev, cmd, async);
 
-	qerr = (p[3] & 0x6) >> 1;
-	if ((qerr == SCST_QERR_2_RESERVED) ||
-	    (qerr > SCST_QERR_3_ABORT_THIS_NEXUS_ONLY)) {
-		PRINT_WARNING("Attempt to set invalid Control mode page QErr "
-			"value %d (initiator %s, dev %s)", qerr,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 3,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 1);
-		goto out;
-	}
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-	d_sense = (p[2] & 0x4) >> 2;
-	if (d_sense > 1) {
-		PRINT_WARNING("Attempt to set invalid Control mode page D_SENSE "
-			"value %d (initiator %s, dev %s)", d_sense,
-			cmd->sess->initiator_name, dev->virt_name);
-		scst_set_invalid_field_in_parm_list(cmd, param_offset + 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 2);
-		goto out;
+static struct iovec *vdisk_alloc_iv(struct scst_cmd *cmd,
+				    struct vdisk_cmd_params *p)
+{
+	int iv_count;
+
+	iv_count = min_t(int, scst_get_buf_count(cmd), UIO_MAXIOV);
+	if (iv_count > p->iv_count) {
+		if (p->iv != p->small_iv)
+			kfree(p->iv);
+		p->iv_count = 0;
+		/* It can't be called in atomic context */
+		p->iv = (iv_count <= ARRAY_SIZE(p->small_iv)) ? p->small_iv :
+			kmalloc_array(iv_count, sizeof(*p->iv),
+				      cmd->cmd_gfp_mask);
+		if (p->iv == NULL) {
+			PRINT_ERROR("Unable to allocate iv (%d)", iv_count);
+			goto out;
+		}
+		p->iv_count = iv_count;
 	}
 
-	dev->queue_alg = queue_alg;
-	dev->swp = swp;
-	dev->tas = tas;
-	dev->tmf_only = tmf_only;
-	dev->dpicz = dpicz;
-	dev->qerr = qerr;
-	dev->d_sense = d_sense;
+out:
+	return p->iv;
+}
 
-	if ((dev->swp == old_swp) && (dev->tas == old_tas) &&
-	    (dev->d_sense == old_dsense) && (dev->queue_alg == old_queue_alg) &&
-	    (dev->qerr == old_qerr) && (dev->tmf_only == old_tmf_only) &&
-	    (dev->dpicz == old_dpicz))
-		goto out;
+static enum compl_status_e nullio_exec_read(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
 
-	if (!save)
-		goto out_ok;
+	TRACE_ENTRY();
 
-	rc = vdev_save_mode_pages(virt_dev);
-	if (rc != 0) {
-		dev->swp = old_swp;
-		dev->tas = old_tas;
-		dev->d_sense = old_dsense;
-		dev->queue_alg = old_queue_alg;
-		dev->tmf_only = old_tmf_only;
-		dev->qerr = old_qerr;
-		dev->dpicz = old_dpicz;
-		/* Hopefully, the error is temporary */
-		scst_set_busy(cmd);
-		goto out;
-	}
+	if (virt_dev->read_zero) {
+		struct scatterlist *sge;
+		struct page *page;
+		int i;
+		void *p;
 
-	dev->swp_saved = dev->swp;
-	dev->tas_saved = dev->tas;
-	dev->d_sense_saved = dev->d_sense;
-	dev->queue_alg_saved = dev->queue_alg;
-	dev->tmf_only_saved = dev->tmf_only;
-	dev->qerr_saved = dev->qerr;
-	dev->dpicz_saved = dev->dpicz;
+		for_each_sg(cmd->sg, sge, cmd->sg_cnt, i) {
+			page = sg_page(sge);
+			p = kmap(page);
+			if (sge->offset == 0 && sge->length == PAGE_SIZE)
+				clear_page(p);
+			else
+				memset(p + sge->offset, 0, sge->length);
+			kunmap(page);
+		}
+	}
 
-out_ok:
-	PRINT_INFO("Device %s: new control mode page parameters: SWP %x "
-		"(was %x), TAS %x (was %x), TMF_ONLY %d (was %x), QErr %x "
-		"(was %x), D_SENSE %d (was %d), QUEUE ALG %d (was %d), "
-		"DPICZ %d (was %d)", virt_dev->name, dev->swp, old_swp,
-		dev->tas, old_tas, dev->tmf_only, old_tmf_only, dev->qerr,
-		old_qerr, dev->d_sense, old_dsense, dev->queue_alg,
-		old_queue_alg, dev->dpicz, old_dpicz);
+	scst_dif_process_read(p->cmd);
 
-out:
 	TRACE_EXIT();
-	return;
+	return CMD_SUCCEEDED;
 }
 
-static void vdisk_caching_m_pg_select(unsigned char *p,
-	struct scst_vdisk_dev *virt_dev, struct scst_cmd *cmd, bool save,
-	bool read_only)
+/*
+ * Copies tags of the command from the page cache of the tags file, see
+ * vdev_open_fd(). Cheaper than an iovec based vfs_readv() for only
+ * 8 bytes per block and, for cached tags, doesn't need any I/O.
+ */
+static int vdev_read_dif_tags(struct vdisk_cmd_params *p)
 {
-	int old_wt = virt_dev->wt_flag, new_wt, rc;
+	int res = 0;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct file *fd = virt_dev->dif_fd;
+	struct address_space *mapping = fd->f_mapping;
+	loff_t loff, end;
+	uint8_t *address, *dst;
+	int tags_num, l;
+	struct scatterlist *tags_sg = NULL;
+	unsigned long flags;
 
 	TRACE_ENTRY();
 
-	if (save && (!vdev_saved_mode_pages_enabled || virt_dev->nv_cache)) {
-		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: saved cache page "
-			"not supported");
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-		goto out;
-	}
+	/*
+	 * !! Data for this cmd can be read simultaneously !!
+	 */
 
-	new_wt = (p[2] & WCE) ? 0 : 1;
+	EXTRACHECKS_BUG_ON(virt_dev->nullio);
 
-	if (new_wt == old_wt)
-		goto out;
+	EXTRACHECKS_BUG_ON(!(cmd->dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) ||
+	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) == SCST_DIF_ACTION_NONE));
 
-	if (vdisk_set_wt(virt_dev, new_wt, read_only) != 0) {
-		scst_set_busy(cmd);
+	tags_num = (cmd->bufflen >> cmd->dev->block_shift);
+	if (unlikely(tags_num == 0))
 		goto out;
+
+	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
+	end = loff + ((loff_t)tags_num << SCST_DIF_TAG_SHIFT);
+	if (unlikely(end > i_size_read(mapping->host))) {
+		PRINT_ERROR("DIF tags %lld-%lld beyond the end of the DIF "
+			"file (dev %s)", (long long)loff, (long long)end,
+			cmd->dev->virt_name);
+		res = -EIO;
+		goto out_err;
 	}
 
-	if (!save)
-		goto out_ok;
+	TRACE_DBG("Reading DIF tags_num %d, loff %lld", tags_num,
+		(long long)loff);
 
-	rc = vdev_save_mode_pages(virt_dev);
-	if (rc != 0) {
-		vdisk_set_wt(virt_dev, old_wt, read_only);
-		/* Hopefully, the error is temporary */
-		scst_set_busy(cmd);
-		goto out;
-	}
+	while (tags_num > 0) {
+		address = scst_get_dif_buf(cmd, &tags_sg, &l);
+		EXTRACHECKS_BUG_ON(l <= 0);
+		tags_num -= l >> SCST_DIF_TAG_SHIFT;
+		EXTRACHECKS_BUG_ON(tags_num < 0);
+
+		dst = address;
+		while (l > 0) {
+			struct page *page;
+			int offs = loff & ~PAGE_MASK;
+			int len = min_t(int, l, PAGE_SIZE - offs);
+			uint8_t *src;
+
+			page = read_mapping_page(mapping, loff >> PAGE_SHIFT, fd);
+			if (IS_ERR(page)) {
+				res = PTR_ERR(page);
+				PRINT_ERROR("Reading DIF page at offs %lld failed: "
+					"%d (dev %s)", (long long)loff, res,
+					cmd->dev->virt_name);
+				scst_put_dif_buf(cmd, address);
+				goto out_err;
+			}
 
-	virt_dev->wt_flag_saved = virt_dev->wt_flag;
+			src = kmap(page);
+			memcpy(dst, src + offs, len);
+			kunmap(page);
+			put_page(page);
 
-out_ok:
-	PRINT_INFO("Device %s: new wt_flag: %x (was %x)", virt_dev->name,
-		virt_dev->wt_flag, old_wt);
+			dst += len;
+			loff += len;
+			l -= len;
+		}
+
+		scst_put_dif_buf(cmd, address);
+	}
 
 out:
-	TRACE_EXIT();
-	return;
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_err:
+	/* To protect sense setting with blockio */
+	spin_lock_irqsave(&vdev_err_lock, flags);
+	if (res == -ENOMEM)
+		scst_set_busy(cmd);
+	else
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_read_error));
+	spin_unlock_irqrestore(&vdev_err_lock, flags);
+	goto out;
 }
 
-static enum compl_status_e vdisk_exec_mode_select(struct vdisk_cmd_params *p)
+static int vdev_write_dif_tags(struct vdisk_cmd_params *p)
 {
+	int res = 0;
 	struct scst_cmd *cmd = p->cmd;
-	int32_t length;
+	loff_t loff;
+	mm_segment_t old_fs;
+	loff_t err = 0;
+	ssize_t length, full_len;
 	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev;
-	int mselect_6, offset, bdl, type;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct file *fd = virt_dev->dif_fd;
+	struct iovec *iv, *eiv;
+	int iv_count, eiv_count, max_iv_count, i;
+	bool finished = false;
+	int tags_num, l;
+	struct scatterlist *tags_sg;
 
 	TRACE_ENTRY();
 
-	virt_dev = cmd->dev->dh_priv;
-	if (cmd->dev->cluster_mode) {
-		PRINT_ERROR("MODE SELECT: not supported in cluster mode\n");
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
+	/*
+	 * !! Data for this cmd can be written simultaneously !!
+	 */
+
+	EXTRACHECKS_BUG_ON(virt_dev->nullio);
+
+#if 0 /* no zero-copy (yet) */
+	if (p->use_zero_copy)
 		goto out;
-	}
+#endif
 
-	mselect_6 = (cmd->cdb[0] == MODE_SELECT);
-	type = cmd->dev->type;
+	EXTRACHECKS_BUG_ON(!(cmd->dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) ||
+	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) == SCST_DIF_ACTION_NONE));
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
+	tags_num = (cmd->bufflen >> cmd->dev->block_shift);
+	if (unlikely(tags_num == 0))
 		goto out;
 
-	if (!(cmd->cdb[1] & PF)) {
-		TRACE(TRACE_MINOR|TRACE_SCSI, "MODE SELECT: Unsupported "
-			"PF bit zero (cdb[1]=%x)", cmd->cdb[1]);
-		scst_set_invalid_field_in_cdb(cmd, 1, 0);
-		goto out_put;
-	}
+	iv = p->iv;
+	if (iv == NULL) {
+		iv = vdisk_alloc_iv(cmd, p);
+		if (iv == NULL) {
+			unsigned long flags;
 
-	if (mselect_6) {
-		bdl = address[3];
-		offset = 4;
-	} else {
-		bdl = get_unaligned_be16(&address[6]);
-		offset = 8;
+			/* To protect sense setting against blockio data writes */
+			spin_lock_irqsave(&vdev_err_lock, flags);
+			scst_set_busy(cmd);
+			spin_unlock_irqrestore(&vdev_err_lock, flags);
+			res = -ENOMEM;
+			goto out;
+		}
 	}
+	max_iv_count = p->iv_count;
 
-	if (bdl == 8)
-		offset += 8;
-	else if (bdl != 0) {
-		PRINT_ERROR("%s", "MODE SELECT: Wrong parameters list length");
-		scst_set_invalid_field_in_parm_list(cmd, offset-1, 0);
-		goto out_put;
-	}
+	old_fs = get_fs();
+	set_fs(get_ds());
 
-	while (length > offset + 2) {
-		if (address[offset] & PS) {
-			PRINT_ERROR("%s", "MODE SELECT: Illegal PS bit");
-			scst_set_invalid_field_in_parm_list(cmd, offset,
-				SCST_INVAL_FIELD_BIT_OFFS_VALID | 7);
-			goto out_put;
+	tags_sg = NULL;
+	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
+	while (1) {
+		iv_count = 0;
+		full_len = 0;
+		i = -1;
+		address = scst_get_dif_buf(cmd, &tags_sg, &l);
+		length = l;
+		EXTRACHECKS_BUG_ON(length <= 0);
+		while (1) {
+			full_len += length;
+			i++;
+			iv_count++;
+			iv[i].iov_base = (uint8_t __force __user *)address;
+			iv[i].iov_len = length;
+			tags_num -= length >> SCST_DIF_TAG_SHIFT;
+			EXTRACHECKS_BUG_ON(tags_num < 0);
+			if ((iv_count == max_iv_count) || (tags_num == 0))
+				break;
+			address = scst_get_dif_buf(cmd, &tags_sg, &l);
+			length = l;
+			EXTRACHECKS_BUG_ON(length <= 0);
 		}
-		if (((address[offset] & 0x3f) == 0x8) && (type != TYPE_ROM)) {
-			/* Caching page */
-			if (address[offset + 1] != 18) {
-				PRINT_ERROR("%s", "MODE SELECT: Invalid "
-					"caching page request");
-				scst_set_invalid_field_in_parm_list(cmd, offset+1, 0);
-				goto out_put;
+		if (tags_num == 0)
+			finished = true;
+
+		eiv = iv;
+		eiv_count = iv_count;
+restart:
+		TRACE_DBG("Writing DIF: eiv_count %d, full_len %zd", eiv_count, full_len);
+
+		/* WRITE */
+		err = vfs_writev(fd, (struct iovec __force __user *)eiv,
+				 eiv_count, &loff, 0);
+		if (err < 0) {
+			unsigned long flags;
+
+			PRINT_ERROR("DIF write() returned %lld from %zd",
+				    err, full_len);
+			/* To protect sense setting with blockio */
+			spin_lock_irqsave(&vdev_err_lock, flags);
+			if (err == -EAGAIN)
+				scst_set_busy(cmd);
+			else {
+				scst_set_cmd_error(cmd,
+				    SCST_LOAD_SENSE(scst_sense_write_error));
 			}
-			vdisk_caching_m_pg_select(&address[offset], virt_dev,
-				cmd, cmd->cdb[1] & SP, cmd->tgt_dev->tgt_dev_rd_only);
-			break;
-		} else if ((address[offset] & 0x3f) == 0xA) {
-			/* Control page */
-			if (address[offset + 1] != 0xA) {
-				PRINT_ERROR("%s", "MODE SELECT: Invalid "
-					"control page request");
-				scst_set_invalid_field_in_parm_list(cmd, offset+1, 0);
-				goto out_put;
+			spin_unlock_irqrestore(&vdev_err_lock, flags);
+			res = err;
+			goto out_set_fs;
+		} else if (err < full_len) {
+			/*
+			 * Probably that's wrong, but sometimes write() returns
+			 * value less, than requested. Let's restart.
+			 */
+			int e = eiv_count;
+
+			TRACE_MGMT_DBG("DIF write() returned %d from %zd "
+				"(iv_count=%d)", (int)err, full_len,
+				eiv_count);
+			if (err == 0) {
+				PRINT_INFO("Suspicious: DIF write() returned 0 from "
+					"%zd (iv_count=%d)", full_len, eiv_count);
 			}
-			vdisk_ctrl_m_pg_select(&address[offset], virt_dev, cmd,
-				cmd->cdb[1] & SP, offset);
-		} else {
-			TRACE(TRACE_MINOR, "MODE SELECT: Invalid request %x",
-				address[offset] & 0x3f);
-			scst_set_invalid_field_in_parm_list(cmd, offset,
-				SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
-			goto out_put;
+			full_len -= err;
+			for (i = 0; i < e; i++) {
+				if ((long long)eiv->iov_len < err) {
+					err -= eiv->iov_len;
+					eiv++;
+					eiv_count--;
+				} else {
+					eiv->iov_base =
+					    (uint8_t __force __user *)eiv->iov_base + err;
+					eiv->iov_len -= err;
+					break;
+				}
+			}
+			goto restart;
 		}
-		offset += address[offset + 1];
+
+		for (i = 0; i < iv_count; i++)
+			scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+
+		if (finished)
+			break;
 	}
 
-out_put:
-	scst_put_buf_full(cmd, address);
+	set_fs(old_fs);
 
 out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_set_fs:
+	set_fs(old_fs);
+	for (i = 0; i < iv_count; i++)
+		scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+	goto out;
 }
 
-static enum compl_status_e vdisk_exec_log(struct vdisk_cmd_params *p)
+/* Returns the cached unit with the lowest index >= @idx or NULL */
+static struct vdisk_wbc_unit *vdisk_wbc_lookup_ge(struct vdisk_wbc *wbc,
+	uint64_t idx)
 {
-	struct scst_cmd *cmd = p->cmd;
+	struct rb_node *n = wbc->units.rb_node;
+	struct vdisk_wbc_unit *u, *res = NULL;
 
-	TRACE_ENTRY();
+	while (n != NULL) {
+		u = rb_entry(n, struct vdisk_wbc_unit, unit_node);
+		if (idx < u->idx) {
+			res = u;
+			n = n->rb_left;
+		} else if (idx > u->idx)
+			n = n->rb_right;
+		else
+			return u;
+	}
+	return res;
+}
 
-	/* No log pages are supported */
-	scst_set_invalid_field_in_cdb(cmd, 2, SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+static inline struct vdisk_wbc_unit *vdisk_wbc_lookup(struct vdisk_wbc *wbc,
+	uint64_t idx)
+{
+	struct vdisk_wbc_unit *u = vdisk_wbc_lookup_ge(wbc, idx);
 
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	return ((u != NULL) && (u->idx == idx)) ? u : NULL;
 }
 
-static enum compl_status_e vdisk_exec_read_capacity(struct vdisk_cmd_params *p)
+static inline struct vdisk_wbc_unit *vdisk_wbc_next(struct vdisk_wbc_unit *u)
 {
-	struct scst_cmd *cmd = p->cmd;
-	int32_t length;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev;
-	uint32_t blocksize;
-	uint64_t nblocks;
-	uint8_t buffer[8];
-
-	TRACE_ENTRY();
+	struct rb_node *n = rb_next(&u->unit_node);
 
-	virt_dev = cmd->dev->dh_priv;
-	blocksize = cmd->dev->block_size;
-	nblocks = virt_dev->nblocks;
+	return (n != NULL) ? rb_entry(n, struct vdisk_wbc_unit, unit_node) : NULL;
+}
 
-	if ((cmd->cdb[8] & 1) == 0) {
-		uint32_t lba = get_unaligned_be32(&cmd->cdb[2]);
+static void vdisk_wbc_insert(struct vdisk_wbc *wbc, struct vdisk_wbc_unit *unit)
+{
+	struct rb_node **p = &wbc->units.rb_node, *parent = NULL;
+	struct vdisk_wbc_unit *u;
 
-		if (lba != 0) {
-			TRACE_DBG("PMI zero and LBA not zero (cmd %p)", cmd);
-			scst_set_invalid_field_in_cdb(cmd, 2, 0);
-			goto out;
-		}
+	while (*p != NULL) {
+		parent = *p;
+		u = rb_entry(parent, struct vdisk_wbc_unit, unit_node);
+		if (unit->idx < u->idx)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
 	}
+	rb_link_node(&unit->unit_node, parent, p);
+	rb_insert_color(&unit->unit_node, &wbc->units);
+	return;
+}
 
-	memset(buffer, 0, sizeof(buffer));
-
-	/* Last block on the virt_dev is (nblocks-1) */
-#if 0 /* we don't need this workaround anymore */
-	/*
-	 * If we are thinly provisioned, we must ensure that the initiator
-	 * issues a READ_CAPACITY(16) so we can return the LBPME bit. By
-	 * returning 0xFFFFFFFF we do that.
-	 */
-	put_unaligned_be32(nblocks >> 32 || virt_dev->thin_provisioned ?
-			   0xffffffffU : nblocks - 1, &buffer[0]);
-#else
-	put_unaligned_be32((nblocks >> 32) ? 0xffffffffU : nblocks - 1, &buffer[0]);
-#endif
-
-	put_unaligned_be32(blocksize, &buffer[4]);
+static struct vdisk_wbc_unit *vdisk_wbc_alloc_unit(uint64_t idx)
+{
+	struct vdisk_wbc_unit *u;
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
+	u = kzalloc(sizeof(*u), GFP_KERNEL);
+	if (u == NULL)
 		goto out;
 
-	length = min_t(int, length, sizeof(buffer));
-
-	memcpy(address, buffer, length);
-
-	scst_put_buf_full(cmd, address);
+	u->page = alloc_page(GFP_KERNEL);
+	if (u->page == NULL) {
+		kfree(u);
+		u = NULL;
+		goto out;
+	}
 
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
+	INIT_LIST_HEAD(&u->lru_entry);
+	u->idx = idx;
 
 out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	return u;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31)
-/*
- * See also patch "block: Export I/O topology for block devices and partitions"
- * (commit ID c72758f33784).
- */
-static inline unsigned int queue_physical_block_size(struct request_queue *q)
+static void vdisk_wbc_free_unit(struct vdisk_wbc_unit *u)
 {
-	return 4096;
+	__free_page(u->page);
+	kfree(u);
+	return;
 }
-#endif
 
-static enum compl_status_e vdisk_exec_read_capacity16(struct vdisk_cmd_params *p)
+/* wbc_lock supposed to be held */
+static void vdisk_wbc_remove_unit(struct vdisk_wbc *wbc,
+	struct vdisk_wbc_unit *u)
 {
-	struct scst_cmd *cmd = p->cmd;
-	int32_t length;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev;
-	struct block_device *bdev;
-	struct request_queue *q;
-	uint32_t blocksize, physical_blocksize;
-	uint64_t nblocks;
-	uint8_t buffer[32];
+	rb_erase(&u->unit_node, &wbc->units);
+	list_del(&u->lru_entry);
+	wbc->units_cnt--;
+	vdisk_wbc_free_unit(u);
+	return;
+}
 
-	TRACE_ENTRY();
+static inline bool vdisk_wbc_has_room(struct vdisk_wbc *wbc)
+{
+	return (wbc->units_cnt < wbc->units_max) ||
+	       !list_empty(&wbc->clean_lru);
+}
 
-	virt_dev = cmd->dev->dh_priv;
-	bdev = virt_dev->bdev;
-	q = bdev ? bdev_get_queue(bdev) : NULL;
-	blocksize = cmd->dev->block_size;
-	nblocks = virt_dev->nblocks - 1;
+/*
+ * Returns the unit caching @idx, allocating it, if needed, with wbc_lock
+ * held. If the cache is full of dirty data, waits until the destaging
+ * frees some room. Returns ERR_PTR() with wbc_lock released on failure,
+ * -EIO if the room can't be freed, because destaging fails.
+ */
+static struct vdisk_wbc_unit *vdisk_wbc_get_unit(struct vdisk_wbc *wbc,
+	uint64_t idx)
+{
+	struct vdisk_wbc_unit *u, *new = NULL;
 
-	if ((cmd->cdb[14] & 1) == 0) {
-		uint32_t lba = get_unaligned_be32(&cmd->cdb[2]);
+	spin_lock(&wbc->wbc_lock);
+	while ((u = vdisk_wbc_lookup(wbc, idx)) == NULL) {
+		if (new != NULL) {
+			u = new;
+			new = NULL;
+			vdisk_wbc_insert(wbc, u);
+			break;
+		}
 
-		if (lba != 0) {
-			TRACE_DBG("PMI zero and LBA not zero (cmd %p)", cmd);
-			scst_set_invalid_field_in_cdb(cmd, 2, 0);
-			goto out;
+		if (wbc->units_cnt >= wbc->units_max) {
+			if (!list_empty(&wbc->clean_lru)) {
+				vdisk_wbc_remove_unit(wbc,
+					list_first_entry(&wbc->clean_lru,
+						struct vdisk_wbc_unit,
+						lru_entry));
+			} else if (unlikely(wbc->destage_failed)) {
+				spin_unlock(&wbc->wbc_lock);
+				u = ERR_PTR(-EIO);
+				goto out;
+			} else {
+				wbc->full_waits++;
+				spin_unlock(&wbc->wbc_lock);
+				queue_work(vdisk_bg_wq, &wbc->destage_work);
+				wait_event(wbc->wbc_wait,
+					   vdisk_wbc_has_room(wbc) ||
+					   READ_ONCE(wbc->destage_failed));
+				spin_lock(&wbc->wbc_lock);
+				continue;
+			}
 		}
-	}
 
-	memset(buffer, 0, sizeof(buffer));
+		/* Reserve the room for the new unit */
+		wbc->units_cnt++;
+		spin_unlock(&wbc->wbc_lock);
 
-	put_unaligned_be64(nblocks, &buffer[0]);
-	put_unaligned_be32(blocksize, &buffer[8]);
+		new = vdisk_wbc_alloc_unit(idx);
 
-	if (cmd->dev->dev_dif_mode != SCST_DIF_MODE_NONE) {
-		switch (cmd->dev->dev_dif_type) {
-		case 1:
-			buffer[12] = 1;
-			break;
-		case 2:
-			buffer[12] = 3;
-			break;
-		case 3:
-			buffer[12] = 5;
-			break;
-		default:
-			sBUG_ON(1);
-			break;
+		spin_lock(&wbc->wbc_lock);
+		if (new == NULL) {
+			wbc->units_cnt--;
+			spin_unlock(&wbc->wbc_lock);
+			u = ERR_PTR(-ENOMEM);
+			goto out;
 		}
 	}
 
-	/* LOGICAL BLOCKS PER PHYSICAL BLOCK EXPONENT */
-	physical_blocksize = q ? queue_physical_block_size(q) : 4096;
-	buffer[13] = max(ilog2(physical_blocksize) - ilog2(blocksize), 0);
-
-	if (virt_dev->thin_provisioned) {
-		buffer[14] |= 0x80;     /* LBPME */
-		if (virt_dev->discard_zeroes_data)
-			buffer[14] |= 0x40;     /* LBPRZ */
+	if (new != NULL) {
+		/* Somebody else has added it meanwhile */
+		wbc->units_cnt--;
+		vdisk_wbc_free_unit(new);
 	}
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
-		goto out;
+out:
+	return u;
+}
 
-	length = min_t(int, length, sizeof(buffer));
+/* Copies @len bytes of @buf to the cache at offset @off of unit @idx */
+static int vdisk_wbc_write_unit(struct vdisk_wbc *wbc, uint64_t idx,
+	unsigned int off, const void *buf, unsigned int len, int shift)
+{
+	unsigned int first = off >> shift;
+	unsigned int end = ((off + len - 1) >> shift) + 1;
+	struct vdisk_wbc_unit *u;
+	unsigned int dirty_units;
+	bool was_dirty;
 
-	memcpy(address, buffer, length);
+	u = vdisk_wbc_get_unit(wbc, idx);
+	if (IS_ERR(u))
+		return PTR_ERR(u);
 
-	scst_put_buf_full(cmd, address);
+	was_dirty = !bitmap_empty(u->dirty, VDISK_WBC_UNIT_MAX_BLOCKS);
+	if (was_dirty && (find_next_bit(u->dirty, end, first) < end))
+		wbc->write_hits++;
 
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
+	memcpy(page_address(u->page) + off, buf, len);
+	bitmap_set(u->valid, first, end - first);
+	bitmap_set(u->dirty, first, end - first);
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	if (!was_dirty) {
+		list_del_init(&u->lru_entry);
+		wbc->dirty_units++;
+	}
+	dirty_units = wbc->dirty_units;
+
+	spin_unlock(&wbc->wbc_lock);
+
+	if (!was_dirty) {
+		if (dirty_units >= wbc->units_max / 2)
+			queue_work(vdisk_bg_wq, &wbc->destage_work);
+		else
+			queue_delayed_work(vdisk_bg_wq, &wbc->expire_work,
+				VDISK_WBC_EXPIRE);
+	}
+	return 0;
 }
 
-static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p)
+/*
+ * Copies @len bytes at offset @off of unit @idx to @buf. Returns -ENOENT if
+ * any of the blocks isn't cached.
+ */
+static int vdisk_wbc_read_unit(struct vdisk_wbc *wbc, uint64_t idx,
+	unsigned int off, void *buf, unsigned int len, int shift)
 {
-	/* Changing it don't forget to add it to vdisk_opcode_descriptors! */
-	scst_set_invalid_field_in_cdb(p->cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
-	return CMD_SUCCEEDED;
+	unsigned int first = off >> shift;
+	unsigned int end = ((off + len - 1) >> shift) + 1;
+	struct vdisk_wbc_unit *u;
+	int res = -ENOENT;
+
+	spin_lock(&wbc->wbc_lock);
+
+	u = vdisk_wbc_lookup(wbc, idx);
+	if ((u == NULL) || (find_next_zero_bit(u->valid, end, first) < end))
+		goto out_unlock;
+
+	memcpy(buf, page_address(u->page) + off, len);
+
+	if (bitmap_empty(u->dirty, VDISK_WBC_UNIT_MAX_BLOCKS) && !u->writeback)
+		list_move_tail(&u->lru_entry, &wbc->clean_lru);
+	res = 0;
+
+out_unlock:
+	spin_unlock(&wbc->wbc_lock);
+	return res;
 }
 
-/* SPC-4 REPORT TARGET PORT GROUPS command */
-static enum compl_status_e vdisk_exec_report_tpgs(struct vdisk_cmd_params *p)
+/*
+ * Copies data of p->cmd from or to the write-back cache. On -ENOENT, i.e.
+ * if reading and some of the blocks aren't cached, the content of the data
+ * buffer is undefined.
+ */
+static int vdisk_wbc_copy(struct vdisk_cmd_params *p, bool write)
 {
 	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_wbc *wbc = virt_dev->wbc;
+	int shift = cmd->dev->block_shift;
+	loff_t loff = p->loff;
 	uint8_t *address;
-	void *buf;
-	int32_t buf_len;
-	uint32_t data_length, length;
-	uint8_t data_format;
-	int res;
+	ssize_t length, done;
+	unsigned int off, n;
+	int res = 0;
 
-	TRACE_ENTRY();
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		for (done = 0; done < length; done += n, loff += n) {
+			off = loff & ~PAGE_MASK;
+			n = min_t(ssize_t, length - done, PAGE_SIZE - off);
+			if (write)
+				res = vdisk_wbc_write_unit(wbc,
+					loff >> PAGE_SHIFT, off,
+					address + done, n, shift);
+			else
+				res = vdisk_wbc_read_unit(wbc,
+					loff >> PAGE_SHIFT, off,
+					address + done, n, shift);
+			if (res != 0)
+				break;
+		}
+		scst_put_buf(cmd, address);
+		if (res != 0)
+			goto out;
+		length = scst_get_buf_next(cmd, &address);
+	}
 
-	buf_len = scst_get_buf_full_sense(cmd, &address);
-	if (buf_len <= 0)
-		goto out;
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_%s() failed: %zd",
+			(loff == p->loff) ? "first" : "next", length);
+		res = length;
+	}
 
-	dev = cmd->dev;
-	data_format = cmd->cdb[1] >> 5;
+out:
+	return res;
+}
 
-	res = scst_tg_get_group_info(&buf, &data_length, dev, data_format);
-	if (res == -ENOMEM) {
-		scst_set_busy(cmd);
-		goto out_put;
-	} else if (res < 0) {
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
-		goto out_put;
+/*
+ * Moves the dirty blocks of the first dirty unit in [*@first, @last] and of
+ * the following adjacent units, as long as the dirty blocks are contiguous,
+ * into destage_buf and marks the units as in writeback. Returns the number
+ * of units in the run, 0 if there's nothing to destage.
+ *
+ * Both wbc_lock and destage_mutex supposed to be held.
+ */
+static int vdisk_wbc_collect_run(struct vdisk_wbc *wbc, uint64_t *first,
+	uint64_t last, loff_t *loff, size_t *len)
+{
+	int shift = wbc->virt_dev->dev->block_shift;
+	unsigned int nb = PAGE_SIZE >> shift;
+	struct vdisk_wbc_unit *u, *next;
+	unsigned int b, e;
+	size_t l = 0;
+	int n = 0;
+
+	for (u = vdisk_wbc_lookup_ge(wbc, *first); u != NULL;
+	     u = vdisk_wbc_next(u)) {
+		if (u->idx > last)
+			goto out;
+		if (!bitmap_empty(u->dirty, nb))
+			break;
 	}
+	if (u == NULL)
+		goto out;
 
-	length = min_t(uint32_t, data_length, buf_len);
-	memcpy(address, buf, length);
-	kfree(buf);
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
+	b = find_first_bit(u->dirty, nb);
+	*loff = ((loff_t)u->idx << PAGE_SHIFT) + (b << shift);
+	while (1) {
+		e = find_next_zero_bit(u->dirty, nb, b);
+		e = min_t(unsigned int, e,
+			b + ((VDISK_WBC_DESTAGE_SIZE - l) >> shift));
+
+		memcpy(wbc->destage_buf + l, page_address(u->page) + (b << shift),
+			(e - b) << shift);
+		bitmap_clear(u->dirty, b, e - b);
+		if (bitmap_empty(u->dirty, nb))
+			wbc->dirty_units--;
+		u->writeback = 1;
+
+		wbc->run[n].unit = u;
+		wbc->run[n].first = b;
+		wbc->run[n].cnt = e - b;
+		n++;
+		l += (e - b) << shift;
+		*first = u->idx;
+
+		if ((e < nb) || (l == VDISK_WBC_DESTAGE_SIZE))
+			break;
 
-out_put:
-	scst_put_buf_full(cmd, address);
+		next = vdisk_wbc_next(u);
+		if ((next == NULL) || (next->idx != u->idx + 1) ||
+		    (next->idx > last) || !test_bit(0, next->dirty))
+			break;
+		u = next;
+		b = 0;
+	}
+
+	*len = l;
 
 out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	return n;
 }
 
-/* SPC-4 SET TARGET PORT GROUPS command */
-static enum compl_status_e vdisk_exec_set_tpgs(struct vdisk_cmd_params *p)
-{
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-	int res = CMD_SUCCEEDED, rc;
+/*
+ * Writes the first run of dirty blocks of units [*@first, @last] back to the
+ * device and advances *@first. Returns 1 if a run was written, 0 if there's
+ * nothing to destage, or a negative error code. destage_mutex supposed to be
+ * held.
+ */
+static int vdisk_wbc_destage_run(struct vdisk_wbc *wbc, uint64_t *first,
+	uint64_t last, bool fua)
+{
+	struct scst_vdisk_dev *virt_dev = wbc->virt_dev;
+	struct vdisk_wbc_run_part *rp;
+	loff_t loff, start;
+	size_t len;
+	ssize_t rc;
+	int i, n;
+
+	lockdep_assert_held(&wbc->destage_mutex);
+
+	spin_lock(&wbc->wbc_lock);
+	n = vdisk_wbc_collect_run(wbc, first, last, &loff, &len);
+	spin_unlock(&wbc->wbc_lock);
+	if (n == 0)
+		return 0;
+
+	TRACE_DBG("Destaging %zd bytes at %lld (dev %s, fua %d)", len,
+		(long long)loff, virt_dev->name, fua);
+
+	start = loff;
+	if (likely(virt_dev->fd != NULL))
+		rc = vdev_write_sync(virt_dev, wbc->destage_buf, len, &loff,
+			fua);
+	else
+		rc = -ENODEV;
+
+	spin_lock(&wbc->wbc_lock);
+	for (i = 0; i < n; i++) {
+		rp = &wbc->run[i];
+		rp->unit->writeback = 0;
+		if (unlikely(rc < 0)) {
+			/* Keep the data to retry later */
+			if (bitmap_empty(rp->unit->dirty,
+					VDISK_WBC_UNIT_MAX_BLOCKS))
+				wbc->dirty_units++;
+			bitmap_set(rp->unit->dirty, rp->first, rp->cnt);
+		} else if (bitmap_empty(rp->unit->dirty,
+				VDISK_WBC_UNIT_MAX_BLOCKS))
+			list_add_tail(&rp->unit->lru_entry, &wbc->clean_lru);
+	}
+	if (likely(rc >= 0)) {
+		wbc->destage_runs++;
+		wbc->destaged_bytes += len;
+	}
+	wbc->destage_failed = (rc < 0);
+	spin_unlock(&wbc->wbc_lock);
+
+	wake_up_all(&wbc->wbc_wait);
+
+	if (unlikely(rc < 0)) {
+		if (rc != -ENODEV)
+			PRINT_ERROR("Destaging of %zd bytes at %lld failed: "
+				"%zd (dev %s)", len, (long long)start, rc,
+				virt_dev->name);
+		return rc;
+	}
 
-	TRACE_ENTRY();
+	return 1;
+}
 
-	if (!virt_dev->expl_alua) {
-		PRINT_ERROR("SET TARGET PORT GROUPS: not explicit ALUA mode "
-			"(dev %s)", dev->virt_name);
-		/* Invalid opcode, i.e. SA field */
-		scst_set_invalid_field_in_cdb(cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
-		goto out;
-	}
+/*
+ * Writes the dirty blocks of units [@first, @last] back to the device in the
+ * LBA order. destage_mutex supposed to be held.
+ */
+static int __vdisk_wbc_destage(struct vdisk_wbc *wbc, uint64_t first,
+	uint64_t last, bool fua)
+{
+	int res;
 
-	rc = scst_tg_set_group_info(cmd);
-	if (rc == 0)
-		res = RUNNING_ASYNC;
-	else
-		scst_stpg_del_unblock_next(cmd);
+	do {
+		res = vdisk_wbc_destage_run(wbc, &first, last, fua);
+	} while (res > 0);
 
-out:
-	TRACE_EXIT_RES(res);
 	return res;
 }
 
-static enum compl_status_e vdisk_exec_read_toc(struct vdisk_cmd_params *p)
+static int vdisk_wbc_destage_range(struct vdisk_wbc *wbc, uint64_t first,
+	uint64_t last, bool fua)
 {
-	struct scst_cmd *cmd = p->cmd;
-	int32_t length, off = 0;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev;
-	uint32_t nblocks;
-	uint8_t buffer[4+8+8] = { 0x00, 0x0a, 0x01, 0x01, 0x00, 0x14,
-				  0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
-
-	TRACE_ENTRY();
+	int res;
 
-	if (cmd->dev->type != TYPE_ROM) {
-		PRINT_ERROR("%s", "READ TOC for non-CDROM device");
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		goto out;
-	}
+	mutex_lock(&wbc->destage_mutex);
+	res = __vdisk_wbc_destage(wbc, first, last, fua);
+	mutex_unlock(&wbc->destage_mutex);
 
-	if (cmd->cdb[2] & 0x0e/*Format*/) {
-		PRINT_ERROR("%s", "READ TOC: invalid requested data format");
-		scst_set_invalid_field_in_cdb(cmd, 2,
-			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
-		goto out;
-	}
+	return res;
+}
 
-	if ((cmd->cdb[6] != 0 && (cmd->cdb[2] & 0x01)) ||
-	    (cmd->cdb[6] > 1 && cmd->cdb[6] != 0xAA)) {
-		PRINT_ERROR("READ TOC: invalid requested track number %x",
-			cmd->cdb[6]);
-		scst_set_invalid_field_in_cdb(cmd, 6, 0);
-		goto out;
-	}
+/*
+ * Destages and then drops from the cache the blocks in [@loff, @loff + @len)
+ * before they are accessed bypassing the cache. destage_mutex supposed to be
+ * held.
+ */
+static int __vdisk_wbc_invalidate(struct vdisk_wbc *wbc, loff_t loff,
+	loff_t len)
+{
+	int shift = wbc->virt_dev->dev->block_shift;
+	unsigned int nb = PAGE_SIZE >> shift;
+	uint64_t first = loff >> PAGE_SHIFT;
+	uint64_t last = (loff + len - 1) >> PAGE_SHIFT;
+	struct vdisk_wbc_unit *u, *next;
+	loff_t ustart;
+	unsigned int b, e;
+	int res;
 
-	length = scst_get_buf_full_sense(cmd, &address);
-	if (unlikely(length <= 0))
+	res = __vdisk_wbc_destage(wbc, first, last, false);
+	if (res != 0)
 		goto out;
 
-	virt_dev = cmd->dev->dh_priv;
-	/* ToDo when you have > 8TB ROM device. */
-	nblocks = (uint32_t)virt_dev->nblocks;
-
-	/* Header */
-	memset(buffer, 0, sizeof(buffer));
-	buffer[2] = 0x01;    /* First Track/Session */
-	buffer[3] = 0x01;    /* Last Track/Session */
-	off = 4;
-	if (cmd->cdb[6] <= 1) {
-		/* Fistr TOC Track Descriptor */
-		/*
-		 * ADDR    0x10 - Q Sub-channel encodes current position data
-		 * CONTROL 0x04 - Data track, recoreded uninterrupted
-		 */
-		buffer[off+1] = 0x14;
-		/* Track Number */
-		buffer[off+2] = 0x01;
-		off += 8;
-	}
-	if (!(cmd->cdb[2] & 0x01)) {
-		/* Lead-out area TOC Track Descriptor */
-		buffer[off+1] = 0x14;
-		/* Track Number */
-		buffer[off+2] = 0xAA;
-		/* Track Start Address */
-		put_unaligned_be32(nblocks, &buffer[off + 4]);
-		off += 8;
+	spin_lock(&wbc->wbc_lock);
+	for (u = vdisk_wbc_lookup_ge(wbc, first); (u != NULL) && (u->idx <= last);
+	     u = next) {
+		next = vdisk_wbc_next(u);
+		ustart = (loff_t)u->idx << PAGE_SHIFT;
+		b = (loff > ustart) ? (loff - ustart) >> shift : 0;
+		e = min_t(loff_t, nb, (loff + len - ustart) >> shift);
+		/* Dirty blocks here were written after the destaging above */
+		for (; b < e; b++)
+			if (!test_bit(b, u->dirty))
+				clear_bit(b, u->valid);
+		if (bitmap_empty(u->valid, nb))
+			vdisk_wbc_remove_unit(wbc, u);
 	}
+	spin_unlock(&wbc->wbc_lock);
 
-	buffer[1] = off - 2;    /* Data  Length */
+	wake_up_all(&wbc->wbc_wait);
 
-	if (off > length)
-		off = length;
-	memcpy(address, buffer, off);
+out:
+	return res;
+}
+
+/*
+ * Destages all dirty data and empties the cache, e.g. before closing the
+ * device. destage_mutex supposed to be held.
+ */
+static void vdisk_wbc_drop(struct vdisk_wbc *wbc)
+{
+	int rc;
 
-	scst_put_buf_full(cmd, address);
+	rc = __vdisk_wbc_invalidate(wbc, 0, LLONG_MAX);
+	if (rc != 0)
+		PRINT_ERROR("Unable to destage write-back cache of dev %s: %d",
+			wbc->virt_dev->name, rc);
+	return;
+}
 
-	if (off < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, off);
+/* Invalidates the blocks of all UNMAP descriptors of @cmd */
+static int vdisk_wbc_invalidate_unmap(struct vdisk_wbc *wbc,
+	struct scst_cmd *cmd)
+{
+	const struct scst_data_descriptor *pd = cmd->cmd_data_descriptors;
+	int shift = cmd->dev->block_shift;
+	int i, res = 0;
 
-out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	mutex_lock(&wbc->destage_mutex);
+	for (i = 0; (pd != NULL) && (i < cmd->cmd_data_descriptors_cnt); i++) {
+		if (pd[i].sdd_blocks == 0)
+			continue;
+		res = __vdisk_wbc_invalidate(wbc, pd[i].sdd_lba << shift,
+			pd[i].sdd_blocks << shift);
+		if (res != 0)
+			break;
+	}
+	mutex_unlock(&wbc->destage_mutex);
+
+	return res;
 }
 
-static enum compl_status_e vdisk_exec_prevent_allow_medium_removal(struct vdisk_cmd_params *p)
+/*
+ * Keeps the cache coherent with commands accessing the device bypassing it,
+ * like COMPARE AND WRITE, WRITE SAME, UNMAP or VERIFY. Only the blocks the
+ * command accesses are destaged and dropped, the whole cache only for
+ * commands without an LBA range, like FORMAT UNIT. Returns false if the
+ * command failed.
+ */
+static bool vdisk_wbc_check_cmd(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
 	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_wbc *wbc = virt_dev->wbc;
+	loff_t loff = 0, len = LLONG_MAX;
+	int rc;
 
-	TRACE_DBG("PERSIST/PREVENT 0x%02x", cmd->cdb[4]);
+	switch (cmd->cdb[0]) {
+	case VARIABLE_LENGTH_CMD:
+		if (cmd->cdb[9] != SUBCODE_VERIFY_32)
+			goto write_medium;
+		/* else go through */
+	case VERIFY:
+	case VERIFY_12:
+	case VERIFY_16:
+		/* Reads the device, so it only needs the dirty data destaged */
+		len = scst_cmd_get_data_len(cmd);
+		if (len <= 0)
+			return true;
+		rc = vdisk_wbc_destage_range(wbc, p->loff >> PAGE_SHIFT,
+			(p->loff + len - 1) >> PAGE_SHIFT, false);
+		goto out_check;
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+		/* Go through the cache */
+		return true;
+	case COMPARE_AND_WRITE:
+		loff = p->loff;
+		len = scst_cmd_get_data_len(cmd);
+		break;
+	case UNMAP:
+		rc = vdisk_wbc_invalidate_unmap(wbc, cmd);
+		goto out_check;
+	default:
+write_medium:
+		if (!(cmd->op_flags & SCST_WRITE_MEDIUM))
+			return true;
+		/* Like WRITE SAME, data_len is the length of the LBA range */
+		if ((cmd->op_flags & (SCST_TRANSFER_LEN_TYPE_FIXED |
+				      SCST_LBA_NOT_VALID)) ==
+		    SCST_TRANSFER_LEN_TYPE_FIXED) {
+			loff = scst_cmd_get_lba(cmd) << cmd->dev->block_shift;
+			len = scst_cmd_get_data_len(cmd);
+		}
+		break;
+	}
 
-	spin_lock(&virt_dev->flags_lock);
-	virt_dev->prevent_allow_medium_removal = cmd->cdb[4] & 0x01 ? 1 : 0;
-	spin_unlock(&virt_dev->flags_lock);
+	if (len <= 0)
+		return true;
 
-	return CMD_SUCCEEDED;
+	mutex_lock(&wbc->destage_mutex);
+	rc = __vdisk_wbc_invalidate(wbc, loff, len);
+	mutex_unlock(&wbc->destage_mutex);
+
+out_check:
+	if (unlikely(rc != 0)) {
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_write_error));
+		return false;
+	}
+	return true;
 }
 
-static int __vdisk_fsync_fileio(loff_t loff,
-	loff_t len, struct scst_device *dev, struct scst_cmd *cmd,
-	struct file *file)
+/*
+ * Returns true if p->cmd has been served from the cache, otherwise the
+ * caller should read the data from the device.
+ */
+static bool vdisk_wbc_read(struct vdisk_cmd_params *p)
 {
-	int res;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_wbc *wbc = virt_dev->wbc;
+	int64_t data_len = scst_cmd_get_data_len(cmd);
+	uint64_t first = p->loff >> PAGE_SHIFT;
+	uint64_t last = (p->loff + data_len - 1) >> PAGE_SHIFT;
+	struct vdisk_wbc_unit *u;
+	bool busy = false;
+	int rc;
 
-	TRACE_ENTRY();
+	if (data_len <= 0)
+		return false;
 
-	/**
-	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
-	 ** anything without checking for NULL at first !!!
-	 **/
+	rc = vdisk_wbc_copy(p, false);
+	if (rc == 0) {
+		spin_lock(&wbc->wbc_lock);
+		wbc->read_hits++;
+		spin_unlock(&wbc->wbc_lock);
+		return true;
+	} else if (unlikely(rc != -ENOENT)) {
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_internal_failure));
+		return true;
+	}
 
-	/* BLOCKIO can be here for DIF tags fsync */
+	/* The device must not be read under not yet destaged data */
+	spin_lock(&wbc->wbc_lock);
+	wbc->read_misses++;
+	for (u = vdisk_wbc_lookup_ge(wbc, first); (u != NULL) && (u->idx <= last);
+	     u = vdisk_wbc_next(u)) {
+		if (u->writeback ||
+		    !bitmap_empty(u->dirty, VDISK_WBC_UNIT_MAX_BLOCKS)) {
+			busy = true;
+			break;
+		}
+	}
+	spin_unlock(&wbc->wbc_lock);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 32)
-	res = sync_page_range(file_inode(file), file->f_mapping, loff, len);
-#else
-#if 0	/* For sparse files we might need to sync metadata as well */
-	res = generic_write_sync(file, loff, len);
-#else
-	res = filemap_write_and_wait_range(file->f_mapping, loff, len);
-#endif
-#endif
-	if (unlikely(res != 0)) {
-		PRINT_ERROR("sync range failed (%d)", res);
-		if (cmd != NULL) {
-			if (res == -ENOMEM)
-				scst_set_busy(cmd);
-			else
-				scst_set_cmd_error(cmd,
-					SCST_LOAD_SENSE(scst_sense_write_error));
+	if (busy) {
+		rc = vdisk_wbc_destage_range(wbc, first, last, false);
+		if (unlikely(rc != 0)) {
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_read_error));
+			return true;
 		}
 	}
 
-	TRACE_EXIT_RES(res);
-	return res;
+	return false;
 }
 
-static int vdisk_fsync_blockio(loff_t loff,
-	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
-	struct scst_cmd *cmd, bool async)
+static void vdisk_wbc_write(struct vdisk_cmd_params *p, bool fua)
 {
-	int res;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_wbc *wbc = virt_dev->wbc;
+	int64_t data_len = scst_cmd_get_data_len(cmd);
+	int rc;
 
-	TRACE_ENTRY();
+	if (data_len <= 0)
+		return;
 
-	/**
-	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
-	 ** anything without checking for NULL at first !!!
-	 **/
+	rc = vdisk_wbc_copy(p, true);
+	if (unlikely(rc != 0)) {
+		if (rc == -ENOMEM)
+			scst_set_busy(cmd);
+		else if (rc == -EIO)
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_internal_failure));
+		return;
+	}
 
-	EXTRACHECKS_BUG_ON(!virt_dev->blockio);
+	spin_lock(&wbc->wbc_lock);
+	wbc->writes++;
+	spin_unlock(&wbc->wbc_lock);
 
-	/* Must be first, because vdisk_blockio_flush() can call scst_cmd_done()! */
-	if (virt_dev->dif_fd != NULL) {
-		loff = (loff >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
-		len = (len >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
-		res = __vdisk_fsync_fileio(loff, len, dev, cmd,
-			virt_dev->dif_fd);
-		if (unlikely(res != 0))
-			goto out;
+	if (fua) {
+		rc = vdisk_wbc_destage_range(wbc, p->loff >> PAGE_SHIFT,
+			(p->loff + data_len - 1) >> PAGE_SHIFT, true);
+		if (unlikely(rc != 0))
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
 	}
+	return;
+}
 
-	res = vdisk_blockio_flush(virt_dev->bdev, gfp_flags, true,
-		cmd, async);
+/*
+ * Takes destage_mutex per run, so commands destaging their ranges, e.g. on
+ * FUA or SYNCHRONIZE CACHE, don't wait for the whole cache to be destaged.
+ */
+static void vdisk_wbc_background_destage(struct vdisk_wbc *wbc)
+{
+	uint64_t first = 0;
+	int rc;
 
-out:
-	TRACE_EXIT_RES(res);
-	return res;
+	do {
+		mutex_lock(&wbc->destage_mutex);
+		rc = vdisk_wbc_destage_run(wbc, &first, ULLONG_MAX, false);
+		mutex_unlock(&wbc->destage_mutex);
+		cond_resched();
+	} while (rc > 0);
+
+	/* Retry later. The device reopen will restart it, if it's closed. */
+	if ((rc != -ENODEV) && (READ_ONCE(wbc->dirty_units) != 0))
+		queue_delayed_work(vdisk_bg_wq, &wbc->expire_work,
+			VDISK_WBC_EXPIRE);
+	return;
 }
 
-static int vdisk_fsync_fileio(loff_t loff,
-	loff_t len, struct scst_device *dev, struct scst_cmd *cmd, bool async)
+static void vdisk_wbc_destage_work_fn(struct work_struct *work)
 {
-	int res;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	vdisk_wbc_background_destage(container_of(work, struct vdisk_wbc,
+						  destage_work));
+}
 
-	TRACE_ENTRY();
+static void vdisk_wbc_expire_work_fn(struct work_struct *work)
+{
+	vdisk_wbc_background_destage(container_of(work, struct vdisk_wbc,
+						  expire_work.work));
+}
 
-	/**
-	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
-	 ** anything without checking for NULL at first !!!
-	 **/
+static int vdisk_wbc_create(struct scst_vdisk_dev *virt_dev)
+{
+	struct vdisk_wbc *wbc;
+	int res = -ENOMEM;
 
-	res = __vdisk_fsync_fileio(loff, len, dev, cmd, virt_dev->fd);
-	if (unlikely(res != 0))
-		goto done;
+	TRACE_ENTRY();
 
-	if (virt_dev->dif_fd != NULL) {
-		loff = (loff >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
-		len = (len >> dev->block_shift) << SCST_DIF_TAG_SHIFT;
-		res = __vdisk_fsync_fileio(loff, len, dev, cmd,
-			virt_dev->dif_fd);
+	if (virt_dev->dif_mode != SCST_DIF_MODE_NONE) {
+		PRINT_ERROR("Write-back cache is not supported with DIF "
+			"(dev %s)", virt_dev->name);
+		res = -EINVAL;
+		goto out;
 	}
 
-done:
-	if (async) {
-		if (cmd != NULL) {
-			cmd->completed = 1;
-			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
-				scst_estimate_context());
-		}
-	}
+	wbc = kzalloc(sizeof(*wbc), GFP_KERNEL);
+	if (wbc == NULL)
+		goto out;
+
+	wbc->destage_buf = vmalloc(VDISK_WBC_DESTAGE_SIZE);
+	if (wbc->destage_buf == NULL)
+		goto out_free;
+
+	wbc->run = kcalloc(VDISK_WBC_DESTAGE_SIZE / PAGE_SIZE + 1,
+		sizeof(*wbc->run), GFP_KERNEL);
+	if (wbc->run == NULL)
+		goto out_free_buf;
+
+	wbc->virt_dev = virt_dev;
+	spin_lock_init(&wbc->wbc_lock);
+	wbc->units = RB_ROOT;
+	INIT_LIST_HEAD(&wbc->clean_lru);
+	wbc->units_max = virt_dev->wbc_size_mb << (20 - PAGE_SHIFT);
+	init_waitqueue_head(&wbc->wbc_wait);
+	mutex_init(&wbc->destage_mutex);
+	INIT_WORK(&wbc->destage_work, vdisk_wbc_destage_work_fn);
+	INIT_DELAYED_WORK(&wbc->expire_work, vdisk_wbc_expire_work_fn);
+
+	virt_dev->wbc = wbc;
+	res = 0;
 
+out:
 	TRACE_EXIT_RES(res);
 	return res;
+
+out_free_buf:
+	vfree(wbc->destage_buf);
+
+out_free:
+	kfree(wbc);
+	goto out;
 }
 
-static int vdisk_fsync(loff_t loff,
-	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
-	struct scst_cmd *cmd, bool async)
+static void vdisk_wbc_destroy(struct scst_vdisk_dev *virt_dev)
 {
-	int res = 0;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	struct vdisk_wbc *wbc = virt_dev->wbc;
+	struct vdisk_wbc_unit *u;
+	struct rb_node *n;
 
 	TRACE_ENTRY();
 
-	/**
-	 ** !!! CAUTION !!!: cmd can be NULL here! Don't use it for
-	 ** anything without checking for NULL at first !!!
-	 **/
+	cancel_work_sync(&wbc->destage_work);
+	cancel_delayed_work_sync(&wbc->expire_work);
 
-	/* It should be generated by compiler as a single comparison */
-	if (virt_dev->nv_cache || virt_dev->wt_flag ||
-	    virt_dev->o_direct_flag || virt_dev->nullio) {
-		if (async) {
-			cmd->completed = 1;
-			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
-				scst_estimate_context());
-		}
-		goto out;
+	if (wbc->dirty_units != 0)
+		PRINT_WARNING("Dropping %u not destaged write-back cache "
+			"units (dev %s)", wbc->dirty_units, virt_dev->name);
+
+	while ((n = rb_first(&wbc->units)) != NULL) {
+		u = rb_entry(n, struct vdisk_wbc_unit, unit_node);
+		rb_erase(n, &wbc->units);
+		vdisk_wbc_free_unit(u);
 	}
 
-	if (virt_dev->nullio)
-		;
-	else if (virt_dev->blockio)
-		res = vdisk_fsync_blockio(loff, len, dev, gfp_flags, cmd, async);
-	else
-		res = vdisk_fsync_fileio(loff, len, dev, cmd, async);
+	kfree(wbc->run);
+	vfree(wbc->destage_buf);
+	kfree(wbc);
+	virt_dev->wbc = NULL;
 
-out:
-	TRACE_EXIT_RES(res);
-	return res;
+	TRACE_EXIT();
+	return;
 }
 
-static struct iovec *vdisk_alloc_iv(struct scst_cmd *cmd,
-				    struct vdisk_cmd_params *p)
+/* ra_lock supposed to be held */
+static void vdisk_ra_put_slot(struct vdisk_ra_slot *slot)
 {
-	int iv_count;
-
-	iv_count = min_t(int, scst_get_buf_count(cmd), UIO_MAXIOV);
-	if (iv_count > p->iv_count) {
-		if (p->iv != p->small_iv)
-			kfree(p->iv);
-		p->iv_count = 0;
-		/* It can't be called in atomic context */
-		p->iv = (iv_count <= ARRAY_SIZE(p->small_iv)) ? p->small_iv :
-			kmalloc_array(iv_count, sizeof(*p->iv),
-				      cmd->cmd_gfp_mask);
-		if (p->iv == NULL) {
-			PRINT_ERROR("Unable to allocate iv (%d)", iv_count);
-			goto out;
-		}
-		p->iv_count = iv_count;
+	slot->refcnt--;
+	if (slot->stale && (slot->refcnt == 0) &&
+	    (slot->state != VDISK_RA_READING)) {
+		slot->state = VDISK_RA_EMPTY;
+		slot->stale = 0;
 	}
+	return;
+}
 
-out:
-	return p->iv;
+/* Drops prefetched data overlapping [@loff, @loff + @len) */
+static void vdisk_ra_invalidate(struct vdisk_ra *ra, loff_t loff, loff_t len)
+{
+	struct vdisk_ra_slot *slot;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ra->ra_lock, flags);
+	for (i = 0; i < VDISK_RA_SLOTS; i++) {
+		slot = &ra->slots[i];
+		if ((slot->state == VDISK_RA_EMPTY) ||
+		    (slot->loff >= loff + len) || (loff >= slot->loff + slot->len))
+			continue;
+		if ((slot->state == VDISK_RA_READING) || (slot->refcnt != 0))
+			slot->stale = 1;
+		else
+			slot->state = VDISK_RA_EMPTY;
+	}
+	spin_unlock_irqrestore(&ra->ra_lock, flags);
+	return;
 }
 
-static enum compl_status_e nullio_exec_read(struct vdisk_cmd_params *p)
+/*
+ * Drops prefetched data overwritten by @cmd. Called both before and after
+ * the data are written, so a prefetch racing with the writing can't leave
+ * stale data behind. Can be called on IRQ context.
+ */
+static void vdisk_ra_invalidate_cmd(struct scst_cmd *cmd)
 {
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	loff_t loff = 0, len = LLONG_MAX;
+
+	switch (cmd->cdb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+	case COMPARE_AND_WRITE:
+		loff = scst_cmd_get_lba(cmd) << cmd->dev->block_shift;
+		len = scst_cmd_get_data_len(cmd);
+		break;
+	}
+
+	vdisk_ra_invalidate(virt_dev->ra, loff, len);
+	return;
+}
 
-	TRACE_ENTRY();
+static void vdisk_ra_work_fn(struct work_struct *work)
+{
+	struct vdisk_ra_slot *slot = container_of(work, struct vdisk_ra_slot,
+						  ra_work);
+	struct vdisk_ra *ra = slot->ra;
+	struct scst_vdisk_dev *virt_dev = ra->virt_dev;
+	loff_t loff = slot->loff;
+	unsigned long flags;
+	ssize_t rc = 0;
 
-	if (virt_dev->read_zero) {
-		struct scatterlist *sge;
-		struct page *page;
-		int i;
-		void *p;
+	TRACE_DBG("Prefetching %zd bytes at %lld (dev %s)", slot->len,
+		(long long)loff, virt_dev->name);
 
-		for_each_sg(cmd->sg, sge, cmd->sg_cnt, i) {
-			page = sg_page(sge);
-			p = kmap(page);
-			if (sge->offset == 0 && sge->length == PAGE_SIZE)
-				clear_page(p);
-			else
-				memset(p + sge->offset, 0, sge->length);
-			kunmap(page);
-		}
+	/* The device must not be read under not yet destaged data */
+	if (virt_dev->wbc != NULL)
+		rc = vdisk_wbc_destage_range(virt_dev->wbc,
+			loff >> PAGE_SHIFT, (loff + slot->len - 1) >> PAGE_SHIFT,
+			false);
+	if (rc == 0) {
+		if (likely(virt_dev->fd != NULL))
+			rc = vdev_read_sync(virt_dev, slot->buf, slot->len, &loff);
+		else
+			rc = -ENODEV;
 	}
 
-	scst_dif_process_read(p->cmd);
+	spin_lock_irqsave(&ra->ra_lock, flags);
+	if ((rc != (ssize_t)slot->len) || slot->stale) {
+		TRACE_DBG("Prefetch at %lld failed (rc %zd, stale %d)",
+			(long long)slot->loff, rc, slot->stale);
+		slot->state = VDISK_RA_EMPTY;
+		slot->stale = 0;
+	} else {
+		slot->state = VDISK_RA_VALID;
+		ra->prefetched_bytes += slot->len;
+	}
+	slot->last_used = jiffies;
+	spin_unlock_irqrestore(&ra->ra_lock, flags);
 
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	wake_up_all(&ra->ra_wait);
+	return;
 }
 
-static int vdev_read_dif_tags(struct vdisk_cmd_params *p)
+/* Returns a slot to prefetch into or NULL. ra_lock supposed to be held. */
+static struct vdisk_ra_slot *vdisk_ra_get_free_slot(struct vdisk_ra *ra)
 {
-	int res = 0;
-	struct scst_cmd *cmd = p->cmd;
-	loff_t loff;
-	mm_segment_t old_fs;
-	loff_t err = 0;
-	ssize_t length, full_len;
-	uint8_t *address;
-	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	struct file *fd = virt_dev->dif_fd;
-	struct iovec *iv;
-	int iv_count, max_iv_count, i;
-	bool finished = false;
-	int tags_num, l;
-	struct scatterlist *tags_sg;
+	struct vdisk_ra_slot *slot, *res = NULL;
+	int i;
 
-	TRACE_ENTRY();
+	for (i = 0; i < VDISK_RA_SLOTS; i++) {
+		slot = &ra->slots[i];
+		if ((slot->refcnt != 0) || (slot->state == VDISK_RA_READING))
+			continue;
+		if (slot->state == VDISK_RA_EMPTY)
+			return slot;
+		if ((res == NULL) || time_before(slot->last_used, res->last_used))
+			res = slot;
+	}
+	return res;
+}
 
-	/*
-	 * !! Data for this cmd can be read simultaneously !!
-	 */
+/*
+ * Updates the sequential stream of @tgt_dev the READ [@loff, @loff + @len)
+ * belongs to and returns the slot to prefetch into, if it's time to start
+ * the next read-ahead window of the stream. ra_lock supposed to be held.
+ */
+static struct vdisk_ra_slot *vdisk_ra_detect(struct vdisk_ra *ra,
+	struct vdisk_ra_tgt_dev *ra_tgt_dev, loff_t loff, loff_t len)
+{
+	struct vdisk_ra_stream *s = NULL, *st;
+	struct vdisk_ra_slot *slot = NULL;
+	loff_t file_size = ra->virt_dev->file_size;
+	int i;
 
-	EXTRACHECKS_BUG_ON(virt_dev->nullio);
+	for (i = 0; i < VDISK_RA_STREAMS; i++) {
+		st = &ra_tgt_dev->streams[i];
+		if ((st->seq_cnt != 0) && (st->next_loff == loff)) {
+			s = st;
+			break;
+		}
+		if ((s == NULL) || time_before(st->last_used, s->last_used))
+			s = st;
+	}
 
-#if 0 /* no zero-copy (yet) */
-	if (p->use_zero_copy)
+	if (s->next_loff == loff)
+		s->seq_cnt++;
+	else {
+		s->seq_cnt = 1;
+		s->ra_loff = 0;
+	}
+	s->next_loff = loff + len;
+	s->last_used = jiffies;
+
+	if (s->seq_cnt < VDISK_RA_SEQ_MIN)
 		goto out;
-#endif
+	if (s->seq_cnt == VDISK_RA_SEQ_MIN)
+		ra->streams++;
 
-	EXTRACHECKS_BUG_ON(!(cmd->dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) ||
-	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) == SCST_DIF_ACTION_NONE));
+	if (s->ra_loff < s->next_loff)
+		s->ra_loff = s->next_loff;
 
-	tags_num = (cmd->bufflen >> cmd->dev->block_shift);
-	if (unlikely(tags_num == 0))
+	/* Keep up to two windows ahead of the stream */
+	if ((s->ra_loff - s->next_loff >= ra->size) || (s->ra_loff >= file_size))
 		goto out;
 
-	iv = p->iv;
-	if (iv == NULL) {
-		iv = vdisk_alloc_iv(cmd, p);
-		if (iv == NULL) {
-			unsigned long flags;
+	slot = vdisk_ra_get_free_slot(ra);
+	if (slot == NULL)
+		goto out;
 
-			/* To protect sense setting against blockio data reads */
-			spin_lock_irqsave(&vdev_err_lock, flags);
-			scst_set_busy(cmd);
-			spin_unlock_irqrestore(&vdev_err_lock, flags);
-			res = -ENOMEM;
-			goto out;
-		}
-	}
-	max_iv_count = p->iv_count;
+	slot->state = VDISK_RA_READING;
+	slot->stale = 0;
+	slot->loff = s->ra_loff;
+	slot->len = min_t(loff_t, ra->size, file_size - s->ra_loff);
+	s->ra_loff += slot->len;
+	ra->prefetches++;
 
-	old_fs = get_fs();
-	set_fs(get_ds());
+out:
+	return slot;
+}
 
-	tags_sg = NULL;
-	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
-	while (1) {
-		iv_count = 0;
-		full_len = 0;
-		i = -1;
-		address = scst_get_dif_buf(cmd, &tags_sg, &l);
-		length = l;
-		EXTRACHECKS_BUG_ON(length <= 0);
-		while (1) {
-			full_len += length;
-			i++;
-			iv_count++;
-			iv[i].iov_base = (uint8_t __force __user *)address;
-			iv[i].iov_len = length;
-			tags_num -= length >> SCST_DIF_TAG_SHIFT;
-			EXTRACHECKS_BUG_ON(tags_num < 0);
-			if ((iv_count == max_iv_count) || (tags_num == 0))
+/*
+ * Stores in @slots, in the offsets order, the slots holding [@loff,
+ * @loff + @len), which can span several adjacent windows, and references
+ * them. Returns their number or 0, if a part of the range isn't prefetched.
+ * @slots must have room for VDISK_RA_SLOTS entries. ra_lock supposed to be
+ * held.
+ */
+static int vdisk_ra_lookup(struct vdisk_ra *ra, loff_t loff, loff_t len,
+	struct vdisk_ra_slot **slots)
+{
+	struct vdisk_ra_slot *slot;
+	int i, n = 0;
+
+	/* Each found slot ends above loff, so none of them is found twice */
+	while (len > 0) {
+		for (i = 0; i < VDISK_RA_SLOTS; i++) {
+			slot = &ra->slots[i];
+			if ((slot->state != VDISK_RA_EMPTY) && !slot->stale &&
+			    (loff >= slot->loff) &&
+			    (loff < slot->loff + slot->len))
 				break;
-			address = scst_get_dif_buf(cmd, &tags_sg, &l);
-			length = l;
-			EXTRACHECKS_BUG_ON(length <= 0);
 		}
-		if (tags_num == 0)
-			finished = true;
+		if (i == VDISK_RA_SLOTS)
+			return 0;
+		slots[n++] = slot;
+		len -= slot->loff + slot->len - loff;
+		loff = slot->loff + slot->len;
+	}
 
-		TRACE_DBG("Reading DIF iv_count %d, full_len %zd, loff %lld",
-			iv_count, full_len, (long long)loff);
+	for (i = 0; i < n; i++)
+		slots[i]->refcnt++;
+	return n;
+}
 
-		/* READ */
-		err = vfs_readv(fd, (struct iovec __force __user *)iv, iv_count,
-				&loff, 0);
-		if ((err < 0) || (err < full_len)) {
-			unsigned long flags;
+/* ra_lock supposed to be held */
+static void vdisk_ra_put_slots(struct vdisk_ra_slot **slots, int n)
+{
+	int i;
 
-			PRINT_ERROR("DIF readv() returned %lld from %zd "
-				"(offs %lld, dev %s)", (long long)err,
-				full_len, (long long)loff, cmd->dev->virt_name);
-			/* To protect sense setting with blockio */
-			spin_lock_irqsave(&vdev_err_lock, flags);
-			if (err == -EAGAIN)
-				scst_set_busy(cmd);
-			else {
-				scst_set_cmd_error(cmd,
-				    SCST_LOAD_SENSE(scst_sense_read_error));
-			}
-			spin_unlock_irqrestore(&vdev_err_lock, flags);
-			res = err;
-			goto out_set_fs;
-		}
+	for (i = 0; i < n; i++)
+		vdisk_ra_put_slot(slots[i]);
+	return;
+}
 
-		for (i = 0; i < iv_count; i++)
-			scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+/* Copies the data of @cmd at @loff from @slots found by vdisk_ra_lookup() */
+static int vdisk_ra_copy(struct scst_cmd *cmd, struct vdisk_ra_slot **slots,
+	loff_t loff)
+{
+	struct vdisk_ra_slot *slot = *slots;
+	uint8_t *address;
+	int length, offs, l;
 
-		if (finished)
-			break;
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		for (offs = 0; offs < length; offs += l) {
+			if (loff == slot->loff + slot->len)
+				slot = *++slots;
+			l = min_t(loff_t, length - offs,
+				  slot->loff + slot->len - loff);
+			memcpy(address + offs, slot->buf + (loff - slot->loff),
+			       l);
+			loff += l;
+		}
+		scst_put_buf(cmd, address);
+		length = scst_get_buf_next(cmd, &address);
 	}
 
-	set_fs(old_fs);
-
-out:
-	TRACE_EXIT_RES(res);
-	return res;
-
-out_set_fs:
-	set_fs(old_fs);
-	for (i = 0; i < iv_count; i++)
-		scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
-	goto out;
+	if (unlikely(length < 0)) {
+		PRINT_ERROR("scst_get_buf_*() failed: %d", length);
+		return length;
+	}
+	return 0;
 }
 
-static int vdev_write_dif_tags(struct vdisk_cmd_params *p)
+/*
+ * Returns true if p->cmd has been served from the prefetched data, otherwise
+ * the caller should read the data from the device. Also starts read-ahead of
+ * the stream p->cmd belongs to, if needed.
+ */
+static bool vdisk_ra_read(struct vdisk_cmd_params *p)
 {
-	int res = 0;
 	struct scst_cmd *cmd = p->cmd;
-	loff_t loff;
-	mm_segment_t old_fs;
-	loff_t err = 0;
-	ssize_t length, full_len;
-	uint8_t *address;
 	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
-	struct file *fd = virt_dev->dif_fd;
-	struct iovec *iv, *eiv;
-	int iv_count, eiv_count, max_iv_count, i;
-	bool finished = false;
-	int tags_num, l;
-	struct scatterlist *tags_sg;
-
-	TRACE_ENTRY();
-
-	/*
-	 * !! Data for this cmd can be written simultaneously !!
-	 */
-
-	EXTRACHECKS_BUG_ON(virt_dev->nullio);
+	struct vdisk_ra *ra = virt_dev->ra;
+	struct vdisk_ra_tgt_dev *ra_tgt_dev = cmd->tgt_dev->dh_priv;
+	int64_t data_len = scst_cmd_get_data_len(cmd);
+	struct vdisk_ra_slot *slots[VDISK_RA_SLOTS], *pf = NULL;
+	bool res = false, waited = false;
+	int i, n, rc;
 
-#if 0 /* no zero-copy (yet) */
-	if (p->use_zero_copy)
+	if (data_len <= 0)
 		goto out;
-#endif
 
-	EXTRACHECKS_BUG_ON(!(cmd->dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) ||
-	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) == SCST_DIF_ACTION_NONE));
+	spin_lock_irq(&ra->ra_lock);
+	if (ra_tgt_dev != NULL)
+		pf = vdisk_ra_detect(ra, ra_tgt_dev, p->loff, data_len);
+	n = vdisk_ra_lookup(ra, p->loff, data_len, slots);
+	spin_unlock_irq(&ra->ra_lock);
 
-	tags_num = (cmd->bufflen >> cmd->dev->block_shift);
-	if (unlikely(tags_num == 0))
-		goto out;
+	if (pf != NULL)
+		queue_work(vdisk_bg_wq, &pf->ra_work);
 
-	iv = p->iv;
-	if (iv == NULL) {
-		iv = vdisk_alloc_iv(cmd, p);
-		if (iv == NULL) {
-			unsigned long flags;
+	if (n == 0)
+		goto out_miss;
 
-			/* To protect sense setting against blockio data writes */
-			spin_lock_irqsave(&vdev_err_lock, flags);
-			scst_set_busy(cmd);
-			spin_unlock_irqrestore(&vdev_err_lock, flags);
-			res = -ENOMEM;
-			goto out;
+	for (i = 0; i < n; i++) {
+		if (slots[i]->state != VDISK_RA_READING)
+			continue;
+		if (!waited) {
+			spin_lock_irq(&ra->ra_lock);
+			ra->waits++;
+			spin_unlock_irq(&ra->ra_lock);
+			waited = true;
 		}
+		wait_event(ra->ra_wait, slots[i]->state != VDISK_RA_READING);
 	}
-	max_iv_count = p->iv_count;
 
-	old_fs = get_fs();
-	set_fs(get_ds());
-
-	tags_sg = NULL;
-	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
-	while (1) {
-		iv_count = 0;
-		full_len = 0;
-		i = -1;
-		address = scst_get_dif_buf(cmd, &tags_sg, &l);
-		length = l;
-		EXTRACHECKS_BUG_ON(length <= 0);
-		while (1) {
-			full_len += length;
-			i++;
-			iv_count++;
-			iv[i].iov_base = (uint8_t __force __user *)address;
-			iv[i].iov_len = length;
-			tags_num -= length >> SCST_DIF_TAG_SHIFT;
-			EXTRACHECKS_BUG_ON(tags_num < 0);
-			if ((iv_count == max_iv_count) || (tags_num == 0))
-				break;
-			address = scst_get_dif_buf(cmd, &tags_sg, &l);
-			length = l;
-			EXTRACHECKS_BUG_ON(length <= 0);
+	spin_lock_irq(&ra->ra_lock);
+	for (i = 0; i < n; i++) {
+		if ((slots[i]->state != VDISK_RA_VALID) || slots[i]->stale) {
+			vdisk_ra_put_slots(slots, n);
+			spin_unlock_irq(&ra->ra_lock);
+			goto out_miss;
 		}
-		if (tags_num == 0)
-			finished = true;
+	}
+	spin_unlock_irq(&ra->ra_lock);
 
-		eiv = iv;
-		eiv_count = iv_count;
-restart:
-		TRACE_DBG("Writing DIF: eiv_count %d, full_len %zd", eiv_count, full_len);
+	rc = vdisk_ra_copy(cmd, slots, p->loff);
+	if (unlikely(rc != 0))
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_internal_failure));
 
-		/* WRITE */
-		err = vfs_writev(fd, (struct iovec __force __user *)eiv,
-				 eiv_count, &loff, 0);
-		if (err < 0) {
-			unsigned long flags;
+	spin_lock_irq(&ra->ra_lock);
+	ra->hits++;
+	for (i = 0; i < n; i++)
+		slots[i]->last_used = jiffies;
+	vdisk_ra_put_slots(slots, n);
+	spin_unlock_irq(&ra->ra_lock);
+
+	res = true;
+
+out:
+	return res;
+
+out_miss:
+	spin_lock_irq(&ra->ra_lock);
+	ra->misses++;
+	spin_unlock_irq(&ra->ra_lock);
+	goto out;
+}
+
+/* Drops all prefetched data, e.g. before closing the device */
+static void vdisk_ra_drop(struct vdisk_ra *ra)
+{
+	struct vdisk_ra_slot *slot;
+	int i;
+
+	for (i = 0; i < VDISK_RA_SLOTS; i++) {
+		slot = &ra->slots[i];
+		cancel_work_sync(&slot->ra_work);
+		spin_lock_irq(&ra->ra_lock);
+		slot->state = VDISK_RA_EMPTY;
+		slot->stale = 0;
+		spin_unlock_irq(&ra->ra_lock);
+	}
+	wake_up_all(&ra->ra_wait);
+	return;
+}
+
+static int vdisk_ra_create(struct scst_vdisk_dev *virt_dev)
+{
+	struct vdisk_ra *ra;
+	int i, res = -ENOMEM;
 
-			PRINT_ERROR("DIF write() returned %lld from %zd",
-				    err, full_len);
-			/* To protect sense setting with blockio */
-			spin_lock_irqsave(&vdev_err_lock, flags);
-			if (err == -EAGAIN)
-				scst_set_busy(cmd);
-			else {
-				scst_set_cmd_error(cmd,
-				    SCST_LOAD_SENSE(scst_sense_write_error));
-			}
-			spin_unlock_irqrestore(&vdev_err_lock, flags);
-			res = err;
-			goto out_set_fs;
-		} else if (err < full_len) {
-			/*
-			 * Probably that's wrong, but sometimes write() returns
-			 * value less, than requested. Let's restart.
-			 */
-			int e = eiv_count;
+	TRACE_ENTRY();
 
-			TRACE_MGMT_DBG("DIF write() returned %d from %zd "
-				"(iv_count=%d)", (int)err, full_len,
-				eiv_count);
-			if (err == 0) {
-				PRINT_INFO("Suspicious: DIF write() returned 0 from "
-					"%zd (iv_count=%d)", full_len, eiv_count);
-			}
-			full_len -= err;
-			for (i = 0; i < e; i++) {
-				if ((long long)eiv->iov_len < err) {
-					err -= eiv->iov_len;
-					eiv++;
-					eiv_count--;
-				} else {
-					eiv->iov_base =
-					    (uint8_t __force __user *)eiv->iov_base + err;
-					eiv->iov_len -= err;
-					break;
-				}
-			}
-			goto restart;
-		}
+	if ((virt_dev->ra_size_kb > VDISK_RA_MAX_SIZE_KB) ||
+	    ((virt_dev->ra_size_kb << 10) & ~PAGE_MASK) != 0) {
+		PRINT_ERROR("Invalid read_ahead_kb %u, it must be a multiple of "
+			"%lu KB not above %d KB (dev %s)", virt_dev->ra_size_kb,
+			PAGE_SIZE >> 10, VDISK_RA_MAX_SIZE_KB, virt_dev->name);
+		res = -EINVAL;
+		goto out;
+	}
 
-		for (i = 0; i < iv_count; i++)
-			scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+	ra = kzalloc(sizeof(*ra), GFP_KERNEL);
+	if (ra == NULL)
+		goto out;
 
-		if (finished)
-			break;
+	ra->virt_dev = virt_dev;
+	ra->size = virt_dev->ra_size_kb << 10;
+	spin_lock_init(&ra->ra_lock);
+	init_waitqueue_head(&ra->ra_wait);
+
+	for (i = 0; i < VDISK_RA_SLOTS; i++) {
+		struct vdisk_ra_slot *slot = &ra->slots[i];
+
+		slot->ra = ra;
+		slot->state = VDISK_RA_EMPTY;
+		INIT_WORK(&slot->ra_work, vdisk_ra_work_fn);
+		slot->buf = vmalloc(ra->size);
+		if (slot->buf == NULL)
+			goto out_free;
 	}
 
-	set_fs(old_fs);
+	virt_dev->ra = ra;
+	res = 0;
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 
-out_set_fs:
-	set_fs(old_fs);
-	for (i = 0; i < iv_count; i++)
-		scst_put_dif_buf(cmd, (void __force *)(iv[i].iov_base));
+out_free:
+	while (--i >= 0)
+		vfree(ra->slots[i].buf);
+	kfree(ra);
 	goto out;
 }
 
+static void vdisk_ra_destroy(struct scst_vdisk_dev *virt_dev)
+{
+	struct vdisk_ra *ra = virt_dev->ra;
+	int i;
+
+	TRACE_ENTRY();
+
+	vdisk_ra_drop(ra);
+
+	for (i = 0; i < VDISK_RA_SLOTS; i++)
+		vfree(ra->slots[i].buf);
+	kfree(ra);
+	virt_dev->ra = NULL;
+
+	TRACE_EXIT();
+	return;
+}
+
 static enum compl_status_e blockio_exec_read(struct vdisk_cmd_params *p)
 {
+	struct scst_vdisk_dev *virt_dev = p->cmd->dev->dh_priv;
+
+	if ((virt_dev->wbc != NULL) && vdisk_wbc_read(p))
+		return CMD_SUCCEEDED;
+
+	if ((virt_dev->ra != NULL) && vdisk_ra_read(p))
+		return CMD_SUCCEEDED;
+
 	blockio_exec_rw(p, false, false);
 	return RUNNING_ASYNC;
 }
@@ -6252,6 +8613,12 @@ static enum compl_status_e blockio_exec_write(struct vdisk_cmd_params *p)
 		goto out;
 	}
 
+	if (virt_dev->wbc != NULL) {
+		vdisk_wbc_write(p, p->fua || virt_dev->wt_flag);
+		res = CMD_SUCCEEDED;
+		goto out;
+	}
+
 	blockio_exec_rw(p, true, p->fua || virt_dev->wt_flag);
 	res = RUNNING_ASYNC;
 
@@ -6471,6 +8838,7 @@ static inline void blockio_check_finish(struct scst_blockio_work *blockio_work)
 	/* Decrement the bios in processing, and if zero signal completion */
 	if (atomic_dec_and_test(&blockio_work->bios_inflight)) {
 		struct scst_cmd *cmd = blockio_work->cmd;
+		struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
 
 		if ((cmd->data_direction & SCST_DATA_READ) &&
 		    likely(cmd->status == SAM_STAT_GOOD)) {
@@ -6481,6 +8849,10 @@ static inline void blockio_check_finish(struct scst_blockio_work *blockio_work)
 			cmd->deferred_dif_read_check = 1;
 		}
 
+		if (unlikely(virt_dev->ra != NULL) &&
+		    (cmd->op_flags & SCST_WRITE_MEDIUM))
+			vdisk_ra_invalidate_cmd(cmd);
+
 		blockio_work->cmd->completed = 1;
 		blockio_work->cmd->scst_cmd_done(cmd,
 			SCST_CMD_STATE_DEFAULT, scst_estimate_context());
@@ -7072,6 +9444,97 @@ out:
 	return res;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+static void vdisk_blockio_start_coalesced_flush(struct scst_vdisk_dev *virt_dev,
+	struct list_head *batch, gfp_t gfp_mask);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+static void vdev_coalesced_flush_end_io(struct bio *bio, int error)
+{
+#else
+static void vdev_coalesced_flush_end_io(struct bio *bio)
+{
+	int error = bio->bi_error;
+#endif
+	struct scst_vdisk_dev *virt_dev = bio->bi_private;
+	LIST_HEAD(batch);
+	LIST_HEAD(next);
+
+	TRACE_ENTRY();
+
+	if (unlikely(error != 0))
+		PRINT_ERROR("FLUSH bio failed: %d (dev %s)", error,
+			virt_dev->name);
+
+	bio_put(bio);
+
+	list_splice_init(&virt_dev->flush_list, &batch);
+	if (vdisk_flush_finish(virt_dev, &next))
+		vdisk_blockio_start_coalesced_flush(virt_dev, &next,
+			GFP_ATOMIC);
+
+	/* virt_dev can't be used after that */
+	vdisk_flush_complete_cmds(&batch, error ? -EIO : 0);
+
+	TRACE_EXIT();
+	return;
+}
+
+/* Submits one FLUSH bio for all commands in @batch */
+static void vdisk_blockio_start_coalesced_flush(struct scst_vdisk_dev *virt_dev,
+	struct list_head *batch, gfp_t gfp_mask)
+{
+	struct bio *bio;
+	LIST_HEAD(next);
+	bool more;
+
+	TRACE_ENTRY();
+
+	while (1) {
+		bio = bio_alloc(gfp_mask, 0);
+		if (likely(bio != NULL))
+			break;
+		PRINT_ERROR("bio_alloc() failed (dev %s)", virt_dev->name);
+		more = vdisk_flush_finish(virt_dev, &next);
+		vdisk_flush_complete_cmds(batch, -ENOMEM);
+		if (!more)
+			goto out;
+		list_splice_init(&next, batch);
+	}
+
+	TRACE_DBG("Submitting coalesced flush (dev %s)", virt_dev->name);
+
+	list_splice_init(batch, &virt_dev->flush_list);
+
+	bio->bi_end_io = vdev_coalesced_flush_end_io;
+	bio->bi_private = virt_dev;
+	bio->bi_bdev = virt_dev->bdev;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	submit_bio(WRITE_FLUSH, bio);
+#else
+	bio_set_op_attrs(bio, REQ_OP_FLUSH, 0);
+	submit_bio(bio);
+#endif
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Flushes the device write cache on behalf of @cmd and all SYNCHRONIZE CACHE
+ * commands coalesced with it, see vdisk_flush_queue().
+ */
+static void vdisk_blockio_flush_coalesced(struct scst_vdisk_dev *virt_dev,
+	struct scst_cmd *cmd, gfp_t gfp_mask)
+{
+	LIST_HEAD(batch);
+
+	if (vdisk_flush_queue(virt_dev, cmd, &batch))
+		vdisk_blockio_start_coalesced_flush(virt_dev, &batch, gfp_mask);
+}
+#endif
+
 struct bio_priv_sync {
 	struct completion c;
 	int error;
@@ -7128,7 +9591,7 @@ static void blockio_end_sync_io(struct bio *bio)
 }
 
 /**
- * blockio_read_sync() - read up to @len bytes from a block I/O device
+ * blockio_rw_sync() - read or write up to @len bytes from/to a block I/O device
  *
  * Returns:
  * - A negative value if an error occurred.
@@ -7138,8 +9601,8 @@ static void blockio_end_sync_io(struct bio *bio)
  * Note:
  * Increments *@loff with the number of bytes transferred upon success.
  */
-static ssize_t blockio_read_sync(struct scst_vdisk_dev *virt_dev, void *buf,
-				 size_t len, loff_t *loff)
+static ssize_t blockio_rw_sync(struct scst_vdisk_dev *virt_dev, void *buf,
+			       size_t len, loff_t *loff, bool write, bool fua)
 {
 	struct bio_priv_sync s = {
 		COMPLETION_INITIALIZER_ONSTACK(s.c), 0,
@@ -7176,9 +9639,12 @@ static ssize_t blockio_read_sync(struct scst_vdisk_dev *virt_dev, void *buf,
 		goto out;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-	bio->bi_rw = READ_SYNC;
+	bio->bi_rw = write ? WRITE_SYNC : READ_SYNC;
+	if (fua)
+		bio->bi_rw |= REQ_FUA;
 #else
-	bio_set_op_attrs(bio, REQ_OP_READ, REQ_SYNC);
+	bio_set_op_attrs(bio, write ? REQ_OP_WRITE : REQ_OP_READ,
+			 REQ_SYNC | (fua ? REQ_FUA : 0));
 #endif
 	bio->bi_bdev = bdev;
 	bio->bi_end_io = blockio_end_sync_io;
@@ -7253,12 +9719,18 @@ static ssize_t vdev_read_sync(struct scst_vdisk_dev *virt_dev, void *buf,
 {
 	ssize_t read, res;
 
-	if (virt_dev->nullio) {
+	if (virt_dev->ramdisk) {
+		res = vdisk_rd_copy(virt_dev->rd, buf, len, *loff, false);
+		if (res < 0)
+			return res;
+		*loff += len;
+		return len;
+	} else if (virt_dev->nullio) {
 		return len;
 	} else if (virt_dev->blockio) {
 		for (read = 0; read < len; read += res) {
-			res = blockio_read_sync(virt_dev, buf + read,
-						len - read, loff);
+			res = blockio_rw_sync(virt_dev, buf + read,
+					      len - read, loff, false, false);
 			if (res < 0)
 				return res;
 		}
@@ -7268,6 +9740,48 @@ static ssize_t vdev_read_sync(struct scst_vdisk_dev *virt_dev, void *buf,
 	}
 }
 
+/* Note: Updates *@loff if writing succeeded. */
+static ssize_t fileio_write_sync(struct file *fd, void *buf, size_t len,
+				 loff_t *loff)
+{
+	mm_segment_t old_fs;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(get_ds());
+	ret = vfs_write(fd, (char __force __user *)buf, len, loff);
+	set_fs(old_fs);
+
+	return ret;
+}
+
+/* Note: Updates *@loff if writing succeeded except for NULLIO devices. */
+static ssize_t vdev_write_sync(struct scst_vdisk_dev *virt_dev, void *buf,
+			       size_t len, loff_t *loff, bool fua)
+{
+	ssize_t written, res;
+
+	if (virt_dev->ramdisk) {
+		res = vdisk_rd_copy(virt_dev->rd, buf, len, *loff, true);
+		if (res < 0)
+			return res;
+		*loff += len;
+		return len;
+	} else if (virt_dev->nullio) {
+		return len;
+	} else if (virt_dev->blockio) {
+		for (written = 0; written < len; written += res) {
+			res = blockio_rw_sync(virt_dev, buf + written,
+					      len - written, loff, true, fua);
+			if (res < 0)
+				return res;
+		}
+		return written;
+	} else {
+		return fileio_write_sync(virt_dev->fd, buf, len, loff);
+	}
+}
+
 static enum compl_status_e vdev_exec_verify(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
@@ -7369,6 +9883,137 @@ out:
 	return CMD_SUCCEEDED;
 }
 
+/*
+ * Executes COMPARE AND WRITE in one step: reads the blocks, compares them
+ * with the first half of the data buffer and, if they match, writes the
+ * second half. Atomicity against overlapping commands is provided by the
+ * SCST core, which doesn't let them run until this SCSI atomic command
+ * finished, see scst_check_scsi_atomicity().
+ */
+static enum compl_status_e vdisk_exec_caw(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	int data_len = scst_cmd_get_data_len(cmd);
+	loff_t loff = p->loff;
+	uint8_t *mem, *address;
+	int length, pos = 0;
+	ssize_t err;
+	/* NULLIO stores nothing, so it can only be compared with zeros */
+	bool compare = !virt_dev->nullio || virt_dev->ramdisk ||
+		       virt_dev->read_zero;
+
+	TRACE_ENTRY();
+
+	TRACE_DBG("COMPARE AND WRITE: loff %lld, data_len %d, fua %d",
+		(long long)loff, data_len, p->fua);
+
+	if (unlikely(data_len == 0))
+		goto out;
+
+	EXTRACHECKS_BUG_ON(cmd->bufflen != 2 * data_len);
+
+	/* Usually a single block, so avoid vmalloc() for it */
+	if (data_len <= PAGE_SIZE)
+		mem = (uint8_t *)__get_free_page(cmd->cmd_gfp_mask);
+	else
+		mem = vmalloc(data_len);
+	if (mem == NULL) {
+		PRINT_ERROR("Unable to allocate %d bytes for COMPARE AND WRITE",
+			data_len);
+		scst_set_busy(cmd);
+		goto out;
+	}
+
+	if (virt_dev->nullio && !virt_dev->ramdisk) {
+		memset(mem, 0, data_len);
+	} else {
+		err = vdev_read_sync(virt_dev, mem, data_len, &loff);
+		if ((err < 0) || (err < data_len)) {
+			PRINT_ERROR("COMPARE AND WRITE read returned %lld from "
+				"%d (dev %s)", (long long)err, data_len,
+				virt_dev->name);
+			if (err == -EAGAIN)
+				scst_set_busy(cmd);
+			else
+				scst_set_cmd_error(cmd,
+				    SCST_LOAD_SENSE(scst_sense_read_error));
+			goto out_free;
+		}
+	}
+
+	/*
+	 * Compare the first half of the buffer and copy the second one in
+	 * place of the compared data.
+	 */
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		uint8_t *a = address;
+
+		while ((length > 0) && (pos < 2 * data_len)) {
+			int l;
+
+			if (pos < data_len) {
+				l = min(length, data_len - pos);
+				if (compare && (memcmp(a, &mem[pos], l) != 0)) {
+					int i;
+
+					for (i = 0; a[i] == mem[pos + i]; i++)
+						;
+					TRACE_DBG("Miscompare at offset %d",
+						pos + i);
+					scst_set_cmd_error_and_inf(cmd,
+						SCST_LOAD_SENSE(scst_sense_miscompare_error),
+						pos + i);
+					scst_put_buf(cmd, address);
+					goto out_free;
+				}
+			} else {
+				l = min(length, 2 * data_len - pos);
+				memcpy(&mem[pos - data_len], a, l);
+			}
+			a += l;
+			pos += l;
+			length -= l;
+		}
+
+		scst_put_buf(cmd, address);
+		length = scst_get_buf_next(cmd, &address);
+	}
+
+	loff = p->loff;
+	err = vdev_write_sync(virt_dev, mem, data_len, &loff,
+		p->fua && virt_dev->blockio);
+	if ((err < 0) || (err < data_len)) {
+		PRINT_ERROR("COMPARE AND WRITE write returned %lld from %d "
+			"(dev %s)", (long long)err, data_len, virt_dev->name);
+		if (err == -EAGAIN)
+			scst_set_busy(cmd);
+		else if (err == -ENOSPC)
+			scst_set_cmd_error(cmd,
+			    SCST_LOAD_SENSE(scst_space_allocation_failed_write_protect));
+		else
+			scst_set_cmd_error(cmd,
+			    SCST_LOAD_SENSE(scst_sense_write_error));
+		goto out_free;
+	}
+
+	/* O_DSYNC flag is used for WT FILEIO devices */
+	if (p->fua && !virt_dev->blockio && !virt_dev->nullio)
+		vdisk_fsync(p->loff, data_len, cmd->dev, cmd->cmd_gfp_mask,
+			cmd, false);
+
+out_free:
+	if (data_len <= PAGE_SIZE)
+		free_page((unsigned long)mem);
+	else
+		vfree(mem);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
+
 static enum compl_status_e blockio_exec_write_verify(struct vdisk_cmd_params *p)
 {
 	/* Not yet implemented */
@@ -7609,7 +10254,10 @@ static void vdisk_report_registering(const struct scst_vdisk_dev *virt_dev)
 		i += snprintf(&buf[i], buf_size - i, "%sO_DIRECT",
 			(j == i) ? "(" : ", ");
 
-	if (virt_dev->nullio)
+	if (virt_dev->ramdisk)
+		i += snprintf(&buf[i], buf_size - i, "%sRAMDISK",
+			(j == i) ? "(" : ", ");
+	else if (virt_dev->nullio)
 		i += snprintf(&buf[i], buf_size - i, "%sNULLIO",
 			(j == i) ? "(" : ", ");
 
@@ -7684,7 +10332,8 @@ static int vdisk_resync_size(struct scst_vdisk_dev *virt_dev)
 		goto out;
 	}
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	/* Only this device's commands care about its size */
+	res = scst_suspend_dev_activity(virt_dev->dev);
 	if (res != 0)
 		goto out;
 
@@ -7704,7 +10353,7 @@ static int vdisk_resync_size(struct scst_vdisk_dev *virt_dev)
 
 	scst_capacity_data_changed(virt_dev->dev);
 
-	scst_resume_activity();
+	scst_resume_dev_activity(virt_dev->dev);
 out:
 	return res;
 }
@@ -7784,6 +10433,10 @@ static int vdev_create_node(struct scst_dev_type *devt,
 	res = -EEXIST;
 	if (vdev_find(name))
 		goto out;
+	list_for_each_entry(vv, &vdev_pending_list, vdev_list_entry) {
+		if (strcmp(vv->name, name) == 0)
+			goto out;
+	}
 
 	/* It's read-mostly, so cache alignment isn't needed */
 	virt_dev = kzalloc_node(sizeof(*virt_dev), GFP_KERNEL, nodeid);
@@ -7795,6 +10448,9 @@ static int vdev_create_node(struct scst_dev_type *devt,
 	}
 
 	spin_lock_init(&virt_dev->flags_lock);
+	spin_lock_init(&virt_dev->flush_lock);
+	INIT_LIST_HEAD(&virt_dev->flush_next_list);
+	INIT_LIST_HEAD(&virt_dev->flush_list);
 
 	virt_dev->vdev_devt = devt;
 
@@ -7848,12 +10504,12 @@ static int vdev_create_node(struct scst_dev_type *devt,
 	TRACE_DBG("usn %s", virt_dev->usn);
 
 	list_for_each_entry(vv, &vdev_list, vdev_list_entry) {
-		if (strcmp(virt_dev->usn, vv->usn) == 0) {
-			PRINT_ERROR("New usn %s conflicts with one of dev %s",
-				virt_dev->usn, vv->name);
-			res = -EEXIST;
-			goto out_free;
-		}
+		if (strcmp(virt_dev->usn, vv->usn) == 0)
+			goto out_usn_conflict;
+	}
+	list_for_each_entry(vv, &vdev_pending_list, vdev_list_entry) {
+		if (strcmp(virt_dev->usn, vv->usn) == 0)
+			goto out_usn_conflict;
 	}
 
 	*res_virt_dev = virt_dev;
@@ -7862,7 +10518,10 @@ static int vdev_create_node(struct scst_dev_type *devt,
 out:
 	return res;
 
-out_free:
+out_usn_conflict:
+	PRINT_ERROR("New usn %s conflicts with one of dev %s", virt_dev->usn,
+		vv->name);
+	res = -EEXIST;
 	kfree(virt_dev);
 	goto out;
 }
@@ -7877,6 +10536,13 @@ static void vdev_destroy(struct scst_vdisk_dev *virt_dev)
 {
 	cancel_work_sync(&virt_dev->vdev_inq_changed_work);
 
+	if (virt_dev->wbc != NULL)
+		vdisk_wbc_destroy(virt_dev);
+	if (virt_dev->ra != NULL)
+		vdisk_ra_destroy(virt_dev);
+	if (virt_dev->rd != NULL)
+		vdisk_rd_destroy(virt_dev);
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
 	vdisk_free_bioset(virt_dev);
 #endif
@@ -8103,6 +10769,17 @@ static int vdev_parse_add_dev_params(struct scst_vdisk_dev *virt_dev,
 			virt_dev->thin_provisioned_manually_set = 1;
 			TRACE_DBG("THIN PROVISIONED %d",
 				virt_dev->thin_provisioned);
+		} else if (!strcasecmp("read_ahead_kb", p)) {
+			virt_dev->ra_size_kb = val;
+			TRACE_DBG("READ-AHEAD %u KB", virt_dev->ra_size_kb);
+		} else if (!strcasecmp("wb_cache_size_mb", p)) {
+			virt_dev->wbc_size_mb = val;
+			TRACE_DBG("WRITE-BACK CACHE %u MB",
+				virt_dev->wbc_size_mb);
+		} else if (!strcasecmp("mem_limit_mb", p)) {
+			virt_dev->rd_mem_limit_mb = val;
+			TRACE_DBG("MEMORY LIMIT %u MB",
+				virt_dev->rd_mem_limit_mb);
 		} else if (!strcasecmp("zero_copy", p)) {
 			virt_dev->zero_copy = !!val;
 		} else if (!strcasecmp("size", p)) {
@@ -8144,13 +10821,80 @@ static int vdev_parse_add_dev_params(struct scst_vdisk_dev *virt_dev,
 		}
 	}
 
-	if ((virt_dev->file_size & ((1 << virt_dev->blk_shift) - 1)) != 0) {
-		PRINT_ERROR("Device size %lld is not a multiple of the block"
-			    " size %d", virt_dev->file_size,
-			    1 << virt_dev->blk_shift);
-		res = -EINVAL;
-	}
-out:
+	if ((virt_dev->file_size & ((1 << virt_dev->blk_shift) - 1)) != 0) {
+		PRINT_ERROR("Device size %lld is not a multiple of the block"
+			    " size %d", virt_dev->file_size,
+			    1 << virt_dev->blk_shift);
+		res = -EINVAL;
+	}
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * scst_vdisk_mutex supposed to be held. Releases it while the backing store
+ * of virt_dev is probed, meanwhile virt_dev sits on vdev_pending_list to
+ * reserve its name and usn. Then registers the device.
+ */
+static int vdev_probe_and_register(struct scst_vdisk_dev *virt_dev)
+{
+	int res;
+	uint64_t burst_ms = 0;
+	unsigned int burst_cnt = 0;
+
+	TRACE_ENTRY();
+
+	list_add_tail(&virt_dev->vdev_list_entry, &vdev_pending_list);
+
+	spin_lock(&vdev_attach_stats_lock);
+	if (vdev_attach_stats.pending++ == 0) {
+		vdev_attach_stats.burst_start = ktime_get();
+		vdev_attach_stats.burst_cnt = 0;
+	}
+	spin_unlock(&vdev_attach_stats_lock);
+
+	mutex_unlock(&scst_vdisk_mutex);
+
+	vdisk_probe_backing_store(virt_dev);
+
+	mutex_lock(&scst_vdisk_mutex);
+
+	list_move_tail(&virt_dev->vdev_list_entry, &vdev_list);
+
+	vdisk_report_registering(virt_dev);
+
+	virt_dev->virt_id = scst_register_virtual_device_node(virt_dev->vdev_devt,
+					virt_dev->name, virt_dev->numa_node_id);
+	res = (virt_dev->virt_id < 0) ? virt_dev->virt_id : 0;
+
+	spin_lock(&vdev_attach_stats_lock);
+	if (res == 0) {
+		vdev_attach_stats.attached++;
+		vdev_attach_stats.burst_cnt++;
+		vdev_attach_stats.total_probe_us += virt_dev->probe_time_us;
+		if (virt_dev->probe_time_us > vdev_attach_stats.max_probe_us) {
+			vdev_attach_stats.max_probe_us = virt_dev->probe_time_us;
+			strlcpy(vdev_attach_stats.max_probe_name, virt_dev->name,
+				sizeof(vdev_attach_stats.max_probe_name));
+		}
+	} else
+		vdev_attach_stats.failed++;
+	if ((--vdev_attach_stats.pending == 0) &&
+	    (vdev_attach_stats.burst_cnt > 1)) {
+		burst_cnt = vdev_attach_stats.burst_cnt;
+		burst_ms = ktime_to_ms(ktime_sub(ktime_get(),
+					vdev_attach_stats.burst_start));
+	}
+	spin_unlock(&vdev_attach_stats_lock);
+
+	if (burst_cnt != 0)
+		PRINT_INFO("%u virtual devices attached in parallel in %lld ms",
+			burst_cnt, (unsigned long long)burst_ms);
+
+	if (res != 0)
+		list_del(&virt_dev->vdev_list_entry);
+
 	TRACE_EXIT_RES(res);
 	return res;
 }
@@ -8192,16 +10936,9 @@ static int vdev_fileio_add_device(const char *device_name, char *params)
 
 	vdev_check_node(&virt_dev, NUMA_NO_NODE);
 
-	list_add_tail(&virt_dev->vdev_list_entry, &vdev_list);
-
-	vdisk_report_registering(virt_dev);
-
-	virt_dev->virt_id = scst_register_virtual_device_node(virt_dev->vdev_devt,
-					virt_dev->name, virt_dev->numa_node_id);
-	if (virt_dev->virt_id < 0) {
-		res = virt_dev->virt_id;
-		goto out_del;
-	}
+	res = vdev_probe_and_register(virt_dev);
+	if (res != 0)
+		goto out_destroy;
 
 	TRACE_DBG("Registered virt_dev %s with id %d", virt_dev->name,
 		virt_dev->virt_id);
@@ -8210,9 +10947,6 @@ out:
 	TRACE_EXIT_RES(res);
 	return res;
 
-out_del:
-	list_del(&virt_dev->vdev_list_entry);
-
 out_destroy:
 	vdev_destroy(virt_dev);
 	goto out;
@@ -8228,7 +10962,8 @@ static int vdev_blockio_add_device(const char *device_name, char *params)
 					 "thin_provisioned", "tst",
 					 "numa_node_id", "dif_mode",
 					 "dif_type", "dif_static_app_tag",
-					 "dif_filename", NULL };
+					 "dif_filename", "wb_cache_size_mb",
+					 "read_ahead_kb", NULL };
 	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
@@ -8262,6 +10997,62 @@ static int vdev_blockio_add_device(const char *device_name, char *params)
 		goto out_destroy;
 #endif
 
+	if (virt_dev->wbc_size_mb != 0) {
+		res = vdisk_wbc_create(virt_dev);
+		if (res != 0)
+			goto out_destroy;
+	}
+
+	if (virt_dev->ra_size_kb != 0) {
+		res = vdisk_ra_create(virt_dev);
+		if (res != 0)
+			goto out_destroy;
+	}
+
+	res = vdev_probe_and_register(virt_dev);
+	if (res != 0)
+		goto out_destroy;
+
+	TRACE_DBG("Registered virt_dev %s with id %d", virt_dev->name,
+		virt_dev->virt_id);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_destroy:
+	vdev_destroy(virt_dev);
+	goto out;
+}
+
+/* scst_vdisk_mutex supposed to be held */
+static int vdev_nullio_add_device(const char *device_name, char *params)
+{
+	int res = 0;
+	static const char *const allowed_params[] = {
+		"read_only", "dummy", "removable", "blocksize", "rotational",
+		"size", "size_mb", "tst", "numa_node_id",
+		"cluster_mode", "dif_mode", "dif_type", "dif_static_app_tag", NULL
+	};
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	res = vdev_create(&vdisk_null_devtype, device_name, &virt_dev);
+	if (res != 0)
+		goto out;
+
+	virt_dev->command_set_version = 0x04C0; /* SBC-3 */
+
+	virt_dev->nullio = 1;
+	virt_dev->file_size = VDISK_NULLIO_SIZE;
+
+	res = vdev_parse_add_dev_params(virt_dev, params, allowed_params);
+	if (res != 0)
+		goto out_destroy;
+
+	vdev_check_node(&virt_dev, NUMA_NO_NODE);
+
 	list_add_tail(&virt_dev->vdev_list_entry, &vdev_list);
 
 	vdisk_report_registering(virt_dev);
@@ -8289,33 +11080,47 @@ out_destroy:
 }
 
 /* scst_vdisk_mutex supposed to be held */
-static int vdev_nullio_add_device(const char *device_name, char *params)
+static int vdev_ramdisk_add_device(const char *device_name, char *params)
 {
 	int res = 0;
 	static const char *const allowed_params[] = {
-		"read_only", "dummy", "removable", "blocksize", "rotational",
-		"size", "size_mb", "tst", "numa_node_id",
-		"cluster_mode", "dif_mode", "dif_type", "dif_static_app_tag", NULL
+		"read_only", "removable", "blocksize", "rotational",
+		"size", "size_mb", "tst", "numa_node_id", "cluster_mode",
+		"mem_limit_mb", "zero_copy", NULL
 	};
 	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
 
-	res = vdev_create(&vdisk_null_devtype, device_name, &virt_dev);
+	res = vdev_create(&vdisk_ramdisk_devtype, device_name, &virt_dev);
 	if (res != 0)
 		goto out;
 
 	virt_dev->command_set_version = 0x04C0; /* SBC-3 */
 
+	/* Reuse the NULLIO handling of devices without a backing file */
 	virt_dev->nullio = 1;
-	virt_dev->file_size = VDISK_NULLIO_SIZE;
+	virt_dev->ramdisk = 1;
+	virt_dev->zero_copy = 1;
+	virt_dev->file_size = 0;
 
 	res = vdev_parse_add_dev_params(virt_dev, params, allowed_params);
 	if (res != 0)
 		goto out_destroy;
 
+	if (virt_dev->file_size == 0) {
+		PRINT_ERROR("Size required (device %s)", virt_dev->name);
+		res = -EINVAL;
+		goto out_destroy;
+	}
+	virt_dev->size_key = 1;
+
 	vdev_check_node(&virt_dev, NUMA_NO_NODE);
 
+	res = vdisk_rd_create(virt_dev);
+	if (res != 0)
+		goto out_destroy;
+
 	list_add_tail(&virt_dev->vdev_list_entry, &vdev_list);
 
 	vdisk_report_registering(virt_dev);
@@ -8401,6 +11206,25 @@ out:
 
 }
 
+static ssize_t vdisk_add_ramdisk_device(const char *device_name, char *params)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+	res = mutex_lock_interruptible(&scst_vdisk_mutex);
+	if (res)
+		goto out;
+
+	res = vdev_ramdisk_add_device(device_name, params);
+
+	mutex_unlock(&scst_vdisk_mutex);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 #endif /* CONFIG_SCST_PROC */
 
 /* scst_vdisk_mutex supposed to be held */
@@ -8752,6 +11576,7 @@ static ssize_t vcdrom_sysfs_filename_store(struct kobject *kobj,
 
 	work->buf = i_buf;
 	work->dev = dev;
+	work->obj_key = (unsigned long)dev;
 
 	SCST_SET_DEP_MAP(work, &scst_dev_dep_map);
 	kobject_get(&dev->dev_kobj);
@@ -8783,7 +11608,7 @@ static int vdev_size_process_store(struct scst_sysfs_work_item *work)
 
 	new_size <<= size_shift;
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	res = scst_suspend_dev_activity(dev);
 	if (res)
 		goto put;
 
@@ -8797,6 +11622,8 @@ static int vdev_size_process_store(struct scst_sysfs_work_item *work)
 	queue_ua = (virt_dev->fd != NULL);
 
 	if ((new_size & ((1 << virt_dev->blk_shift) - 1)) == 0) {
+		if ((virt_dev->rd != NULL) && (new_size < virt_dev->file_size))
+			vdisk_rd_truncate(virt_dev->rd, new_size);
 		virt_dev->file_size = new_size;
 		virt_dev->nblocks = virt_dev->file_size >> dev->block_shift;
 		virt_dev->size_key = 1;
@@ -8810,7 +11637,7 @@ static int vdev_size_process_store(struct scst_sysfs_work_item *work)
 		scst_capacity_data_changed(dev);
 
 resume:
-	scst_resume_activity();
+	scst_resume_dev_activity(dev);
 
 put:
 	kobject_put(&dev->dev_kobj);
@@ -8838,6 +11665,7 @@ static ssize_t vdev_size_store(struct kobject *kobj,
 
 	work->buf = new_size;
 	work->dev = dev;
+	work->obj_key = (unsigned long)dev;
 
 	SCST_SET_DEP_MAP(work, &scst_dev_dep_map);
 	kobject_get(&dev->dev_kobj);
@@ -9075,6 +11903,203 @@ static ssize_t vdisk_sysfs_nv_cache_show(struct kobject *kobj,
 	return pos;
 }
 
+static ssize_t vdisk_sysfs_flush_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+	unsigned long flush_cmds, flushes;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	spin_lock_irq(&virt_dev->flush_lock);
+	flush_cmds = virt_dev->flush_cmds;
+	flushes = virt_dev->flushes;
+	spin_unlock_irq(&virt_dev->flush_lock);
+
+	pos = sprintf(buf, "sync_cache_cmds %lu\nflushes %lu\n", flush_cmds,
+		flushes);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_wb_cache_size_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%u\n%s", virt_dev->wbc_size_mb,
+		(virt_dev->wbc_size_mb == 0) ? "" : SCST_SYSFS_KEY_MARK "\n");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_wb_cache_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+	struct vdisk_wbc *wbc;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+	wbc = virt_dev->wbc;
+
+	if (wbc == NULL)
+		goto out;
+
+	spin_lock(&wbc->wbc_lock);
+	pos = scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"units %u\nmax_units %u\ndirty_units %u\n"
+		"read_hits %lu\nread_misses %lu\nwrites %lu\n"
+		"write_hits %lu\nfull_waits %lu\ndestage_runs %lu\n"
+		"destaged_mb %llu\n", wbc->units_cnt, wbc->units_max,
+		wbc->dirty_units, wbc->read_hits, wbc->read_misses,
+		wbc->writes, wbc->write_hits, wbc->full_waits,
+		wbc->destage_runs,
+		(unsigned long long)(wbc->destaged_bytes >> 20));
+	spin_unlock(&wbc->wbc_lock);
+
+out:
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_mem_limit_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%u\n%s", virt_dev->rd_mem_limit_mb,
+		(virt_dev->rd_mem_limit_mb == 0) ? "" : SCST_SYSFS_KEY_MARK "\n");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_mem_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+	struct vdisk_rd *rd;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+	rd = virt_dev->rd;
+
+	if (rd == NULL)
+		goto out;
+
+	spin_lock(&rd->rd_lock);
+	pos = scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"pages %lu\nmax_pages %lu\nused_mb %lu\nlimit_hits %lu\n",
+		rd->pages_cnt, rd->max_pages,
+		rd->pages_cnt >> (20 - PAGE_SHIFT), rd->limit_hits);
+	spin_unlock(&rd->rd_lock);
+
+out:
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_read_ahead_kb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%u\n%s", virt_dev->ra_size_kb,
+		(virt_dev->ra_size_kb == 0) ? "" : SCST_SYSFS_KEY_MARK "\n");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_read_ahead_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+	struct vdisk_ra *ra;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+	ra = virt_dev->ra;
+
+	if (ra == NULL)
+		goto out;
+
+	spin_lock_irq(&ra->ra_lock);
+	pos = scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"streams %lu\nprefetches %lu\nprefetched_mb %llu\n"
+		"hits %lu\nwaits %lu\nmisses %lu\n", ra->streams,
+		ra->prefetches, (unsigned long long)(ra->prefetched_bytes >> 20),
+		ra->hits, ra->waits, ra->misses);
+	spin_unlock_irq(&ra->ra_lock);
+
+out:
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_sysfs_attach_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+
+	TRACE_ENTRY();
+
+	spin_lock(&vdev_attach_stats_lock);
+	pos = scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"attached %lu\nfailed %lu\npending %u\n"
+		"total_probe_ms %llu\nmax_probe_ms %llu (%s)\n",
+		vdev_attach_stats.attached, vdev_attach_stats.failed,
+		vdev_attach_stats.pending,
+		(unsigned long long)div_u64(vdev_attach_stats.total_probe_us, 1000),
+		(unsigned long long)div_u64(vdev_attach_stats.max_probe_us, 1000),
+		vdev_attach_stats.max_probe_name);
+	spin_unlock(&vdev_attach_stats_lock);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
 static ssize_t vdisk_sysfs_o_direct_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -9393,6 +12418,7 @@ static ssize_t vdev_sysfs_cluster_mode_store(struct kobject *kobj,
 	if (res)
 		goto out;
 	work->dev = dev;
+	work->obj_key = (unsigned long)dev;
 	swap(work->buf, arg);
 	kobject_get(&dev->dev_kobj);
 	res = scst_sysfs_queue_wait_work(work);
@@ -9443,6 +12469,7 @@ static ssize_t vdisk_sysfs_resync_size_store(struct kobject *kobj,
 		goto out;
 
 	work->dev = dev;
+	work->obj_key = (unsigned long)dev;
 
 	SCST_SET_DEP_MAP(work, &scst_dev_dep_map);
 	kobject_get(&dev->dev_kobj);
@@ -10132,8 +13159,10 @@ static ssize_t vdev_zero_copy_show(struct kobject *kobj,
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 	virt_dev = dev->dh_priv;
 
+	/* Zero copy is on by default only for vdisk_ramdisk devices */
 	pos = sprintf(buf, "%d\n%s", virt_dev->zero_copy,
-		      virt_dev->zero_copy ? SCST_SYSFS_KEY_MARK "\n" : "");
+		      (virt_dev->zero_copy != virt_dev->ramdisk) ?
+				SCST_SYSFS_KEY_MARK "\n" : "");
 
 	TRACE_EXIT_RES(pos);
 	return pos;
@@ -10927,6 +13956,7 @@ static int __init init_scst_vdisk_driver(void)
 	init_ops(fileio_ops, ARRAY_SIZE(fileio_ops));
 	init_ops(blockio_ops, ARRAY_SIZE(blockio_ops));
 	init_ops(nullio_ops, ARRAY_SIZE(nullio_ops));
+	init_ops(ramdisk_ops, ARRAY_SIZE(ramdisk_ops));
 
 	res = vdev_check_mode_pages_path();
 	if (res != 0)
@@ -10946,6 +13976,17 @@ static int __init init_scst_vdisk_driver(void)
 		goto out_free_vdisk_cache;
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	vdisk_bg_wq = alloc_workqueue("scst_vdisk_bg",
+				      WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+#else
+	vdisk_bg_wq = create_workqueue("scst_vdisk_bg");
+#endif
+	if (vdisk_bg_wq == NULL) {
+		res = -ENOMEM;
+		goto out_free_work_cache;
+	}
+
 	if (num_threads < 1) {
 		PRINT_ERROR("num_threads can not be less than 1, use "
 			"default %d", DEF_NUM_THREADS);
@@ -10954,10 +13995,11 @@ static int __init init_scst_vdisk_driver(void)
 
 	vdisk_file_devtype.threads_num = num_threads;
 	vcdrom_devtype.threads_num = num_threads;
+	vdisk_ramdisk_devtype.threads_num = num_threads;
 
 	res = init_scst_vdisk(&vdisk_file_devtype);
 	if (res != 0)
-		goto out_free_slab;
+		goto out_destroy_wq;
 
 	res = init_scst_vdisk(&vdisk_blk_devtype);
 	if (res != 0)
@@ -10967,13 +14009,20 @@ static int __init init_scst_vdisk_driver(void)
 	if (res != 0)
 		goto out_free_blk;
 
-	res = init_scst_vdisk(&vcdrom_devtype);
+	res = init_scst_vdisk(&vdisk_ramdisk_devtype);
 	if (res != 0)
 		goto out_free_null;
 
+	res = init_scst_vdisk(&vcdrom_devtype);
+	if (res != 0)
+		goto out_free_ramdisk;
+
 out:
 	return res;
 
+out_free_ramdisk:
+	exit_scst_vdisk(&vdisk_ramdisk_devtype);
+
 out_free_null:
 	exit_scst_vdisk(&vdisk_null_devtype);
 
@@ -10983,7 +14032,10 @@ out_free_blk:
 out_free_vdisk:
 	exit_scst_vdisk(&vdisk_file_devtype);
 
-out_free_slab:
+out_destroy_wq:
+	destroy_workqueue(vdisk_bg_wq);
+
+out_free_work_cache:
 	kmem_cache_destroy(blockio_work_cachep);
 
 out_free_vdisk_cache:
@@ -10993,11 +14045,13 @@ out_free_vdisk_cache:
 
 static void __exit exit_scst_vdisk_driver(void)
 {
+	exit_scst_vdisk(&vdisk_ramdisk_devtype);
 	exit_scst_vdisk(&vdisk_null_devtype);
 	exit_scst_vdisk(&vdisk_blk_devtype);
 	exit_scst_vdisk(&vdisk_file_devtype);
 	exit_scst_vdisk(&vcdrom_devtype);
 
+	destroy_workqueue(vdisk_bg_wq);
 	kmem_cache_destroy(blockio_work_cachep);
 	kmem_cache_destroy(vdisk_cmd_param_cachep);
 }
@@ -609,7 +609,7 @@ static void scst_cm_prepare_final_sense(struct scst_cmd *ec_cmd)
 
 		/* THIRD PARTY DEVICE FAILURE */
 
-		rc = scst_alloc_sense(ec_cmd, 0);
+		rc = scst_alloc_sense_len(ec_cmd, 0, SCST_INLINE_SENSE_BUFFERSIZE);
 		if (rc != 0)
 			goto out;
 
@@ -704,11 +704,8 @@ static void scst_cm_prepare_final_sense(struct scst_cmd *ec_cmd)
 	}
 
 	ec_cmd->status = SAM_STAT_CHECK_CONDITION;
-	if (ec_cmd->sense != NULL) {
-		memcpy(ec_cmd->sense, fsense, sense_len);
-		ec_cmd->sense_valid_len = sense_len;
-	} else
-		scst_alloc_set_sense(ec_cmd, 0, fsense, sense_len);
+	/* The existing sense buffer can be too small for the new sense */
+	scst_alloc_set_sense(ec_cmd, 0, fsense, sense_len);
 
 	mempool_free(fsense, scst_sense_mempool);
 
@@ -2661,6 +2658,23 @@ out:
 	return;
 }
 
+/*
+ * Suspends activity of only the copy manager's target. Enough for changes
+ * of its LUNs, which can't affect sessions of other targets.
+ */
+int scst_cm_suspend_activity(unsigned long timeout)
+{
+	if (scst_cm_tgt == NULL)
+		return 0;
+	return scst_suspend_tgt_activity(scst_cm_tgt, timeout);
+}
+
+void scst_cm_resume_activity(void)
+{
+	if (scst_cm_tgt != NULL)
+		scst_resume_tgt_activity(scst_cm_tgt);
+}
+
 void scst_cm_update_dev(struct scst_device *dev)
 {
 	int rc;
@@ -2669,7 +2683,7 @@ void scst_cm_update_dev(struct scst_device *dev)
 
 	TRACE_MGMT_DBG("copy manager: updating device %s", dev->virt_name);
 
-	scst_suspend_activity(SCST_SUSPEND_TIMEOUT_UNLIMITED);
+	scst_cm_suspend_activity(SCST_SUSPEND_TIMEOUT_UNLIMITED);
 	mutex_lock(&scst_mutex);
 
 	scst_cm_dev_unregister(dev, false);
@@ -2684,7 +2698,7 @@ void scst_cm_update_dev(struct scst_device *dev)
 
 out_resume:
 	mutex_unlock(&scst_mutex);
-	scst_resume_activity();
+	scst_cm_resume_activity();
 
 	TRACE_EXIT();
 	return;
@@ -2997,7 +3011,7 @@ static int scst_cm_set_seg_err_sense(struct scst_cmd *cmd, int asc, int ascq,
 	if (res != 0)
 		goto out;
 
-	res = scst_alloc_sense(cmd, 1);
+	res = scst_alloc_sense_len(cmd, 1, SCST_INLINE_SENSE_BUFFERSIZE);
 	if (res != 0) {
 		PRINT_ERROR("Lost COPY ABORTED sense data");
 		goto out;
@@ -3731,6 +3745,8 @@ static struct scst_tgt_template scst_cm_tgtt = {
 #ifndef CONFIG_SCST_PROC
 	.enabled_attr_not_needed = 1,
 #endif
+	/* scst_cm_get_lun() etc. expect tgt_devs for all LUNs */
+	.eager_tgt_devs		= 1,
 	.dif_supported		= 1,
 	.hw_dif_type1_supported = 1,
 	.hw_dif_type2_supported = 1,
@@ -41,11 +41,24 @@ static void scst_dlm_post_ast(void *astarg);
 static inline void compile_time_size_checks(void)
 {
 	BUILD_BUG_ON(sizeof(struct pr_lvb) > PR_DLM_LVB_LEN);
-	BUILD_BUG_ON(sizeof(struct pr_lvb) != 20);
+	BUILD_BUG_ON(offsetof(struct pr_lvb, seq) != 20);
+	BUILD_BUG_ON(sizeof(struct pr_lvb) != PR_DLM_LVB_LEN);
 	BUILD_BUG_ON(sizeof(struct pr_reg_lvb) > PR_DLM_LVB_LEN);
 	BUILD_BUG_ON(sizeof(struct pr_reg_lvb) != 240);
 }
 
+static void scst_dlm_count_lock(struct scst_lksb *lksb)
+{
+	if (lksb->pr_dlm)
+		atomic_inc(&lksb->pr_dlm->nr_lock_calls);
+}
+
+static void scst_dlm_count_unlock(struct scst_lksb *lksb)
+{
+	if (lksb->pr_dlm)
+		atomic_inc(&lksb->pr_dlm->nr_unlock_calls);
+}
+
 static void scst_dlm_ast(void *astarg)
 {
 	struct scst_lksb *scst_lksb = astarg;
@@ -61,6 +74,7 @@ static int scst_dlm_cancel(dlm_lockspace_t *ls, struct scst_lksb *lksb,
 {
 	int res;
 
+	scst_dlm_count_unlock(lksb);
 	res = dlm_unlock(ls, lksb->lksb.sb_lkid,
 			      DLM_LKF_CANCEL | (flags & DLM_LKF_VALBLK),
 			      &lksb->lksb, lksb);
@@ -73,26 +87,39 @@ out:
 }
 
 /**
- * scst_dlm_lock_wait - Wait until a DLM lock has been granted
+ * scst_dlm_lock_async - Submit a DLM lock request without waiting
  * @ls:     DLM lock space.
  * @mode:   DLM lock mode.
  * @lksb:   DLM lock status block.
  * @flags:  DLM flags.
  * @name:   DLM lock name. Only required for non-conversion requests.
  * @bast:   AST to be invoked in case this lock blocks another one.
+ *
+ * Submitting several requests before calling scst_dlm_lock_finish() for each
+ * of them lets the DLM round trips of these requests overlap.
  */
-static int scst_dlm_lock_wait(dlm_lockspace_t *ls, int mode,
-			      struct scst_lksb *lksb, int flags,
-			      const char *name, void (*bast)(void *, int))
+static int scst_dlm_lock_async(dlm_lockspace_t *ls, int mode,
+			       struct scst_lksb *lksb, int flags,
+			       const char *name, void (*bast)(void *, int))
+{
+	init_completion(&lksb->compl);
+	scst_dlm_count_lock(lksb);
+	return dlm_lock(ls, mode, &lksb->lksb, flags,
+			     (void *)name, name ? strlen(name) : 0, 0,
+			     scst_dlm_ast, lksb, bast);
+}
+
+/**
+ * scst_dlm_lock_finish - Wait until a lock request submitted by
+ *	scst_dlm_lock_async() has been granted
+ *
+ * Cancels the lock request if it has not been granted in time.
+ */
+static int scst_dlm_lock_finish(dlm_lockspace_t *ls, struct scst_lksb *lksb,
+				int flags, const char *name)
 {
 	int res;
 
-	init_completion(&lksb->compl);
-	res = dlm_lock(ls, mode, &lksb->lksb, flags,
-			    (void *)name, name ? strlen(name) : 0, 0,
-			    scst_dlm_ast, lksb, bast);
-	if (res < 0)
-		goto out;
 	res = wait_for_completion_timeout(&lksb->compl, 60 * HZ);
 	if (res > 0)
 		res = lksb->lksb.sb_status;
@@ -105,23 +132,53 @@ static int scst_dlm_lock_wait(dlm_lockspace_t *ls, int mode,
 		     name ? : "?", lksb->lksb.sb_lkid, res2);
 	}
 
-out:
 	return res;
 }
 
 /**
- * scst_dlm_unlock_wait - Discard a DLM lock
+ * scst_dlm_lock_wait - Wait until a DLM lock has been granted
+ * @ls:     DLM lock space.
+ * @mode:   DLM lock mode.
+ * @lksb:   DLM lock status block.
+ * @flags:  DLM flags.
+ * @name:   DLM lock name. Only required for non-conversion requests.
+ * @bast:   AST to be invoked in case this lock blocks another one.
  */
-static int scst_dlm_unlock_wait(dlm_lockspace_t *ls, struct scst_lksb *lksb)
+static int scst_dlm_lock_wait(dlm_lockspace_t *ls, int mode,
+			      struct scst_lksb *lksb, int flags,
+			      const char *name, void (*bast)(void *, int))
 {
 	int res;
 
+	res = scst_dlm_lock_async(ls, mode, lksb, flags, name, bast);
+	if (res < 0)
+		goto out;
+	res = scst_dlm_lock_finish(ls, lksb, flags, name);
+
+out:
+	return res;
+}
+
+/**
+ * scst_dlm_unlock_async - Submit a request to discard a DLM lock
+ */
+static int scst_dlm_unlock_async(dlm_lockspace_t *ls, struct scst_lksb *lksb)
+{
 	sBUG_ON(!ls);
 
 	init_completion(&lksb->compl);
-	res = dlm_unlock(ls, lksb->lksb.sb_lkid, 0, &lksb->lksb, lksb);
-	if (res < 0)
-		goto out;
+	scst_dlm_count_unlock(lksb);
+	return dlm_unlock(ls, lksb->lksb.sb_lkid, 0, &lksb->lksb, lksb);
+}
+
+/**
+ * scst_dlm_unlock_finish - Wait until a request submitted by
+ *	scst_dlm_unlock_async() has finished
+ */
+static int scst_dlm_unlock_finish(struct scst_lksb *lksb)
+{
+	int res;
+
 	res = wait_for_completion_timeout(&lksb->compl, 60 * HZ);
 	if (res > 0) {
 		res = lksb->lksb.sb_status;
@@ -131,6 +188,21 @@ static int scst_dlm_unlock_wait(dlm_lockspace_t *ls, struct scst_lksb *lksb)
 		res = -ETIMEDOUT;
 	}
 
+	return res;
+}
+
+/**
+ * scst_dlm_unlock_wait - Discard a DLM lock
+ */
+static int scst_dlm_unlock_wait(dlm_lockspace_t *ls, struct scst_lksb *lksb)
+{
+	int res;
+
+	res = scst_dlm_unlock_async(ls, lksb);
+	if (res < 0)
+		goto out;
+	res = scst_dlm_unlock_finish(lksb);
+
 out:
 	return res;
 }
@@ -156,6 +228,7 @@ static void scst_dlm_pr_init_reg(struct scst_device *dev,
 {
 	reg->lksb.lksb.sb_lvbptr = (void *)reg->lvb;
 	reg->lksb.lksb.sb_lkid = 0;
+	reg->lksb.pr_dlm = dev->pr_dlm;
 	reg->dlm_idx = -1;
 }
 
@@ -230,10 +303,36 @@ static bool scst_copy_res_from_dlm(struct scst_device *dev, struct pr_lvb *lvb)
 	return modified_lvb;
 }
 
+/*
+ * Whether PR_REG_LOCK slot @i has to be reread from the DLM. If @delta is
+ * false, all slots have to be reread. Otherwise only the slots that have been
+ * modified by the update that set pr_lvb.seq have to be reread.
+ */
+static bool scst_reg_lvb_changed(const struct scst_pr_dlm_data *pr_dlm,
+				 const struct pr_lvb *lvb, bool delta, int i)
+{
+	if (!delta)
+		return true;
+	if (be32_to_cpu(lvb->seq) == pr_dlm->lvb_seq)
+		return false;
+	return i >= PR_LVB_DIRTY_BITS || (lvb->dirty[i / 8] & (1 << (i % 8)));
+}
+
+static void scst_reg_lvb_mark_dirty(struct pr_lvb *lvb, int i)
+{
+	if (i < PR_LVB_DIRTY_BITS)
+		lvb->dirty[i / 8] |= 1 << (i % 8);
+}
+
 /*
  * Update local PR and registrant information from the content of the DLM LVB's.
  * Caller must hold PR_DATA_LOCK in PW mode.
  *
+ * If the local state reflects the update that preceded the current one, only
+ * the registrant LVBs that have been marked as modified in the PR_DATA_LOCK
+ * LVB are reread. All lock requests are submitted before waiting for any of
+ * them such that the DLM round trips overlap.
+ *
  * Returns -EINVAL if and only if an invalid lock value block has been
  * encountered.
  */
@@ -244,13 +343,18 @@ static int scst_copy_from_dlm(struct scst_device *dev, dlm_lockspace_t *ls,
 	struct pr_lvb *lvb = (void *)pr_dlm->lvb;
 	struct scst_lksb *reg_lksb = NULL;
 	struct scst_dev_registrant *reg, *tmp_reg;
-	int i, res = -ENOMEM;
-	uint32_t nr_registrants;
+	int i, res = -ENOMEM, res2, submitted;
+	uint32_t nr_registrants, seq;
 	void *reg_lvb_content = NULL;
+	char reg_name[32];
+	bool delta, failed = false;
 
 	lockdep_assert_held(&pr_dlm->ls_mutex);
 
 	nr_registrants = be32_to_cpu(lvb->nr_registrants);
+	seq = be32_to_cpu(lvb->seq);
+	delta = !pr_dlm->full_sync_needed && lvb->version >= 2 &&
+		(seq == pr_dlm->lvb_seq || seq == pr_dlm->lvb_seq + 1);
 	if (nr_registrants) {
 		reg_lksb = vzalloc((sizeof(*reg_lksb) + PR_DLM_LVB_LEN) *
 				   nr_registrants);
@@ -264,33 +368,58 @@ static int scst_copy_from_dlm(struct scst_device *dev, dlm_lockspace_t *ls,
 			nr_registrants * sizeof(*reg_lksb);
 	}
 
+	res = 0;
 	for (i = 0; i < nr_registrants; i++) {
-		char reg_name[32];
-		struct pr_reg_lvb *reg_lvb;
-
+		if (!scst_reg_lvb_changed(pr_dlm, lvb, delta, i))
+			continue;
 		snprintf(reg_name, sizeof(reg_name), PR_REG_LOCK, i);
-		reg_lvb = reg_lvb_content + i * PR_DLM_LVB_LEN;
-		reg_lksb[i].lksb.sb_lvbptr = (void *)reg_lvb;
-		res = scst_dlm_lock_wait(ls, DLM_LOCK_PW, &reg_lksb[i],
-					 DLM_LKF_VALBLK, reg_name, NULL);
+		reg_lksb[i].lksb.sb_lvbptr = reg_lvb_content +
+			i * PR_DLM_LVB_LEN;
+		reg_lksb[i].pr_dlm = pr_dlm;
+		res = scst_dlm_lock_async(ls, DLM_LOCK_PW, &reg_lksb[i],
+					  DLM_LKF_VALBLK, reg_name, NULL);
 		if (res < 0) {
 			res = -EFAULT;
 			PRINT_ERROR("locking %s.%s failed", dev->virt_name,
 				    reg_name);
-			goto cancel;
+			break;
+		}
+	}
+	submitted = i;
+
+	for (i = 0; i < submitted; i++) {
+		struct pr_reg_lvb *reg_lvb;
+
+		if (!reg_lksb[i].lksb.sb_lvbptr)
+			continue;
+		snprintf(reg_name, sizeof(reg_name), PR_REG_LOCK, i);
+		reg_lvb = (void *)reg_lksb[i].lksb.sb_lvbptr;
+		res2 = scst_dlm_lock_finish(ls, &reg_lksb[i], DLM_LKF_VALBLK,
+					    reg_name);
+		if (res2 < 0) {
+			res2 = -EFAULT;
+			PRINT_ERROR("locking %s.%s failed", dev->virt_name,
+				    reg_name);
 		} else if (reg_lksb[i].lksb.sb_flags & DLM_SBF_VALNOTVALID) {
-			res = -EINVAL;
+			res2 = -EINVAL;
 			PRINT_WARNING("%s.%s has an invalid lock value block",
 				      dev->virt_name, reg_name);
-			goto cancel;
 		} else if (reg_lvb->version != 1) {
-			res = -EPROTONOSUPPORT;
+			res2 = -EPROTONOSUPPORT;
 			PRINT_ERROR("%s.%s.version = %d instead of 1",
 				    dev->virt_name, reg_name,
 				    reg_lvb->version);
-			goto cancel;
 		}
+		if (res2 < 0 && res == 0)
+			res = res2;
 	}
+	if (res < 0)
+		goto cancel;
+
+	if (delta)
+		atomic_inc(&pr_dlm->nr_delta_rereads);
+	else
+		atomic_inc(&pr_dlm->nr_full_rereads);
 
 	*modified_lvb = scst_copy_res_from_dlm(dev, lvb);
 
@@ -305,12 +434,16 @@ static int scst_copy_from_dlm(struct scst_device *dev, dlm_lockspace_t *ls,
 
 	list_for_each_entry(reg, &dev->dev_registrants_list,
 			    dev_registrants_list_entry)
-		scst_dlm_pr_rm_reg_ls(ls, reg);
+		if (reg->dlm_idx < 0 || reg->dlm_idx >= nr_registrants ||
+		    scst_reg_lvb_changed(pr_dlm, lvb, delta, reg->dlm_idx))
+			scst_dlm_pr_rm_reg_ls(ls, reg);
 
 	for (i = 0; i < nr_registrants; i++) {
 		struct pr_reg_lvb *reg_lvb;
 		uint16_t rel_tgt_id;
 
+		if (!reg_lksb[i].lksb.sb_lkid)
+			continue;
 		reg_lvb = (struct pr_reg_lvb *)reg_lksb[i].lksb.sb_lvbptr;
 		rel_tgt_id = be16_to_cpu(reg_lvb->rel_tgt_id);
 #if 0
@@ -332,22 +465,28 @@ static int scst_copy_from_dlm(struct scst_device *dev, dlm_lockspace_t *ls,
 			scst_dlm_pr_rm_reg_ls(ls, reg);
 			reg->lksb.lksb.sb_lkid = reg_lksb[i].lksb.sb_lkid;
 			reg->dlm_idx = i;
-			memcpy(reg->lvb, reg_lvb_content, sizeof(reg->lvb));
-			if (reg_lvb->is_holder) {
-				if (dev->pr_is_set)
-					scst_pr_clear_holder(dev);
-				scst_pr_set_holder(dev, reg, lvb->pr_scope,
-						   lvb->pr_type);
-			}
+			memcpy(reg->lvb, reg_lvb, sizeof(reg->lvb));
 		} else {
 			PRINT_ERROR("pr_add_registrant %s." PR_REG_LOCK
 				    " failed\n", dev->virt_name, i);
 			scst_dlm_unlock_wait(ls, &reg_lksb[i]);
+			failed = true;
 			continue;
 		}
-		scst_dlm_lock_wait(ls, DLM_LOCK_CR, &reg->lksb,
-				   DLM_LKF_CONVERT | DLM_LKF_VALBLK, NULL,
-				   NULL);
+		snprintf(reg_name, sizeof(reg_name), PR_REG_LOCK, i);
+		if (scst_dlm_lock_async(ls, DLM_LOCK_CR, &reg->lksb,
+					DLM_LKF_CONVERT | DLM_LKF_VALBLK,
+					reg_name, NULL) >= 0)
+			reg->dlm_pending = true;
+	}
+
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry) {
+		if (!reg->dlm_pending)
+			continue;
+		reg->dlm_pending = false;
+		scst_dlm_lock_finish(ls, &reg->lksb,
+				     DLM_LKF_CONVERT | DLM_LKF_VALBLK, NULL);
 	}
 
 	/* Remove all registrants not found in any DLM LVB */
@@ -356,13 +495,27 @@ static int scst_copy_from_dlm(struct scst_device *dev, dlm_lockspace_t *ls,
 		if (reg->lksb.lksb.sb_lkid == 0)
 			scst_pr_remove_registrant(dev, reg);
 
+	/*
+	 * Registrants whose LVB has not been reread keep their cached LVB
+	 * copy, so look up the reservation holder in these copies.
+	 */
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry) {
+		struct pr_reg_lvb *reg_lvb = (void *)reg->lvb;
+
+		if (reg_lvb->is_holder)
+			scst_pr_set_holder(dev, reg, lvb->pr_scope,
+					   lvb->pr_type);
+	}
+
 #ifndef CONFIG_SCST_PROC
 	scst_pr_sync_device_file(dev);
 #endif
 
 	scst_pr_write_unlock(dev);
 
-	res = 0;
+	pr_dlm->lvb_seq = seq;
+	pr_dlm->full_sync_needed = failed || lvb->version < 2;
 
 out:
 	vfree(reg_lksb);
@@ -372,6 +525,7 @@ cancel:
 	for (i = 0; i < nr_registrants; i++)
 		if (reg_lksb[i].lksb.sb_lkid)
 			scst_dlm_unlock_wait(ls, &reg_lksb[i]);
+	pr_dlm->full_sync_needed = true;
 
 	goto out;
 }
@@ -413,34 +567,70 @@ static void scst_copy_res_to_dlm(struct scst_device *dev, struct pr_lvb *lvb)
 	spin_unlock_bh(&dev->dev_lock);
 }
 
+/* Compute the PR_REG_LOCK LVB contents for registrant @reg. */
+static void scst_fill_reg_lvb(struct scst_device *dev,
+			      struct scst_dev_registrant *reg,
+			      struct pr_reg_lvb *reg_lvb)
+{
+	int tid_size;
+
+	memset(reg_lvb, 0, sizeof(*reg_lvb));
+	reg_lvb->key = reg->key;
+	reg_lvb->rel_tgt_id = cpu_to_be16(reg->rel_tgt_id);
+	reg_lvb->version = 1;
+	reg_lvb->is_holder = dev->pr_holder == reg;
+	tid_size = scst_tid_size(reg->transport_id);
+#if 0
+	PRINT_INFO("Copying transport ID into %s." PR_REG_LOCK " (len %d)",
+		   dev->virt_name, reg->dlm_idx, tid_size);
+	print_hex_dump(KERN_DEBUG, "", DUMP_PREFIX_OFFSET, 16, 1,
+		       reg->transport_id, tid_size, 1);
+#endif
+	if (WARN(tid_size > sizeof(reg_lvb->tid), "tid_size %d > %zd\n",
+		 tid_size, sizeof(reg_lvb->tid)))
+		tid_size = sizeof(reg_lvb->tid);
+	memcpy(reg_lvb->tid, reg->transport_id, tid_size);
+}
+
 /*
  * Update PR and registrant information in the DLM LVB's. Caller must hold
  * PR_DATA_LOCK in PW mode.
+ *
+ * Unless @full is true, registrant LVBs whose contents did not change are
+ * not rewritten. The slots that have been rewritten are recorded in the
+ * PR_DATA_LOCK LVB such that other nodes only have to reread these.
  */
-static void scst_copy_to_dlm(struct scst_device *dev, dlm_lockspace_t *ls)
+static void scst_copy_to_dlm(struct scst_device *dev, dlm_lockspace_t *ls,
+			     bool full)
 {
 	struct scst_pr_dlm_data *const pr_dlm = dev->pr_dlm;
 	struct pr_lvb *lvb = (void *)pr_dlm->lvb;
-	struct pr_reg_lvb *reg_lvb;
+	struct pr_reg_lvb new_lvb;
 	struct scst_dev_registrant *reg;
-	int i, tid_size;
+	int i;
 	char reg_name[32];
 	uint32_t nr_registrants;
+	bool failed = false;
 
 	lockdep_assert_held(&pr_dlm->ls_mutex);
 
+	full |= pr_dlm->full_sync_needed;
+
 	scst_copy_res_to_dlm(dev, lvb);
 
 	scst_pr_write_lock(dev);
 
 	nr_registrants = scst_pr_num_regs(dev);
-	lvb->version = 1;
+	lvb->version = 2;
 	lvb->pr_is_set = dev->pr_is_set;
 	lvb->pr_type = dev->pr_type;
 	lvb->pr_scope = dev->pr_scope;
 	lvb->pr_aptpl = dev->pr_aptpl;
 	lvb->nr_registrants = cpu_to_be32(nr_registrants);
 	lvb->pr_generation = cpu_to_be32(dev->pr_generation);
+	pr_dlm->lvb_seq = be32_to_cpu(lvb->seq) + 1;
+	lvb->seq = cpu_to_be32(pr_dlm->lvb_seq);
+	memset(lvb->dirty, 0, sizeof(lvb->dirty));
 
 	list_for_each_entry(reg, &dev->dev_registrants_list,
 			    dev_registrants_list_entry) {
@@ -449,49 +639,86 @@ static void scst_copy_to_dlm(struct scst_device *dev, dlm_lockspace_t *ls)
 		if (reg->dlm_idx < 0) {
 			i = scst_get_available_dlm_idx(dev);
 			snprintf(reg_name, sizeof(reg_name), PR_REG_LOCK, i);
-			if (scst_dlm_lock_wait(ls, DLM_LOCK_NL,
-					       &reg->lksb, 0, reg_name, NULL)
-			    >= 0)
+			if (scst_dlm_lock_async(ls, DLM_LOCK_NL, &reg->lksb, 0,
+						reg_name, NULL) >= 0) {
 				reg->dlm_idx = i;
+				reg->dlm_pending = true;
+			}
+		}
+	}
+
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry) {
+		if (!reg->dlm_pending)
+			continue;
+		reg->dlm_pending = false;
+		snprintf(reg_name, sizeof(reg_name), PR_REG_LOCK,
+			 reg->dlm_idx);
+		if (scst_dlm_lock_finish(ls, &reg->lksb, 0, reg_name) < 0) {
+			reg->lksb.lksb.sb_lkid = 0;
+			reg->dlm_idx = -1;
+			failed = true;
+			continue;
 		}
+		/* Make sure that the LVB of a newly assigned slot is written. */
+		memset(reg->lvb, 0, sizeof(reg->lvb));
 	}
 
 	list_for_each_entry(reg, &dev->dev_registrants_list,
 			    dev_registrants_list_entry) {
 		if (WARN_ON(!reg->lksb.lksb.sb_lkid))
 			continue;
+		scst_fill_reg_lvb(dev, reg, &new_lvb);
+		if (!full && memcmp(&new_lvb, reg->lvb, sizeof(new_lvb)) == 0) {
+			atomic_inc(&pr_dlm->nr_reg_lvb_skipped);
+			continue;
+		}
 		snprintf(reg_name, sizeof(reg_name), PR_REG_LOCK, reg->dlm_idx);
-		if (scst_dlm_lock_wait(ls, DLM_LOCK_PW, &reg->lksb,
-				       DLM_LKF_VALBLK | DLM_LKF_CONVERT,
-				       reg_name, NULL) >= 0) {
-			reg_lvb = (void *)reg->lksb.lksb.sb_lvbptr;
-			memset(reg->lvb, 0, sizeof(reg->lvb));
-			reg_lvb->key = reg->key;
-			reg_lvb->rel_tgt_id = cpu_to_be16(reg->rel_tgt_id);
-			reg_lvb->version = 1;
-			reg_lvb->is_holder = dev->pr_holder == reg;
-			tid_size = scst_tid_size(reg->transport_id);
-#if 0
-			PRINT_INFO("Copying transport ID into %s." PR_REG_LOCK
-				   " (len %d)", dev->virt_name, reg->dlm_idx,
-				   tid_size);
-			print_hex_dump(KERN_DEBUG, "", DUMP_PREFIX_OFFSET, 16,
-				       1, reg->transport_id, tid_size, 1);
-#endif
-			if (WARN(tid_size > sizeof(reg_lvb->tid),
-				 "tid_size %d > %zd\n", tid_size,
-				 sizeof(reg_lvb->tid)))
-				tid_size = sizeof(reg_lvb->tid);
-			memcpy(reg_lvb->tid, reg->transport_id, tid_size);
-			scst_dlm_lock_wait(ls, DLM_LOCK_CR, &reg->lksb,
-					   DLM_LKF_CONVERT | DLM_LKF_VALBLK,
-					   reg_name, NULL);
+		if (scst_dlm_lock_async(ls, DLM_LOCK_PW, &reg->lksb,
+					DLM_LKF_VALBLK | DLM_LKF_CONVERT,
+					reg_name, NULL) >= 0) {
+			reg->dlm_pending = true;
 		} else {
 			PRINT_ERROR("Failed to lock %s.%s", dev->virt_name,
 				    reg_name);
+			failed = true;
+		}
+	}
+
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry) {
+		if (!reg->dlm_pending)
+			continue;
+		snprintf(reg_name, sizeof(reg_name), PR_REG_LOCK, reg->dlm_idx);
+		if (scst_dlm_lock_finish(ls, &reg->lksb,
+					 DLM_LKF_VALBLK | DLM_LKF_CONVERT,
+					 reg_name) < 0) {
+			PRINT_ERROR("Failed to lock %s.%s", dev->virt_name,
+				    reg_name);
+			reg->dlm_pending = false;
+			failed = true;
+			continue;
 		}
+		scst_fill_reg_lvb(dev, reg, (void *)reg->lvb);
+		scst_reg_lvb_mark_dirty(lvb, reg->dlm_idx);
+		atomic_inc(&pr_dlm->nr_reg_lvb_writes);
+		if (scst_dlm_lock_async(ls, DLM_LOCK_CR, &reg->lksb,
+					DLM_LKF_CONVERT | DLM_LKF_VALBLK,
+					reg_name, NULL) < 0)
+			reg->dlm_pending = false;
 	}
 
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry) {
+		if (!reg->dlm_pending)
+			continue;
+		reg->dlm_pending = false;
+		scst_dlm_lock_finish(ls, &reg->lksb,
+				     DLM_LKF_CONVERT | DLM_LKF_VALBLK, NULL);
+	}
+
+	pr_dlm->full_sync_needed = failed;
+
 	scst_pr_write_unlock(dev);
 }
 
@@ -636,19 +863,82 @@ out:
 	return ret;
 }
 
+/* Per-node state of a scst_pr_toggle_lock() call. */
+struct scst_dlm_toggle {
+	struct scst_lksb lksb;
+	bool		 pending;
+};
+
 /*
  * Toggle all non-local DLM locks with name format @fmt from NL to PR and back
- * to NL.
+ * to NL. The lock requests for all nodes are submitted before waiting for any
+ * of them such that the other nodes process the notification concurrently.
  */
 static void scst_pr_toggle_lock(struct scst_pr_dlm_data *pr_dlm,
 				dlm_lockspace_t *ls, const char *fmt)
 {
+	struct scst_dlm_toggle *t;
 	struct scst_lksb lksb;
-	int i, res;
+	int i, res, n = pr_dlm->participants;
 	char lock_name[32];
 
+	t = kcalloc(n, sizeof(*t), GFP_KERNEL);
+	if (!t)
+		goto serial;
+
+	for (i = 0; i < n; i++) {
+		if (pr_dlm->nodeid[i] == pr_dlm->local_nodeid)
+			continue;
+		snprintf(lock_name, sizeof(lock_name), fmt, pr_dlm->nodeid[i]);
+		t[i].lksb.pr_dlm = pr_dlm;
+		res = scst_dlm_lock_async(ls, DLM_LOCK_PR, &t[i].lksb, 0,
+					  lock_name, NULL);
+		if (res < 0)
+			PRINT_WARNING("Locking %s.%s failed (%d)",
+				      pr_dlm->dev->virt_name, lock_name, res);
+		else
+			t[i].pending = true;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!t[i].pending)
+			continue;
+		t[i].pending = false;
+		snprintf(lock_name, sizeof(lock_name), fmt, pr_dlm->nodeid[i]);
+		res = scst_dlm_lock_finish(ls, &t[i].lksb, 0, lock_name);
+		if (res < 0)
+			PRINT_WARNING("Locking %s.%s failed (%d)",
+				      pr_dlm->dev->virt_name, lock_name, res);
+		if (!t[i].lksb.lksb.sb_lkid)
+			continue;
+		if (scst_dlm_lock_async(ls, DLM_LOCK_NL, &t[i].lksb,
+					DLM_LKF_CONVERT, lock_name, NULL) >= 0)
+			t[i].pending = true;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (t[i].pending) {
+			snprintf(lock_name, sizeof(lock_name), fmt,
+				 pr_dlm->nodeid[i]);
+			scst_dlm_lock_finish(ls, &t[i].lksb, DLM_LKF_CONVERT,
+					     lock_name);
+		}
+		if (!t[i].lksb.lksb.sb_lkid)
+			continue;
+		t[i].pending = scst_dlm_unlock_async(ls, &t[i].lksb) >= 0;
+	}
+
+	for (i = 0; i < n; i++)
+		if (t[i].pending)
+			scst_dlm_unlock_finish(&t[i].lksb);
+
+	kfree(t);
+	return;
+
+serial:
 	memset(&lksb, 0, sizeof(lksb));
-	for (i = 0; i < pr_dlm->participants; i++) {
+	lksb.pr_dlm = pr_dlm;
+	for (i = 0; i < n; i++) {
 		if (pr_dlm->nodeid[i] == pr_dlm->local_nodeid)
 			continue;
 		snprintf(lock_name, sizeof(lock_name), fmt, pr_dlm->nodeid[i]);
@@ -832,6 +1122,7 @@ static dlm_lockspace_t *get_lockspace(struct scst_device *dev)
 	PRINT_INFO("Created DLM lockspace %s for %s", lsp_name, dev->virt_name);
 
 	memset(&pr_lksb, 0, sizeof(pr_lksb));
+	pr_lksb.pr_dlm = pr_dlm;
 	res = scst_dlm_lock_wait(ls, DLM_LOCK_EX, &pr_lksb, 0, PR_LOCK,
 				 NULL);
 	if (res < 0)
@@ -885,9 +1176,10 @@ static dlm_lockspace_t *get_lockspace(struct scst_device *dev)
 
 	switch (lvb->version) {
 	case 0:
-		scst_copy_to_dlm(dev, ls);
+		scst_copy_to_dlm(dev, ls, true);
 		break;
 	case 1:
+	case 2:
 		res = scst_copy_from_dlm(dev, ls, &modified_lvb);
 		break;
 	default:
@@ -957,6 +1249,10 @@ static void scst_dlm_pr_write_lock(struct scst_device *dev,
 	if (!ls)
 		goto out;
 
+	pr_dlm->pr_out_start_lock_calls = atomic_read(&pr_dlm->nr_lock_calls);
+	pr_dlm->pr_out_start_unlock_calls =
+		atomic_read(&pr_dlm->nr_unlock_calls);
+	pr_lksb->pr_dlm = pr_dlm;
 	scst_dlm_lock_wait(ls, DLM_LOCK_EX, pr_lksb, 0, PR_LOCK, NULL);
 	if (pr_lksb->lksb.sb_lkid) {
 		scst_pr_toggle_lock(pr_dlm, ls, PR_POST_UPDATE_LOCK);
@@ -987,12 +1283,22 @@ static void scst_dlm_pr_write_unlock(struct scst_device *dev,
 	if (!pr_lksb->lksb.sb_lkid)
 		return;
 
-	scst_copy_to_dlm(dev, ls);
+	scst_copy_to_dlm(dev, ls, false);
 	scst_dlm_lock_wait(ls, DLM_LOCK_CR, &pr_dlm->data_lksb,
 			   DLM_LKF_CONVERT | DLM_LKF_VALBLK, PR_DATA_LOCK,
 			   NULL);
 	scst_pr_toggle_lock(pr_dlm, ls, PR_POST_UPDATE_LOCK);
 	scst_dlm_unlock_wait(ls, pr_lksb);
+
+	/* Statistics only, hence no further synchronization. */
+	pr_dlm->last_pr_out_lock_calls = atomic_read(&pr_dlm->nr_lock_calls) -
+		pr_dlm->pr_out_start_lock_calls;
+	pr_dlm->last_pr_out_unlock_calls =
+		atomic_read(&pr_dlm->nr_unlock_calls) -
+		pr_dlm->pr_out_start_unlock_calls;
+	pr_dlm->max_pr_out_lock_calls = max(pr_dlm->max_pr_out_lock_calls,
+					    pr_dlm->last_pr_out_lock_calls);
+	pr_dlm->nr_pr_out++;
 }
 
 static bool scst_dlm_reserved(struct scst_device *dev)
@@ -1016,6 +1322,7 @@ static void scst_dlm_res_lock(struct scst_device *dev,
 	if (!ls)
 		goto out;
 
+	pr_lksb->pr_dlm = pr_dlm;
 	scst_dlm_lock_wait(ls, DLM_LOCK_EX, pr_lksb, 0, PR_LOCK, NULL);
 	if (pr_lksb->lksb.sb_lkid) {
 		scst_dlm_lock_wait(ls, DLM_LOCK_PW, &pr_dlm->data_lksb,
@@ -1045,7 +1352,7 @@ static void scst_dlm_res_unlock(struct scst_device *dev,
 		      pr_dlm->reserved_by_nodeid);
 
 	if (update_lvb)
-		scst_copy_to_dlm(dev, ls);
+		scst_copy_to_dlm(dev, ls, false);
 	scst_dlm_lock_wait(ls, DLM_LOCK_CR, &pr_dlm->data_lksb,
 			   DLM_LKF_CONVERT | DLM_LKF_VALBLK, PR_DATA_LOCK,
 			   NULL);
@@ -1189,12 +1496,13 @@ static void scst_copy_to_dlm_work(struct work_struct *work)
 		PRINT_INFO("%s.%s LVB not valid\n", dev->virt_name,
 			   PR_DATA_LOCK);
 
-	scst_copy_to_dlm(dev, ls);
+	scst_copy_to_dlm(dev, ls, true);
 	scst_dlm_lock_wait(ls, DLM_LOCK_CR, &pr_dlm->data_lksb,
 			   DLM_LKF_CONVERT | DLM_LKF_VALBLK, PR_DATA_LOCK,
 			   NULL);
 
 unlock_pr:
+	scst_dlm_count_lock(&pr_dlm->post_join_lksb);
 	dlm_lock(ls, DLM_LOCK_NL, &pr_dlm->post_join_lksb.lksb,
 		      DLM_LKF_CONVERT, NULL, 0, 0, scst_dlm_post_ast,
 		      &pr_dlm->post_join_lksb, scst_dlm_post_bast);
@@ -1264,6 +1572,7 @@ static void scst_copy_from_dlm_work(struct work_struct *work)
 			   NULL);
 
 unlock_pr:
+	scst_dlm_count_lock(&pr_dlm->post_upd_lksb);
 	dlm_lock(ls, DLM_LOCK_NL, &pr_dlm->post_upd_lksb.lksb,
 		      DLM_LKF_CONVERT, NULL, 0, 0, scst_dlm_post_ast,
 		      &pr_dlm->post_upd_lksb, scst_dlm_post_bast);
@@ -1303,6 +1612,7 @@ static void scst_reread_lvb_work(struct work_struct *work)
 	if (!ls)
 		goto unlock_ls;
 	memset(&pr_lksb, 0, sizeof(pr_lksb));
+	pr_lksb.pr_dlm = pr_dlm;
 	res = scst_dlm_lock_wait(ls, DLM_LOCK_EX, &pr_lksb, 0, PR_LOCK,
 				 NULL);
 	if (res >= 0)
@@ -1334,6 +1644,7 @@ static void scst_lvb_upd_work(struct work_struct *work)
 	if (!ls)
 		goto unlock_ls;
 	memset(&lksb, 0, sizeof(lksb));
+	lksb.pr_dlm = pr_dlm;
 	res = scst_dlm_lock_wait(ls, DLM_LOCK_EX, &lksb, 0, PR_LOCK, NULL);
 	if (res >= 0)
 		scst_trigger_lvb_update(pr_dlm, ls);
@@ -1372,10 +1683,6 @@ static int scst_pr_dlm_init(struct scst_device *dev, const char *cl_dev_id)
 
 	compile_time_size_checks();
 
-	list_for_each_entry(reg, &dev->dev_registrants_list,
-			    dev_registrants_list_entry)
-		scst_dlm_pr_init_reg(dev, reg);
-
 	pr_dlm = kzalloc(sizeof(*dev->pr_dlm), GFP_KERNEL);
 	if (!pr_dlm)
 		goto out;
@@ -1384,6 +1691,12 @@ static int scst_pr_dlm_init(struct scst_device *dev, const char *cl_dev_id)
 	mutex_init(&pr_dlm->ls_cr_mutex);
 	mutex_init(&pr_dlm->ls_mutex);
 	pr_dlm->data_lksb.lksb.sb_lvbptr = pr_dlm->lvb;
+	pr_dlm->data_lksb.pr_dlm = pr_dlm;
+	pr_dlm->full_sync_needed = true;
+
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry)
+		scst_dlm_pr_init_reg(dev, reg);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
 	INIT_WORK(&pr_dlm->pre_join_work, scst_pre_join_work, pr_dlm);
 	INIT_WORK(&pr_dlm->pre_upd_work, scst_pre_upd_work, pr_dlm);
@@ -1468,6 +1781,7 @@ static void scst_pr_dlm_cleanup(struct scst_device *dev)
 	ls = pr_dlm->ls;
 	if (ls) {
 		memset(&pr_lksb, 0, sizeof(pr_lksb));
+		pr_lksb.pr_dlm = pr_dlm;
 
 		mutex_lock(&pr_dlm->ls_mutex);
 		scst_dlm_lock_wait(ls, DLM_LOCK_EX, &pr_lksb, 0, PR_LOCK, NULL);
@@ -1498,6 +1812,36 @@ static void scst_pr_dlm_cleanup(struct scst_device *dev)
 	dev->pr_dlm = NULL;
 }
 
+static ssize_t scst_dlm_pr_show_stats(struct scst_device *dev, char *buf)
+{
+	struct scst_pr_dlm_data *const pr_dlm = dev->pr_dlm;
+
+	if (!pr_dlm)
+		return 0;
+
+	return sprintf(buf,
+		"dlm_lock_calls %u\n"
+		"dlm_unlock_calls %u\n"
+		"pr_out %u\n"
+		"last_pr_out_lock_calls %u\n"
+		"last_pr_out_unlock_calls %u\n"
+		"max_pr_out_lock_calls %u\n"
+		"reg_lvb_writes %u\n"
+		"reg_lvb_skipped %u\n"
+		"full_rereads %u\n"
+		"delta_rereads %u\n",
+		atomic_read(&pr_dlm->nr_lock_calls),
+		atomic_read(&pr_dlm->nr_unlock_calls),
+		pr_dlm->nr_pr_out,
+		pr_dlm->last_pr_out_lock_calls,
+		pr_dlm->last_pr_out_unlock_calls,
+		pr_dlm->max_pr_out_lock_calls,
+		atomic_read(&pr_dlm->nr_reg_lvb_writes),
+		atomic_read(&pr_dlm->nr_reg_lvb_skipped),
+		atomic_read(&pr_dlm->nr_full_rereads),
+		atomic_read(&pr_dlm->nr_delta_rereads));
+}
+
 const struct scst_cl_ops scst_dlm_cl_ops = {
 	.pr_init		= scst_pr_dlm_init,
 	.pr_cleanup		= scst_pr_dlm_cleanup,
@@ -1512,6 +1856,7 @@ const struct scst_cl_ops scst_dlm_cl_ops = {
 	.is_rsv_holder		= scst_dlm_is_rsv_holder,
 	.is_not_rsv_holder	= scst_dlm_is_not_rsv_holder,
 	.reserve		= scst_dlm_reserve,
+	.pr_show_stats		= scst_dlm_pr_show_stats,
 };
 
 #endif
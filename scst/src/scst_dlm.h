@@ -109,19 +109,55 @@ struct scst_pr_dlm_data {
 
 	/* SPC-2 reservation state information. */
 	uint32_t reserved_by_nodeid;
+
+	/*
+	 * Sequence number of the PR_DATA_LOCK LVB contents this node has
+	 * seen most recently and whether the local registrant LVB copies
+	 * may be out of sync with the DLM, e.g. because a DLM operation
+	 * failed. Protected by ls_mutex.
+	 */
+	uint32_t lvb_seq;
+	bool	 full_sync_needed;
+
+	/*
+	 * Statistics. nr_lock_calls and nr_unlock_calls count all dlm_lock()
+	 * and dlm_unlock() calls made for this lockspace. The pr_out_*
+	 * members record these numbers for the most recent PR OUT command.
+	 */
+	atomic_t nr_lock_calls;
+	atomic_t nr_unlock_calls;
+	atomic_t nr_full_rereads;
+	atomic_t nr_delta_rereads;
+	atomic_t nr_reg_lvb_writes;
+	atomic_t nr_reg_lvb_skipped;
+	unsigned int nr_pr_out;
+	unsigned int pr_out_start_lock_calls;
+	unsigned int pr_out_start_unlock_calls;
+	unsigned int last_pr_out_lock_calls;
+	unsigned int last_pr_out_unlock_calls;
+	unsigned int max_pr_out_lock_calls;
 };
 
+/*
+ * Number of PR_REG_LOCK slots tracked in the pr_lvb.dirty bitmap. Slots with a
+ * higher index are always considered to have been modified.
+ */
+#define PR_LVB_DIRTY_BITS	(8 * (PR_DLM_LVB_LEN - 24))
+
 /**
  * struct pr_lvb - PR_DATA_LOCK LVB data format
  * @nr_registrants: number of reservation keys that have been registered
  * @pr_generation:  persistent reservation generation
- * @version:	    version of this structure
+ * @version:	    version of this structure. Version 2 adds @seq and @dirty.
  * @pr_is_set:	    whether the device has been reserved persistently
  * @pr_type:	    persistent reservation type
  * @pr_scope:	    persistent reservation scope
  * @pr_aptpl:	    persistent reservation APTPL
  * @reserved_by_nodeid: Corosync node ID of the node holding an SPC-2
  *                  reservation. Zero if no SPC-2 reservation is held.
+ * @seq:	    incremented each time the PR state is copied to the DLM.
+ * @dirty:	    bitmap with one bit per PR_REG_LOCK slot that has been
+ *                  modified by the update that set @seq.
  */
 struct pr_lvb {
 	__be32	nr_registrants;
@@ -133,6 +169,8 @@ struct pr_lvb {
 	u8	pr_aptpl;
 	u8      reserved[3];
 	__be32  reserved_by_nodeid;
+	__be32	seq;
+	u8	dirty[PR_LVB_DIRTY_BITS / 8];
 };
 
 /**
@@ -712,25 +712,29 @@ out:
 	return res;
 }
 
-/* scst_event_mutex supposed to be held. Might drop it, then get back. */
-static int scst_event_user_next_event(struct scst_event_priv *priv,
-	void __user *arg)
+/*
+ * scst_event_mutex supposed to be held. Might drop it, then get back.
+ *
+ * Copies the first queued event into out_event. If there is no queued event,
+ * waits for one if wait is true and the file is in blocking mode. If the event
+ * doesn't fit in max_event_size bytes, returns -ENOSPC and stores the needed
+ * size in *needed_size.
+ */
+static int scst_event_get_one_event(struct scst_event_priv *priv,
+	struct scst_event __user *out_event, int32_t max_event_size,
+	int32_t *needed_size, bool wait)
 {
 	int res, rc;
-	int32_t max_event_size, needed_size;
 	struct scst_event_entry *event_entry;
-	struct scst_event_user __user *event_user = arg;
 
 	TRACE_ENTRY();
 
-	res = get_user(max_event_size, (int32_t __user *)arg);
-	if (res != 0) {
-		PRINT_ERROR("Failed to get max event size: %d", res);
-		goto out;
-	};
-
 	/* Waiting for at least one event, if blocking */
 	while (list_empty(&priv->queued_events_list)) {
+		if (!wait) {
+			res = -EAGAIN;
+			goto out;
+		}
 		mutex_unlock(&scst_event_mutex);
 		wait_event_interruptible(priv->queued_events_waitQ,
 			(!list_empty(&priv->queued_events_list) || priv->going_to_exit ||
@@ -753,18 +757,16 @@ static int scst_event_user_next_event(struct scst_event_priv *priv,
 	event_entry = list_entry(priv->queued_events_list.next,
 			struct scst_event_entry, events_list_entry);
 
-	needed_size = sizeof(event_entry->event) + event_entry->event.payload_len;
+	*needed_size = sizeof(event_entry->event) + event_entry->event.payload_len;
 
-	if (needed_size > max_event_size) {
-		TRACE_DBG("Too big event (size %d, max size %d)", needed_size,
+	if (*needed_size > max_event_size) {
+		TRACE_DBG("Too big event (size %d, max size %d)", *needed_size,
 			max_event_size);
-		res = put_user(needed_size, (int32_t __user *)arg);
-		if (res == 0)
-			res = -ENOSPC;
+		res = -ENOSPC;
 		goto out;
 	}
 
-	rc = copy_to_user(&event_user->out_event, &event_entry->event, needed_size);
+	rc = copy_to_user(out_event, &event_entry->event, *needed_size);
 	if (rc != 0) {
 		PRINT_ERROR("Copy to user failed (%d)", rc);
 		res = -EFAULT;
@@ -792,33 +794,52 @@ out:
 }
 
 /* scst_event_mutex supposed to be held. Might drop it, then get back. */
-static int scst_event_user_notify_done(struct scst_event_priv *priv,
+static int scst_event_user_next_event(struct scst_event_priv *priv,
 	void __user *arg)
 {
-	int res, rc;
-	struct scst_event_notify_done n;
-	struct scst_event_entry *e;
-	bool found = false;
+	int res;
+	int32_t max_event_size, needed_size;
+	struct scst_event_user __user *event_user = arg;
 
 	TRACE_ENTRY();
 
-	rc = copy_from_user(&n, arg, sizeof(n));
-	if (rc != 0) {
-		PRINT_ERROR("Failed to copy %d user's bytes of notify done", rc);
-		res = -EFAULT;
+	res = get_user(max_event_size, (int32_t __user *)arg);
+	if (res != 0) {
+		PRINT_ERROR("Failed to get max event size: %d", res);
 		goto out;
+	};
+
+	res = scst_event_get_one_event(priv, &event_user->out_event,
+		max_event_size, &needed_size, true);
+	if (res == -ENOSPC) {
+		res = put_user(needed_size, (int32_t __user *)arg);
+		if (res == 0)
+			res = -ENOSPC;
 	}
 
-	res = 0;
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* scst_event_mutex supposed to be held. Might drop it, then get back. */
+static int __scst_event_notify_done(struct scst_event_priv *priv,
+	const struct scst_event_notify_done *n)
+{
+	int res = 0;
+	struct scst_event_entry *e;
+	bool found = false;
+
+	TRACE_ENTRY();
 
 	list_for_each_entry(e, &priv->processing_events_list, events_list_entry) {
-		if (e->event.event_id == n.event_id) {
+		if (e->event.event_id == n->event_id) {
 			found = true;
 			break;
 		}
 	}
 	if (!found) {
-		PRINT_ERROR("Waiting event for id %u not found", n.event_id);
+		PRINT_ERROR("Waiting event for id %u not found", n->event_id);
 		res = -ENOENT;
 		goto out;
 	}
@@ -831,7 +852,7 @@ static int scst_event_user_notify_done(struct scst_event_priv *priv,
 
 	if (e->event_notify_fn != NULL) {
 		TRACE_DBG("Calling notify_fn of event_entry %p", e);
-		e->event_notify_fn(&e->event, e->notify_fn_priv, n.status);
+		e->event_notify_fn(&e->event, e->notify_fn_priv, n->status);
 	}
 
 	TRACE_MEM("Freeing event entry %p", e);
@@ -845,6 +866,111 @@ out:
 	return res;
 }
 
+/* scst_event_mutex supposed to be held. Might drop it, then get back. */
+static int scst_event_user_notify_done(struct scst_event_priv *priv,
+	void __user *arg)
+{
+	int res, rc;
+	struct scst_event_notify_done n;
+
+	TRACE_ENTRY();
+
+	rc = copy_from_user(&n, arg, sizeof(n));
+	if (rc != 0) {
+		PRINT_ERROR("Failed to copy %d user's bytes of notify done", rc);
+		res = -EFAULT;
+		goto out;
+	}
+
+	res = __scst_event_notify_done(priv, &n);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * scst_event_mutex supposed to be held. Might drop it, then get back.
+ *
+ * First processes notify_done_cnt notifications, then returns up to
+ * events_cnt events as records of event_size bytes each. Waits, if blocking,
+ * only for the first event.
+ */
+static int scst_event_user_notify_done_get_multi(struct scst_event_priv *priv,
+	void __user *arg)
+{
+	int res = 0, rc;
+	struct scst_event_get_multi __user *m = arg;
+	struct scst_event_get_multi mh;
+	struct scst_event_notify_done __user *notifies;
+	uint8_t __user *events;
+	int32_t needed_size;
+	int16_t i, notify_done_done = 0;
+
+	TRACE_ENTRY();
+
+	/* get_user() can't be used with 64-bit values on x86_32 */
+	rc = copy_from_user(&mh, m, sizeof(mh));
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("Failed to copy %d user's bytes of get multi", rc);
+		res = -EFAULT;
+		goto out;
+	}
+
+	TRACE_DBG("notifies %d, space %d (event size %d)", mh.notify_done_cnt,
+		mh.events_cnt, mh.event_size);
+
+	notifies = (struct scst_event_notify_done __user *)
+			(unsigned long)mh.pnotify_done;
+	for (i = 0; i < mh.notify_done_cnt; i++) {
+		struct scst_event_notify_done n;
+
+		rc = copy_from_user(&n, &notifies[i], sizeof(n));
+		if (unlikely(rc != 0)) {
+			PRINT_ERROR("Unable to get notify done %d", i);
+			res = -EFAULT;
+			break;
+		}
+
+		/* Unknown IDs, e.g. already timed out, don't stop the batch */
+		__scst_event_notify_done(priv, &n);
+		notify_done_done++;
+	}
+
+	TRACE_DBG("Returning %d notify_done_done", notify_done_done);
+	rc = put_user(notify_done_done, &m->notify_done_done);
+	if ((rc != 0) && (res == 0))
+		res = rc;
+	if (res != 0)
+		goto out;
+
+	events = (uint8_t __user *)(unsigned long)mh.pevents;
+	for (i = 0; i < mh.events_cnt; i++) {
+		res = scst_event_get_one_event(priv,
+			(struct scst_event __user *)(events + i * mh.event_size),
+			mh.event_size, &needed_size, i == 0);
+		if (res != 0) {
+			if ((res == -ENOSPC) && (i == 0)) {
+				rc = put_user(needed_size, &m->event_size);
+				if (rc != 0)
+					res = rc;
+			} else if (((res == -EAGAIN) || (res == -ENOSPC)) &&
+				   (i > 0))
+				res = 0;
+			break;
+		}
+	}
+
+	TRACE_DBG("Returning %d events", i);
+	rc = put_user(i, &m->events_cnt);
+	if (unlikely(rc != 0))
+		res = rc; /* this error is more important */
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 /* scst_event_mutex supposed to be held */
 static int scst_event_create_priv(struct file *file)
 {
@@ -946,6 +1072,12 @@ static long scst_event_ioctl(struct file *file, unsigned int cmd,
 		res = scst_event_user_notify_done(priv, (void __user *)arg);
 		break;
 
+	case SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI:
+		TRACE_DBG("%s", "NOTIFY_DONE_AND_GET_MULTI");
+		res = scst_event_user_notify_done_get_multi(priv,
+			(void __user *)arg);
+		break;
+
 	default:
 		PRINT_ERROR("Invalid ioctl cmd %x", cmd);
 		res = -EINVAL;
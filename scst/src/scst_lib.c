@@ -1681,6 +1681,9 @@ static void scst_release_space(struct scst_cmd *cmd);
 static void scst_clear_reservation(struct scst_tgt_dev *tgt_dev);
 static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 	struct scst_acg_dev *acg_dev, struct scst_tgt_dev **out_tgt_dev);
+static bool scst_sess_has_tgt_devs(const struct scst_session *sess);
+static int scst_sess_alloc_first_tgt_dev(struct scst_session *sess,
+	struct scst_acg *acg);
 static void scst_tgt_retry_timer_fn(unsigned long arg);
 
 #ifdef CONFIG_SCST_DEBUG_TM
@@ -1691,22 +1694,33 @@ static inline void tm_dbg_init_tgt_dev(struct scst_tgt_dev *tgt_dev) {}
 static inline void tm_dbg_deinit_tgt_dev(struct scst_tgt_dev *tgt_dev) {}
 #endif /* CONFIG_SCST_DEBUG_TM */
 
-/**
- * scst_alloc_sense() - allocate sense buffer for command
- *
- * Allocates, if necessary, sense buffer for command. Returns 0 on success
- * and error code otherwise. Parameter "atomic" should be non-0 if the
- * function called in atomic context.
+/*
+ * Gets for cmd a zeroed sense buffer of at least len bytes. Sense up to
+ * SCST_INLINE_SENSE_BUFFERSIZE, i.e. all sense generated by SCST itself,
+ * goes to the buffer embedded in cmd, so error storms, like UAs after a
+ * reset, don't need any allocation. Bigger sense gets a buffer of
+ * SCST_SENSE_BUFFERSIZE from scst_sense_mempool.
  */
-int scst_alloc_sense(struct scst_cmd *cmd, int atomic)
+int scst_alloc_sense_len(struct scst_cmd *cmd, int atomic, unsigned int len)
 {
 	int res = 0;
 	gfp_t gfp_mask = atomic ? GFP_ATOMIC : (cmd->cmd_gfp_mask|__GFP_NOFAIL);
 
 	TRACE_ENTRY();
 
-	if (cmd->sense != NULL)
+	if (cmd->sense != NULL) {
+		if (cmd->sense_buflen >= len)
+			goto memzero;
+		/* Only the inline buffer can be too small */
+		EXTRACHECKS_BUG_ON(cmd->sense != cmd->sense_inline);
+		cmd->sense = NULL;
+	}
+
+	if (len <= sizeof(cmd->sense_inline)) {
+		cmd->sense = cmd->sense_inline;
+		cmd->sense_buflen = sizeof(cmd->sense_inline);
 		goto memzero;
+	}
 
 	cmd->sense = mempool_alloc(scst_sense_mempool, gfp_mask);
 	if (cmd->sense == NULL) {
@@ -1726,6 +1740,18 @@ out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
+
+/**
+ * scst_alloc_sense() - allocate sense buffer for command
+ *
+ * Allocates, if necessary, sense buffer of SCST_SENSE_BUFFERSIZE bytes for
+ * command. Returns 0 on success and error code otherwise. Parameter
+ * "atomic" should be non-0 if the function called in atomic context.
+ */
+int scst_alloc_sense(struct scst_cmd *cmd, int atomic)
+{
+	return scst_alloc_sense_len(cmd, atomic, SCST_SENSE_BUFFERSIZE);
+}
 EXPORT_SYMBOL(scst_alloc_sense);
 
 /**
@@ -1747,7 +1773,8 @@ int scst_alloc_set_sense(struct scst_cmd *cmd, int atomic,
 	 * we suppose the caller did it based on cmd->status.
 	 */
 
-	res = scst_alloc_sense(cmd, atomic);
+	res = scst_alloc_sense_len(cmd, atomic, min_t(unsigned int, len,
+						SCST_SENSE_BUFFERSIZE));
 	if (res != 0) {
 		PRINT_BUFFER("Lost sense", sense, len);
 		goto out;
@@ -2001,7 +2028,7 @@ do_sense:
 	if (res != 0)
 		goto out;
 
-	res = scst_alloc_sense(cmd, 1);
+	res = scst_alloc_sense_len(cmd, 1, SCST_INLINE_SENSE_BUFFERSIZE);
 	if (res != 0) {
 		PRINT_ERROR("Lost sense data (key %x, asc %x, ascq %x)",
 			key, asc, ascq);
@@ -2081,7 +2108,7 @@ static int scst_set_invalid_field_in(struct scst_cmd *cmd, int field_offs,
 	if (res != 0)
 		goto out;
 
-	res = scst_alloc_sense(cmd, 1);
+	res = scst_alloc_sense_len(cmd, 1, SCST_INLINE_SENSE_BUFFERSIZE);
 	if (res != 0) {
 		PRINT_ERROR("Lost %s sense data", cdb ? "INVALID FIELD IN CDB" :
 			"INVALID FIELD IN PARAMETERS LIST");
@@ -2619,9 +2646,51 @@ static inline bool scst_is_report_luns_changed_type(int type)
 	}
 }
 
-/* scst_mutex supposed to be held */
-static void scst_queue_report_luns_changed_UA(struct scst_session *sess,
-					      int flags)
+/*
+ * Returns true, if REPORTED LUNS DATA CHANGED UA generation of tgt_dev's
+ * session hasn't been queued to tgt_dev yet. No locks.
+ */
+static inline bool scst_tgt_dev_luns_changed_pending(
+	const struct scst_tgt_dev *tgt_dev)
+{
+	return (tgt_dev->tgt_dev_luns_changed_gen !=
+			READ_ONCE(tgt_dev->sess->sess_luns_changed_gen)) &&
+		scst_is_report_luns_changed_type(tgt_dev->dev->type);
+}
+
+/* tgt_dev_lock supposed to be held and BH off */
+static void scst_tgt_dev_queue_luns_changed_UA(struct scst_tgt_dev *tgt_dev)
+{
+	uint8_t sense_buffer[SCST_STANDARD_SENSE_LEN];
+	int sl;
+
+	TRACE_ENTRY();
+
+	tgt_dev->tgt_dev_luns_changed_gen =
+		READ_ONCE(tgt_dev->sess->sess_luns_changed_gen);
+
+	TRACE_MGMT_DBG("Queueing delayed REPORTED LUNS DATA CHANGED UA "
+		"(tgt_dev %p, gen %u)", tgt_dev,
+		tgt_dev->tgt_dev_luns_changed_gen);
+
+	sl = scst_set_sense(sense_buffer, sizeof(sense_buffer),
+		tgt_dev->dev->d_sense,
+		SCST_LOAD_SENSE(scst_sense_reported_luns_data_changed));
+
+	__scst_check_set_UA(tgt_dev, sense_buffer, sl, SCST_SET_UA_FLAG_GLOBAL);
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Queues REPORTED LUNS DATA CHANGED UA to all tgt_devs of sess right away.
+ * Used to requeue the UA at the head after a failed delivery.
+ *
+ * scst_mutex supposed to be held.
+ */
+static void scst_requeue_report_luns_changed_UA(struct scst_session *sess,
+						int flags)
 {
 	uint8_t sense_buffer[SCST_STANDARD_SENSE_LEN];
 	struct list_head *head;
@@ -2630,7 +2699,7 @@ static void scst_queue_report_luns_changed_UA(struct scst_session *sess,
 
 	TRACE_ENTRY();
 
-	TRACE_MGMT_DBG("Queueing REPORTED LUNS DATA CHANGED UA "
+	TRACE_MGMT_DBG("Requeueing REPORTED LUNS DATA CHANGED UA "
 		"(sess %p)", sess);
 
 	local_bh_disable();
@@ -2683,6 +2752,71 @@ static void scst_queue_report_luns_changed_UA(struct scst_session *sess,
 	return;
 }
 
+/*
+ * Makes REPORTED LUNS DATA CHANGED UA pending for all tgt_devs of sess.
+ * Instead of allocating the UA for each tgt_dev, it only advances the
+ * session's UA generation. Each tgt_dev then queues the UA on its next
+ * command, so a series of LUN changes before the initiator has seen the
+ * UA results in a single UA and a single rescan.
+ *
+ * scst_mutex supposed to be held.
+ */
+static void scst_queue_report_luns_changed_UA(struct scst_session *sess,
+					      int flags)
+{
+	struct list_head *head;
+	struct scst_tgt_dev *tgt_dev;
+	bool pending;
+	int i;
+
+	TRACE_ENTRY();
+
+	if (flags & SCST_SET_UA_FLAG_AT_HEAD) {
+		scst_requeue_report_luns_changed_UA(sess, flags);
+		goto out;
+	}
+
+	spin_lock_bh(&sess->sess_tgt_dev_add_lock);
+	pending = (sess->sess_luns_changed_gen !=
+			sess->sess_luns_changed_done_gen);
+	if (!pending)
+		WRITE_ONCE(sess->sess_luns_changed_gen,
+			   sess->sess_luns_changed_gen + 1);
+	spin_unlock_bh(&sess->sess_tgt_dev_add_lock);
+
+	if (pending) {
+		TRACE_MGMT_DBG("REPORTED LUNS DATA CHANGED UA already pending "
+			"(sess %p, gen %u)", sess, sess->sess_luns_changed_gen);
+		atomic_inc(&sess->sess_ua_suppressed);
+		goto out;
+	}
+
+	TRACE_MGMT_DBG("Queueing REPORTED LUNS DATA CHANGED UA "
+		"(sess %p, gen %u)", sess, sess->sess_luns_changed_gen);
+
+	/* Pairs with the barrier in scst_tgt_dev_clear_UA_pending() */
+	smp_mb();
+
+	/*
+	 * scst_mutex protects sess_tgt_dev_list from tgt_devs allocated on
+	 * the first access to their LUNs.
+	 */
+	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
+		head = &sess->sess_tgt_dev_list[i];
+
+		list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
+			if (scst_is_report_luns_changed_type(
+					tgt_dev->dev->type))
+				set_bit(SCST_TGT_DEV_UA_PENDING,
+					&tgt_dev->tgt_dev_flags);
+		}
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
 /* The activity supposed to be suspended and scst_mutex held */
 static void scst_report_luns_changed_sess(struct scst_session *sess)
 {
@@ -2756,12 +2890,24 @@ void scst_report_luns_changed(struct scst_acg *acg)
 
 	TRACE_ENTRY();
 
+#ifndef CONFIG_SCST_PROC
+	if (scst_cfg_batch_active) {
+		TRACE_DBG("Deferring REPORTED LUNS DATA CHANGED (acg %s) "
+			"until the configuration batch commit", acg->acg_name);
+		acg->acg_luns_changed_pending = true;
+		goto out;
+	}
+#endif
+
 	TRACE_DBG("REPORTED LUNS DATA CHANGED (acg %s)", acg->acg_name);
 
 	list_for_each_entry(sess, &acg->acg_sess_list, acg_sess_list_entry) {
 		scst_report_luns_changed_sess(sess);
 	}
 
+#ifndef CONFIG_SCST_PROC
+out:
+#endif
 	TRACE_EXIT();
 	return;
 }
@@ -2940,6 +3086,10 @@ retry_add:
 
 		luns_changed = true;
 
+		/* Unless it replaces an existing one, allocated on access */
+		if (sess->sess_lazy_tgt_devs && !inq_changed_ua_needed)
+			continue;
+
 		TRACE_MGMT_DBG("sess %p: Allocing new tgt_dev for LUN %lld",
 			sess, (unsigned long long)acg_dev->lun);
 
@@ -2981,6 +3131,9 @@ next:
 		goto retry_add;
 	}
 
+	if (sess->sess_lazy_tgt_devs)
+		scst_sess_alloc_first_tgt_dev(sess, acg);
+
 	sess->acg = acg;
 
 	TRACE_DBG("Moving sess %p from acg %s to acg %s", sess,
@@ -4069,6 +4222,15 @@ int scst_alloc_tgt(struct scst_tgt_template *tgtt, struct scst_tgt **tgt)
 		goto out;
 	}
 
+	/* Zeroed by alloc_percpu() */
+	t->tgt_cmd_counts = alloc_percpu(atomic_t);
+	if (t->tgt_cmd_counts == NULL) {
+		PRINT_ERROR("%s", "Allocation of tgt cmd counters failed");
+		kmem_cache_free(scst_tgt_cachep, t);
+		res = -ENOMEM;
+		goto out;
+	}
+
 	INIT_LIST_HEAD(&t->sess_list);
 	INIT_LIST_HEAD(&t->sysfs_sess_list);
 	init_waitqueue_head(&t->unreg_waitQ);
@@ -4122,8 +4284,11 @@ void scst_free_tgt(struct scst_tgt *tgt)
 	kfree(tgt->tgt_comment);
 #ifdef CONFIG_SCST_PROC
 	kfree(tgt->default_group_name);
+#else
+	kfree(rcu_dereference_protected(tgt->tgt_acn_index, 1));
 #endif
 
+	free_percpu(tgt->tgt_cmd_counts);
 	kmem_cache_free(scst_tgt_cachep, tgt);
 
 	TRACE_EXIT();
@@ -4207,6 +4372,8 @@ int scst_alloc_device(gfp_t gfp_mask, int nodeid,
 
 	scst_init_threads(&dev->dev_cmd_threads);
 
+	scst_qos_init_dev(dev);
+
 	*out_dev = dev;
 
 out:
@@ -4233,6 +4400,8 @@ void scst_free_device(struct scst_device *dev)
 	/* Ensure that ext_blockers_work is done */
 	flush_work(&dev->ext_blockers_work);
 
+	scst_qos_deinit_dev(dev);
+
 	scst_deinit_threads(&dev->dev_cmd_threads);
 
 	scst_pr_cleanup(dev);
@@ -4284,6 +4453,7 @@ static struct scst_acg_dev *scst_alloc_acg_dev(struct scst_acg *acg,
 	res->dev = dev;
 	res->acg = acg;
 	res->lun = lun;
+	res->acg_dev_qos_weight = SCST_QOS_DEF_WEIGHT;
 
 out:
 	TRACE_EXIT_HRES(res);
@@ -4443,6 +4613,9 @@ int scst_acg_add_lun(struct scst_acg *acg, struct kobject *parent,
 	}
 
 	list_for_each_entry(sess, &acg->acg_sess_list, acg_sess_list_entry) {
+		if (sess->sess_lazy_tgt_devs && scst_sess_has_tgt_devs(sess))
+			continue;
+
 		res = scst_alloc_add_tgt_dev(sess, acg_dev, &tgt_dev);
 		if (res == -EPERM)
 			continue;
@@ -4491,6 +4664,7 @@ static struct scst_acg_dev *__scst_acg_del_lun(struct scst_acg *acg,
 {
 	struct scst_acg_dev *acg_dev = NULL, *a;
 	struct scst_tgt_dev *tgt_dev, *tt;
+	struct scst_session *sess;
 
 	scst_assert_activity_suspended();
 	lockdep_assert_held(&scst_mutex);
@@ -4515,6 +4689,11 @@ static struct scst_acg_dev *__scst_acg_del_lun(struct scst_acg *acg,
 
 	scst_del_free_acg_dev(acg_dev, true);
 
+	list_for_each_entry(sess, &acg->acg_sess_list, acg_sess_list_entry) {
+		if (sess->sess_lazy_tgt_devs)
+			scst_sess_alloc_first_tgt_dev(sess, acg);
+	}
+
 	PRINT_INFO("Removed LUN %lld from group %s (target %s)",
 		lun, acg->acg_name, acg->tgt ? acg->tgt->tgt_name : "?");
 
@@ -4612,6 +4791,7 @@ int scst_alloc_add_acg(struct scst_tgt *tgt, const char *acg_name,
 	INIT_LIST_HEAD(&acg->acg_sess_list);
 	INIT_LIST_HEAD(&acg->acn_list);
 	cpumask_copy(&acg->acg_cpu_mask, &default_cpu_mask);
+	spin_lock_init(&acg->acg_qos_lock);
 	acg->acg_name = kstrdup(acg_name, GFP_KERNEL);
 	if (acg->acg_name == NULL) {
 		PRINT_ERROR("%s", "Allocation of acg_name failed");
@@ -4628,7 +4808,8 @@ int scst_alloc_add_acg(struct scst_tgt *tgt, const char *acg_name,
 		: SCST_LUN_ADDR_METHOD_PERIPHERAL;
 
 	TRACE_DBG("Adding acg %s to scst_acg_list", acg_name);
-	list_add_tail(&acg->acg_list_entry, &scst_acg_list);
+	list_add_tail_rcu(&acg->acg_list_entry, &scst_acg_list);
+	scst_acg_lookup_changed(tgt);
 
 	scst_check_reassign_sessions();
 #else
@@ -4637,7 +4818,8 @@ int scst_alloc_add_acg(struct scst_tgt *tgt, const char *acg_name,
 	if (tgt_acg) {
 		TRACE_DBG("Adding acg '%s' to device '%s' acg_list", acg_name,
 			tgt->tgt_name);
-		list_add_tail(&acg->acg_list_entry, &tgt->tgt_acg_list);
+		list_add_tail_rcu(&acg->acg_list_entry, &tgt->tgt_acg_list);
+		scst_acg_lookup_changed(tgt);
 		acg->tgt_acg = 1;
 
 		res = scst_acg_sysfs_create(tgt, acg);
@@ -4658,7 +4840,9 @@ out:
 
 #ifndef CONFIG_SCST_PROC
 out_del:
-	list_del(&acg->acg_list_entry);
+	list_del_rcu(&acg->acg_list_entry);
+	scst_acg_lookup_changed(tgt);
+	synchronize_rcu();
 #endif
 
 out_undup:
@@ -4696,17 +4880,18 @@ static void scst_del_acg(struct scst_acg *acg)
 		scst_acn_sysfs_del(acn);
 
 #ifdef CONFIG_SCST_PROC
-	list_del(&acg->acg_list_entry);
+	list_del_rcu(&acg->acg_list_entry);
 #else
 	if (acg->tgt_acg) {
 		TRACE_DBG("Removing acg %s from list", acg->acg_name);
-		list_del(&acg->acg_list_entry);
+		list_del_rcu(&acg->acg_list_entry);
 
 		scst_acg_sysfs_del(acg);
 	} else {
 		acg->tgt->default_acg = NULL;
 	}
 #endif
+	scst_acg_lookup_changed(acg->tgt);
 }
 
 /**
@@ -4740,6 +4925,12 @@ static void scst_free_acg(struct scst_acg *acg)
 			list_is_last(&acn->acn_list_entry, &acg->acn_list));
 	}
 
+	/*
+	 * Lockless ACG lookups might still be walking it. Normally called
+	 * from scst_release_acg_wq, so can wait for them.
+	 */
+	synchronize_rcu();
+
 	kfree(acg->acg_name);
 	kfree(acg);
 
@@ -5121,7 +5312,12 @@ int scst_tgt_dev_setup_threads(struct scst_tgt_dev *tgt_dev)
 		if (res != 0) {
 			/* Let's clear here, because no threads could be run */
 			tgt_dev->active_cmd_threads->io_context = NULL;
+			break;
 		}
+
+		if (dev->threads_max > 0)
+			scst_set_thr_adaptive(tgt_dev->active_cmd_threads, NULL,
+					      tgt_dev, dev->threads_max);
 		break;
 	}
 	case SCST_THREADS_POOL_SHARED:
@@ -5190,6 +5386,7 @@ void scst_tgt_dev_stop_threads(struct scst_tgt_dev *tgt_dev)
 				 tgtt->threads_num);
 	} else if (tgt_dev->active_cmd_threads == &tgt_dev->tgt_dev_cmd_threads) {
 		/* Per tgt_dev threads */
+		scst_set_thr_adaptive(tgt_dev->active_cmd_threads, NULL, NULL, 0);
 		scst_del_threads(tgt_dev->active_cmd_threads, -1);
 		scst_deinit_threads(&tgt_dev->tgt_dev_cmd_threads);
 	} /* else no threads (not yet initialized, e.g.) */
@@ -5207,8 +5404,9 @@ static __be16 scst_dif_ip_fn(const void *data, unsigned int len);
 
 /*
  * scst_mutex supposed to be held, there must not be parallel activity in this
- * session. May be invoked from inside scst_check_reassign_sessions() which
- * means that sess->acg can be NULL.
+ * session, except when called by scst_sess_alloc_lazy_tgt_dev(). May be
+ * invoked from inside scst_check_reassign_sessions() which means that
+ * sess->acg can be NULL.
  */
 static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 	struct scst_acg_dev *acg_dev, struct scst_tgt_dev **out_tgt_dev)
@@ -5360,11 +5558,24 @@ static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 		goto out_detach;
 
 	spin_lock_bh(&dev->dev_lock);
-	list_add_tail(&tgt_dev->dev_tgt_dev_list_entry, &dev->dev_tgt_dev_list);
+	/* Under dev_lock to not miss concurrent QoS settings changes */
+	scst_qos_init_tgt_dev(tgt_dev);
+	list_add_tail_rcu(&tgt_dev->dev_tgt_dev_list_entry,
+		&dev->dev_tgt_dev_list);
 	spin_unlock_bh(&dev->dev_lock);
 
 	head = &sess->sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_FN(tgt_dev->lun)];
-	list_add_tail(&tgt_dev->sess_tgt_dev_list_entry, head);
+	/*
+	 * Activities might not be suspended, if this tgt_dev is allocated on
+	 * the first access to its LUN, so publish it for lockless readers.
+	 */
+	spin_lock_bh(&sess->sess_tgt_dev_add_lock);
+	/* Inherit not yet delivered REPORTED LUNS DATA CHANGED UA, if any */
+	tgt_dev->tgt_dev_luns_changed_gen = sess->sess_luns_changed_done_gen;
+	if (scst_tgt_dev_luns_changed_pending(tgt_dev))
+		set_bit(SCST_TGT_DEV_UA_PENDING, &tgt_dev->tgt_dev_flags);
+	list_add_tail_rcu(&tgt_dev->sess_tgt_dev_list_entry, head);
+	spin_unlock_bh(&sess->sess_tgt_dev_add_lock);
 
 	scst_tg_init_tgt_dev(tgt_dev);
 
@@ -5432,6 +5643,8 @@ static void scst_free_tgt_dev(struct scst_tgt_dev *tgt_dev)
 
 	TRACE_ENTRY();
 
+	EXTRACHECKS_BUG_ON(!list_empty(&tgt_dev->tgt_dev_qos_cmd_list));
+
 	spin_lock_bh(&dev->dev_lock);
 	list_del(&tgt_dev->dev_tgt_dev_list_entry);
 	spin_unlock_bh(&dev->dev_lock);
@@ -5466,6 +5679,103 @@ static void scst_free_tgt_dev(struct scst_tgt_dev *tgt_dev)
 	return;
 }
 
+static bool scst_sess_has_tgt_devs(const struct scst_session *sess)
+{
+	int i;
+
+	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
+		if (!list_empty(&sess->sess_tgt_dev_list[i]))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Sessions with lazily allocated tgt_devs keep at least one of them
+ * allocated, so there is always one to queue session wide UAs, like
+ * REPORTED LUNS DATA CHANGED, on. Allocates it, if needed.
+ *
+ * scst_mutex supposed to be held. Sess->acg can be NULL, hence acg.
+ */
+static int scst_sess_alloc_first_tgt_dev(struct scst_session *sess,
+	struct scst_acg *acg)
+{
+	int res = 0;
+	struct scst_acg_dev *acg_dev;
+	struct scst_tgt_dev *tgt_dev;
+
+	TRACE_ENTRY();
+
+	if (scst_sess_has_tgt_devs(sess))
+		goto out;
+
+	list_for_each_entry(acg_dev, &acg->acg_dev_list, acg_dev_list_entry) {
+		res = scst_alloc_add_tgt_dev(sess, acg_dev, &tgt_dev);
+		if (res != -EPERM)
+			break;
+		res = 0;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Protected by scst_mutex or suspended activity */
+bool scst_acg_has_lun(const struct scst_acg *acg, u64 lun)
+{
+	const struct scst_acg_dev *acg_dev;
+
+	list_for_each_entry(acg_dev, &acg->acg_dev_list, acg_dev_list_entry) {
+		if (acg_dev->lun == lun)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * scst_sess_alloc_lazy_tgt_dev() - allocate tgt_dev on the first LUN access
+ *
+ * Allocates tgt_dev for LUN lun of a session with lazily allocated tgt_devs.
+ * Returns 0 if the tgt_dev exists, error code otherwise. Might sleep, must
+ * be called without any SCST locks and references held.
+ */
+int scst_sess_alloc_lazy_tgt_dev(struct scst_session *sess, u64 lun)
+{
+	int res;
+	struct scst_acg_dev *acg_dev;
+	struct scst_tgt_dev *tgt_dev;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&scst_mutex);
+
+	res = 0;
+	if (scst_lookup_tgt_dev(sess, lun) != NULL)
+		goto out_unlock;
+
+	res = -ENOENT;
+	if ((sess->shut_phase != SCST_SESS_SPH_READY) || (sess->acg == NULL))
+		goto out_unlock;
+
+	list_for_each_entry(acg_dev, &sess->acg->acg_dev_list,
+			acg_dev_list_entry) {
+		if (acg_dev->lun != lun)
+			continue;
+
+		TRACE_MGMT_DBG("sess %p: allocating tgt_dev for LUN %lld on "
+			"first access", sess, (unsigned long long)lun);
+		res = scst_alloc_add_tgt_dev(sess, acg_dev, &tgt_dev);
+		break;
+	}
+
+out_unlock:
+	mutex_unlock(&scst_mutex);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 /* scst_mutex supposed to be held */
 int scst_sess_alloc_tgt_devs(struct scst_session *sess)
 {
@@ -5475,6 +5785,15 @@ int scst_sess_alloc_tgt_devs(struct scst_session *sess)
 
 	TRACE_ENTRY();
 
+	sess->sess_lazy_tgt_devs = scst_lazy_tgt_devs &&
+				   !sess->tgt->tgtt->eager_tgt_devs;
+	if (sess->sess_lazy_tgt_devs) {
+		res = scst_sess_alloc_first_tgt_dev(sess, sess->acg);
+		if (res != 0)
+			goto out_free;
+		goto out;
+	}
+
 	list_for_each_entry(acg_dev, &sess->acg->acg_dev_list,
 			acg_dev_list_entry) {
 		res = scst_alloc_add_tgt_dev(sess, acg_dev, &tgt_dev);
@@ -5537,7 +5856,8 @@ int scst_acg_add_acn(struct scst_acg *acg, const char *name)
 		}
 	}
 
-	acn = kzalloc(sizeof(*acn), GFP_KERNEL);
+	/* The name is kept together with acn to free both after RCU */
+	acn = kzalloc(sizeof(*acn) + strlen(name) + 1, GFP_KERNEL);
 	if (acn == NULL) {
 		PRINT_ERROR("%s", "Unable to allocate scst_acn");
 		res = -ENOMEM;
@@ -5546,19 +5866,17 @@ int scst_acg_add_acn(struct scst_acg *acg, const char *name)
 
 	acn->acg = acg;
 
-	nm = kstrdup(name, GFP_KERNEL);
-	if (nm == NULL) {
-		PRINT_ERROR("%s", "Unable to allocate scst_acn->name");
-		res = -ENOMEM;
-		goto out_free;
-	}
+	nm = (char *)(acn + 1);
+	strcpy(nm, name);
 	acn->name = nm;
+	scst_acn_compile(acn);
 
 	res = scst_acn_sysfs_create(acn);
 	if (res != 0)
-		goto out_free_nm;
+		goto out_free;
 
-	list_add_tail(&acn->acn_list_entry, &acg->acn_list);
+	list_add_tail_rcu(&acn->acn_list_entry, &acg->acn_list);
+	scst_acg_lookup_changed(acg->tgt);
 
 out:
 	if (res == 0) {
@@ -5570,9 +5888,6 @@ out:
 	TRACE_EXIT_RES(res);
 	return res;
 
-out_free_nm:
-	kfree(nm);
-
 out_free:
 	kfree(acn);
 	goto out;
@@ -5581,8 +5896,8 @@ out_free:
 /* The activity supposed to be suspended and scst_mutex held */
 static void scst_free_acn(struct scst_acn *acn, bool reassign)
 {
-	kfree(acn->name);
-	kfree(acn);
+	/* Lockless ACG lookups might still be walking it */
+	kfree_rcu(acn, rcu_head);
 
 	if (reassign)
 		scst_check_reassign_sessions();
@@ -5592,7 +5907,8 @@ static void scst_free_acn(struct scst_acn *acn, bool reassign)
 void scst_del_free_acn(struct scst_acn *acn, bool reassign)
 {
 	TRACE_ENTRY();
-	list_del(&acn->acn_list_entry);
+	list_del_rcu(&acn->acn_list_entry);
+	scst_acg_lookup_changed(acn->acg->tgt);
 	scst_acn_sysfs_del(acn);
 	scst_free_acn(acn, reassign);
 	TRACE_EXIT();
@@ -5690,13 +6006,15 @@ struct scst_cmd *__scst_create_prepare_internal_cmd(const uint8_t *cdb,
 		 * real work.
 		 */
 		spin_lock_irqsave(&res->sess->sess_list_lock, flags);
-		list_add_tail(&res->sess_cmd_list_entry, &res->sess->sess_cmd_list);
+		scst_sess_add_cmd(res->sess, res);
 		spin_unlock_irqrestore(&res->sess->sess_list_lock, flags);
 	}
 
 	scst_sess_get(res->sess);
-	if (res->tgt_dev != NULL)
+	if (res->tgt_dev != NULL) {
+		scst_tgt_get(res->tgt);
 		res->cpu_cmd_counter = scst_get();
+	}
 
 	scst_set_start_time(res);
 
@@ -5743,7 +6061,7 @@ static void scst_prelim_finish_internal_cmd(struct scst_cmd *cmd)
 	sBUG_ON(!cmd->internal);
 
 	spin_lock_irqsave(&cmd->sess->sess_list_lock, flags);
-	list_del(&cmd->sess_cmd_list_entry);
+	scst_sess_del_cmd(cmd);
 	spin_unlock_irqrestore(&cmd->sess->sess_list_lock, flags);
 
 	__scst_cmd_put(cmd);
@@ -5762,12 +6080,8 @@ int scst_prepare_request_sense(struct scst_cmd *orig_cmd)
 
 	TRACE_ENTRY();
 
-	if (orig_cmd->sense != NULL) {
-		TRACE_MEM("Releasing sense %p (orig_cmd %p)",
-			orig_cmd->sense, orig_cmd);
-		mempool_free(orig_cmd->sense, scst_sense_mempool);
-		orig_cmd->sense = NULL;
-	}
+	if (orig_cmd->sense != NULL)
+		scst_free_sense(orig_cmd);
 
 	rs_cmd = scst_create_prepare_internal_cmd(orig_cmd,
 			request_sense, sizeof(request_sense),
@@ -6742,7 +7056,7 @@ int scst_finish_internal_cmd(struct scst_cmd *cmd)
 	}
 
 	spin_lock_irqsave(&cmd->sess->sess_list_lock, flags);
-	list_del(&cmd->sess_cmd_list_entry);
+	scst_sess_del_cmd(cmd);
 	cmd->done = 1;
 	cmd->finished = 1;
 	spin_unlock_irqrestore(&cmd->sess->sess_list_lock, flags);
@@ -6856,14 +7170,19 @@ struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
 
 	sess->init_phase = SCST_SESS_IPH_INITING;
 	sess->shut_phase = SCST_SESS_SPH_READY;
+	sess->sess_init_queue = scst_get_init_queue();
 	atomic_set(&sess->refcnt, 0);
 	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
 		struct list_head *head = &sess->sess_tgt_dev_list[i];
 
 		INIT_LIST_HEAD(head);
 	}
+	spin_lock_init(&sess->sess_tgt_dev_add_lock);
+	INIT_LIST_HEAD(&sess->sess_lazy_cmd_list);
 	spin_lock_init(&sess->sess_list_lock);
 	INIT_LIST_HEAD(&sess->sess_cmd_list);
+	for (i = 0; i < SESS_CMD_TAG_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&sess->sess_cmd_tag_hash[i]);
 	sess->tgt = tgt;
 	INIT_LIST_HEAD(&sess->init_deferred_cmd_list);
 	INIT_LIST_HEAD(&sess->init_deferred_mcmd_list);
@@ -6872,10 +7191,14 @@ struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
 	INIT_DELAYED_WORK(&sess->sess_cm_list_id_cleanup_work,
 			  sess_cm_list_id_cleanup_work_fn);
 	INIT_DELAYED_WORK(&sess->hw_pending_work, scst_hw_pending_work_fn);
+	INIT_WORK(&sess->sess_lazy_tgt_dev_work,
+		  scst_sess_lazy_tgt_dev_work_fn);
 #else
 	INIT_WORK(&sess->sess_cm_list_id_cleanup_work,
 		  sess_cm_list_id_cleanup_work_fn, sess);
 	INIT_WORK(&sess->hw_pending_work, scst_hw_pending_work_fn, sess);
+	INIT_WORK(&sess->sess_lazy_tgt_dev_work,
+		  scst_sess_lazy_tgt_dev_work_fn, sess);
 #endif
 
 #ifdef CONFIG_SCST_MEASURE_LATENCY
@@ -6902,6 +7225,9 @@ void scst_free_session(struct scst_session *sess)
 {
 	TRACE_ENTRY();
 
+	/* All lazy cmds are done, but the work might be still finishing */
+	cancel_work_sync(&sess->sess_lazy_tgt_dev_work);
+
 	mutex_lock(&scst_mutex);
 
 	scst_sess_free_tgt_devs(sess);
@@ -7175,6 +7501,14 @@ static void scst_destroy_cmd(struct scst_cmd *cmd)
 
 	TRACE_DBG("Destroying cmd %p", cmd);
 
+	/* Let a retiring thread know it has one command less to wait for */
+	if (cmd->cmd_thr != NULL)
+		atomic_dec(&cmd->cmd_thr->thr_assigned_cmds);
+
+	/* Target must be accessed before the session reference dropped */
+	if (likely(cmd->tgt_dev != NULL))
+		scst_tgt_put(cmd->tgt);
+
 	scst_sess_put(cmd->sess);
 
 	/*
@@ -7291,11 +7625,8 @@ void scst_free_cmd(struct scst_cmd *cmd)
 
 	scst_release_space(cmd);
 
-	if (unlikely(cmd->sense != NULL)) {
-		TRACE_MEM("Releasing sense %p (cmd %p)", cmd->sense, cmd);
-		mempool_free(cmd->sense, scst_sense_mempool);
-		cmd->sense = NULL;
-	}
+	if (unlikely(cmd->sense != NULL))
+		scst_free_sense(cmd);
 
 	if (likely(cmd->tgt_dev != NULL)) {
 		EXTRACHECKS_BUG_ON(cmd->sn_set && !cmd->out_of_sn &&
@@ -7419,6 +7750,9 @@ void scst_free_mgmt_cmd(struct scst_mgmt_cmd *mcmd)
 	atomic_dec(&mcmd->sess->sess_cmd_count);
 	spin_unlock_irqrestore(&mcmd->sess->sess_list_lock, flags);
 
+	if ((mcmd->mcmd_tgt_dev != NULL) || mcmd->scst_get_called)
+		scst_tgt_put(mcmd->sess->tgt);
+
 	scst_sess_put(mcmd->sess);
 
 	if ((mcmd->mcmd_tgt_dev != NULL) || mcmd->scst_get_called)
@@ -8830,6 +9164,124 @@ static __be16 scst_dif_ip_fn(const void *data, unsigned int len)
 	return (__force __be16)ip_compute_csum(data, len);
 }
 
+/*
+ * Batched T10-PI processing.
+ *
+ * App and ref tags of a tuple are checked at once by comparing the whole
+ * 8 bytes tuple as a 64-bit word with the expected value under a mask, so
+ * a batch of blocks needs only one compare per block in addition to the
+ * guard tag calculation. Expected value and masks are built in the tuple
+ * layout, hence they don't depend on the CPU endianness.
+ */
+union scst_dif_tuple {
+	struct t10_pi_tuple t;
+	u64 v;
+};
+
+struct scst_dif_batch {
+	/* Expected app and ref tags, ref tag is of the first block */
+	union scst_dif_tuple exp;
+	/* Tuple bits to check */
+	u64 mask;
+	/* Tuples, which have all escape_mask bits set, must not be checked */
+	u64 escape_mask;
+	/* Set if the ref tag is incremented for each block (types 1 and 2) */
+	bool inc_ref;
+	bool check_guard;
+	bool ip_guard;
+	int block_size;
+};
+
+static void scst_dif_batch_init(struct scst_dif_batch *b, struct scst_cmd *cmd,
+	__be16 app_tag, __be16 app_tag_mask, __be32 ref_tag, bool check_ref,
+	bool inc_ref, bool escape_ref)
+{
+	union scst_dif_tuple m;
+
+	memset(b, 0, sizeof(*b));
+
+	b->exp.t.app_tag = app_tag & app_tag_mask;
+	b->exp.t.ref_tag = ref_tag;
+
+	m.v = 0;
+	m.t.app_tag = app_tag_mask;
+	if (check_ref)
+		m.t.ref_tag = cpu_to_be32(0xFFFFFFFF);
+	b->mask = m.v;
+	b->exp.v &= b->mask;
+
+	m.v = 0;
+	m.t.app_tag = SCST_DIF_NO_CHECK_ALL_APP_TAG;
+	if (escape_ref)
+		m.t.ref_tag = SCST_DIF_NO_CHECK_ALL_REF_TAG;
+	b->escape_mask = m.v;
+
+	b->inc_ref = inc_ref && check_ref;
+	b->ip_guard = (cmd->tgt_dev->tgt_dev_dif_guard_format ==
+				SCST_DIF_GUARD_FORMAT_IP);
+	b->block_size = cmd->dev->block_size;
+	return;
+}
+
+/* Calls the guard function directly, saving an indirect call per block */
+static inline __be16 scst_dif_batch_guard(const struct scst_dif_batch *b,
+	const void *data)
+{
+	if (b->ip_guard)
+		return scst_dif_ip_fn(data, b->block_size);
+	else
+		return scst_dif_crc_fn(data, b->block_size);
+}
+
+/*
+ * Verifies up to nblocks blocks starting from buf with their tuples t.
+ * Returns number of blocks verified successfully, i.e. index of the first
+ * block, which needs the slow path to find out and report what's wrong.
+ */
+static int scst_dif_verify_batch(const struct scst_dif_batch *b,
+	const uint8_t *buf, const struct t10_pi_tuple *t, uint32_t ref_tag,
+	int nblocks)
+{
+	union scst_dif_tuple exp = b->exp;
+	int i;
+
+	for (i = 0; i < nblocks; i++, t++, buf += b->block_size) {
+		u64 v = get_unaligned((const u64 *)t);
+
+		if (unlikely((v & b->escape_mask) == b->escape_mask))
+			continue;
+
+		if (b->inc_ref)
+			exp.t.ref_tag = cpu_to_be32(ref_tag + i);
+
+		if (unlikely((v & b->mask) != exp.v))
+			break;
+
+		if (b->check_guard &&
+		    unlikely(t->guard_tag != scst_dif_batch_guard(b, buf)))
+			break;
+	}
+
+	return i;
+}
+
+/* Generates tuples for nblocks blocks starting from buf */
+static void scst_dif_generate_batch(const struct scst_dif_batch *b,
+	const uint8_t *buf, struct t10_pi_tuple *t, uint32_t ref_tag,
+	int nblocks)
+{
+	union scst_dif_tuple tuple = b->exp;
+	int i;
+
+	for (i = 0; i < nblocks; i++, t++, buf += b->block_size) {
+		if (b->inc_ref)
+			tuple.t.ref_tag = cpu_to_be32(ref_tag + i);
+		tuple.t.guard_tag = scst_dif_batch_guard(b, buf);
+		put_unaligned(tuple.v, (u64 *)t);
+	}
+	return;
+}
+
 static int scst_verify_dif_type1(struct scst_cmd *cmd)
 {
 	int res = 0;
@@ -8842,6 +9294,7 @@ static int scst_verify_dif_type1(struct scst_cmd *cmd)
 	uint64_t lba = cmd->lba;
 	int block_size = dev->block_size, block_shift = dev->block_shift;
 	__be16 (*crc_fn)(const void *buffer, unsigned int len);
+	struct scst_dif_batch batch;
 
 	TRACE_ENTRY();
 
@@ -8861,12 +9314,19 @@ static int scst_verify_dif_type1(struct scst_cmd *cmd)
 
 	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
 
+	scst_dif_batch_init(&batch, cmd, dev->dev_dif_static_app_tag,
+		(checks & SCST_DIF_CHECK_APP_TAG) ? cpu_to_be16(0xFFFF) : 0,
+		0, checks & SCST_DIF_CHECK_REF_TAG, true, false);
+	batch.check_guard = (checks & SCST_DIF_CHECK_GUARD_TAG) && !cmd->internal;
+
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
+		int i = 0, blocks = len >> block_shift;
 		uint8_t *cur_buf = buf;
 
-		for (i = 0; i < (len >> block_shift); i++) {
+		while (i < blocks) {
+			int n;
+
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
 				EXTRACHECKS_BUG_ON(tags_len <= 0);
@@ -8876,6 +9336,14 @@ static int scst_verify_dif_type1(struct scst_cmd *cmd)
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
+			n = scst_dif_verify_batch(&batch, cur_buf, t, lba & 0xFFFFFFFF,
+				min(blocks - i, tags_len >> SCST_DIF_TAG_SHIFT));
+			if (n != 0)
+				goto next;
+
+			/* Slow path to find out and report what's wrong */
+			n = 1;
+
 			if (t->app_tag == SCST_DIF_NO_CHECK_ALL_APP_TAG) {
 				TRACE_DBG("Skipping tag %lld (cmd %p)",
 					(long long)lba, cmd);
@@ -8935,11 +9403,12 @@ static int scst_verify_dif_type1(struct scst_cmd *cmd)
 			}
 
 next:
-			cur_buf += dev->block_size;
-			lba++;
+			cur_buf += n << block_shift;
+			lba += n;
 
-			t++;
-			tags_len -= tag_size;
+			t += n;
+			tags_len -= n * tag_size;
+			i += n;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9003,8 +9472,8 @@ static int scst_generate_dif_type1(struct scst_cmd *cmd)
 	uint8_t *buf, *tags_buf = NULL;
 	struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
 	uint64_t lba = cmd->lba;
-	int block_size = dev->block_size, block_shift = dev->block_shift;
-	__be16 (*crc_fn)(const void *buffer, unsigned int len);
+	int block_shift = dev->block_shift;
+	struct scst_dif_batch batch;
 
 	TRACE_ENTRY();
 
@@ -9020,16 +9489,19 @@ static int scst_generate_dif_type1(struct scst_cmd *cmd)
 	}
 #endif
 
-	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
+	scst_dif_batch_init(&batch, cmd, dev->dev_dif_static_app_tag,
+		cpu_to_be16(0xFFFF), 0, true, true, false);
 
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
+		int i = 0, blocks = len >> block_shift;
 		uint8_t *cur_buf = buf;
 
 		TRACE_DBG("len %d", len);
 
-		for (i = 0; i < (len >> block_shift); i++) {
+		while (i < blocks) {
+			int n;
+
 			TRACE_DBG("lba %lld, tags_len %d", (long long)lba, tags_len);
 
 			if (tags_buf == NULL) {
@@ -9040,9 +9512,13 @@ static int scst_generate_dif_type1(struct scst_cmd *cmd)
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			t->app_tag = dev->dev_dif_static_app_tag;
-			t->ref_tag = cpu_to_be32(lba & 0xFFFFFFFF);
-			t->guard_tag = crc_fn(cur_buf, block_size);
+			n = min(blocks - i, tags_len >> SCST_DIF_TAG_SHIFT);
+#ifdef CONFIG_SCST_DIF_INJECT_CORRUPTED_TAGS
+			/* Tags corruption below works on one block at time */
+			if (cmd->cmd_corrupt_dif_tag != 0)
+				n = 1;
+#endif
+			scst_dif_generate_batch(&batch, cur_buf, t, lba & 0xFFFFFFFF, n);
 
 #ifdef CONFIG_SCST_DIF_INJECT_CORRUPTED_TAGS
 			switch (cmd->cmd_corrupt_dif_tag) {
@@ -9197,11 +9673,12 @@ static int scst_generate_dif_type1(struct scst_cmd *cmd)
 				break;
 			}
 #endif
-			cur_buf += dev->block_size;
-			lba++;
+			cur_buf += n << block_shift;
+			lba += n;
 
-			t++;
-			tags_len -= tag_size;
+			t += n;
+			tags_len -= n * tag_size;
+			i += n;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9297,6 +9774,7 @@ static int scst_verify_dif_type2(struct scst_cmd *cmd)
 	/* Let's keep both in BE */
 	__be16 app_tag_mask = cpu_to_be16(scst_cmd_get_dif_app_tag_mask(cmd));
 	__be16 app_tag_masked = cpu_to_be16(scst_cmd_get_dif_exp_app_tag(cmd)) & app_tag_mask;
+	struct scst_dif_batch batch;
 
 	TRACE_ENTRY();
 
@@ -9316,18 +9794,33 @@ static int scst_verify_dif_type2(struct scst_cmd *cmd)
 
 	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
 
+	scst_dif_batch_init(&batch, cmd, app_tag_masked,
+		(checks & SCST_DIF_CHECK_APP_TAG) ? app_tag_mask : 0,
+		0, checks & SCST_DIF_CHECK_REF_TAG, true, false);
+	batch.check_guard = (checks & SCST_DIF_CHECK_GUARD_TAG) && !cmd->internal;
+
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
+		int i = 0, blocks = len >> block_shift;
 		uint8_t *cur_buf = buf;
 
-		for (i = 0; i < (len >> block_shift); i++) {
+		while (i < blocks) {
+			int n;
+
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
 				EXTRACHECKS_BUG_ON(tags_len <= 0);
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
+			n = scst_dif_verify_batch(&batch, cur_buf, t, ref_tag,
+				min(blocks - i, tags_len >> SCST_DIF_TAG_SHIFT));
+			if (n != 0)
+				goto next;
+
+			/* Slow path to find out and report what's wrong */
+			n = 1;
+
 			if (t->app_tag == SCST_DIF_NO_CHECK_ALL_APP_TAG) {
 				TRACE_DBG("Skipping tag (cmd %p)", cmd);
 				goto next;
@@ -9385,12 +9878,13 @@ static int scst_verify_dif_type2(struct scst_cmd *cmd)
 			}
 
 next:
-			cur_buf += dev->block_size;
-			lba++;
-			ref_tag++;
+			cur_buf += n << block_shift;
+			lba += n;
+			ref_tag += n;
 
-			t++;
-			tags_len -= tag_size;
+			t += n;
+			tags_len -= n * tag_size;
+			i += n;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9421,12 +9915,12 @@ static int scst_generate_dif_type2(struct scst_cmd *cmd)
 	struct scatterlist *tags_sg = NULL;
 	uint8_t *buf, *tags_buf = NULL;
 	struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
-	int block_size = dev->block_size, block_shift = dev->block_shift;
-	__be16 (*crc_fn)(const void *buffer, unsigned int len);
+	int block_shift = dev->block_shift;
 	uint32_t ref_tag = scst_cmd_get_dif_exp_ref_tag(cmd);
 	/* Let's keep both in BE */
 	__be16 app_tag_mask = cpu_to_be16(scst_cmd_get_dif_app_tag_mask(cmd));
 	__be16 app_tag_masked = cpu_to_be16(scst_cmd_get_dif_exp_app_tag(cmd)) & app_tag_mask;
+	struct scst_dif_batch batch;
 
 	TRACE_ENTRY();
 
@@ -9442,16 +9936,19 @@ static int scst_generate_dif_type2(struct scst_cmd *cmd)
 	}
 #endif
 
-	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
+	scst_dif_batch_init(&batch, cmd, app_tag_masked, cpu_to_be16(0xFFFF),
+		0, true, true, false);
 
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
+		int i = 0, blocks = len >> block_shift;
 		uint8_t *cur_buf = buf;
 
 		TRACE_DBG("len %d", len);
 
-		for (i = 0; i < (len >> block_shift); i++) {
+		while (i < blocks) {
+			int n;
+
 			TRACE_DBG("tags_len %d", tags_len);
 
 			if (tags_buf == NULL) {
@@ -9462,15 +9959,15 @@ static int scst_generate_dif_type2(struct scst_cmd *cmd)
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			t->app_tag = app_tag_masked;
-			t->ref_tag = cpu_to_be32(ref_tag);
-			t->guard_tag = crc_fn(cur_buf, block_size);
+			n = min(blocks - i, tags_len >> SCST_DIF_TAG_SHIFT);
+			scst_dif_generate_batch(&batch, cur_buf, t, ref_tag, n);
 
-			cur_buf += dev->block_size;
-			ref_tag++;
+			cur_buf += n << block_shift;
+			ref_tag += n;
 
-			t++;
-			tags_len -= tag_size;
+			t += n;
+			tags_len -= n * tag_size;
+			i += n;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9513,6 +10010,7 @@ static int scst_verify_dif_type3(struct scst_cmd *cmd)
 	uint64_t lba = cmd->lba;
 	int block_size = dev->block_size, block_shift = dev->block_shift;
 	__be16 (*crc_fn)(const void *buffer, unsigned int len);
+	struct scst_dif_batch batch;
 
 	TRACE_ENTRY();
 
@@ -9532,18 +10030,34 @@ static int scst_verify_dif_type3(struct scst_cmd *cmd)
 
 	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
 
+	scst_dif_batch_init(&batch, cmd, dev->dev_dif_static_app_tag,
+		(checks & SCST_DIF_CHECK_APP_TAG) ? cpu_to_be16(0xFFFF) : 0,
+		dev->dev_dif_static_app_ref_tag,
+		checks & SCST_DIF_CHECK_REF_TAG, false, true);
+	batch.check_guard = (checks & SCST_DIF_CHECK_GUARD_TAG) && !cmd->internal;
+
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
+		int i = 0, blocks = len >> block_shift;
 		uint8_t *cur_buf = buf;
 
-		for (i = 0; i < (len >> block_shift); i++) {
+		while (i < blocks) {
+			int n;
+
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
 				EXTRACHECKS_BUG_ON(tags_len <= 0);
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
+			n = scst_dif_verify_batch(&batch, cur_buf, t, 0,
+				min(blocks - i, tags_len >> SCST_DIF_TAG_SHIFT));
+			if (n != 0)
+				goto next;
+
+			/* Slow path to find out and report what's wrong */
+			n = 1;
+
 			if ((t->app_tag == SCST_DIF_NO_CHECK_ALL_APP_TAG) &&
 			    (t->ref_tag == SCST_DIF_NO_CHECK_ALL_REF_TAG)) {
 				TRACE_DBG("Skipping tag (cmd %p)", cmd);
@@ -9603,11 +10117,12 @@ static int scst_verify_dif_type3(struct scst_cmd *cmd)
 			}
 
 next:
-			cur_buf += dev->block_size;
-			lba++;
+			cur_buf += n << block_shift;
+			lba += n;
 
-			t++;
-			tags_len -= tag_size;
+			t += n;
+			tags_len -= n * tag_size;
+			i += n;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9638,8 +10153,8 @@ static int scst_generate_dif_type3(struct scst_cmd *cmd)
 	struct scatterlist *tags_sg = NULL;
 	uint8_t *buf, *tags_buf = NULL;
 	struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
-	int block_size = dev->block_size, block_shift = dev->block_shift;
-	__be16 (*crc_fn)(const void *buffer, unsigned int len);
+	int block_shift = dev->block_shift;
+	struct scst_dif_batch batch;
 
 	TRACE_ENTRY();
 
@@ -9655,16 +10170,20 @@ static int scst_generate_dif_type3(struct scst_cmd *cmd)
 	}
 #endif
 
-	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
+	scst_dif_batch_init(&batch, cmd, dev->dev_dif_static_app_tag,
+		cpu_to_be16(0xFFFF), dev->dev_dif_static_app_ref_tag, true,
+		false, false);
 
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
+		int i = 0, blocks = len >> block_shift;
 		uint8_t *cur_buf = buf;
 
 		TRACE_DBG("len %d", len);
 
-		for (i = 0; i < (len >> block_shift); i++) {
+		while (i < blocks) {
+			int n;
+
 			TRACE_DBG("tags_len %d", tags_len);
 
 			if (tags_buf == NULL) {
@@ -9675,14 +10194,14 @@ static int scst_generate_dif_type3(struct scst_cmd *cmd)
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			t->app_tag = dev->dev_dif_static_app_tag;
-			t->ref_tag = dev->dev_dif_static_app_ref_tag;
-			t->guard_tag = crc_fn(cur_buf, block_size);
+			n = min(blocks - i, tags_len >> SCST_DIF_TAG_SHIFT);
+			scst_dif_generate_batch(&batch, cur_buf, t, 0, n);
 
-			cur_buf += dev->block_size;
+			cur_buf += n << block_shift;
 
-			t++;
-			tags_len -= tag_size;
+			t += n;
+			tags_len -= n * tag_size;
+			i += n;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -12522,13 +13041,28 @@ void scst_process_reset(struct scst_device *dev,
 	return;
 }
 
+/*
+ * Clears SCST_TGT_DEV_UA_PENDING, unless REPORTED LUNS DATA CHANGED UA
+ * is still to be queued to tgt_dev.
+ *
+ * Caller must hold tgt_dev->tgt_dev_lock.
+ */
+static void scst_tgt_dev_clear_UA_pending(struct scst_tgt_dev *tgt_dev)
+{
+	clear_bit(SCST_TGT_DEV_UA_PENDING, &tgt_dev->tgt_dev_flags);
+	/* Pairs with the barrier in scst_queue_report_luns_changed_UA() */
+	smp_mb__after_clear_bit();
+	if (unlikely(scst_tgt_dev_luns_changed_pending(tgt_dev)))
+		set_bit(SCST_TGT_DEV_UA_PENDING, &tgt_dev->tgt_dev_flags);
+}
+
 /* Caller must hold tgt_dev->tgt_dev_lock. */
 void scst_tgt_dev_del_free_UA(struct scst_tgt_dev *tgt_dev,
 			      struct scst_tgt_dev_UA *ua)
 {
 	list_del(&ua->UA_list_entry);
 	if (list_empty(&tgt_dev->UA_list))
-		clear_bit(SCST_TGT_DEV_UA_PENDING, &tgt_dev->tgt_dev_flags);
+		scst_tgt_dev_clear_UA_pending(tgt_dev);
 	mempool_free(ua, scst_ua_mempool);
 }
 
@@ -12557,10 +13091,14 @@ int scst_set_pending_UA(struct scst_cmd *cmd, uint8_t *buf, int *size)
 
 	spin_lock_bh(&cmd->tgt_dev->tgt_dev_lock);
 
+	if (unlikely(scst_tgt_dev_luns_changed_pending(cmd->tgt_dev)))
+		scst_tgt_dev_queue_luns_changed_UA(cmd->tgt_dev);
+
 again:
 	/* UA list could be cleared behind us, so retest */
 	if (list_empty(&cmd->tgt_dev->UA_list)) {
 		TRACE_DBG("SCST_TGT_DEV_UA_PENDING set, but UA_list empty");
+		scst_tgt_dev_clear_UA_pending(cmd->tgt_dev);
 		res = -1;
 		goto out_unlock;
 	} else
@@ -12587,6 +13125,9 @@ again:
 
 		local_bh_disable();
 
+		/* Keep the set of tgt_devs stable until all unlocked */
+		spin_lock(&sess->sess_tgt_dev_add_lock);
+
 		for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
 			struct list_head *head = &sess->sess_tgt_dev_list[i];
 			struct scst_tgt_dev *tgt_dev;
@@ -12626,6 +13167,18 @@ again:
 	list_del(&UA_entry->UA_list_entry);
 
 	if (UA_entry->global_UA) {
+		bool luns_changed = scst_analyze_sense(UA_entry->UA_sense_buffer,
+			UA_entry->UA_valid_sense_len, SCST_SENSE_ALL_VALID,
+			SCST_LOAD_SENSE(scst_sense_reported_luns_data_changed));
+
+		/*
+		 * The initiator has seen all LUN changes so far, so all
+		 * tgt_devs, which haven't queued the UA yet, don't need it.
+		 */
+		if (luns_changed)
+			sess->sess_luns_changed_done_gen =
+				sess->sess_luns_changed_gen;
+
 		for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
 			struct list_head *head = &sess->sess_tgt_dev_list[i];
 			struct scst_tgt_dev *tgt_dev;
@@ -12634,6 +13187,14 @@ again:
 					sess_tgt_dev_list_entry) {
 				struct scst_tgt_dev_UA *ua;
 
+				if (luns_changed) {
+					tgt_dev->tgt_dev_luns_changed_gen =
+						sess->sess_luns_changed_gen;
+					if (list_empty(&tgt_dev->UA_list))
+						clear_bit(SCST_TGT_DEV_UA_PENDING,
+							&tgt_dev->tgt_dev_flags);
+				}
+
 				list_for_each_entry(ua, &tgt_dev->UA_list,
 							UA_list_entry) {
 					if (ua->global_UA &&
@@ -12654,10 +13215,8 @@ again:
 
 	mempool_free(UA_entry, scst_ua_mempool);
 
-	if (list_empty(&cmd->tgt_dev->UA_list)) {
-		clear_bit(SCST_TGT_DEV_UA_PENDING,
-			  &cmd->tgt_dev->tgt_dev_flags);
-	}
+	if (list_empty(&cmd->tgt_dev->UA_list))
+		scst_tgt_dev_clear_UA_pending(cmd->tgt_dev);
 
 out_unlock:
 	if (global_unlock) {
@@ -12672,6 +13231,8 @@ out_unlock:
 			}
 		}
 
+		spin_unlock(&sess->sess_tgt_dev_add_lock);
+
 		local_bh_enable();
 		spin_lock_bh(&cmd->tgt_dev->tgt_dev_lock);
 #endif
@@ -12750,6 +13311,7 @@ static void __scst_check_set_UA(struct scst_tgt_dev *tgt_dev,
 			TRACE_DBG("UA already exists (dev %s, "
 				"initiator %s)", tgt_dev->dev->virt_name,
 				tgt_dev->sess->initiator_name);
+			atomic_inc(&tgt_dev->sess->sess_ua_suppressed);
 			skip_UA = 1;
 			break;
 		}
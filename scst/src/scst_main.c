@@ -108,10 +108,16 @@ struct scst_acg *scst_default_acg;
 unsigned int scst_setup_id;
 #endif
 
-spinlock_t scst_init_lock;
-wait_queue_head_t scst_init_cmd_list_waitQ;
-struct list_head scst_init_cmd_list;
-unsigned int scst_init_poll_cnt;
+/* nr_cpu_ids entries, allocated by init_scst() */
+struct scst_init_queue *scst_init_queues;
+/* Number of started init queues, constant after scst_init() */
+unsigned int scst_init_queues_num = 1;
+static atomic_t scst_init_queue_next = ATOMIC_INIT(0);
+/*
+ * Bumped around clearing tgt_suspended of a target, so scst_do_job_init()
+ * can detect that a target was resumed in the middle of its list pass.
+ */
+DEFINE_SEQLOCK(scst_tgt_resume_lock);
 
 struct kmem_cache *scst_cmd_cachep;
 
@@ -148,7 +154,6 @@ static struct mutex scst_cmd_threads_mutex;
 static struct list_head scst_cmd_threads_list;
 
 int scst_threads;
-static struct task_struct *scst_init_cmd_thread;
 static struct task_struct *scst_mgmt_thread;
 static struct task_struct *scst_mgmt_cmd_thread;
 
@@ -175,6 +180,7 @@ cpumask_t default_cpu_mask;
 static unsigned int scst_max_cmd_mem;
 unsigned int scst_max_dev_cmd_mem;
 int scst_forcibly_close_sessions;
+bool scst_lazy_tgt_devs;
 
 module_param_named(scst_threads, scst_threads, int, 0);
 MODULE_PARM_DESC(scst_threads, "SCSI target threads count");
@@ -193,6 +199,11 @@ MODULE_PARM_DESC(forcibly_close_sessions,
 "If enabled, close the sessions associated with an access control group (ACG)"
 " when an ACG is deleted via sysfs instead of returning -EBUSY");
 
+module_param_named(lazy_tgt_devs, scst_lazy_tgt_devs, bool, S_IRUGO);
+MODULE_PARM_DESC(lazy_tgt_devs,
+"If enabled, allocate per-session LUN data on the first access to the LUN"
+" instead of at the session registration");
+
 
 struct scst_dev_type scst_null_devtype = {
 	.name = "none",
@@ -1056,6 +1067,7 @@ static void __scst_resume_activity(void)
 {
 	struct scst_cmd_threads *l;
 	struct scst_mgmt_cmd *m;
+	unsigned int i;
 
 	TRACE_ENTRY();
 
@@ -1078,13 +1090,18 @@ static void __scst_resume_activity(void)
 	mutex_unlock(&scst_cmd_threads_mutex);
 
 	/*
-	 * Wait until scst_init_thread() either is waiting or has reexamined
-	 * scst_flags.
+	 * Wait until each scst_init_thread() either is waiting or has
+	 * reexamined scst_flags.
 	 */
-	spin_lock_irq(&scst_init_lock);
-	spin_unlock_irq(&scst_init_lock);
+	for (i = 0; i < scst_init_queues_num; i++) {
+		struct scst_init_queue *q = &scst_init_queues[i];
 
-	wake_up_all(&scst_init_cmd_list_waitQ);
+		spin_lock_irq(&q->init_lock);
+		q->init_tgt_susp_blocked = false;
+		spin_unlock_irq(&q->init_lock);
+
+		wake_up_all(&q->init_cmd_list_waitQ);
+	}
 
 	spin_lock_irq(&scst_mcmd_lock);
 	list_for_each_entry(m, &scst_delayed_mgmt_cmd_list,
@@ -1125,6 +1142,237 @@ void scst_resume_activity(void)
 }
 EXPORT_SYMBOL_GPL(scst_resume_activity);
 
+int scst_get_tgt_cmd_counter(struct scst_tgt *tgt)
+{
+	int i, res = 0;
+
+	for_each_possible_cpu(i)
+		res += atomic_read(per_cpu_ptr(tgt->tgt_cmd_counts, i));
+	return res;
+}
+
+/* scst_suspend_mutex supposed to be locked */
+static int scst_tgt_susp_wait(struct scst_tgt *tgt, unsigned long timeout)
+{
+	int res;
+
+	/*
+	 * Makes scst_put() wake us up. Ordered with the counters by the
+	 * barrier in scst_put(), see comment about smp_mb() in
+	 * scst_suspend_activity().
+	 */
+	set_bit(SCST_FLAG_TGT_SUSP_WAITING, &scst_flags);
+	smp_mb__after_set_bit();
+
+	if (timeout != SCST_SUSPEND_TIMEOUT_UNLIMITED) {
+		res = wait_event_interruptible_timeout(scst_dev_cmd_waitQ,
+			scst_get_tgt_cmd_counter(tgt) == 0, timeout);
+		if (res == 0)
+			res = -EBUSY;
+		else if (res > 0)
+			res = 0;
+	} else {
+		wait_event(scst_dev_cmd_waitQ,
+			scst_get_tgt_cmd_counter(tgt) == 0);
+		res = 0;
+	}
+
+	clear_bit(SCST_FLAG_TGT_SUSP_WAITING, &scst_flags);
+	return res;
+}
+
+/* scst_suspend_mutex supposed to be locked */
+static void __scst_resume_tgt_activity(struct scst_tgt *tgt)
+{
+	unsigned int i;
+
+	TRACE_ENTRY();
+
+	if (tgt->tgt_suspend_count == 0) {
+		PRINT_WARNING("Resume without suspend (target %s)",
+			tgt->tgt_name);
+		goto out;
+	}
+
+	tgt->tgt_suspend_count--;
+	TRACE_MGMT_DBG("Target %s suspend_count %d left", tgt->tgt_name,
+		tgt->tgt_suspend_count);
+	if (tgt->tgt_suspend_count > 0)
+		goto out;
+
+	/*
+	 * scst_do_job_init() restarts its list pass, if it sees this write
+	 * in the middle of it, so it can't reorder the target's commands.
+	 */
+	write_seqlock(&scst_tgt_resume_lock);
+	WRITE_ONCE(tgt->tgt_suspended, false);
+	write_sequnlock(&scst_tgt_resume_lock);
+
+	for (i = 0; i < scst_init_queues_num; i++) {
+		struct scst_init_queue *q = &scst_init_queues[i];
+
+		spin_lock_irq(&q->init_lock);
+		q->init_tgt_susp_blocked = false;
+		spin_unlock_irq(&q->init_lock);
+
+		wake_up_all(&q->init_cmd_list_waitQ);
+	}
+
+	spin_lock_irq(&scst_mcmd_lock);
+	list_splice_init(&scst_delayed_mgmt_cmd_list,
+			 &scst_active_mgmt_cmd_list);
+	spin_unlock_irq(&scst_mcmd_lock);
+
+	wake_up_all(&scst_mgmt_cmd_list_waitQ);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/**
+ * scst_suspend_tgt_activity() - suspend activity of a single target
+ * @tgt:	target to suspend
+ * @timeout:	the same as for scst_suspend_activity()
+ *
+ * Description:
+ *    The same as scst_suspend_activity(), but suspends only commands and
+ *    TM commands of @tgt's sessions, so changes limited to the target's
+ *    LUN maps (LUNs, initiator groups, initiators) don't stall I/O of all
+ *    other targets. The caller must make sure @tgt stays alive until the
+ *    corresponding scst_resume_tgt_activity().
+ */
+int scst_suspend_tgt_activity(struct scst_tgt *tgt, unsigned long timeout)
+{
+	int res = 0;
+	unsigned long cur_time = jiffies, wait_time;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
+	rwlock_acquire_read(&scst_suspend_dep_map, 0, 0, _RET_IP_);
+#endif
+
+	if (timeout != SCST_SUSPEND_TIMEOUT_UNLIMITED) {
+		res = mutex_lock_interruptible(&scst_suspend_mutex);
+		if (res != 0)
+			goto out;
+	} else
+		mutex_lock(&scst_suspend_mutex);
+
+	TRACE_MGMT_DBG("Target %s suspend_count %d", tgt->tgt_name,
+		tgt->tgt_suspend_count);
+	tgt->tgt_suspend_count++;
+	if (tgt->tgt_suspend_count > 1)
+		goto out_up;
+
+	WRITE_ONCE(tgt->tgt_suspending, true);
+	WRITE_ONCE(tgt->tgt_suspended, true);
+	/*
+	 * Pairs with the barrier in scst_get() following scst_tgt_get(), see
+	 * comment about smp_mb() in scst_suspend_activity().
+	 */
+	smp_mb();
+
+	if (scst_get_tgt_cmd_counter(tgt) != 0)
+		TRACE_MGMT_DBG("Waiting for %d active commands of target %s "
+			"to complete", scst_get_tgt_cmd_counter(tgt),
+			tgt->tgt_name);
+
+	/* TM commands are still allowed in, so stuck commands can be aborted */
+	res = scst_tgt_susp_wait(tgt, timeout);
+
+	WRITE_ONCE(tgt->tgt_suspending, false);
+	smp_mb();
+
+	if (res != 0)
+		goto out_resume;
+
+	if (timeout != SCST_SUSPEND_TIMEOUT_UNLIMITED) {
+		wait_time = jiffies - cur_time;
+		/* just in case */
+		if (wait_time >= timeout) {
+			res = -EBUSY;
+			goto out_resume;
+		}
+		wait_time = timeout - wait_time;
+	} else
+		wait_time = SCST_SUSPEND_TIMEOUT_UNLIMITED;
+
+	res = scst_tgt_susp_wait(tgt, wait_time);
+	if (res != 0)
+		goto out_resume;
+
+out_up:
+	mutex_unlock(&scst_suspend_mutex);
+
+out:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
+	if (res == 0)
+		lock_acquired(&scst_suspend_dep_map, _RET_IP_);
+	else
+		rwlock_release(&scst_suspend_dep_map, 1, _RET_IP_);
+#endif
+
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_resume:
+	PRINT_WARNING("Suspending of target %s failed: %d", tgt->tgt_name,
+		res);
+	__scst_resume_tgt_activity(tgt);
+	goto out_up;
+}
+EXPORT_SYMBOL_GPL(scst_suspend_tgt_activity);
+
+/**
+ * scst_resume_tgt_activity() - resume activity of a single target
+ *
+ * Resumes activity suspended by scst_suspend_tgt_activity().
+ */
+void scst_resume_tgt_activity(struct scst_tgt *tgt)
+{
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
+	rwlock_release(&scst_suspend_dep_map, 1, _RET_IP_);
+#endif
+
+	mutex_lock(&scst_suspend_mutex);
+	__scst_resume_tgt_activity(tgt);
+	mutex_unlock(&scst_suspend_mutex);
+
+	TRACE_EXIT();
+	return;
+}
+EXPORT_SYMBOL_GPL(scst_resume_tgt_activity);
+
+/**
+ * scst_suspend_dev_activity() - wait until a device becomes idle
+ * @dev:	device to suspend
+ *
+ * Description:
+ *    Blocks execution of new commands on @dev and waits until all commands
+ *    being executed on it finished. Other devices are not affected. Meant
+ *    for changes of a device's own state, like its size, not for changes
+ *    of LUN maps. Returns 0 on success or negative error code otherwise.
+ */
+int scst_suspend_dev_activity(struct scst_device *dev)
+{
+	return scst_ext_block_dev(dev, NULL, NULL, 0, SCST_EXT_BLOCK_SYNC);
+}
+EXPORT_SYMBOL_GPL(scst_suspend_dev_activity);
+
+/**
+ * scst_resume_dev_activity() - resume a device suspended by
+ * scst_suspend_dev_activity()
+ */
+void scst_resume_dev_activity(struct scst_device *dev)
+{
+	scst_ext_unblock_dev(dev, false);
+}
+EXPORT_SYMBOL_GPL(scst_resume_dev_activity);
+
 int scst_get_suspend_count(void)
 {
 	return suspend_count;
@@ -1439,7 +1687,11 @@ int scst_register_virtual_device_node(struct scst_dev_type *dev_handler,
 	if (res != 0)
 		goto out;
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	/*
+	 * The new device isn't visible to any initiator yet, only the copy
+	 * manager may add it to its LUNs, so suspend only its target.
+	 */
+	res = scst_cm_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
 	if (res != 0)
 		goto out;
 
@@ -1513,7 +1765,7 @@ int scst_register_virtual_device_node(struct scst_dev_type *dev_handler,
 		goto out_unreg;
 
 	mutex_unlock(&scst_mutex);
-	scst_resume_activity();
+	scst_cm_resume_activity();
 
 	res = dev->virt_id;
 
@@ -1548,7 +1800,7 @@ out_unlock:
 	mutex_unlock(&scst_mutex);
 
 out_resume:
-	scst_resume_activity();
+	scst_cm_resume_activity();
 	goto out;
 }
 EXPORT_SYMBOL_GPL(scst_register_virtual_device_node);
@@ -1893,8 +2145,9 @@ void scst_unregister_virtual_dev_driver(struct scst_dev_type *dev_type)
 }
 EXPORT_SYMBOL_GPL(scst_unregister_virtual_dev_driver);
 
-int scst_add_threads(struct scst_cmd_threads *cmd_threads,
-	struct scst_device *dev, struct scst_tgt_dev *tgt_dev, int num)
+static int __scst_add_threads(struct scst_cmd_threads *cmd_threads,
+	struct scst_device *dev, struct scst_tgt_dev *tgt_dev, int num,
+	bool adaptive)
 {
 	int res = 0, i;
 	struct scst_cmd_thread_t *thr;
@@ -1940,6 +2193,8 @@ int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 		INIT_LIST_HEAD(&thr->thr_active_cmd_list);
 		spin_lock_init(&thr->thr_cmd_list_lock);
 		thr->thr_cmd_threads = cmd_threads;
+		atomic_set(&thr->thr_assigned_cmds, 0);
+		thr->thr_adaptive = adaptive;
 
 		if (dev != NULL) {
 			thr->cmd_thread = kthread_create_on_node(scst_cmd_thread,
@@ -2002,6 +2257,12 @@ out:
 	return res;
 }
 
+int scst_add_threads(struct scst_cmd_threads *cmd_threads,
+	struct scst_device *dev, struct scst_tgt_dev *tgt_dev, int num)
+{
+	return __scst_add_threads(cmd_threads, dev, tgt_dev, num, false);
+}
+
 /*
  * The being stopped threads must not have assigned commands, which usually
  * means suspended activities.
@@ -2044,6 +2305,216 @@ void scst_del_threads(struct scst_cmd_threads *cmd_threads, int num)
 	return;
 }
 
+/*
+ * Adaptive threads pools sizing.
+ *
+ * Every SCST_THR_TUNE_INTERVAL the tuner samples each adaptive pool. If all
+ * its threads are busy, i.e. not waiting for new commands, while commands
+ * are still queued for SCST_THR_GROW_SAMPLES samples in a row, one more
+ * thread is added, up to thr_adaptive_max. If less than half of the threads
+ * are busy for SCST_THR_SHRINK_SAMPLES samples in a row, one of the threads
+ * added by the tuner is retired. Threads created by the configuration are
+ * never retired, so they are the low bound of the pool size.
+ */
+#define SCST_THR_TUNE_INTERVAL		(HZ / 10)
+#define SCST_THR_GROW_SAMPLES		2
+#define SCST_THR_SHRINK_SAMPLES		50
+
+/* Protected by scst_cmd_threads_mutex */
+static int scst_nr_adaptive_pools;
+
+static void scst_thr_tune_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scst_thr_tune_work, scst_thr_tune_work_fn);
+
+/*
+ * Enables adaptive sizing of cmd_threads up to max threads, or disables it,
+ * if max is 0. It must be disabled before the pool's threads are stopped.
+ *
+ * scst_mutex supposed to be held
+ */
+void scst_set_thr_adaptive(struct scst_cmd_threads *cmd_threads,
+	struct scst_device *dev, struct scst_tgt_dev *tgt_dev, int max)
+{
+	TRACE_ENTRY();
+
+	mutex_lock(&scst_cmd_threads_mutex);
+
+	if ((max > 0) && (cmd_threads->thr_adaptive_max == 0)) {
+		if (scst_nr_adaptive_pools++ == 0)
+			schedule_delayed_work(&scst_thr_tune_work,
+					      SCST_THR_TUNE_INTERVAL);
+		cmd_threads->thr_grown = 0;
+		cmd_threads->thr_shrunk = 0;
+		cmd_threads->thr_last_decision = NULL;
+	} else if ((max == 0) && (cmd_threads->thr_adaptive_max > 0))
+		scst_nr_adaptive_pools--;
+
+	cmd_threads->thr_adaptive_max = max;
+	cmd_threads->thr_dev = dev;
+	cmd_threads->thr_tgt_dev = tgt_dev;
+	cmd_threads->thr_busy_samples = 0;
+	cmd_threads->thr_idle_samples = 0;
+
+	mutex_unlock(&scst_cmd_threads_mutex);
+
+	TRACE_EXIT();
+	return;
+}
+
+/* scst_mutex and scst_cmd_threads_mutex supposed to be held */
+static void scst_thr_reap_retired(struct scst_cmd_threads *cmd_threads)
+{
+	while (1) {
+		struct scst_cmd_thread_t *ct = NULL, *ct2;
+		int rc;
+
+		spin_lock(&cmd_threads->thr_lock);
+		list_for_each_entry(ct2, &cmd_threads->threads_list,
+				    thread_list_entry) {
+			if (ct2->thr_retiring && READ_ONCE(ct2->thr_retired)) {
+				ct = ct2;
+				list_del(&ct->thread_list_entry);
+				ct->being_stopped = true;
+				cmd_threads->nr_threads--;
+				break;
+			}
+		}
+		spin_unlock(&cmd_threads->thr_lock);
+
+		if (ct == NULL)
+			break;
+
+		TRACE_DBG("Stopping retired thr %p (nr_threads %d)", ct,
+			cmd_threads->nr_threads);
+
+		rc = kthread_stop(ct->cmd_thread);
+		if (rc != 0 && rc != -EINTR)
+			TRACE_MGMT_DBG("kthread_stop() failed: %d", rc);
+
+		kmem_cache_free(scst_thr_cachep, ct);
+	}
+	return;
+}
+
+/* scst_mutex and scst_cmd_threads_mutex supposed to be held */
+static void scst_thr_retire_one(struct scst_cmd_threads *cmd_threads)
+{
+	struct scst_cmd_thread_t *thr;
+
+	spin_lock(&cmd_threads->thr_lock);
+	/* New threads are added to the head, so retire the youngest one */
+	list_for_each_entry(thr, &cmd_threads->threads_list,
+			    thread_list_entry) {
+		if (thr->thr_adaptive && !thr->thr_retiring) {
+			thr->thr_retiring = true;
+			wake_up_process(thr->cmd_thread);
+			cmd_threads->thr_shrunk++;
+			cmd_threads->thr_last_decision = "shrink";
+			cmd_threads->thr_last_decision_time = jiffies;
+			TRACE(TRACE_MINOR, "Retiring thread %s (cmd_threads "
+				"%p)", thr->cmd_thread->comm, cmd_threads);
+			break;
+		}
+	}
+	spin_unlock(&cmd_threads->thr_lock);
+	return;
+}
+
+/* scst_mutex and scst_cmd_threads_mutex supposed to be held */
+static void scst_thr_tune_pool(struct scst_cmd_threads *cmd_threads)
+{
+	struct scst_cmd_thread_t *thr;
+	int active = 0, busy = 0, adaptive = 0;
+	bool queued;
+
+	scst_thr_reap_retired(cmd_threads);
+
+	spin_lock(&cmd_threads->thr_lock);
+	list_for_each_entry(thr, &cmd_threads->threads_list,
+			    thread_list_entry) {
+		if (thr->thr_retiring)
+			continue;
+		active++;
+		if (!READ_ONCE(thr->thr_waiting))
+			busy++;
+		if (thr->thr_adaptive)
+			adaptive++;
+	}
+	spin_unlock(&cmd_threads->thr_lock);
+
+	if (active == 0)
+		goto out;
+
+	queued = !list_empty(&cmd_threads->active_cmd_list) ||
+		 (atomic_read(&cmd_threads->nr_backlogged_threads) > 0);
+
+	if ((busy == active) && queued) {
+		cmd_threads->thr_idle_samples = 0;
+		if ((++cmd_threads->thr_busy_samples < SCST_THR_GROW_SAMPLES) ||
+		    (active >= cmd_threads->thr_adaptive_max))
+			goto out;
+		cmd_threads->thr_busy_samples = 0;
+
+		if (__scst_add_threads(cmd_threads, cmd_threads->thr_dev,
+				cmd_threads->thr_tgt_dev, 1, true) != 0)
+			goto out;
+
+		cmd_threads->thr_grown++;
+		cmd_threads->thr_last_decision = "grow";
+		cmd_threads->thr_last_decision_time = jiffies;
+		TRACE(TRACE_MINOR, "Grown cmd_threads %p to %d threads",
+			cmd_threads, active + 1);
+	} else if (busy * 2 < active) {
+		cmd_threads->thr_busy_samples = 0;
+		if ((++cmd_threads->thr_idle_samples < SCST_THR_SHRINK_SAMPLES) ||
+		    (adaptive == 0))
+			goto out;
+		cmd_threads->thr_idle_samples = 0;
+
+		scst_thr_retire_one(cmd_threads);
+	} else {
+		cmd_threads->thr_busy_samples = 0;
+		cmd_threads->thr_idle_samples = 0;
+	}
+
+out:
+	return;
+}
+
+static void scst_thr_tune_work_fn(struct work_struct *work)
+{
+	struct scst_cmd_threads *l;
+	bool resched = true;
+
+	TRACE_ENTRY();
+
+	/*
+	 * scst_mutex keeps the pools' devices and tgt_devs alive and stable.
+	 * Don't wait for it: busy configuration would only delay the
+	 * sampling, so just skip this one.
+	 */
+	if (!mutex_trylock(&scst_mutex))
+		goto out_resched;
+
+	mutex_lock(&scst_cmd_threads_mutex);
+	list_for_each_entry(l, &scst_cmd_threads_list, lists_list_entry) {
+		if (l->thr_adaptive_max > 0)
+			scst_thr_tune_pool(l);
+	}
+	resched = (scst_nr_adaptive_pools > 0);
+	mutex_unlock(&scst_cmd_threads_mutex);
+
+	mutex_unlock(&scst_mutex);
+
+out_resched:
+	if (resched)
+		schedule_delayed_work(&scst_thr_tune_work,
+				      SCST_THR_TUNE_INTERVAL);
+
+	TRACE_EXIT();
+	return;
+}
+
 /* scst_mutex supposed to be held */
 int scst_set_thr_cpu_mask(struct scst_cmd_threads *cmd_threads,
 			  cpumask_t *cpu_mask)
@@ -2071,6 +2542,10 @@ void scst_stop_dev_threads(struct scst_device *dev)
 
 	TRACE_ENTRY();
 
+	if ((dev->threads_num > 0) &&
+	    (dev->threads_pool_type == SCST_THREADS_POOL_SHARED))
+		scst_set_thr_adaptive(&dev->dev_cmd_threads, NULL, NULL, 0);
+
 	list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
 				dev_tgt_dev_list_entry) {
 		scst_tgt_dev_stop_threads(tgt_dev);
@@ -2105,6 +2580,10 @@ int scst_create_dev_threads(struct scst_device *dev)
 			dev->threads_num);
 		if (res != 0)
 			goto out_err;
+
+		if (dev->threads_max > 0)
+			scst_set_thr_adaptive(&dev->dev_cmd_threads, dev, NULL,
+					      dev->threads_max);
 	}
 
 out:
@@ -2163,6 +2642,7 @@ assign:
 	dev->handler = handler;
 	dev->threads_num = handler->threads_num;
 	dev->threads_pool_type = handler->threads_pool_type;
+	dev->threads_max = 0;
 	dev->max_tgt_dev_commands = handler->max_tgt_dev_commands;
 	dev->max_write_same_len = 256 * 1024 * 1024; /* 256 MB */
 
@@ -2248,6 +2728,8 @@ void scst_init_threads(struct scst_cmd_threads *cmd_threads)
 	INIT_LIST_HEAD(&cmd_threads->threads_list);
 	mutex_init(&cmd_threads->io_context_mutex);
 	spin_lock_init(&cmd_threads->thr_lock);
+	atomic_set(&cmd_threads->nr_backlogged_threads, 0);
+	cmd_threads->thr_adaptive_max = 0;
 
 	mutex_lock(&scst_cmd_threads_mutex);
 	list_add_tail(&cmd_threads->lists_list_entry,
@@ -2269,6 +2751,10 @@ void scst_deinit_threads(struct scst_cmd_threads *cmd_threads)
 	TRACE_ENTRY();
 
 	mutex_lock(&scst_cmd_threads_mutex);
+	if (cmd_threads->thr_adaptive_max > 0) {
+		cmd_threads->thr_adaptive_max = 0;
+		scst_nr_adaptive_pools--;
+	}
 	list_del(&cmd_threads->lists_list_entry);
 	mutex_unlock(&scst_cmd_threads_mutex);
 
@@ -2279,6 +2765,74 @@ void scst_deinit_threads(struct scst_cmd_threads *cmd_threads)
 }
 EXPORT_SYMBOL_GPL(scst_deinit_threads);
 
+/* Returns init queue index for a new session. Sessions go round robin. */
+unsigned int scst_get_init_queue(void)
+{
+	return (unsigned int)atomic_inc_return(&scst_init_queue_next) %
+		scst_init_queues_num;
+}
+
+static void scst_stop_init_threads(void)
+{
+	unsigned int i;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < scst_init_queues_num; i++) {
+		struct scst_init_queue *q = &scst_init_queues[i];
+
+		if (q->init_cmd_thread) {
+			kthread_stop(q->init_cmd_thread);
+			q->init_cmd_thread = NULL;
+		}
+	}
+
+	TRACE_EXIT();
+	return;
+}
+
+/* One init thread per online CPU, bound to it. Doesn't stop ran threads. */
+static int scst_start_init_threads(void)
+{
+	int res = 0, cpu, rc;
+	unsigned int n = 0;
+
+	TRACE_ENTRY();
+
+	for_each_online_cpu(cpu) {
+		struct scst_init_queue *q = &scst_init_queues[n];
+
+		q->init_cmd_thread = kthread_create_on_node(scst_init_thread,
+			q, cpu_to_node(cpu), "scst_initd%d", cpu);
+		if (IS_ERR(q->init_cmd_thread)) {
+			res = PTR_ERR(q->init_cmd_thread);
+			PRINT_ERROR("kthread_create() for init cmd failed: %d",
+				res);
+			q->init_cmd_thread = NULL;
+			break;
+		}
+
+		/*
+		 * Not kthread_bind(), because the CPU might go offline later.
+		 * Then the scheduler will move the thread somewhere else.
+		 */
+		rc = set_cpus_allowed_ptr(q->init_cmd_thread, cpumask_of(cpu));
+		if (rc != 0)
+			PRINT_ERROR("Setting CPU affinity failed: %d", rc);
+
+		wake_up_process(q->init_cmd_thread);
+		n++;
+	}
+
+	if (n > 0)
+		scst_init_queues_num = n;
+
+	TRACE_DBG("%u init threads started", n);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static void scst_stop_global_threads(void)
 {
 	TRACE_ENTRY();
@@ -2291,8 +2845,7 @@ static void scst_stop_global_threads(void)
 		kthread_stop(scst_mgmt_cmd_thread);
 	if (scst_mgmt_thread)
 		kthread_stop(scst_mgmt_thread);
-	if (scst_init_cmd_thread)
-		kthread_stop(scst_init_cmd_thread);
+	scst_stop_init_threads();
 
 	mutex_unlock(&scst_mutex);
 
@@ -2313,14 +2866,9 @@ static int scst_start_global_threads(int num)
 	if (res < 0)
 		goto out_unlock;
 
-	scst_init_cmd_thread = kthread_run(scst_init_thread,
-		NULL, "scst_initd");
-	if (IS_ERR(scst_init_cmd_thread)) {
-		res = PTR_ERR(scst_init_cmd_thread);
-		PRINT_ERROR("kthread_create() for init cmd failed: %d", res);
-		scst_init_cmd_thread = NULL;
+	res = scst_start_init_threads();
+	if (res != 0)
 		goto out_unlock;
-	}
 
 	scst_mgmt_cmd_thread = kthread_run(scst_tm_thread,
 		NULL, "scsi_tm");
@@ -2515,9 +3063,18 @@ static int __init init_scst(void)
 #ifdef CONFIG_SCST_PROC
 	INIT_LIST_HEAD(&scst_acg_list);
 #endif
-	spin_lock_init(&scst_init_lock);
-	init_waitqueue_head(&scst_init_cmd_list_waitQ);
-	INIT_LIST_HEAD(&scst_init_cmd_list);
+	scst_init_queues = kcalloc(nr_cpu_ids, sizeof(*scst_init_queues),
+				   GFP_KERNEL);
+	if (scst_init_queues == NULL) {
+		PRINT_ERROR("%s", "Allocation of init queues failed");
+		res = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < (int)nr_cpu_ids; i++) {
+		spin_lock_init(&scst_init_queues[i].init_lock);
+		INIT_LIST_HEAD(&scst_init_queues[i].init_cmd_list);
+		init_waitqueue_head(&scst_init_queues[i].init_cmd_list_waitQ);
+	}
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
 	scst_trace_flag = SCST_DEFAULT_LOG_FLAGS;
 #endif
@@ -2825,6 +3382,7 @@ out_lib_exit:
 
 out_deinit_threads:
 	scst_deinit_threads(&scst_main_cmd_threads);
+	kfree(scst_init_queues);
 	goto out;
 }
 
@@ -2842,6 +3400,8 @@ static void __exit exit_scst(void)
 
 	scst_stop_global_threads();
 
+	cancel_delayed_work_sync(&scst_thr_tune_work);
+
 	scst_deinit_threads(&scst_main_cmd_threads);
 
 	scsi_unregister_interface(&scst_interface);
@@ -2882,6 +3442,8 @@ static void __exit exit_scst(void)
 	DEINIT_CACHEP(scst_acgd_cachep);
 	DEINIT_CACHEP(scst_thr_cachep);
 
+	kfree(scst_init_queues);
+
 	scst_lib_exit();
 
 	PRINT_INFO("%s", "SCST unloaded");
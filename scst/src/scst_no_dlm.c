@@ -101,6 +101,11 @@ static void scst_no_dlm_reserve(struct scst_device *dev,
 	dev->reserved_by = sess;
 }
 
+static ssize_t scst_no_dlm_pr_show_stats(struct scst_device *dev, char *buf)
+{
+	return 0;
+}
+
 const struct scst_cl_ops scst_no_dlm_cl_ops = {
 	.pr_init		= scst_no_dlm_pr_init,
 	.pr_cleanup		= scst_no_dlm_pr_cleanup,
@@ -115,4 +120,5 @@ const struct scst_cl_ops scst_no_dlm_cl_ops = {
 	.is_rsv_holder		= scst_no_dlm_is_rsv_holder,
 	.is_not_rsv_holder	= scst_no_dlm_is_not_rsv_holder,
 	.reserve		= scst_no_dlm_reserve,
+	.pr_show_stats		= scst_no_dlm_pr_show_stats,
 };
@@ -21,6 +21,7 @@
 
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 2, 0)
 #include <linux/export.h>
 #endif
@@ -87,6 +88,12 @@ extern unsigned long scst_trace_flag;
 /* Set if new commands initialization is suspended for a while */
 #define SCST_FLAG_SUSPENDED		     1
 
+/*
+ * Set while scst_suspend_tgt_activity() is waiting for commands of a
+ * target to finish, so scst_put() has to wake it up.
+ */
+#define SCST_FLAG_TGT_SUSP_WAITING	     2
+
 /**
  ** Return codes for cmd state process functions. Codes are the same as
  ** for SCST_EXEC_* to avoid translation to them and, hence, have better code.
@@ -151,6 +158,7 @@ extern int scst_threads;
 extern unsigned int scst_max_dev_cmd_mem;
 
 extern int scst_forcibly_close_sessions;
+extern bool scst_lazy_tgt_devs;
 
 extern mempool_t *scst_mgmt_mempool;
 extern mempool_t *scst_mgmt_stub_mempool;
@@ -190,10 +198,39 @@ extern int scst_max_tasklet_cmd;
 extern unsigned long scst_poll_ns;
 #endif
 
-extern spinlock_t scst_init_lock;
-extern struct list_head scst_init_cmd_list;
-extern wait_queue_head_t scst_init_cmd_list_waitQ;
-extern unsigned int scst_init_poll_cnt;
+/*
+ * Queue of commands, which couldn't be inited directly in scst_init_cmd().
+ * There is one such queue with its own thread per online CPU. Each session
+ * is assigned to one of them, so commands from the same initiator stay in
+ * order, while different initiators don't contend on the same lock.
+ */
+struct scst_init_queue {
+	spinlock_t init_lock;
+	struct list_head init_cmd_list;
+	wait_queue_head_t init_cmd_list_waitQ;
+
+	/* Protected by init_lock */
+	unsigned int init_poll_cnt;
+
+	/*
+	 * Set by the init thread if all commands left in init_cmd_list
+	 * belong to suspended targets. Protected by init_lock.
+	 */
+	bool init_tgt_susp_blocked;
+
+	struct task_struct *init_cmd_thread;
+} ____cacheline_aligned_in_smp;
+extern struct scst_init_queue *scst_init_queues;
+extern unsigned int scst_init_queues_num;
+extern seqlock_t scst_tgt_resume_lock;
+
+static inline struct scst_init_queue *scst_sess_init_queue(
+	const struct scst_session *sess)
+{
+	return &scst_init_queues[sess->sess_init_queue];
+}
+
+unsigned int scst_get_init_queue(void);
 
 extern struct scst_cmd_threads scst_main_cmd_threads;
 
@@ -218,13 +255,35 @@ extern struct list_head scst_sess_shut_list;
 
 extern cpumask_t default_cpu_mask;
 
+/*
+ * Minimal number of commands waiting on a thread's own list, from which
+ * idle threads of the same pool start stealing them.
+ */
+#define SCST_CMD_THR_STEAL_MIN	2
+
 struct scst_cmd_thread_t {
 	struct list_head thr_active_cmd_list;
 	spinlock_t thr_cmd_list_lock;
+	/* Length of thr_active_cmd_list, protected by thr_cmd_list_lock */
+	int thr_active_cmd_cnt;
 	struct task_struct *cmd_thread;
 	struct scst_cmd_threads *thr_cmd_threads;
 	struct list_head thread_list_entry;
 	bool being_stopped;
+
+	/* Number of not yet freed commands with cmd_thr pointing here */
+	atomic_t thr_assigned_cmds;
+	/* Set while the thread is sleeping waiting for new commands */
+	bool thr_waiting;
+	/* Set, if the thread was added by the adaptive pool sizing */
+	bool thr_adaptive;
+	/*
+	 * Set by the pool tuner under thr_lock. A retiring thread takes no
+	 * new commands and only processes the already assigned ones.
+	 */
+	bool thr_retiring;
+	/* Set by the retiring thread, when it has nothing to do anymore */
+	bool thr_retired;
 };
 
 static inline bool scst_set_io_context(struct scst_cmd *cmd,
@@ -278,6 +337,8 @@ extern enum scst_dev_type_threads_pool_type scst_parse_threads_pool_type(
 extern int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 	struct scst_device *dev, struct scst_tgt_dev *tgt_dev, int num);
 extern void scst_del_threads(struct scst_cmd_threads *cmd_threads, int num);
+extern void scst_set_thr_adaptive(struct scst_cmd_threads *cmd_threads,
+	struct scst_device *dev, struct scst_tgt_dev *tgt_dev, int max);
 
 extern int scst_create_dev_threads(struct scst_device *dev);
 extern void scst_stop_dev_threads(struct scst_device *dev);
@@ -326,6 +387,7 @@ static inline void scst_make_deferred_commands_active_locked(
 }
 
 bool scst_inc_expected_sn(const struct scst_cmd *cmd);
+void scst_release_sn_early(struct scst_cmd *cmd);
 int scst_check_hq_cmd(struct scst_cmd *cmd);
 
 void scst_unblock_deferred(struct scst_order_data *order_data,
@@ -366,9 +428,38 @@ void scst_put_acg(struct scst_acg *acg);
 struct scst_acg *scst_tgt_find_acg(struct scst_tgt *tgt, const char *name);
 struct scst_acg *scst_find_acg(const struct scst_session *sess);
 
+void scst_acn_compile(struct scst_acn *acn);
+#ifndef CONFIG_SCST_PROC
+void scst_tgt_update_acn_index(struct scst_tgt *tgt);
+#endif
+
+/*
+ * Incremented under scst_mutex after each change of ACG or ACN lists, so
+ * lockless ACG lookups can find out if their results are still valid.
+ */
+extern unsigned int scst_acg_lookup_gen;
+
+static inline void scst_acg_lookup_changed(struct scst_tgt *tgt)
+{
+	lockdep_assert_held(&scst_mutex);
+#ifndef CONFIG_SCST_PROC
+	scst_tgt_update_acn_index(tgt);
+#endif
+	/* Make the list and index changes visible before the new generation */
+	smp_wmb();
+	WRITE_ONCE(scst_acg_lookup_gen, scst_acg_lookup_gen + 1);
+}
+
 void scst_check_reassign_sessions(void);
 
 int scst_sess_alloc_tgt_devs(struct scst_session *sess);
+int scst_sess_alloc_lazy_tgt_dev(struct scst_session *sess, u64 lun);
+bool scst_acg_has_lun(const struct scst_acg *acg, u64 lun);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+void scst_sess_lazy_tgt_dev_work_fn(void *p);
+#else
+void scst_sess_lazy_tgt_dev_work_fn(struct work_struct *work);
+#endif
 void scst_sess_free_tgt_devs(struct scst_session *sess);
 struct scst_tgt_dev *scst_lookup_tgt_dev(struct scst_session *sess, u64 lun);
 void scst_nexus_loss(struct scst_tgt_dev *tgt_dev, bool queue_UA);
@@ -406,6 +497,15 @@ int scst_finish_internal_cmd(struct scst_cmd *cmd);
 int scst_set_cmd_error_sense(struct scst_cmd *cmd, uint8_t *sense,
 	unsigned int len);
 void scst_store_sense(struct scst_cmd *cmd);
+int scst_alloc_sense_len(struct scst_cmd *cmd, int atomic, unsigned int len);
+
+static inline void scst_free_sense(struct scst_cmd *cmd)
+{
+	TRACE_MEM("Releasing sense %p (cmd %p)", cmd->sense, cmd);
+	if (cmd->sense != cmd->sense_inline)
+		mempool_free(cmd->sense, scst_sense_mempool);
+	cmd->sense = NULL;
+}
 
 int scst_process_check_condition(struct scst_cmd *cmd);
 
@@ -467,6 +567,44 @@ void scst_finish_cmd_mgmt(struct scst_cmd *cmd);
 
 static inline void scst_devt_cleanup(struct scst_dev_type *devt) { }
 
+#define SCST_QOS_DEF_WEIGHT	1
+#define SCST_QOS_MAX_WEIGHT	10000
+
+void scst_process_redirect_cmd(struct scst_cmd *cmd,
+	enum scst_exec_context context, int check_retries);
+
+void scst_qos_init_dev(struct scst_device *dev);
+void scst_qos_deinit_dev(struct scst_device *dev);
+void scst_qos_init_tgt_dev(struct scst_tgt_dev *tgt_dev);
+void scst_qos_set_dev_limits(struct scst_device *dev,
+	unsigned int iops_limit, unsigned int bw_limit);
+void scst_qos_set_acg_limits(struct scst_acg *acg,
+	unsigned int iops_limit, unsigned int bw_limit);
+void scst_qos_update_acg_dev(struct scst_acg_dev *acg_dev);
+bool __scst_qos_admit(struct scst_cmd *cmd);
+
+static inline bool scst_qos_bucket_limited(const struct scst_qos_bucket *b)
+{
+	return (READ_ONCE(b->qb_iops_limit) | READ_ONCE(b->qb_bw_limit)) != 0;
+}
+
+/*
+ * Returns true, if cmd can go to execution, or false, if it was delayed by
+ * the QoS limits.
+ */
+static inline bool scst_qos_admit(struct scst_cmd *cmd)
+{
+	struct scst_tgt_dev *tgt_dev = cmd->tgt_dev;
+
+	if (likely(!scst_qos_bucket_limited(&tgt_dev->tgt_dev_qos_bucket) &&
+		   !scst_qos_bucket_limited(&tgt_dev->acg_dev->acg->acg_qos_bucket) &&
+		   !scst_qos_bucket_limited(&tgt_dev->dev->dev_qos_bucket) &&
+		   list_empty(&tgt_dev->tgt_dev_qos_cmd_list)))
+		return true;
+
+	return __scst_qos_admit(cmd);
+}
+
 void scst_tg_init(void);
 void scst_tg_cleanup(void);
 int scst_dg_add(struct kobject *parent, const char *name);
@@ -627,6 +765,9 @@ void scst_acg_dev_sysfs_del(struct scst_acg_dev *acg_dev);
 int scst_acn_sysfs_create(struct scst_acn *acn);
 void scst_acn_sysfs_del(struct scst_acn *acn);
 
+/* Protected by scst_mutex */
+extern bool scst_cfg_batch_active;
+
 #endif /* CONFIG_SCST_PROC */
 
 /*
@@ -785,6 +926,11 @@ static inline void scst_put(atomic_t *a)
 	if (unlikely(test_bit(SCST_FLAG_SUSPENDED, &scst_flags)) && f) {
 		TRACE_MGMT_DBG("%s", "Waking up scst_dev_cmd_waitQ");
 		wake_up_all(&scst_dev_cmd_waitQ);
+	} else if (unlikely(test_bit(SCST_FLAG_TGT_SUSP_WAITING,
+				&scst_flags))) {
+		/* The put might have been the last one of the target */
+		TRACE_MGMT_DBG("%s", "Waking up scst_dev_cmd_waitQ (tgt)");
+		wake_up_all(&scst_dev_cmd_waitQ);
 	}
 	TRACE_DBG("Decrementing cpu_cmd_count %p (new value %d)",
 	      a, atomic_read(a));
@@ -792,6 +938,41 @@ static inline void scst_put(atomic_t *a)
 
 int scst_get_cmd_counter(void);
 
+/*
+ * Per target analog of scst_get(), protects from entering into suspended
+ * activity of this target. Must be called before scst_get(), whose barrier
+ * orders the increment with the following checks of the target's flags.
+ */
+static inline void scst_tgt_get(struct scst_tgt *tgt)
+{
+	/* The same as in scst_get(), any CPU's counter will do */
+	atomic_inc(per_cpu_ptr(tgt->tgt_cmd_counts, raw_smp_processor_id()));
+}
+
+/*
+ * Per target analog of scst_put(), must be called before scst_put(), which
+ * wakes up scst_suspend_tgt_activity(), if it's waiting.
+ */
+static inline void scst_tgt_put(struct scst_tgt *tgt)
+{
+	atomic_dec(per_cpu_ptr(tgt->tgt_cmd_counts, raw_smp_processor_id()));
+}
+
+int scst_get_tgt_cmd_counter(struct scst_tgt *tgt);
+
+/* Returns true if new commands of tgt must wait for its activity resume */
+static inline bool scst_tgt_cmds_suspended(struct scst_tgt *tgt)
+{
+	return unlikely(READ_ONCE(tgt->tgt_suspended));
+}
+
+/* Returns true if new TM commands of tgt must wait for its activity resume */
+static inline bool scst_tgt_mgmt_suspended(struct scst_tgt *tgt)
+{
+	return unlikely(READ_ONCE(tgt->tgt_suspended) &&
+			!READ_ONCE(tgt->tgt_suspending));
+}
+
 void scst_sched_session_free(struct scst_session *sess);
 
 static inline void scst_sess_get(struct scst_session *sess)
@@ -809,6 +990,22 @@ static inline void scst_sess_put(struct scst_session *sess)
 		scst_sched_session_free(sess);
 }
 
+/* Must be called under sess->sess_list_lock */
+static inline void scst_sess_add_cmd(struct scst_session *sess,
+	struct scst_cmd *cmd)
+{
+	list_add_tail(&cmd->sess_cmd_list_entry, &sess->sess_cmd_list);
+	list_add_tail(&cmd->sess_cmd_tag_hash_entry,
+		&sess->sess_cmd_tag_hash[SESS_CMD_TAG_HASH_FN(cmd->tag)]);
+}
+
+/* Must be called under sess->sess_list_lock */
+static inline void scst_sess_del_cmd(struct scst_cmd *cmd)
+{
+	list_del(&cmd->sess_cmd_list_entry);
+	list_del(&cmd->sess_cmd_tag_hash_entry);
+}
+
 struct scst_cmd *scst_alloc_cmd(const uint8_t *cdb,
 	unsigned int cdb_len, gfp_t gfp_mask);
 int scst_pre_init_cmd(struct scst_cmd *cmd, const uint8_t *cdb,
@@ -873,6 +1070,8 @@ static inline bool scst_lba1_inside_lba2(int64_t lba1,
 
 #ifndef CONFIG_SCST_PROC
 
+int scst_cm_suspend_activity(unsigned long timeout);
+void scst_cm_resume_activity(void);
 void scst_cm_update_dev(struct scst_device *dev);
 int scst_cm_on_dev_register(struct scst_device *dev);
 void scst_cm_on_dev_unregister(struct scst_device *dev);
@@ -907,6 +1106,11 @@ void scst_cm_exit(void);
 
 #else /* #ifndef CONFIG_SCST_PROC */
 
+static inline int scst_cm_suspend_activity(unsigned long timeout)
+{
+	return 0;
+}
+static inline void scst_cm_resume_activity(void) {}
 static inline void scst_cm_update_dev(struct scst_device *dev) {}
 static inline int scst_cm_on_dev_register(struct scst_device *dev) { return 0; }
 static inline void scst_cm_on_dev_unregister(struct scst_device *dev) {}
@@ -0,0 +1,434 @@
+/*
+ *  scst_qos.c
+ *
+ *  Per-LUN, per-ACG and per-device IOPS and bandwidth limits.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, version 2
+ *  of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Each tgt_dev, ACG and device can have an IOPS and a bandwidth limit,
+ * enforced by token buckets. A command must take tokens from all three
+ * buckets before it goes to execution. If any of the buckets is empty, the
+ * command is delayed on its tgt_dev's queue, instead of being returned
+ * with BUSY status, and the device's QoS timer releases the delayed
+ * commands as soon as the buckets get refilled. Commands are checked after
+ * their SN check, and in a task set shared by all I_T nexuses a delayed
+ * command gives up its place in the SN order, so a throttled initiator
+ * doesn't hold back the others.
+ *
+ * When the delayed commands wait for the device's bucket, the tgt_devs
+ * with delayed commands are served by deficit round robin, so each of them
+ * gets a share of the device proportional to its LUN's weight.
+ */
+
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+
+#ifdef INSIDE_KERNEL_TREE
+#include <scst/scst.h>
+#else
+#include "scst.h"
+#endif
+#include "scst_priv.h"
+
+/* Max amount of tokens a bucket can accumulate, in jiffies of its rate */
+#define SCST_QOS_BURST_JIFFIES	max(HZ / 10, 1)
+
+enum scst_qos_res {
+	SCST_QOS_PASS,
+	SCST_QOS_TGT_DEV,
+	SCST_QOS_ACG,
+	SCST_QOS_DEV,
+};
+
+static s64 scst_qos_cap(unsigned int limit, unsigned int unit)
+{
+	return max_t(s64, (s64)limit * unit * SCST_QOS_BURST_JIFFIES, HZ);
+}
+
+static void scst_qos_refill(struct scst_qos_bucket *b, unsigned long now)
+{
+	unsigned long delta = now - b->qb_last_refill;
+
+	if (delta == 0)
+		return;
+
+	b->qb_last_refill = now;
+	if (delta > HZ)
+		delta = HZ;
+
+	if (b->qb_iops_limit != 0)
+		b->qb_iops_tokens = min_t(s64,
+			b->qb_iops_tokens + (s64)b->qb_iops_limit * delta,
+			scst_qos_cap(b->qb_iops_limit, 1));
+	if (b->qb_bw_limit != 0)
+		b->qb_bw_tokens = min_t(s64,
+			b->qb_bw_tokens + (s64)b->qb_bw_limit * 1024 * delta,
+			scst_qos_cap(b->qb_bw_limit, 1024));
+	return;
+}
+
+/*
+ * Tokens can go negative, so a command bigger than the bucket's capacity
+ * still passes, when the bucket is not empty, and the following commands
+ * wait until the debt is paid.
+ */
+static bool scst_qos_bucket_ready(const struct scst_qos_bucket *b)
+{
+	return ((b->qb_iops_limit == 0) || (b->qb_iops_tokens > 0)) &&
+	       ((b->qb_bw_limit == 0) || (b->qb_bw_tokens > 0));
+}
+
+static void scst_qos_bucket_charge(struct scst_qos_bucket *b,
+	unsigned int bytes)
+{
+	if (b->qb_iops_limit != 0)
+		b->qb_iops_tokens -= HZ;
+	if (b->qb_bw_limit != 0)
+		b->qb_bw_tokens -= (s64)bytes * HZ;
+	return;
+}
+
+static void scst_qos_bucket_set(struct scst_qos_bucket *b,
+	unsigned int iops_limit, unsigned int bw_limit)
+{
+	b->qb_iops_limit = iops_limit;
+	b->qb_bw_limit = bw_limit;
+	b->qb_iops_tokens = scst_qos_cap(iops_limit, 1);
+	b->qb_bw_tokens = scst_qos_cap(bw_limit, 1024);
+	b->qb_last_refill = jiffies;
+	return;
+}
+
+static unsigned int scst_qos_cmd_bytes(const struct scst_cmd *cmd)
+{
+	return cmd->bufflen + cmd->out_bufflen;
+}
+
+/*
+ * Takes tokens for a command of the given size from all the buckets of
+ * tgt_dev, or from none of them. Returns SCST_QOS_PASS on success, or
+ * which bucket is empty.
+ *
+ * dev->dev_qos_lock supposed to be held with BHs disabled.
+ */
+static enum scst_qos_res scst_qos_take(struct scst_tgt_dev *tgt_dev,
+	unsigned int bytes, unsigned long now)
+{
+	struct scst_device *dev = tgt_dev->dev;
+	struct scst_acg *acg = tgt_dev->acg_dev->acg;
+	struct scst_qos_bucket *tb = &tgt_dev->tgt_dev_qos_bucket;
+	struct scst_qos_bucket *db = &dev->dev_qos_bucket;
+	struct scst_qos_bucket *ab = &acg->acg_qos_bucket;
+	enum scst_qos_res res;
+
+	scst_qos_refill(tb, now);
+	if (!scst_qos_bucket_ready(tb)) {
+		res = SCST_QOS_TGT_DEV;
+		goto out;
+	}
+
+	scst_qos_refill(db, now);
+	if (!scst_qos_bucket_ready(db)) {
+		res = SCST_QOS_DEV;
+		goto out;
+	}
+
+	spin_lock(&acg->acg_qos_lock);
+	scst_qos_refill(ab, now);
+	if (!scst_qos_bucket_ready(ab)) {
+		spin_unlock(&acg->acg_qos_lock);
+		res = SCST_QOS_ACG;
+		goto out;
+	}
+	scst_qos_bucket_charge(ab, bytes);
+	spin_unlock(&acg->acg_qos_lock);
+
+	scst_qos_bucket_charge(tb, bytes);
+	scst_qos_bucket_charge(db, bytes);
+	res = SCST_QOS_PASS;
+
+out:
+	return res;
+}
+
+/*
+ * Checks QoS limits of cmd. Returns true, if cmd can proceed, or false, if
+ * it was delayed. Delayed commands are resumed from the device's QoS timer.
+ * Aborted commands pass without taking any tokens.
+ *
+ * No locks, thread context.
+ */
+bool __scst_qos_admit(struct scst_cmd *cmd)
+{
+	struct scst_tgt_dev *tgt_dev = cmd->tgt_dev;
+	struct scst_device *dev = tgt_dev->dev;
+	unsigned long now = jiffies;
+	enum scst_qos_res r;
+	bool res = true;
+
+	TRACE_ENTRY();
+
+	if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags)))
+		goto out;
+
+	spin_lock_bh(&dev->dev_qos_lock);
+
+	/* Don't overtake the already delayed commands */
+	if (!list_empty(&tgt_dev->tgt_dev_qos_cmd_list))
+		r = SCST_QOS_TGT_DEV;
+	else if (dev->dev_qos_dev_blocked)
+		r = SCST_QOS_DEV;
+	else {
+		r = scst_qos_take(tgt_dev, scst_qos_cmd_bytes(cmd), now);
+		if (r == SCST_QOS_PASS)
+			goto out_unlock;
+	}
+
+	switch (r) {
+	case SCST_QOS_TGT_DEV:
+		tgt_dev->tgt_dev_qos_bucket.qb_throttled++;
+		break;
+	case SCST_QOS_ACG:
+		spin_lock(&tgt_dev->acg_dev->acg->acg_qos_lock);
+		tgt_dev->acg_dev->acg->acg_qos_bucket.qb_throttled++;
+		spin_unlock(&tgt_dev->acg_dev->acg->acg_qos_lock);
+		break;
+	case SCST_QOS_DEV:
+		dev->dev_qos_bucket.qb_throttled++;
+		break;
+	default:
+		sBUG();
+		break;
+	}
+
+	TRACE_DBG("Delaying cmd %p (tgt_dev %p, reason %d)", cmd, tgt_dev, r);
+
+	/*
+	 * cmd has passed the SN check. If its task set is shared by all I_T
+	 * nexuses, don't make the others wait for it. The later cmds of
+	 * tgt_dev are delayed after it anyway.
+	 */
+	if (cmd->cur_order_data == &dev->dev_order_data)
+		scst_release_sn_early(cmd);
+
+	list_add_tail(&cmd->cmd_list_entry, &tgt_dev->tgt_dev_qos_cmd_list);
+	if (list_empty(&tgt_dev->tgt_dev_qos_list_entry)) {
+		list_add_tail(&tgt_dev->tgt_dev_qos_list_entry,
+			&dev->dev_qos_active_list);
+		dev->dev_qos_nr_active++;
+	}
+	dev->dev_qos_parked++;
+	if (!timer_pending(&dev->dev_qos_timer))
+		mod_timer(&dev->dev_qos_timer, now + 1);
+	res = false;
+
+out_unlock:
+	spin_unlock_bh(&dev->dev_qos_lock);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Moves the aborted delayed commands of dev to @released, so they finish
+ * without waiting for tokens. dev->dev_qos_lock supposed to be held.
+ */
+static void scst_qos_release_aborted(struct scst_device *dev,
+	struct list_head *released)
+{
+	struct scst_tgt_dev *tgt_dev, *tt;
+	struct scst_cmd *cmd, *t;
+
+	list_for_each_entry_safe(tgt_dev, tt, &dev->dev_qos_active_list,
+			tgt_dev_qos_list_entry) {
+		list_for_each_entry_safe(cmd, t, &tgt_dev->tgt_dev_qos_cmd_list,
+				cmd_list_entry) {
+			if (!test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))
+				continue;
+			TRACE_MGMT_DBG("Releasing aborted delayed cmd %p", cmd);
+			list_move_tail(&cmd->cmd_list_entry, released);
+			dev->dev_qos_parked--;
+		}
+		if (list_empty(&tgt_dev->tgt_dev_qos_cmd_list)) {
+			list_del_init(&tgt_dev->tgt_dev_qos_list_entry);
+			dev->dev_qos_nr_active--;
+			tgt_dev->tgt_dev_qos_deficit = 0;
+		}
+	}
+	return;
+}
+
+static void scst_qos_timer_fn(unsigned long arg)
+{
+	struct scst_device *dev = (struct scst_device *)arg;
+	unsigned long now = jiffies;
+	struct scst_tgt_dev *tgt_dev;
+	struct scst_cmd *cmd, *t;
+	LIST_HEAD(released);
+	int idle = 0;
+
+	TRACE_ENTRY();
+
+	spin_lock(&dev->dev_qos_lock);
+
+	scst_qos_release_aborted(dev, &released);
+
+	dev->dev_qos_dev_blocked = false;
+
+	/*
+	 * Deficit round robin: each tgt_dev in its turn can release up to
+	 * its weight commands. The round stops, when the device's bucket is
+	 * empty, or when none of the tgt_devs could release anything.
+	 */
+	while (!list_empty(&dev->dev_qos_active_list) &&
+	       (idle < dev->dev_qos_nr_active)) {
+		bool released_some = false;
+
+		tgt_dev = list_first_entry(&dev->dev_qos_active_list,
+				typeof(*tgt_dev), tgt_dev_qos_list_entry);
+
+		if (tgt_dev->tgt_dev_qos_deficit <= 0)
+			tgt_dev->tgt_dev_qos_deficit +=
+				tgt_dev->tgt_dev_qos_weight;
+
+		while ((tgt_dev->tgt_dev_qos_deficit > 0) &&
+		       !list_empty(&tgt_dev->tgt_dev_qos_cmd_list)) {
+			enum scst_qos_res r;
+
+			cmd = list_first_entry(&tgt_dev->tgt_dev_qos_cmd_list,
+					typeof(*cmd), cmd_list_entry);
+			r = scst_qos_take(tgt_dev, scst_qos_cmd_bytes(cmd), now);
+			if (r == SCST_QOS_DEV) {
+				/* Keep the place of tgt_dev in the round */
+				dev->dev_qos_dev_blocked = true;
+				goto out_rearm;
+			} else if (r != SCST_QOS_PASS) {
+				/* Own limits, don't let it hoard the deficit */
+				tgt_dev->tgt_dev_qos_deficit = 0;
+				break;
+			}
+
+			list_move_tail(&cmd->cmd_list_entry, &released);
+			tgt_dev->tgt_dev_qos_deficit--;
+			dev->dev_qos_parked--;
+			released_some = true;
+		}
+
+		if (list_empty(&tgt_dev->tgt_dev_qos_cmd_list)) {
+			list_del_init(&tgt_dev->tgt_dev_qos_list_entry);
+			dev->dev_qos_nr_active--;
+			tgt_dev->tgt_dev_qos_deficit = 0;
+			idle = 0;
+			continue;
+		}
+
+		list_move_tail(&tgt_dev->tgt_dev_qos_list_entry,
+			&dev->dev_qos_active_list);
+		idle = released_some ? 0 : idle + 1;
+	}
+
+out_rearm:
+	if (dev->dev_qos_parked > 0)
+		mod_timer(&dev->dev_qos_timer, now + 1);
+
+	spin_unlock(&dev->dev_qos_lock);
+
+	list_for_each_entry_safe(cmd, t, &released, cmd_list_entry) {
+		list_del(&cmd->cmd_list_entry);
+		TRACE_DBG("Releasing delayed cmd %p", cmd);
+		cmd->qos_admitted = 1;
+		scst_process_redirect_cmd(cmd, SCST_CONTEXT_THREAD, 0);
+	}
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Limits changes take effect on the next QoS timer run, so no need to kick
+ * the delayed commands here.
+ */
+void scst_qos_set_dev_limits(struct scst_device *dev,
+	unsigned int iops_limit, unsigned int bw_limit)
+{
+	spin_lock_bh(&dev->dev_qos_lock);
+	scst_qos_bucket_set(&dev->dev_qos_bucket, iops_limit, bw_limit);
+	spin_unlock_bh(&dev->dev_qos_lock);
+	return;
+}
+
+void scst_qos_set_acg_limits(struct scst_acg *acg,
+	unsigned int iops_limit, unsigned int bw_limit)
+{
+	spin_lock_bh(&acg->acg_qos_lock);
+	scst_qos_bucket_set(&acg->acg_qos_bucket, iops_limit, bw_limit);
+	spin_unlock_bh(&acg->acg_qos_lock);
+	return;
+}
+
+/* Applies the QoS settings of acg_dev to all its tgt_devs */
+void scst_qos_update_acg_dev(struct scst_acg_dev *acg_dev)
+{
+	struct scst_device *dev = acg_dev->dev;
+	struct scst_tgt_dev *tgt_dev;
+
+	TRACE_ENTRY();
+
+	spin_lock_bh(&dev->dev_lock);
+	list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
+			    dev_tgt_dev_list_entry) {
+		if (tgt_dev->acg_dev != acg_dev)
+			continue;
+		spin_lock(&dev->dev_qos_lock);
+		scst_qos_bucket_set(&tgt_dev->tgt_dev_qos_bucket,
+			acg_dev->acg_dev_qos_iops_limit,
+			acg_dev->acg_dev_qos_bw_limit);
+		tgt_dev->tgt_dev_qos_weight = acg_dev->acg_dev_qos_weight;
+		spin_unlock(&dev->dev_qos_lock);
+	}
+	spin_unlock_bh(&dev->dev_lock);
+
+	TRACE_EXIT();
+	return;
+}
+
+/* Called under dev_lock before tgt_dev is added to dev_tgt_dev_list */
+void scst_qos_init_tgt_dev(struct scst_tgt_dev *tgt_dev)
+{
+	struct scst_acg_dev *acg_dev = tgt_dev->acg_dev;
+
+	INIT_LIST_HEAD(&tgt_dev->tgt_dev_qos_cmd_list);
+	INIT_LIST_HEAD(&tgt_dev->tgt_dev_qos_list_entry);
+	scst_qos_bucket_set(&tgt_dev->tgt_dev_qos_bucket,
+		acg_dev->acg_dev_qos_iops_limit, acg_dev->acg_dev_qos_bw_limit);
+	tgt_dev->tgt_dev_qos_weight = acg_dev->acg_dev_qos_weight;
+	return;
+}
+
+void scst_qos_init_dev(struct scst_device *dev)
+{
+	spin_lock_init(&dev->dev_qos_lock);
+	INIT_LIST_HEAD(&dev->dev_qos_active_list);
+	init_timer(&dev->dev_qos_timer);
+	dev->dev_qos_timer.data = (unsigned long)dev;
+	dev->dev_qos_timer.function = scst_qos_timer_fn;
+	return;
+}
+
+void scst_qos_deinit_dev(struct scst_device *dev)
+{
+	EXTRACHECKS_BUG_ON(dev->dev_qos_parked != 0);
+	del_timer_sync(&dev->dev_qos_timer);
+	return;
+}
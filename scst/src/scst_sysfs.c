@@ -24,6 +24,7 @@
 #include <linux/ctype.h>
 #include <linux/slab.h>
 #include <linux/kthread.h>
+#include <linux/jhash.h>
 
 #ifdef INSIDE_KERNEL_TREE
 #include <scst/scst.h>
@@ -352,12 +353,64 @@ static void sysfs_remove_files(struct kobject *kobj,
  ** Sysfs work
  **/
 
+/*
+ * Management works are executed by a pool of SCST_SYSFS_WORK_THREADS
+ * threads. See the comment for obj_key in struct scst_sysfs_work_item for
+ * ordering rules.
+ */
+#define SCST_SYSFS_WORK_THREADS		8
+
+/* Number of distinct work functions to collect statistics for */
+#define SCST_SYSFS_WORK_STATS		64
+
+struct scst_sysfs_work_stat {
+	/* NULL for the last, catch-all entry */
+	int (*sysfs_work_fn)(struct scst_sysfs_work_item *work);
+	unsigned int queued;
+	unsigned int max_queued;
+	unsigned long done;
+	uint64_t total_wait_us;
+	uint64_t max_wait_us;
+	uint64_t total_exec_us;
+	uint64_t max_exec_us;
+};
+
 static DEFINE_SPINLOCK(sysfs_work_lock);
+/* Queued works, in the queuing order */
 static LIST_HEAD(sysfs_work_list);
+/* Works being executed */
+static LIST_HEAD(sysfs_active_work_list);
 static DECLARE_WAIT_QUEUE_HEAD(sysfs_work_waitQ);
 static int active_sysfs_works;
+static int queued_sysfs_works;
+static int idle_sysfs_work_threads;
 static int last_sysfs_work_res;
-static struct task_struct *sysfs_work_thread;
+static struct task_struct *sysfs_work_threads[SCST_SYSFS_WORK_THREADS];
+/* Protected by sysfs_work_lock */
+static struct scst_sysfs_work_stat sysfs_work_stats[SCST_SYSFS_WORK_STATS];
+
+static void scst_cfg_batch_touch(void);
+
+static inline uint64_t scst_sysfs_get_usec(void)
+{
+	return ktime_to_us(ktime_get());
+}
+
+/*
+ * Returns obj_key for a mgmt command of @parent, like "add_device name ...",
+ * so commands for different names can be executed in parallel.
+ */
+static unsigned long scst_sysfs_name_key(const void *parent, const char *cmd)
+{
+	const char *name;
+	int len;
+
+	name = cmd + strcspn(cmd, " \t\n");
+	name += strspn(name, " \t\n");
+	len = strcspn(name, " \t\n");
+
+	return (unsigned long)parent ^ jhash(name, len, 0);
+}
 
 /**
  * scst_alloc_sysfs_work() - allocates a sysfs work
@@ -436,22 +489,81 @@ void scst_sysfs_work_put(struct scst_sysfs_work_item *work)
 }
 EXPORT_SYMBOL(scst_sysfs_work_put);
 
+/* Called under sysfs_work_lock */
+static struct scst_sysfs_work_stat *scst_sysfs_get_work_stat(
+	int (*sysfs_work_fn)(struct scst_sysfs_work_item *))
+{
+	struct scst_sysfs_work_stat *st;
+	int i;
+
+	for (i = 0; i < SCST_SYSFS_WORK_STATS - 1; i++) {
+		st = &sysfs_work_stats[i];
+		if (st->sysfs_work_fn == sysfs_work_fn)
+			goto out;
+		if (st->sysfs_work_fn == NULL) {
+			st->sysfs_work_fn = sysfs_work_fn;
+			goto out;
+		}
+	}
+	st = &sysfs_work_stats[SCST_SYSFS_WORK_STATS - 1];
+
+out:
+	return st;
+}
+
+/* Called under sysfs_work_lock */
+static bool scst_sysfs_work_obj_busy(unsigned long obj_key)
+{
+	struct scst_sysfs_work_item *w;
+
+	list_for_each_entry(w, &sysfs_active_work_list,
+			    sysfs_work_list_entry) {
+		if (!w->read_only_action && (w->obj_key == obj_key))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Called under sysfs_work_lock. Returns the first queued work, which
+ * doesn't have to wait for another work on the same object, or NULL.
+ * Since the list is scanned in the queuing order, works on the same object
+ * are started in the order they were queued.
+ */
+static struct scst_sysfs_work_item *scst_sysfs_get_next_work(void)
+{
+	struct scst_sysfs_work_item *work;
+
+	list_for_each_entry(work, &sysfs_work_list, sysfs_work_list_entry) {
+		if (work->read_only_action ||
+		    !scst_sysfs_work_obj_busy(work->obj_key))
+			return work;
+	}
+	return NULL;
+}
+
 /* Called under sysfs_work_lock and drops/reacquire it inside */
 static void scst_process_sysfs_works(void)
 	__releases(&sysfs_work_lock)
 	__acquires(&sysfs_work_lock)
 {
 	struct scst_sysfs_work_item *work;
+	struct scst_sysfs_work_stat *st;
+	uint64_t start, wait, exec;
 
 	TRACE_ENTRY();
 
-	while (!list_empty(&sysfs_work_list)) {
-		work = list_first_entry(&sysfs_work_list,
-			struct scst_sysfs_work_item, sysfs_work_list_entry);
-		list_del(&work->sysfs_work_list_entry);
+	while ((work = scst_sysfs_get_next_work()) != NULL) {
+		list_move_tail(&work->sysfs_work_list_entry,
+			       &sysfs_active_work_list);
+		queued_sysfs_works--;
+		st = work->stat;
+		st->queued--;
 		spin_unlock(&sysfs_work_lock);
 
-		TRACE_DBG("Sysfs work %p", work);
+		TRACE_DBG("Sysfs work %p (obj key %lx)", work, work->obj_key);
+
+		start = scst_sysfs_get_usec();
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
 		if (work->dep_map) {
@@ -467,12 +579,26 @@ static void scst_process_sysfs_works(void)
 			mutex_release(work->dep_map, 0, _RET_IP_);
 #endif
 
+		exec = scst_sysfs_get_usec() - start;
+		wait = start - work->queue_time_us;
+
 		spin_lock(&sysfs_work_lock);
+		list_del(&work->sysfs_work_list_entry);
 		if (!work->read_only_action)
 			last_sysfs_work_res = work->work_res;
 		active_sysfs_works--;
+		st->done++;
+		st->total_wait_us += wait;
+		if (wait > st->max_wait_us)
+			st->max_wait_us = wait;
+		st->total_exec_us += exec;
+		if (exec > st->max_exec_us)
+			st->max_exec_us = exec;
 		spin_unlock(&sysfs_work_lock);
 
+		/* Works on the same object might be waiting for this one */
+		wake_up_all(&sysfs_work_waitQ);
+
 		complete_all(&work->sysfs_work_done);
 		kref_put(&work->sysfs_work_kref, scst_sysfs_work_release);
 
@@ -485,7 +611,7 @@ static void scst_process_sysfs_works(void)
 
 static inline int test_sysfs_work_list(void)
 {
-	int res = !list_empty(&sysfs_work_list) ||
+	int res = (scst_sysfs_get_next_work() != NULL) ||
 		  unlikely(kthread_should_stop());
 	return res;
 }
@@ -497,7 +623,7 @@ static int sysfs_work_thread_fn(void *arg)
 	TRACE_ENTRY();
 
 	if (!one_time_only)
-		PRINT_INFO("User interface thread started");
+		PRINT_INFO("User interface thread %s started", current->comm);
 
 	current->flags |= PF_NOFREEZE;
 
@@ -505,23 +631,22 @@ static int sysfs_work_thread_fn(void *arg)
 
 	spin_lock(&sysfs_work_lock);
 	while (!kthread_should_stop()) {
-		if (one_time_only && !test_sysfs_work_list())
-			break;
-		wait_event_locked(sysfs_work_waitQ, test_sysfs_work_list(),
-				  lock, sysfs_work_lock);
+		if (one_time_only) {
+			if (!test_sysfs_work_list())
+				break;
+		} else {
+			idle_sysfs_work_threads++;
+			wait_event_locked(sysfs_work_waitQ,
+					  test_sysfs_work_list(),
+					  lock, sysfs_work_lock);
+			idle_sysfs_work_threads--;
+		}
 		scst_process_sysfs_works();
 	}
 	spin_unlock(&sysfs_work_lock);
 
-	if (!one_time_only) {
-		/*
-		 * If kthread_should_stop() is true, we are guaranteed to be
-		 * on the module unload, so both lists must be empty.
-		 */
-		sBUG_ON(!list_empty(&sysfs_work_list));
-
-		PRINT_INFO("User interface thread finished");
-	}
+	if (!one_time_only)
+		PRINT_INFO("User interface thread %s finished", current->comm);
 
 	TRACE_EXIT();
 	return 0;
@@ -540,42 +665,58 @@ int scst_sysfs_queue_wait_work(struct scst_sysfs_work_item *work)
 	unsigned long timeout = 15*HZ;
 	struct task_struct *t;
 	static atomic_t uid_thread_name = ATOMIC_INIT(0);
+	bool extra_thread;
 
 	TRACE_ENTRY();
 
+	scst_cfg_batch_touch();
+
+	work->queue_time_us = scst_sysfs_get_usec();
+
 	spin_lock(&sysfs_work_lock);
 
-	TRACE_DBG("Adding sysfs work %p to the list", work);
+	TRACE_DBG("Adding sysfs work %p (obj key %lx) to the list", work,
+		work->obj_key);
 	list_add_tail(&work->sysfs_work_list_entry, &sysfs_work_list);
 
 	active_sysfs_works++;
+	queued_sysfs_works++;
 
-	kref_get(&work->sysfs_work_kref);
-
-	spin_unlock(&sysfs_work_lock);
-
-	wake_up(&sysfs_work_waitQ);
+	work->stat = scst_sysfs_get_work_stat(work->sysfs_work_fn);
+	work->stat->queued++;
+	if (work->stat->queued > work->stat->max_queued)
+		work->stat->max_queued = work->stat->queued;
 
 	/*
-	 * We can have a dead lock possibility like: the sysfs thread is waiting
+	 * We can have a dead lock possibility like: a sysfs thread is waiting
 	 * for the last put during some object unregistration and at the same
 	 * time another queued work is having reference on that object taken and
-	 * waiting for attention from the sysfs thread. Generally, all sysfs
+	 * waiting for attention from a sysfs thread. Generally, all sysfs
 	 * functions calling kobject_get() and then queuing sysfs thread job
 	 * affected by this. This is especially dangerous in read only cases,
 	 * like vdev_sysfs_filename_show().
 	 *
-	 * So, to eliminate that deadlock we will create an extra sysfs thread
-	 * for each queued sysfs work. This thread will quit as soon as it will
-	 * see that there is not more queued works to process.
+	 * So, to eliminate that deadlock, if there is no idle thread left
+	 * in the pool for this work, we will create an extra sysfs thread. This
+	 * thread will quit as soon as it will see that there is not more
+	 * queued works it can process.
 	 */
+	extra_thread = (queued_sysfs_works > idle_sysfs_work_threads);
+
+	kref_get(&work->sysfs_work_kref);
+
+	spin_unlock(&sysfs_work_lock);
+
+	wake_up(&sysfs_work_waitQ);
 
-	t = kthread_run(sysfs_work_thread_fn, (void *)true, "scst_uid%d",
-		atomic_inc_return(&uid_thread_name));
-	if (IS_ERR(t))
-		PRINT_ERROR("kthread_run() for user interface thread %d "
-			"failed: %d", atomic_read(&uid_thread_name),
-			(int)PTR_ERR(t));
+	if (extra_thread) {
+		t = kthread_run(sysfs_work_thread_fn, (void *)true,
+			"scst_uid%d", atomic_inc_return(&uid_thread_name));
+		if (IS_ERR(t))
+			PRINT_ERROR("kthread_run() for user interface thread "
+				"%d failed: %d", atomic_read(&uid_thread_name),
+				(int)PTR_ERR(t));
+	}
 
 #ifdef CONFIG_SCST_DEBUG_SYSFS_EAGAIN
 	{
@@ -624,6 +765,44 @@ out_put:
 }
 EXPORT_SYMBOL(scst_sysfs_queue_wait_work);
 
+static void scst_stop_sysfs_work_threads(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sysfs_work_threads); i++) {
+		if (sysfs_work_threads[i] == NULL)
+			continue;
+		kthread_stop(sysfs_work_threads[i]);
+		sysfs_work_threads[i] = NULL;
+	}
+
+	/*
+	 * We are on the module unload, so there must be no queued works
+	 * left.
+	 */
+	sBUG_ON(!list_empty(&sysfs_work_list));
+}
+
+static int scst_start_sysfs_work_threads(void)
+{
+	int res = 0, i;
+	struct task_struct *t;
+
+	for (i = 0; i < ARRAY_SIZE(sysfs_work_threads); i++) {
+		t = kthread_run(sysfs_work_thread_fn, NULL, "scst_uid_%d", i);
+		if (IS_ERR(t)) {
+			res = PTR_ERR(t);
+			PRINT_ERROR("kthread_run() for user interface thread "
+				"failed: %d", res);
+			scst_stop_sysfs_work_threads();
+			break;
+		}
+		sysfs_work_threads[i] = t;
+	}
+
+	return res;
+}
+
 /* No locks */
 static int scst_check_grab_tgtt_ptr(struct scst_tgt_template *tgtt)
 {
@@ -1021,6 +1200,7 @@ static ssize_t scst_tgtt_mgmt_store(struct kobject *kobj,
 
 	work->buf = buffer;
 	work->tgtt = tgtt;
+	work->obj_key = scst_sysfs_name_key(tgtt, buffer);
 
 	res = scst_sysfs_queue_wait_work(work);
 	if (res == 0)
@@ -1378,7 +1558,7 @@ static int __scst_process_luns_mgmt_store(char *buffer,
 		goto out;
 	}
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	res = scst_suspend_tgt_activity(tgt, SCST_SUSPEND_TIMEOUT_USER);
 	if (res != 0)
 		goto out;
 
@@ -1502,7 +1682,7 @@ out_unlock:
 	mutex_unlock(&scst_mutex);
 
 out_resume:
-	scst_resume_activity();
+	scst_resume_tgt_activity(tgt);
 
 out:
 	TRACE_EXIT_RES(res);
@@ -1511,8 +1691,13 @@ out:
 
 static int scst_luns_mgmt_store_work_fn(struct scst_sysfs_work_item *work)
 {
-	return __scst_process_luns_mgmt_store(work->buf, work->tgt, work->acg,
+	int res;
+
+	res = __scst_process_luns_mgmt_store(work->buf, work->tgt, work->acg,
 			work->is_tgt_kobj);
+
+	kobject_put(&work->tgt->tgt_kobj);
+	return res;
 }
 
 static ssize_t __scst_acg_mgmt_store(struct scst_acg *acg,
@@ -1537,9 +1722,14 @@ static ssize_t __scst_acg_mgmt_store(struct scst_acg *acg,
 
 	work->buf = buffer;
 	work->tgt = acg->tgt;
+	work->obj_key = (unsigned long)acg->tgt;
 	work->acg = acg;
 	work->is_tgt_kobj = is_tgt_kobj;
 
+	/* To keep tgt alive for scst_suspend_tgt_activity() in sysfs_work_fn */
+	SCST_SET_DEP_MAP(work, &scst_tgt_dep_map);
+	kobject_get(&acg->tgt->tgt_kobj);
+
 	res = scst_sysfs_queue_wait_work(work);
 	if (res == 0)
 		res = count;
@@ -1791,6 +1981,7 @@ static ssize_t __scst_acg_io_grouping_type_store(struct scst_acg *acg,
 		goto out;
 
 	work->tgt = acg->tgt;
+	work->obj_key = (unsigned long)acg->tgt;
 	work->acg = acg;
 	work->io_grouping_type = io_grouping_type;
 
@@ -2080,6 +2271,7 @@ static ssize_t __scst_acg_cpu_mask_store(struct scst_acg *acg,
 		goto out;
 
 	work->tgt = acg->tgt;
+	work->obj_key = (unsigned long)acg->tgt;
 	work->acg = acg;
 
 	res = scst_sysfs_queue_wait_work(work);
@@ -2130,6 +2322,151 @@ static struct kobj_attribute scst_tgt_cpu_mask =
 	       scst_tgt_cpu_mask_show,
 	       scst_tgt_cpu_mask_store);
 
+static int scst_sysfs_parse_qos_limit(const char *buf, unsigned int *limit)
+{
+	int res;
+	unsigned long val;
+
+	res = kstrtoul(buf, 0, &val);
+	if (res != 0) {
+		PRINT_ERROR("kstrtoul() for %s failed: %d ", buf, res);
+		goto out;
+	}
+	if (val > UINT_MAX) {
+		PRINT_ERROR("Illegal QoS limit %lu", val);
+		res = -EINVAL;
+		goto out;
+	}
+
+	*limit = val;
+
+out:
+	return res;
+}
+
+static ssize_t scst_sysfs_qos_limit_show(unsigned int limit, char *buf)
+{
+	return sprintf(buf, "%u\n%s", limit,
+		(limit != 0) ? SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+static ssize_t __scst_acg_qos_iops_limit_store(struct scst_acg *acg,
+	const char *buf, size_t count)
+{
+	int res;
+	unsigned int limit;
+
+	res = scst_sysfs_parse_qos_limit(buf, &limit);
+	if (res != 0)
+		goto out;
+
+	scst_qos_set_acg_limits(acg, limit, acg->acg_qos_bucket.qb_bw_limit);
+
+	PRINT_INFO("Set QoS IOPS limit of acg %s to %u", acg->acg_name, limit);
+
+	res = count;
+
+out:
+	return res;
+}
+
+static ssize_t __scst_acg_qos_bw_limit_store(struct scst_acg *acg,
+	const char *buf, size_t count)
+{
+	int res;
+	unsigned int limit;
+
+	res = scst_sysfs_parse_qos_limit(buf, &limit);
+	if (res != 0)
+		goto out;
+
+	scst_qos_set_acg_limits(acg, acg->acg_qos_bucket.qb_iops_limit, limit);
+
+	PRINT_INFO("Set QoS bandwidth limit of acg %s to %u KB/s",
+		acg->acg_name, limit);
+
+	res = count;
+
+out:
+	return res;
+}
+
+static ssize_t __scst_acg_qos_throttled_show(struct scst_acg *acg, char *buf)
+{
+	u64 throttled;
+
+	spin_lock_bh(&acg->acg_qos_lock);
+	throttled = acg->acg_qos_bucket.qb_throttled;
+	spin_unlock_bh(&acg->acg_qos_lock);
+
+	return sprintf(buf, "%llu\n", (unsigned long long)throttled);
+}
+
+static ssize_t scst_tgt_qos_iops_limit_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt *tgt;
+
+	tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+
+	return scst_sysfs_qos_limit_show(
+		tgt->default_acg->acg_qos_bucket.qb_iops_limit, buf);
+}
+
+static ssize_t scst_tgt_qos_iops_limit_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_tgt *tgt;
+
+	tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+
+	return __scst_acg_qos_iops_limit_store(tgt->default_acg, buf, count);
+}
+
+static struct kobj_attribute scst_tgt_qos_iops_limit =
+	__ATTR(qos_iops_limit, S_IRUGO | S_IWUSR,
+	       scst_tgt_qos_iops_limit_show,
+	       scst_tgt_qos_iops_limit_store);
+
+static ssize_t scst_tgt_qos_bw_limit_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt *tgt;
+
+	tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+
+	return scst_sysfs_qos_limit_show(
+		tgt->default_acg->acg_qos_bucket.qb_bw_limit, buf);
+}
+
+static ssize_t scst_tgt_qos_bw_limit_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_tgt *tgt;
+
+	tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+
+	return __scst_acg_qos_bw_limit_store(tgt->default_acg, buf, count);
+}
+
+static struct kobj_attribute scst_tgt_qos_bw_limit =
+	__ATTR(qos_bw_limit, S_IRUGO | S_IWUSR,
+	       scst_tgt_qos_bw_limit_show,
+	       scst_tgt_qos_bw_limit_store);
+
+static ssize_t scst_tgt_qos_throttled_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt *tgt;
+
+	tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+
+	return __scst_acg_qos_throttled_show(tgt->default_acg, buf);
+}
+
+static struct kobj_attribute scst_tgt_qos_throttled =
+	__ATTR(qos_throttled, S_IRUGO, scst_tgt_qos_throttled_show, NULL);
+
 static ssize_t scst_ini_group_mgmt_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -2167,7 +2504,7 @@ static int scst_process_ini_group_mgmt_store(char *buffer,
 		goto out;
 	}
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	res = scst_suspend_tgt_activity(tgt, SCST_SUSPEND_TIMEOUT_USER);
 	if (res != 0)
 		goto out;
 
@@ -2226,7 +2563,7 @@ out_unlock:
 	mutex_unlock(&scst_mutex);
 
 out_resume:
-	scst_resume_activity();
+	scst_resume_tgt_activity(tgt);
 
 out:
 	TRACE_EXIT_RES(res);
@@ -2235,7 +2572,12 @@ out:
 
 static int scst_ini_group_mgmt_store_work_fn(struct scst_sysfs_work_item *work)
 {
-	return scst_process_ini_group_mgmt_store(work->buf, work->tgt);
+	int res;
+
+	res = scst_process_ini_group_mgmt_store(work->buf, work->tgt);
+
+	kobject_put(&work->tgt->tgt_kobj);
+	return res;
 }
 
 static ssize_t scst_ini_group_mgmt_store(struct kobject *kobj,
@@ -2263,6 +2605,11 @@ static ssize_t scst_ini_group_mgmt_store(struct kobject *kobj,
 
 	work->buf = buffer;
 	work->tgt = tgt;
+	work->obj_key = (unsigned long)tgt;
+
+	/* To keep tgt alive for scst_suspend_tgt_activity() */
+	SCST_SET_DEP_MAP(work, &scst_tgt_dep_map);
+	kobject_get(&tgt->tgt_kobj);
 
 	res = scst_sysfs_queue_wait_work(work);
 	if (res == 0)
@@ -2380,6 +2727,7 @@ static ssize_t scst_tgt_enable_store(struct kobject *kobj,
 		goto out;
 
 	work->tgt = tgt;
+	work->obj_key = (unsigned long)tgt;
 	work->enable = enable;
 
 	SCST_SET_DEP_MAP(work, &scst_tgt_dep_map);
@@ -2492,6 +2840,7 @@ static ssize_t scst_rel_tgt_id_store(struct kobject *kobj,
 		goto out;
 
 	work->tgt_r = tgt;
+	work->obj_key = (unsigned long)tgt;
 	work->rel_tgt_id = rel_tgt_id;
 
 	SCST_SET_DEP_MAP(work, &scst_tgt_dep_map);
@@ -2879,6 +3228,9 @@ static struct attribute *scst_tgt_attrs[] = {
 	&scst_tgt_io_grouping_type.attr,
 	&scst_tgt_black_hole.attr,
 	&scst_tgt_cpu_mask.attr,
+	&scst_tgt_qos_iops_limit.attr,
+	&scst_tgt_qos_bw_limit.attr,
+	&scst_tgt_qos_throttled.attr,
 	&scst_tgt_unknown_cmd_count_attr.attr,
 	&scst_tgt_write_cmd_count_attr.attr,
 	&scst_tgt_write_io_count_kb_attr.attr,
@@ -3179,6 +3531,7 @@ static ssize_t scst_dev_sysfs_pr_file_name_store(struct kobject *kobj,
 		goto out;
 	kobject_get(&dev->dev_kobj);
 	work->dev = dev;
+	work->obj_key = (unsigned long)dev;
 	work->default_val = def;
 	swap(work->buf, pr_file_name);
 
@@ -3228,16 +3581,18 @@ static struct kobj_attribute dev_dump_prs_attr =
 
 static int scst_process_dev_sysfs_threads_data_store(
 	struct scst_device *dev, int threads_num,
-	enum scst_dev_type_threads_pool_type threads_pool_type)
+	enum scst_dev_type_threads_pool_type threads_pool_type, int threads_max)
 {
 	int res = 0;
 	int oldtn = dev->threads_num;
 	enum scst_dev_type_threads_pool_type oldtt = dev->threads_pool_type;
+	int oldtm = dev->threads_max;
 
 	TRACE_ENTRY();
 
-	TRACE_DBG("dev %p, threads_num %d, threads_pool_type %d", dev,
-		threads_num, threads_pool_type);
+	TRACE_DBG("dev %p, threads_num %d, threads_pool_type %d, "
+		"threads_max %d", dev, threads_num, threads_pool_type,
+		threads_max);
 
 	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
 	if (res != 0)
@@ -3255,6 +3610,7 @@ static int scst_process_dev_sysfs_threads_data_store(
 
 	dev->threads_num = threads_num;
 	dev->threads_pool_type = threads_pool_type;
+	dev->threads_max = threads_max;
 
 	res = scst_create_dev_threads(dev);
 	if (res != 0)
@@ -3265,6 +3621,8 @@ static int scst_process_dev_sysfs_threads_data_store(
 	else if (oldtt != dev->threads_pool_type)
 		PRINT_INFO("Changed cmd threads pool type to %d",
 			dev->threads_pool_type);
+	else if (oldtm != dev->threads_max)
+		PRINT_INFO("Changed cmd threads max to %d", dev->threads_max);
 
 out_unlock:
 	mutex_unlock(&scst_mutex);
@@ -3281,12 +3639,14 @@ static int scst_dev_sysfs_threads_data_store_work_fn(
 	struct scst_sysfs_work_item *work)
 {
 	return scst_process_dev_sysfs_threads_data_store(work->dev,
-		work->new_threads_num, work->new_threads_pool_type);
+		work->new_threads_num, work->new_threads_pool_type,
+		work->new_threads_max);
 }
 
 static ssize_t scst_dev_sysfs_check_threads_data(
 	struct scst_device *dev, int threads_num,
-	enum scst_dev_type_threads_pool_type threads_pool_type, bool *stop)
+	enum scst_dev_type_threads_pool_type threads_pool_type,
+	int threads_max, bool *stop)
 {
 	int res = 0;
 
@@ -3302,7 +3662,8 @@ static ssize_t scst_dev_sysfs_check_threads_data(
 	}
 
 	if ((threads_num == dev->threads_num) &&
-	    (threads_pool_type == dev->threads_pool_type)) {
+	    (threads_pool_type == dev->threads_pool_type) &&
+	    (threads_max == dev->threads_max)) {
 		*stop = true;
 		goto out;
 	}
@@ -3355,7 +3716,7 @@ static ssize_t scst_dev_sysfs_threads_num_store(struct kobject *kobj,
 	}
 
 	res = scst_dev_sysfs_check_threads_data(dev, newtn,
-		dev->threads_pool_type, &stop);
+		dev->threads_pool_type, dev->threads_max, &stop);
 	if ((res != 0) || stop)
 		goto out;
 
@@ -3365,8 +3726,10 @@ static ssize_t scst_dev_sysfs_threads_num_store(struct kobject *kobj,
 		goto out;
 
 	work->dev = dev;
+	work->obj_key = (unsigned long)dev;
 	work->new_threads_num = newtn;
 	work->new_threads_pool_type = dev->threads_pool_type;
+	work->new_threads_max = dev->threads_max;
 
 	res = scst_sysfs_queue_wait_work(work);
 
@@ -3445,7 +3808,7 @@ static ssize_t scst_dev_sysfs_threads_pool_type_store(struct kobject *kobj,
 	TRACE_DBG("buf %s, count %zd, newtpt %d", buf, count, newtpt);
 
 	res = scst_dev_sysfs_check_threads_data(dev, dev->threads_num,
-		newtpt, &stop);
+		newtpt, dev->threads_max, &stop);
 	if ((res != 0) || stop)
 		goto out;
 
@@ -3455,8 +3818,10 @@ static ssize_t scst_dev_sysfs_threads_pool_type_store(struct kobject *kobj,
 		goto out;
 
 	work->dev = dev;
+	work->obj_key = (unsigned long)dev;
 	work->new_threads_num = dev->threads_num;
 	work->new_threads_pool_type = newtpt;
+	work->new_threads_max = dev->threads_max;
 
 	res = scst_sysfs_queue_wait_work(work);
 
@@ -3473,7 +3838,7 @@ static struct kobj_attribute dev_threads_pool_type_attr =
 		scst_dev_sysfs_threads_pool_type_show,
 		scst_dev_sysfs_threads_pool_type_store);
 
-static ssize_t scst_dev_sysfs_max_tgt_dev_commands_show(struct kobject *kobj,
+static ssize_t scst_dev_sysfs_threads_max_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
 	int pos = 0;
@@ -3483,45 +3848,54 @@ static ssize_t scst_dev_sysfs_max_tgt_dev_commands_show(struct kobject *kobj,
 
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 
-	pos = sprintf(buf, "%d\n%s", dev->max_tgt_dev_commands,
-		(dev->max_tgt_dev_commands != dev->handler->max_tgt_dev_commands) ?
-			SCST_SYSFS_KEY_MARK "\n" : "");
+	pos = sprintf(buf, "%d\n%s", dev->threads_max,
+		(dev->threads_max != 0) ? SCST_SYSFS_KEY_MARK "\n" : "");
 
 	TRACE_EXIT_RES(pos);
 	return pos;
 }
 
-static ssize_t scst_dev_sysfs_max_tgt_dev_commands_store(struct kobject *kobj,
+static ssize_t scst_dev_sysfs_threads_max_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count)
 {
 	int res;
 	struct scst_device *dev;
-	long newtn;
+	long newtm;
+	bool stop;
+	struct scst_sysfs_work_item *work;
 
 	TRACE_ENTRY();
 
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
-	res = kstrtol(buf, 0, &newtn);
-#else
-	res = strict_strtol(buf, 0, &newtn);
-#endif
+	res = kstrtol(buf, 0, &newtm);
 	if (res != 0) {
-		PRINT_ERROR("strtol() for %s failed: %d ", buf, res);
+		PRINT_ERROR("kstrtol() for %s failed: %d ", buf, res);
 		goto out;
 	}
-	if (newtn < 0) {
-		PRINT_ERROR("Illegal max tgt dev value %ld", newtn);
+	if ((newtm < 0) || (newtm > INT_MAX)) {
+		PRINT_ERROR("Illegal threads max value %ld", newtm);
 		res = -EINVAL;
 		goto out;
 	}
 
-	if (dev->max_tgt_dev_commands != newtn) {
-		PRINT_INFO("Setting new queue depth %ld for device %s (old %d)",
-			newtn, dev->virt_name, dev->max_tgt_dev_commands);
-		dev->max_tgt_dev_commands = newtn;
-	}
+	res = scst_dev_sysfs_check_threads_data(dev, dev->threads_num,
+		dev->threads_pool_type, newtm, &stop);
+	if ((res != 0) || stop)
+		goto out;
+
+	res = scst_alloc_sysfs_work(scst_dev_sysfs_threads_data_store_work_fn,
+					false, &work);
+	if (res != 0)
+		goto out;
+
+	work->dev = dev;
+	work->obj_key = (unsigned long)dev;
+	work->new_threads_num = dev->threads_num;
+	work->new_threads_pool_type = dev->threads_pool_type;
+	work->new_threads_max = newtm;
+
+	res = scst_sysfs_queue_wait_work(work);
 
 out:
 	if (res == 0)
@@ -3531,26 +3905,249 @@ out:
 	return res;
 }
 
-static struct kobj_attribute dev_max_tgt_dev_commands_attr =
-	__ATTR(max_tgt_dev_commands, S_IRUGO | S_IWUSR,
-		scst_dev_sysfs_max_tgt_dev_commands_show,
-		scst_dev_sysfs_max_tgt_dev_commands_store);
+static struct kobj_attribute dev_threads_max_attr =
+	__ATTR(threads_max, S_IRUGO | S_IWUSR,
+		scst_dev_sysfs_threads_max_show,
+		scst_dev_sysfs_threads_max_store);
 
-static ssize_t scst_dev_numa_node_id_show(struct kobject *kobj,
+static int scst_dev_sysfs_print_thr_stats(char *buf, int size,
+	const char *name, struct scst_cmd_threads *cmd_threads)
+{
+	const char *decision = cmd_threads->thr_last_decision;
+
+	if (decision == NULL)
+		return scnprintf(buf, size,
+			"%s: threads %d, grown %lu, shrunk %lu, last none\n",
+			name, cmd_threads->nr_threads, cmd_threads->thr_grown,
+			cmd_threads->thr_shrunk);
+
+	return scnprintf(buf, size,
+		"%s: threads %d, grown %lu, shrunk %lu, last %s %u ms ago\n",
+		name, cmd_threads->nr_threads, cmd_threads->thr_grown,
+		cmd_threads->thr_shrunk, decision,
+		jiffies_to_msecs(jiffies -
+				 cmd_threads->thr_last_decision_time));
+}
+
+static ssize_t scst_dev_sysfs_threads_stats_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
 	int pos = 0;
 	struct scst_device *dev;
+	struct scst_tgt_dev *tgt_dev;
 
 	TRACE_ENTRY();
 
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 
-	pos = sprintf(buf, "%d\n%s", dev->dev_numa_node_id,
-		(dev->dev_numa_node_id != NUMA_NO_NODE) ?
-			SCST_SYSFS_KEY_MARK "\n" : "");
+	if ((dev->threads_num <= 0) || (dev->threads_max == 0))
+		goto out;
 
-	TRACE_EXIT_RES(pos);
+	if (dev->threads_pool_type == SCST_THREADS_POOL_SHARED) {
+		pos = scst_dev_sysfs_print_thr_stats(buf, SCST_SYSFS_BLOCK_SIZE,
+			"shared", &dev->dev_cmd_threads);
+		goto out;
+	}
+
+	spin_lock_bh(&dev->dev_lock);
+	list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
+			    dev_tgt_dev_list_entry) {
+		if (tgt_dev->active_cmd_threads != &tgt_dev->tgt_dev_cmd_threads)
+			continue;
+		pos += scst_dev_sysfs_print_thr_stats(&buf[pos],
+			SCST_SYSFS_BLOCK_SIZE - pos,
+			tgt_dev->sess->initiator_name,
+			&tgt_dev->tgt_dev_cmd_threads);
+	}
+	spin_unlock_bh(&dev->dev_lock);
+
+out:
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static struct kobj_attribute dev_threads_stats_attr =
+	__ATTR(threads_stats, S_IRUGO,
+		scst_dev_sysfs_threads_stats_show, NULL);
+
+static ssize_t scst_dev_sysfs_qos_iops_limit_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	return scst_sysfs_qos_limit_show(dev->dev_qos_bucket.qb_iops_limit,
+		buf);
+}
+
+static ssize_t scst_dev_sysfs_qos_iops_limit_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_device *dev;
+	unsigned int limit;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	res = scst_sysfs_parse_qos_limit(buf, &limit);
+	if (res != 0)
+		goto out;
+
+	scst_qos_set_dev_limits(dev, limit, dev->dev_qos_bucket.qb_bw_limit);
+
+	PRINT_INFO("Set QoS IOPS limit of device %s to %u", dev->virt_name,
+		limit);
+
+	res = count;
+
+out:
+	return res;
+}
+
+static struct kobj_attribute dev_qos_iops_limit_attr =
+	__ATTR(qos_iops_limit, S_IRUGO | S_IWUSR,
+		scst_dev_sysfs_qos_iops_limit_show,
+		scst_dev_sysfs_qos_iops_limit_store);
+
+static ssize_t scst_dev_sysfs_qos_bw_limit_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	return scst_sysfs_qos_limit_show(dev->dev_qos_bucket.qb_bw_limit, buf);
+}
+
+static ssize_t scst_dev_sysfs_qos_bw_limit_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_device *dev;
+	unsigned int limit;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	res = scst_sysfs_parse_qos_limit(buf, &limit);
+	if (res != 0)
+		goto out;
+
+	scst_qos_set_dev_limits(dev, dev->dev_qos_bucket.qb_iops_limit, limit);
+
+	PRINT_INFO("Set QoS bandwidth limit of device %s to %u KB/s",
+		dev->virt_name, limit);
+
+	res = count;
+
+out:
+	return res;
+}
+
+static struct kobj_attribute dev_qos_bw_limit_attr =
+	__ATTR(qos_bw_limit, S_IRUGO | S_IWUSR,
+		scst_dev_sysfs_qos_bw_limit_show,
+		scst_dev_sysfs_qos_bw_limit_store);
+
+static ssize_t scst_dev_sysfs_qos_throttled_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	u64 throttled;
+	int parked;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	spin_lock_bh(&dev->dev_qos_lock);
+	throttled = dev->dev_qos_bucket.qb_throttled;
+	parked = dev->dev_qos_parked;
+	spin_unlock_bh(&dev->dev_qos_lock);
+
+	return sprintf(buf, "throttled %llu, delayed now %d\n",
+		(unsigned long long)throttled, parked);
+}
+
+static struct kobj_attribute dev_qos_throttled_attr =
+	__ATTR(qos_throttled, S_IRUGO, scst_dev_sysfs_qos_throttled_show, NULL);
+
+static ssize_t scst_dev_sysfs_max_tgt_dev_commands_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	pos = sprintf(buf, "%d\n%s", dev->max_tgt_dev_commands,
+		(dev->max_tgt_dev_commands != dev->handler->max_tgt_dev_commands) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t scst_dev_sysfs_max_tgt_dev_commands_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_device *dev;
+	long newtn;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtol(buf, 0, &newtn);
+#else
+	res = strict_strtol(buf, 0, &newtn);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strtol() for %s failed: %d ", buf, res);
+		goto out;
+	}
+	if (newtn < 0) {
+		PRINT_ERROR("Illegal max tgt dev value %ld", newtn);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (dev->max_tgt_dev_commands != newtn) {
+		PRINT_INFO("Setting new queue depth %ld for device %s (old %d)",
+			newtn, dev->virt_name, dev->max_tgt_dev_commands);
+		dev->max_tgt_dev_commands = newtn;
+	}
+
+out:
+	if (res == 0)
+		res = count;
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute dev_max_tgt_dev_commands_attr =
+	__ATTR(max_tgt_dev_commands, S_IRUGO | S_IWUSR,
+		scst_dev_sysfs_max_tgt_dev_commands_show,
+		scst_dev_sysfs_max_tgt_dev_commands_store);
+
+static ssize_t scst_dev_numa_node_id_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	pos = sprintf(buf, "%d\n%s", dev->dev_numa_node_id,
+		(dev->dev_numa_node_id != NUMA_NO_NODE) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
 	return pos;
 }
 
@@ -3727,11 +4324,40 @@ static struct kobj_attribute dev_block_attr =
 	__ATTR(block, S_IRUGO | S_IWUSR, scst_dev_block_show,
 		scst_dev_block_store);
 
+static ssize_t scst_dev_cluster_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	ssize_t res;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	/* scst_mutex protects dev->cl_ops against cluster_mode changes */
+	res = mutex_lock_interruptible(&scst_mutex);
+	if (res != 0)
+		goto out;
+	res = dev->cl_ops->pr_show_stats(dev, buf);
+	mutex_unlock(&scst_mutex);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute dev_cluster_stats_attr =
+	__ATTR(cluster_stats, S_IRUGO, scst_dev_cluster_stats_show, NULL);
+
 static struct attribute *scst_dev_attrs[] = {
 	&dev_type_attr.attr,
 	&dev_max_tgt_dev_commands_attr.attr,
 	&dev_numa_node_id_attr.attr,
 	&dev_block_attr.attr,
+	&dev_cluster_stats_attr.attr,
+	&dev_qos_iops_limit_attr.attr,
+	&dev_qos_bw_limit_attr.attr,
+	&dev_qos_throttled_attr.attr,
 	NULL,
 };
 
@@ -3812,6 +4438,22 @@ int scst_devt_dev_sysfs_create(struct scst_device *dev)
 				dev->virt_name);
 			goto out_err;
 		}
+		res = sysfs_create_file(&dev->dev_kobj,
+				&dev_threads_max_attr.attr);
+		if (res != 0) {
+			PRINT_ERROR("Can't add dev attr %s for dev %s",
+				dev_threads_max_attr.attr.name,
+				dev->virt_name);
+			goto out_err;
+		}
+		res = sysfs_create_file(&dev->dev_kobj,
+				&dev_threads_stats_attr.attr);
+		if (res != 0) {
+			PRINT_ERROR("Can't add dev attr %s for dev %s",
+				dev_threads_stats_attr.attr.name,
+				dev->virt_name);
+			goto out_err;
+		}
 	}
 
 	if (dev->handler->dev_attrs) {
@@ -3851,6 +4493,10 @@ void scst_devt_dev_sysfs_del(struct scst_device *dev)
 			&dev_threads_num_attr.attr);
 		sysfs_remove_file(&dev->dev_kobj,
 			&dev_threads_pool_type_attr.attr);
+		sysfs_remove_file(&dev->dev_kobj,
+			&dev_threads_max_attr.attr);
+		sysfs_remove_file(&dev->dev_kobj,
+			&dev_threads_stats_attr.attr);
 	}
 
 out:
@@ -4331,10 +4977,31 @@ static struct kobj_attribute tgt_dev_dif_checks_failed_attr =
 		scst_tgt_dev_dif_checks_failed_show,
 		scst_tgt_dev_dif_checks_failed_store);
 
+static ssize_t scst_tgt_dev_qos_throttled_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt_dev *tgt_dev;
+	struct scst_device *dev;
+	u64 throttled;
+
+	tgt_dev = container_of(kobj, struct scst_tgt_dev, tgt_dev_kobj);
+	dev = tgt_dev->dev;
+
+	spin_lock_bh(&dev->dev_qos_lock);
+	throttled = tgt_dev->tgt_dev_qos_bucket.qb_throttled;
+	spin_unlock_bh(&dev->dev_qos_lock);
+
+	return sprintf(buf, "%llu\n", (unsigned long long)throttled);
+}
+
+static struct kobj_attribute tgt_dev_qos_throttled_attr =
+	__ATTR(qos_throttled, S_IRUGO, scst_tgt_dev_qos_throttled_show, NULL);
+
 static struct attribute *scst_tgt_dev_attrs[] = {
 	&tgt_dev_thread_idx_attr.attr,
 	&tgt_dev_thread_pid_attr.attr,
 	&tgt_dev_active_commands_attr.attr,
+	&tgt_dev_qos_throttled_attr.attr,
 #ifdef CONFIG_SCST_MEASURE_LATENCY
 	&tgt_dev_latency_attr.attr,
 #endif
@@ -4641,6 +5308,7 @@ static ssize_t scst_sess_latency_store(struct kobject *kobj,
 		goto out;
 
 	work->sess = sess;
+	work->obj_key = (unsigned long)sess;
 
 	SCST_SET_DEP_MAP(work, &scst_sess_dep_map);
 	kobject_get(&sess->sess_kobj);
@@ -4673,6 +5341,20 @@ static ssize_t scst_sess_sysfs_commands_show(struct kobject *kobj,
 static struct kobj_attribute session_commands_attr =
 	__ATTR(commands, S_IRUGO, scst_sess_sysfs_commands_show, NULL);
 
+static ssize_t scst_sess_sysfs_ua_suppressed_show(struct kobject *kobj,
+			    struct kobj_attribute *attr, char *buf)
+{
+	struct scst_session *sess;
+
+	sess = container_of(kobj, struct scst_session, sess_kobj);
+
+	return sprintf(buf, "%i\n", atomic_read(&sess->sess_ua_suppressed));
+}
+
+static struct kobj_attribute session_ua_suppressed_attr =
+	__ATTR(ua_suppressed, S_IRUGO, scst_sess_sysfs_ua_suppressed_show,
+	       NULL);
+
 static int scst_sysfs_sess_get_active_commands(struct scst_session *sess)
 {
 	int res;
@@ -4879,6 +5561,7 @@ static ssize_t scst_sess_sysfs_dif_checks_failed_store(struct kobject *kobj,
 		goto out;
 
 	work->sess = sess;
+	work->obj_key = (unsigned long)sess;
 
 	SCST_SET_DEP_MAP(work, &scst_sess_dep_map);
 	kobject_get(&sess->sess_kobj);
@@ -4991,6 +5674,7 @@ static struct kobj_attribute session_force_close_attr =
 static struct attribute *scst_session_attrs[] = {
 	&session_commands_attr.attr,
 	&session_active_commands_attr.attr,
+	&session_ua_suppressed_attr.attr,
 	&session_initiator_name_attr.attr,
 	&session_unknown_cmd_count_attr.attr,
 	&session_write_cmd_count_attr.attr,
@@ -5172,25 +5856,147 @@ static void scst_acg_dev_release(struct kobject *kobj)
 	return;
 }
 
-static ssize_t scst_lun_rd_only_show(struct kobject *kobj,
-				   struct kobj_attribute *attr,
-				   char *buf)
-{
-	struct scst_acg_dev *acg_dev;
+static ssize_t scst_lun_rd_only_show(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   char *buf)
+{
+	struct scst_acg_dev *acg_dev;
+
+	acg_dev = container_of(kobj, struct scst_acg_dev, acg_dev_kobj);
+
+	if (acg_dev->acg_dev_rd_only || acg_dev->dev->dev_rd_only)
+		return sprintf(buf, "%d\n%s\n", 1, SCST_SYSFS_KEY_MARK);
+	else
+		return sprintf(buf, "%d\n", 0);
+}
+
+static struct kobj_attribute lun_options_attr =
+	__ATTR(read_only, S_IRUGO, scst_lun_rd_only_show, NULL);
+
+static ssize_t scst_lun_qos_iops_limit_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_acg_dev *acg_dev;
+
+	acg_dev = container_of(kobj, struct scst_acg_dev, acg_dev_kobj);
+
+	return scst_sysfs_qos_limit_show(acg_dev->acg_dev_qos_iops_limit, buf);
+}
+
+static ssize_t scst_lun_qos_iops_limit_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_acg_dev *acg_dev;
+	unsigned int limit;
+
+	acg_dev = container_of(kobj, struct scst_acg_dev, acg_dev_kobj);
+
+	res = scst_sysfs_parse_qos_limit(buf, &limit);
+	if (res != 0)
+		goto out;
+
+	acg_dev->acg_dev_qos_iops_limit = limit;
+	scst_qos_update_acg_dev(acg_dev);
+
+	res = count;
+
+out:
+	return res;
+}
+
+static struct kobj_attribute lun_qos_iops_limit_attr =
+	__ATTR(qos_iops_limit, S_IRUGO | S_IWUSR,
+		scst_lun_qos_iops_limit_show, scst_lun_qos_iops_limit_store);
+
+static ssize_t scst_lun_qos_bw_limit_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_acg_dev *acg_dev;
+
+	acg_dev = container_of(kobj, struct scst_acg_dev, acg_dev_kobj);
+
+	return scst_sysfs_qos_limit_show(acg_dev->acg_dev_qos_bw_limit, buf);
+}
+
+static ssize_t scst_lun_qos_bw_limit_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_acg_dev *acg_dev;
+	unsigned int limit;
+
+	acg_dev = container_of(kobj, struct scst_acg_dev, acg_dev_kobj);
+
+	res = scst_sysfs_parse_qos_limit(buf, &limit);
+	if (res != 0)
+		goto out;
+
+	acg_dev->acg_dev_qos_bw_limit = limit;
+	scst_qos_update_acg_dev(acg_dev);
+
+	res = count;
+
+out:
+	return res;
+}
+
+static struct kobj_attribute lun_qos_bw_limit_attr =
+	__ATTR(qos_bw_limit, S_IRUGO | S_IWUSR,
+		scst_lun_qos_bw_limit_show, scst_lun_qos_bw_limit_store);
+
+static ssize_t scst_lun_qos_weight_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_acg_dev *acg_dev;
+	unsigned int weight;
+
+	acg_dev = container_of(kobj, struct scst_acg_dev, acg_dev_kobj);
+	weight = acg_dev->acg_dev_qos_weight;
+
+	return sprintf(buf, "%u\n%s", weight,
+		(weight != SCST_QOS_DEF_WEIGHT) ? SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+static ssize_t scst_lun_qos_weight_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_acg_dev *acg_dev;
+	unsigned long weight;
+
+	acg_dev = container_of(kobj, struct scst_acg_dev, acg_dev_kobj);
+
+	res = kstrtoul(buf, 0, &weight);
+	if (res != 0) {
+		PRINT_ERROR("kstrtoul() for %s failed: %d ", buf, res);
+		goto out;
+	}
+	if ((weight < 1) || (weight > SCST_QOS_MAX_WEIGHT)) {
+		PRINT_ERROR("Illegal QoS weight %lu (allowed 1 - %d)", weight,
+			SCST_QOS_MAX_WEIGHT);
+		res = -EINVAL;
+		goto out;
+	}
+
+	acg_dev->acg_dev_qos_weight = weight;
+	scst_qos_update_acg_dev(acg_dev);
 
-	acg_dev = container_of(kobj, struct scst_acg_dev, acg_dev_kobj);
+	res = count;
 
-	if (acg_dev->acg_dev_rd_only || acg_dev->dev->dev_rd_only)
-		return sprintf(buf, "%d\n%s\n", 1, SCST_SYSFS_KEY_MARK);
-	else
-		return sprintf(buf, "%d\n", 0);
+out:
+	return res;
 }
 
-static struct kobj_attribute lun_options_attr =
-	__ATTR(read_only, S_IRUGO, scst_lun_rd_only_show, NULL);
+static struct kobj_attribute lun_qos_weight_attr =
+	__ATTR(qos_weight, S_IRUGO | S_IWUSR,
+		scst_lun_qos_weight_show, scst_lun_qos_weight_store);
 
 static struct attribute *lun_attrs[] = {
 	&lun_options_attr.attr,
+	&lun_qos_iops_limit_attr.attr,
+	&lun_qos_bw_limit_attr.attr,
+	&lun_qos_weight_attr.attr,
 	NULL,
 };
 
@@ -5342,7 +6148,7 @@ static int scst_process_acg_ini_mgmt_store(char *buffer,
 		goto out;
 	}
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	res = scst_suspend_tgt_activity(tgt, SCST_SUSPEND_TIMEOUT_USER);
 	if (res != 0)
 		goto out;
 
@@ -5445,7 +6251,7 @@ out_unlock:
 	mutex_unlock(&scst_mutex);
 
 out_resume:
-	scst_resume_activity();
+	scst_resume_tgt_activity(tgt);
 
 out:
 	TRACE_EXIT_RES(res);
@@ -5454,7 +6260,12 @@ out:
 
 static int scst_acg_ini_mgmt_store_work_fn(struct scst_sysfs_work_item *work)
 {
-	return scst_process_acg_ini_mgmt_store(work->buf, work->tgt, work->acg);
+	int res;
+
+	res = scst_process_acg_ini_mgmt_store(work->buf, work->tgt, work->acg);
+
+	kobject_put(&work->tgt->tgt_kobj);
+	return res;
 }
 
 static ssize_t scst_acg_ini_mgmt_store(struct kobject *kobj,
@@ -5619,6 +6430,70 @@ static struct kobj_attribute scst_acg_cpu_mask =
 	       scst_acg_cpu_mask_show,
 	       scst_acg_cpu_mask_store);
 
+static ssize_t scst_acg_qos_iops_limit_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_acg *acg;
+
+	acg = container_of(kobj, struct scst_acg, acg_kobj);
+
+	return scst_sysfs_qos_limit_show(acg->acg_qos_bucket.qb_iops_limit,
+		buf);
+}
+
+static ssize_t scst_acg_qos_iops_limit_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_acg *acg;
+
+	acg = container_of(kobj, struct scst_acg, acg_kobj);
+
+	return __scst_acg_qos_iops_limit_store(acg, buf, count);
+}
+
+static struct kobj_attribute scst_acg_qos_iops_limit =
+	__ATTR(qos_iops_limit, S_IRUGO | S_IWUSR,
+	       scst_acg_qos_iops_limit_show,
+	       scst_acg_qos_iops_limit_store);
+
+static ssize_t scst_acg_qos_bw_limit_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_acg *acg;
+
+	acg = container_of(kobj, struct scst_acg, acg_kobj);
+
+	return scst_sysfs_qos_limit_show(acg->acg_qos_bucket.qb_bw_limit, buf);
+}
+
+static ssize_t scst_acg_qos_bw_limit_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_acg *acg;
+
+	acg = container_of(kobj, struct scst_acg, acg_kobj);
+
+	return __scst_acg_qos_bw_limit_store(acg, buf, count);
+}
+
+static struct kobj_attribute scst_acg_qos_bw_limit =
+	__ATTR(qos_bw_limit, S_IRUGO | S_IWUSR,
+	       scst_acg_qos_bw_limit_show,
+	       scst_acg_qos_bw_limit_store);
+
+static ssize_t scst_acg_qos_throttled_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_acg *acg;
+
+	acg = container_of(kobj, struct scst_acg, acg_kobj);
+
+	return __scst_acg_qos_throttled_show(acg, buf);
+}
+
+static struct kobj_attribute scst_acg_qos_throttled =
+	__ATTR(qos_throttled, S_IRUGO, scst_acg_qos_throttled_show, NULL);
+
 /*
  * Called with scst_mutex held.
  *
@@ -5722,6 +6597,27 @@ int scst_acg_sysfs_create(struct scst_tgt *tgt,
 		goto out_del;
 	}
 
+	res = sysfs_create_file(&acg->acg_kobj, &scst_acg_qos_iops_limit.attr);
+	if (res != 0) {
+		PRINT_ERROR("Can't add tgt attr %s for tgt %s",
+			scst_acg_qos_iops_limit.attr.name, tgt->tgt_name);
+		goto out_del;
+	}
+
+	res = sysfs_create_file(&acg->acg_kobj, &scst_acg_qos_bw_limit.attr);
+	if (res != 0) {
+		PRINT_ERROR("Can't add tgt attr %s for tgt %s",
+			scst_acg_qos_bw_limit.attr.name, tgt->tgt_name);
+		goto out_del;
+	}
+
+	res = sysfs_create_file(&acg->acg_kobj, &scst_acg_qos_throttled.attr);
+	if (res != 0) {
+		PRINT_ERROR("Can't add tgt attr %s for tgt %s",
+			scst_acg_qos_throttled.attr.name, tgt->tgt_name);
+		goto out_del;
+	}
+
 	if (acg->tgt->tgtt->acg_attrs) {
 		res = sysfs_create_files(&acg->acg_kobj,
 					 acg->tgt->tgtt->acg_attrs);
@@ -6054,6 +6950,7 @@ static ssize_t __scst_devt_mgmt_store(struct kobject *kobj,
 
 	work->buf = buffer;
 	work->devt = devt;
+	work->obj_key = scst_sysfs_name_key(devt, buffer);
 
 	res = scst_sysfs_queue_wait_work(work);
 	if (res == 0)
@@ -6402,6 +7299,7 @@ static ssize_t scst_dg_devs_mgmt_store(struct kobject *kobj,
 
 	swap(work->buf, cmd);
 	work->kobj = kobj;
+	work->obj_key = (unsigned long)kobj;
 	SCST_SET_DEP_MAP(work, &scst_dg_dep_map);
 	kobject_get(kobj);
 	res = scst_sysfs_queue_wait_work(work);
@@ -6613,6 +7511,7 @@ static ssize_t scst_tg_preferred_store(struct kobject *kobj,
 
 	swap(work->buf, cmd);
 	work->kobj = kobj;
+	work->obj_key = (unsigned long)kobj;
 	SCST_SET_DEP_MAP(work, &scst_tg_dep_map);
 	kobject_get(kobj);
 	res = scst_sysfs_queue_wait_work(work);
@@ -6694,6 +7593,7 @@ static ssize_t scst_tg_state_store(struct kobject *kobj,
 
 	swap(work->buf, cmd);
 	work->kobj = kobj;
+	work->obj_key = (unsigned long)kobj;
 	SCST_SET_DEP_MAP(work, &scst_tg_dep_map);
 	kobject_get(kobj);
 	res = scst_sysfs_queue_wait_work(work);
@@ -6711,6 +7611,29 @@ static struct kobj_attribute scst_tg_state =
 	__ATTR(state, S_IRUGO | S_IWUSR, scst_tg_state_show,
 	       scst_tg_state_store);
 
+static ssize_t scst_tg_state_stats_show(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					char *buf)
+{
+	struct scst_target_group *tg;
+
+	tg = container_of(kobj, struct scst_target_group, kobj);
+
+	return scnprintf(buf, PAGE_SIZE,
+		"state_changes %u\n"
+		"time_in_state_ms %u\n"
+		"transitions %u\n"
+		"last_transition_ms %u\n"
+		"max_transition_ms %u\n",
+		tg->state_changes,
+		jiffies_to_msecs(jiffies - tg->state_changed),
+		tg->transitions, tg->last_transition_ms,
+		tg->max_transition_ms);
+}
+
+static struct kobj_attribute scst_tg_state_stats =
+	__ATTR(state_stats, S_IRUGO, scst_tg_state_stats_show, NULL);
+
 static ssize_t scst_tg_mgmt_show(struct kobject *kobj,
 				 struct kobj_attribute *attr,
 				 char *buf)
@@ -6779,6 +7702,7 @@ static ssize_t scst_tg_mgmt_store(struct kobject *kobj,
 
 	swap(work->buf, cmd);
 	work->kobj = kobj;
+	work->obj_key = (unsigned long)kobj;
 	SCST_SET_DEP_MAP(work, &scst_tg_dep_map);
 	kobject_get(kobj);
 	res = scst_sysfs_queue_wait_work(work);
@@ -6801,6 +7725,7 @@ static const struct attribute *scst_tg_attrs[] = {
 	&scst_tg_group_id.attr,
 	&scst_tg_preferred.attr,
 	&scst_tg_state.attr,
+	&scst_tg_state_stats.attr,
 	NULL,
 };
 
@@ -6903,6 +7828,7 @@ static ssize_t scst_dg_tgs_mgmt_store(struct kobject *kobj,
 
 	swap(work->buf, cmd);
 	work->kobj = kobj;
+	work->obj_key = (unsigned long)kobj;
 	SCST_SET_DEP_MAP(work, &scst_dg_dep_map);
 	kobject_get(kobj);
 	res = scst_sysfs_queue_wait_work(work);
@@ -7328,6 +8254,253 @@ static struct kobj_attribute scst_suspend_attr =
 	__ATTR(suspend, S_IRUGO | S_IWUSR, scst_suspend_show,
 	       scst_suspend_store);
 
+/*
+ * Configuration batch. Between "begin" and "commit" all activities are
+ * suspended only once, so the management commands of the batch don't wait
+ * for commands to finish each on its own, and initiators see the whole set
+ * of changes at once.
+ *
+ * The timeout is an idle timeout: each management command of the batch
+ * pushes the deadline, so a long batch doesn't need a long timeout, while
+ * a killed owner stalls I/O of all targets only for a few seconds.
+ */
+
+#define SCST_CFG_BATCH_DEF_TIMEOUT	5
+
+bool scst_cfg_batch_active;
+
+static DEFINE_MUTEX(scst_cfg_batch_mutex);
+/*
+ * Set under scst_cfg_batch_mutex, the deadline is also pushed without it
+ * by scst_cfg_batch_touch(). 0 means no timeout.
+ */
+static unsigned long scst_cfg_batch_idle_timeout;
+static unsigned long scst_cfg_batch_deadline;
+
+static void scst_cfg_batch_timeout_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scst_cfg_batch_timeout_work,
+	scst_cfg_batch_timeout_work_fn);
+
+/* scst_mutex supposed to be held */
+static void scst_cfg_batch_report_luns_changed(struct scst_acg *acg)
+{
+	if (!acg->acg_luns_changed_pending)
+		return;
+
+	acg->acg_luns_changed_pending = false;
+	scst_report_luns_changed(acg);
+}
+
+/* scst_cfg_batch_mutex supposed to be held */
+static void __scst_cfg_batch_commit(void)
+{
+	struct scst_tgt_template *tgtt;
+	struct scst_tgt *tgt;
+	struct scst_acg *acg;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&scst_mutex);
+
+	scst_cfg_batch_active = false;
+	scst_cfg_batch_idle_timeout = 0;
+	scst_cfg_batch_deadline = 0;
+
+	/* One UA per changed group instead of one per changed LUN */
+	list_for_each_entry(tgtt, &scst_template_list,
+			    scst_template_list_entry) {
+		list_for_each_entry(tgt, &tgtt->tgt_list, tgt_list_entry) {
+			if (tgt->tgt_acn_index_stale)
+				scst_tgt_update_acn_index(tgt);
+			scst_cfg_batch_report_luns_changed(tgt->default_acg);
+			list_for_each_entry(acg, &tgt->tgt_acg_list,
+					    acg_list_entry)
+				scst_cfg_batch_report_luns_changed(acg);
+		}
+	}
+
+	mutex_unlock(&scst_mutex);
+
+	scst_resume_activity();
+
+	PRINT_INFO("%s", "Configuration batch committed");
+
+	TRACE_EXIT();
+	return;
+}
+
+static int scst_cfg_batch_begin(unsigned long timeout)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+	res = mutex_lock_interruptible(&scst_cfg_batch_mutex);
+	if (res != 0)
+		goto out;
+
+	if (scst_cfg_batch_active) {
+		PRINT_ERROR("%s", "Configuration batch already begun");
+		res = -EBUSY;
+		goto out_unlock;
+	}
+
+	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	if (res != 0)
+		goto out_unlock;
+
+	mutex_lock(&scst_mutex);
+	scst_cfg_batch_active = true;
+	mutex_unlock(&scst_mutex);
+
+	if (timeout != 0) {
+		scst_cfg_batch_idle_timeout = timeout * HZ;
+		scst_cfg_batch_deadline = jiffies + timeout * HZ;
+		schedule_delayed_work(&scst_cfg_batch_timeout_work,
+			timeout * HZ);
+	}
+
+	PRINT_INFO("Configuration batch begun (timeout %lu)", timeout);
+
+out_unlock:
+	mutex_unlock(&scst_cfg_batch_mutex);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int scst_cfg_batch_commit(void)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+	res = mutex_lock_interruptible(&scst_cfg_batch_mutex);
+	if (res != 0)
+		goto out;
+
+	if (!scst_cfg_batch_active) {
+		PRINT_ERROR("%s", "No configuration batch to commit");
+		res = -EINVAL;
+		goto out_unlock;
+	}
+
+	__scst_cfg_batch_commit();
+
+	/* Not _sync(), the work takes scst_cfg_batch_mutex */
+	cancel_delayed_work(&scst_cfg_batch_timeout_work);
+
+out_unlock:
+	mutex_unlock(&scst_cfg_batch_mutex);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Called for each management command. Pushes the deadline of the open
+ * batch, if any, because its owner is evidently still alive.
+ */
+static void scst_cfg_batch_touch(void)
+{
+	unsigned long t;
+
+	if (likely(!READ_ONCE(scst_cfg_batch_active)))
+		return;
+
+	t = READ_ONCE(scst_cfg_batch_idle_timeout);
+	if (t != 0)
+		WRITE_ONCE(scst_cfg_batch_deadline, jiffies + t);
+}
+
+/*
+ * Commits a batch its owner forgot about, e.g. because it was killed, so
+ * the initiators don't stay suspended for long.
+ */
+static void scst_cfg_batch_timeout_work_fn(struct work_struct *work)
+{
+	TRACE_ENTRY();
+
+	mutex_lock(&scst_cfg_batch_mutex);
+
+	if (!scst_cfg_batch_active || scst_cfg_batch_deadline == 0)
+		goto out_unlock;
+
+	if (time_before(jiffies, READ_ONCE(scst_cfg_batch_deadline))) {
+		/* Pushed by scst_cfg_batch_touch() or a previous batch's work */
+		schedule_delayed_work(&scst_cfg_batch_timeout_work,
+			READ_ONCE(scst_cfg_batch_deadline) - jiffies);
+		goto out_unlock;
+	}
+
+	PRINT_WARNING("%s", "Configuration batch idle for too long, "
+		"committing it");
+	__scst_cfg_batch_commit();
+
+out_unlock:
+	mutex_unlock(&scst_cfg_batch_mutex);
+
+	TRACE_EXIT();
+	return;
+}
+
+static ssize_t scst_cfg_batch_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", READ_ONCE(scst_cfg_batch_active));
+}
+
+static ssize_t scst_cfg_batch_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	char *buffer, *p, *pp;
+	unsigned long timeout = SCST_CFG_BATCH_DEF_TIMEOUT;
+
+	TRACE_ENTRY();
+
+	buffer = kasprintf(GFP_KERNEL, "%.*s", (int)count, buf);
+	if (buffer == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	pp = buffer;
+	p = scst_get_next_lexem(&pp);
+	if (strcasecmp("begin", p) == 0) {
+		p = scst_get_next_lexem(&pp);
+		if (*p != '\0') {
+			res = kstrtoul(p, 0, &timeout);
+			if (res != 0) {
+				PRINT_ERROR("Wrong timeout %s", p);
+				goto out_free;
+			}
+		}
+		res = scst_cfg_batch_begin(timeout);
+	} else if (strcasecmp("commit", p) == 0) {
+		res = scst_cfg_batch_commit();
+	} else {
+		PRINT_ERROR("Unknown action \"%s\"", p);
+		res = -EINVAL;
+	}
+
+	if (res == 0)
+		res = count;
+
+out_free:
+	kfree(buffer);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute scst_cfg_batch_attr =
+	__ATTR(config_batch, S_IRUGO | S_IWUSR, scst_cfg_batch_show,
+	       scst_cfg_batch_store);
+
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
 
 static ssize_t scst_main_trace_level_show(struct kobject *kobj,
@@ -7585,6 +8758,48 @@ static struct kobj_attribute scst_last_sysfs_mgmt_res_attr =
 	__ATTR(last_sysfs_mgmt_res, S_IRUGO,
 		scst_last_sysfs_mgmt_res_show, NULL);
 
+static ssize_t scst_sysfs_mgmt_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int res, i;
+	struct scst_sysfs_work_stat *st;
+
+	TRACE_ENTRY();
+
+	res = scnprintf(buf, PAGE_SIZE,
+		"%-48s %6s %6s %8s %10s %10s %10s %10s\n", "Work", "Queued",
+		"MaxQ", "Done", "AvgWait", "MaxWait", "AvgExec", "MaxExec");
+
+	spin_lock(&sysfs_work_lock);
+	for (i = 0; i < SCST_SYSFS_WORK_STATS; i++) {
+		st = &sysfs_work_stats[i];
+		if (st->done == 0 && st->queued == 0)
+			continue;
+		if (st->sysfs_work_fn != NULL)
+			res += scnprintf(&buf[res], PAGE_SIZE - res, "%-48ps",
+				st->sysfs_work_fn);
+		else
+			res += scnprintf(&buf[res], PAGE_SIZE - res, "%-48s",
+				"other");
+		res += scnprintf(&buf[res], PAGE_SIZE - res,
+			" %6u %6u %8lu %10llu %10llu %10llu %10llu\n",
+			st->queued, st->max_queued, st->done,
+			st->done ? (unsigned long long)
+				div64_u64(st->total_wait_us, st->done) : 0ULL,
+			(unsigned long long)st->max_wait_us,
+			st->done ? (unsigned long long)
+				div64_u64(st->total_exec_us, st->done) : 0ULL,
+			(unsigned long long)st->max_exec_us);
+	}
+	spin_unlock(&sysfs_work_lock);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute scst_sysfs_mgmt_stats_attr =
+	__ATTR(sysfs_mgmt_stats, S_IRUGO, scst_sysfs_mgmt_stats_show, NULL);
+
 static struct attribute *scst_sysfs_root_default_attrs[] = {
 	&scst_threads_attr.attr,
 	&scst_setup_id_attr.attr,
@@ -7593,6 +8808,7 @@ static struct attribute *scst_sysfs_root_default_attrs[] = {
 	&scst_poll_us_attr.attr,
 #endif
 	&scst_suspend_attr.attr,
+	&scst_cfg_batch_attr.attr,
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
 	&scst_main_trace_level_attr.attr,
 #endif
@@ -7601,6 +8817,7 @@ static struct attribute *scst_sysfs_root_default_attrs[] = {
 	&scst_trace_mcmds_attr.attr,
 	&scst_version_attr.attr,
 	&scst_last_sysfs_mgmt_res_attr.attr,
+	&scst_sysfs_mgmt_stats_attr.attr,
 	NULL,
 };
 
@@ -7832,15 +9049,9 @@ int __init scst_sysfs_init(void)
 
 	TRACE_ENTRY();
 
-	sysfs_work_thread = kthread_run(sysfs_work_thread_fn,
-		NULL, "scst_uid");
-	if (IS_ERR(sysfs_work_thread)) {
-		res = PTR_ERR(sysfs_work_thread);
-		PRINT_ERROR("kthread_run() for user interface thread "
-			"failed: %d", res);
-		sysfs_work_thread = NULL;
+	res = scst_start_sysfs_work_threads();
+	if (res != 0)
 		goto out;
-	}
 
 	res = kobject_init_and_add(&scst_sysfs_root_kobj,
 			&scst_sysfs_root_ktype, kernel_kobj, "%s", "scst_tgt");
@@ -7904,7 +9115,7 @@ targets_kobj_error:
 sysfs_root_add_error:
 	kobject_put(&scst_sysfs_root_kobj);
 
-	kthread_stop(sysfs_work_thread);
+	scst_stop_sysfs_work_threads();
 
 	if (res == 0)
 		res = -EINVAL;
@@ -7918,6 +9129,15 @@ void scst_sysfs_cleanup(void)
 
 	PRINT_INFO("%s", "Exiting SCST sysfs hierarchy...");
 
+	mutex_lock(&scst_cfg_batch_mutex);
+	if (scst_cfg_batch_active) {
+		PRINT_WARNING("%s", "Committing not finished configuration "
+			"batch");
+		__scst_cfg_batch_commit();
+	}
+	mutex_unlock(&scst_cfg_batch_mutex);
+	cancel_delayed_work_sync(&scst_cfg_batch_timeout_work);
+
 	scst_del_put_sgv_kobj();
 
 	kobject_del(scst_devices_kobj);
@@ -7947,8 +9167,7 @@ void scst_sysfs_cleanup(void)
 	 */
 	msleep(3000);
 
-	if (sysfs_work_thread)
-		kthread_stop(sysfs_work_thread);
+	scst_stop_sysfs_work_threads();
 
 	PRINT_INFO("%s", "Exiting SCST sysfs hierarchy done");
 
@@ -26,6 +26,7 @@
 #include <linux/unistd.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/log2.h>
 #include <linux/kthread.h>
 #include <linux/delay.h>
 #include <linux/ktime.h>
@@ -40,13 +41,17 @@
 #include "scst_priv.h"
 #include "scst_pres.h"
 
+/*
+ * Returned by scst_translate_lun() and __scst_init_cmd(), if the LUN exists,
+ * but its tgt_dev isn't allocated yet.
+ */
+#define SCST_LUN_NEED_TGT_DEV	2
+
 static void scst_cmd_set_sn(struct scst_cmd *cmd);
+static void scst_queue_lazy_tgt_dev_cmd(struct scst_cmd *cmd);
 static int __scst_init_cmd(struct scst_cmd *cmd);
 static struct scst_cmd *__scst_find_cmd_by_tag(struct scst_session *sess,
 	uint64_t tag, bool to_abort);
-static void scst_process_redirect_cmd(struct scst_cmd *cmd,
-	enum scst_exec_context context, int check_retries);
-
 /**
  * scst_post_parse() - do post parse actions
  *
@@ -706,12 +711,13 @@ EXPORT_SYMBOL(scst_rx_cmd);
  */
 static int scst_init_cmd(struct scst_cmd *cmd, enum scst_exec_context *context)
 {
+	struct scst_init_queue *q = scst_sess_init_queue(cmd->sess);
 	int rc, res = 0;
 
 	TRACE_ENTRY();
 
 	/* See the comment in scst_do_job_init() */
-	if (unlikely(!list_empty(&scst_init_cmd_list))) {
+	if (unlikely(!list_empty(&q->init_cmd_list))) {
 		TRACE_DBG("%s", "init cmd list busy");
 		goto out_redirect;
 	}
@@ -722,7 +728,11 @@ static int scst_init_cmd(struct scst_cmd *cmd, enum scst_exec_context *context)
 	 */
 
 	rc = __scst_init_cmd(cmd);
-	if (unlikely(rc > 0))
+	if (unlikely(rc == SCST_LUN_NEED_TGT_DEV)) {
+		scst_queue_lazy_tgt_dev_cmd(cmd);
+		res = -1;
+		goto out;
+	} else if (unlikely(rc > 0))
 		goto out_redirect;
 	else if (unlikely(rc != 0)) {
 		res = 1;
@@ -772,13 +782,14 @@ out_redirect:
 	} else {
 		unsigned long flags;
 
-		spin_lock_irqsave(&scst_init_lock, flags);
+		spin_lock_irqsave(&q->init_lock, flags);
 		TRACE_DBG("Adding cmd %p to init cmd list", cmd);
-		list_add_tail(&cmd->cmd_list_entry, &scst_init_cmd_list);
+		list_add_tail(&cmd->cmd_list_entry, &q->init_cmd_list);
 		if (test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))
-			scst_init_poll_cnt++;
-		spin_unlock_irqrestore(&scst_init_lock, flags);
-		wake_up(&scst_init_cmd_list_waitQ);
+			q->init_poll_cnt++;
+		q->init_tgt_susp_blocked = false;
+		spin_unlock_irqrestore(&q->init_lock, flags);
+		wake_up(&q->init_cmd_list_waitQ);
 		res = -1;
 	}
 	goto out;
@@ -852,8 +863,7 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 		 * old, i.e. deferred, commands and new, i.e. just coming, ones.
 		 */
 		if (cmd->sess_cmd_list_entry.next == NULL)
-			list_add_tail(&cmd->sess_cmd_list_entry,
-				&sess->sess_cmd_list);
+			scst_sess_add_cmd(sess, cmd);
 		switch (sess->init_phase) {
 		case SCST_SESS_IPH_SUCCESS:
 			break;
@@ -872,8 +882,7 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 			sBUG();
 		}
 	} else
-		list_add_tail(&cmd->sess_cmd_list_entry,
-			      &sess->sess_cmd_list);
+		scst_sess_add_cmd(sess, cmd);
 
 	spin_unlock_irqrestore(&sess->sess_list_lock, flags);
 
@@ -1874,7 +1883,7 @@ out_dev_done:
 }
 
 /* No locks, but might be in IRQ */
-static void scst_process_redirect_cmd(struct scst_cmd *cmd,
+void scst_process_redirect_cmd(struct scst_cmd *cmd,
 	enum scst_exec_context context, int check_retries)
 {
 	struct scst_tgt *tgt = cmd->tgt;
@@ -1912,11 +1921,13 @@ static void scst_process_redirect_cmd(struct scst_cmd *cmd,
 	{
 		struct list_head *active_cmd_list;
 
-		if (cmd->cmd_thr != NULL) {
+		struct scst_cmd_thread_t *thr = cmd->cmd_thr;
+
+		if (thr != NULL) {
 			TRACE_DBG("Using assigned thread %p for cmd %p",
-				cmd->cmd_thr, cmd);
-			active_cmd_list = &cmd->cmd_thr->thr_active_cmd_list;
-			spin_lock_irqsave(&cmd->cmd_thr->thr_cmd_list_lock, flags);
+				thr, cmd);
+			active_cmd_list = &thr->thr_active_cmd_list;
+			spin_lock_irqsave(&thr->thr_cmd_list_lock, flags);
 		} else {
 			active_cmd_list = &cmd->cmd_threads->active_cmd_list;
 			spin_lock_irqsave(&cmd->cmd_threads->cmd_list_lock, flags);
@@ -1926,9 +1937,21 @@ static void scst_process_redirect_cmd(struct scst_cmd *cmd,
 			list_add(&cmd->cmd_list_entry, active_cmd_list);
 		else
 			list_add_tail(&cmd->cmd_list_entry, active_cmd_list);
-		if (cmd->cmd_thr != NULL) {
-			wake_up_process(cmd->cmd_thr->cmd_thread);
-			spin_unlock_irqrestore(&cmd->cmd_thr->thr_cmd_list_lock, flags);
+		if (thr != NULL) {
+			bool backlogged;
+
+			/*
+			 * The thread is busy with the previous commands, so
+			 * let an idle sibling steal from it.
+			 */
+			backlogged = (++thr->thr_active_cmd_cnt ==
+					SCST_CMD_THR_STEAL_MIN);
+			if (backlogged)
+				atomic_inc(&thr->thr_cmd_threads->nr_backlogged_threads);
+			wake_up_process(thr->cmd_thread);
+			spin_unlock_irqrestore(&thr->thr_cmd_list_lock, flags);
+			if (backlogged)
+				wake_up(&thr->thr_cmd_threads->cmd_list_waitQ);
 		} else {
 			wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 			spin_unlock_irqrestore(&cmd->cmd_threads->cmd_list_lock, flags);
@@ -2289,6 +2312,17 @@ static void scst_cmd_done_local(struct scst_cmd *cmd, int next_state,
 	return;
 }
 
+/* Adds lun to REPORT LUNS data in buffer, if it still fits there */
+static inline void scst_report_luns_add(struct scst_cmd *cmd, uint8_t *buffer,
+	int buffer_size, int *offs, uint64_t lun)
+{
+	if ((buffer_size - *offs) < 8)
+		return;
+	*(__force __be64 *)&buffer[*offs] = scst_pack_lun(lun,
+						cmd->sess->acg->addr_method);
+	*offs += 8;
+}
+
 static int scst_report_luns_local(struct scst_cmd *cmd)
 {
 	int res = SCST_EXEC_COMPLETED;
@@ -2297,7 +2331,7 @@ static int scst_report_luns_local(struct scst_cmd *cmd)
 	int i;
 	struct scst_tgt_dev *tgt_dev = NULL;
 	uint8_t *buffer;
-	int offs, overflow = 0;
+	int offs;
 
 	TRACE_ENTRY();
 
@@ -2327,25 +2361,30 @@ static int scst_report_luns_local(struct scst_cmd *cmd)
 
 	/*
 	 * cmd won't allow to suspend activities, so we can access
-	 * sess->sess_tgt_dev_list without any additional protection.
+	 * sess->sess_tgt_dev_list and sess->acg->acg_dev_list without any
+	 * additional protection.
 	 */
-	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
-		struct list_head *head = &cmd->sess->sess_tgt_dev_list[i];
+	if (cmd->sess->sess_lazy_tgt_devs) {
+		/* Not all LUNs have tgt_devs, and REPORT LUNS doesn't need them */
+		struct scst_acg_dev *acg_dev;
 
-		list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
-			if (!overflow) {
-				if ((buffer_size - offs) < 8) {
-					overflow = 1;
-					goto inc_dev_cnt;
-				}
-				*(__force __be64 *)&buffer[offs]
-					= scst_pack_lun(tgt_dev->lun,
-						cmd->sess->acg->addr_method);
-				offs += 8;
-			}
-inc_dev_cnt:
+		list_for_each_entry(acg_dev, &cmd->sess->acg->acg_dev_list,
+				acg_dev_list_entry) {
+			scst_report_luns_add(cmd, buffer, buffer_size, &offs,
+				acg_dev->lun);
 			dev_cnt++;
 		}
+	} else {
+		for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
+			struct list_head *head = &cmd->sess->sess_tgt_dev_list[i];
+
+			list_for_each_entry(tgt_dev, head,
+					sess_tgt_dev_list_entry) {
+				scst_report_luns_add(cmd, buffer, buffer_size,
+					&offs, tgt_dev->lun);
+				dev_cnt++;
+			}
+		}
 	}
 
 	/* Set the response header */
@@ -3395,6 +3434,29 @@ ordered:
 	goto inc_expected_sn_locked;
 }
 
+/*
+ * Passes the place of cmd in the SN order before cmd is executed, so cmds
+ * of other I_T nexuses sharing its task set don't wait for it meanwhile.
+ * Must be called before cmd can get to scst_post_exec_sn().
+ */
+void scst_release_sn_early(struct scst_cmd *cmd)
+{
+	TRACE_ENTRY();
+
+	if (!cmd->sn_set || cmd->retry)
+		goto out;
+
+	TRACE_SN("Releasing SN %d of cmd %p early", cmd->sn, cmd);
+	if (scst_inc_expected_sn(cmd))
+		scst_make_deferred_commands_active(cmd->cur_order_data);
+	/* Don't let scst_post_exec_sn() or done increment it again */
+	cmd->sn_set = 0;
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
 /* No locks */
 static struct scst_cmd *scst_post_exec_sn(struct scst_cmd *cmd,
 	bool make_active)
@@ -3668,10 +3730,19 @@ out_done:
 
 static inline bool scst_check_alua(struct scst_cmd *cmd, int *out_res)
 {
-	int (*alua_filter)(struct scst_cmd *cmd);
+	struct scst_target_group *tg;
+	int (*alua_filter)(struct scst_cmd *cmd) = NULL;
 	bool res = false;
 
-	alua_filter = READ_ONCE(cmd->tgt_dev->alua_filter);
+	if (likely(rcu_access_pointer(cmd->tgt_dev->alua_tg) == NULL))
+		goto out;
+
+	rcu_read_lock();
+	tg = rcu_dereference(cmd->tgt_dev->alua_tg);
+	if (tg != NULL)
+		alua_filter = READ_ONCE(tg->alua_filter);
+	rcu_read_unlock();
+
 	if (unlikely(alua_filter)) {
 		int ac = alua_filter(cmd);
 
@@ -3685,9 +3756,24 @@ static inline bool scst_check_alua(struct scst_cmd *cmd, int *out_res)
 		}
 	}
 
+out:
 	return res;
 }
 
+/*
+ * Returns true, if cmd was delayed by the QoS limits. The QoS timer will
+ * resume it in the EXEC_CHECK_BLOCKING state. It's checked after the SN
+ * check, so cmds waiting for their turn don't consume tokens.
+ */
+static inline bool scst_check_qos(struct scst_cmd *cmd)
+{
+	/* HEAD OF QUEUE cmds would hold back all others meanwhile */
+	if (cmd->internal || cmd->qos_admitted ||
+	    (cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
+		return false;
+	return !scst_qos_admit(cmd);
+}
+
 static int scst_exec_check_blocking(struct scst_cmd **active_cmd)
 {
 	struct scst_cmd *cmd = *active_cmd;
@@ -3698,6 +3784,9 @@ static int scst_exec_check_blocking(struct scst_cmd **active_cmd)
 
 	cmd->state = SCST_CMD_STATE_EXEC_CHECK_BLOCKING;
 
+	if (unlikely(scst_check_qos(cmd)))
+		goto out;
+
 	if (unlikely(scst_check_alua(cmd, &res)))
 		goto out;
 
@@ -3766,6 +3855,9 @@ done:
 
 		cmd->state = SCST_CMD_STATE_EXEC_CHECK_BLOCKING;
 
+		if (unlikely(scst_check_qos(cmd)))
+			break;
+
 		if (unlikely(scst_check_alua(cmd, &res)))
 			goto out;
 
@@ -3995,9 +4087,7 @@ static int scst_check_sense(struct scst_cmd *cmd)
 					cmd->driver_status = 0;
 					cmd->completed = 0;
 
-					mempool_free(cmd->sense,
-						     scst_sense_mempool);
-					cmd->sense = NULL;
+					scst_free_sense(cmd);
 
 					scst_check_restore_sg_buff(cmd);
 					if (cmd->data_direction & SCST_DATA_WRITE)
@@ -4756,7 +4846,7 @@ static int scst_finish_cmd(struct scst_cmd *cmd)
 	    unlikely(((cmd->bufflen + cmd->out_bufflen) & align_len) != 0))
 		stat->unaligned_cmd_count++;
 
-	list_del(&cmd->sess_cmd_list_entry);
+	scst_sess_del_cmd(cmd);
 
 	/*
 	 * Done under sess_list_lock to sync with scst_abort_cmd() without
@@ -4981,20 +5071,175 @@ struct scst_tgt_dev *scst_lookup_tgt_dev(struct scst_session *sess, u64 lun)
 #endif
 
 	head = &sess->sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_FN(lun)];
-	list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
+	/* Lazily allocated tgt_devs can be added in parallel */
+	rcu_read_lock();
+	list_for_each_entry_rcu(tgt_dev, head, sess_tgt_dev_list_entry) {
 		if (tgt_dev->lun == lun)
-			return tgt_dev;
+			goto out_unlock;
+	}
+	tgt_dev = NULL;
+
+out_unlock:
+	rcu_read_unlock();
+	return tgt_dev;
+}
+
+/* No locks, might be on IRQ */
+static void scst_queue_lazy_tgt_dev_cmd(struct scst_cmd *cmd)
+{
+	struct scst_session *sess = cmd->sess;
+	unsigned long flags;
+
+	TRACE_MGMT_DBG("cmd %p waits for tgt_dev of LUN %lld (sess %p)", cmd,
+		(unsigned long long)cmd->lun, sess);
+
+	if (!cmd->lazy_parked) {
+		cmd->lazy_parked = 1;
+		atomic_inc(&sess->sess_lazy_cmd_cnt);
+	}
+
+	spin_lock_irqsave(&sess->sess_list_lock, flags);
+	list_add_tail(&cmd->cmd_list_entry, &sess->sess_lazy_cmd_list);
+	spin_unlock_irqrestore(&sess->sess_list_lock, flags);
+
+	schedule_work(&sess->sess_lazy_tgt_dev_work);
+	return;
+}
+
+/* Called when parked cmd got its SN or is finished without it */
+static inline void scst_lazy_cmd_inited(struct scst_cmd *cmd)
+{
+	if (likely(!cmd->lazy_parked))
+		return;
+
+	cmd->lazy_parked = 0;
+	/* Let the next cmds see our SN before they see the counter drop */
+	smp_mb__before_atomic_dec();
+	atomic_dec(&cmd->sess->sess_lazy_cmd_cnt);
+	return;
+}
+
+/* Returns any tgt_dev of sess or NULL, if it doesn't have any */
+static struct scst_tgt_dev *scst_lookup_any_tgt_dev(struct scst_session *sess)
+{
+	struct scst_tgt_dev *tgt_dev;
+	int i;
+
+	rcu_read_lock();
+	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
+		list_for_each_entry_rcu(tgt_dev, &sess->sess_tgt_dev_list[i],
+				sess_tgt_dev_list_entry)
+			goto out_unlock;
+	}
+	tgt_dev = NULL;
+
+out_unlock:
+	rcu_read_unlock();
+	return tgt_dev;
+}
+
+/*
+ * Lazy tgt_devs part of scst_translate_lun(). Returns true, if cmd must be
+ * parked until its tgt_dev is allocated and the cmds parked before it got
+ * their SNs. Otherwise, *tgt_dev is the tgt_dev to use for cmd.
+ */
+static bool scst_lazy_tgt_dev_needed(struct scst_cmd *cmd,
+	struct scst_tgt_dev **tgt_dev)
+{
+	struct scst_session *sess = cmd->sess;
+
+	if (*tgt_dev == NULL) {
+		if (!scst_acg_has_lun(sess->acg, cmd->lun))
+			return false;
+		/*
+		 * REPORT LUNS isn't an access to its LUN, so let it use any
+		 * tgt_dev. It is the first one, which also carries session
+		 * wide UAs, like REPORTED LUNS DATA CHANGED.
+		 */
+		if (cmd->cdb[0] == REPORT_LUNS)
+			*tgt_dev = scst_lookup_any_tgt_dev(sess);
+		if (*tgt_dev == NULL)
+			return true;
+	}
+
+	/*
+	 * Don't let cmd overtake earlier parked ones, which the tgt_dev was
+	 * allocated for, but which haven't got their SNs yet.
+	 */
+	if (likely(cmd->lazy_parked ||
+		   (atomic_read(&sess->sess_lazy_cmd_cnt) == 0)))
+		return false;
+
+	TRACE_DBG("Parking cmd %p behind earlier parked cmds", cmd);
+	*tgt_dev = NULL;
+	return true;
+}
+
+/*
+ * Allocates tgt_devs for the commands queued by scst_queue_lazy_tgt_dev_cmd()
+ * and passes them in the arrival order to the init thread, which then finds
+ * the tgt_devs.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+void scst_sess_lazy_tgt_dev_work_fn(void *p)
+{
+	struct scst_session *sess = p;
+#else
+void scst_sess_lazy_tgt_dev_work_fn(struct work_struct *work)
+{
+	struct scst_session *sess = container_of(work, struct scst_session,
+					sess_lazy_tgt_dev_work);
+#endif
+	struct scst_init_queue *q = scst_sess_init_queue(sess);
+	struct scst_cmd *cmd, *t;
+	LIST_HEAD(cmds);
+
+	TRACE_ENTRY();
+
+	spin_lock_irq(&sess->sess_list_lock);
+	list_splice_init(&sess->sess_lazy_cmd_list, &cmds);
+	spin_unlock_irq(&sess->sess_list_lock);
+
+	list_for_each_entry_safe(cmd, t, &cmds, cmd_list_entry) {
+		list_del(&cmd->cmd_list_entry);
+
+		if (!test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags) &&
+		    (scst_sess_alloc_lazy_tgt_dev(sess, cmd->lun) != 0)) {
+			TRACE_DBG("Finishing cmd %p", cmd);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_lun_not_supported));
+			scst_set_cmd_abnormal_done_state(cmd);
+			scst_lazy_cmd_inited(cmd);
+
+			spin_lock_irq(&cmd->cmd_threads->cmd_list_lock);
+			list_add_tail(&cmd->cmd_list_entry,
+				&cmd->cmd_threads->active_cmd_list);
+			wake_up(&cmd->cmd_threads->cmd_list_waitQ);
+			spin_unlock_irq(&cmd->cmd_threads->cmd_list_lock);
+			continue;
+		}
+
+		spin_lock_irq(&q->init_lock);
+		TRACE_DBG("Adding cmd %p to init cmd list", cmd);
+		list_add_tail(&cmd->cmd_list_entry, &q->init_cmd_list);
+		if (test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))
+			q->init_poll_cnt++;
+		q->init_tgt_susp_blocked = false;
+		spin_unlock_irq(&q->init_lock);
+		wake_up(&q->init_cmd_list_waitQ);
 	}
 
-	return NULL;
+	TRACE_EXIT();
+	return;
 }
 
 /*
- * Returns 0 on success, > 0 when we need to wait for unblock,
- * < 0 if there is no device (lun) or device type handler.
+ * Returns 0 on success, > 0 when we need to wait for unblock or
+ * SCST_LUN_NEED_TGT_DEV, < 0 if there is no device (lun) or device type
+ * handler.
  *
  * No locks, but might be on IRQ, protection is done by the
- * suspended activity.
+ * suspended activity, global or of the cmd's target.
  */
 static int scst_translate_lun(struct scst_cmd *cmd)
 {
@@ -5004,13 +5249,24 @@ static int scst_translate_lun(struct scst_cmd *cmd)
 
 	TRACE_ENTRY();
 
+	scst_tgt_get(cmd->tgt);
 	cmd->cpu_cmd_counter = scst_get();
 
-	if (likely(!test_bit(SCST_FLAG_SUSPENDED, &scst_flags))) {
+	if (likely(!test_bit(SCST_FLAG_SUSPENDED, &scst_flags) &&
+		   !scst_tgt_cmds_suspended(cmd->tgt))) {
 		TRACE_DBG("Finding tgt_dev for cmd %p (lun %lld)", cmd,
 			(unsigned long long int)cmd->lun);
 		res = -1;
 		tgt_dev = scst_lookup_tgt_dev(cmd->sess, cmd->lun);
+		if (unlikely(cmd->sess->sess_lazy_tgt_devs) &&
+		    scst_lazy_tgt_dev_needed(cmd, &tgt_dev)) {
+			TRACE_DBG("tgt_dev for LUN %lld not ready yet",
+				(unsigned long long int)cmd->lun);
+			res = SCST_LUN_NEED_TGT_DEV;
+			scst_tgt_put(cmd->tgt);
+			scst_put(cmd->cpu_cmd_counter);
+			goto out;
+		}
 		if (tgt_dev) {
 			TRACE_DBG("tgt_dev %p found", tgt_dev);
 
@@ -5038,14 +5294,17 @@ static int scst_translate_lun(struct scst_cmd *cmd)
 					cmd->sess->initiator_name, cmd->tgt->tgt_name);
 				scst_event_queue_lun_not_found(cmd);
 			}
+			scst_tgt_put(cmd->tgt);
 			scst_put(cmd->cpu_cmd_counter);
 		}
 	} else {
+		scst_tgt_put(cmd->tgt);
 		scst_put(cmd->cpu_cmd_counter);
 		TRACE_MGMT_DBG("%s", "FLAG SUSPENDED set, skipping");
 		res = 1;
 	}
 
+out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
@@ -5053,8 +5312,9 @@ static int scst_translate_lun(struct scst_cmd *cmd)
 /*
  * No locks, but might be on IRQ.
  *
- * Returns 0 on success, > 0 when we need to wait for unblock,
- * < 0 if there is no device (lun) or device type handler.
+ * Returns 0 on success, > 0 when we need to wait for unblock or
+ * SCST_LUN_NEED_TGT_DEV, < 0 if there is no device (lun) or device type
+ * handler.
  */
 static int __scst_init_cmd(struct scst_cmd *cmd)
 {
@@ -5203,6 +5463,9 @@ again:
 	} /* else goto out; */
 
 out:
+	if (res <= 0)
+		scst_lazy_cmd_inited(cmd);
+
 	TRACE_EXIT_RES(res);
 	return res;
 
@@ -5222,13 +5485,15 @@ out_unlock_aca_active:
 	goto out_bypass_aca;
 }
 
-/* Called under scst_init_lock and IRQs disabled */
-static void scst_do_job_init(void)
-	__releases(&scst_init_lock)
-	__acquires(&scst_init_lock)
+/* Called under q->init_lock and IRQs disabled */
+static void scst_do_job_init(struct scst_init_queue *q)
+	__releases(&q->init_lock)
+	__acquires(&q->init_lock)
 {
 	struct scst_cmd *cmd;
 	int susp;
+	bool tgt_skipped;
+	unsigned int resume_seq;
 
 	TRACE_ENTRY();
 
@@ -5238,19 +5503,43 @@ restart:
 	 * this check will be done.
 	 */
 	susp = test_bit(SCST_FLAG_SUSPENDED, &scst_flags);
-	if (scst_init_poll_cnt > 0)
-		scst_init_poll_cnt--;
+	if (q->init_poll_cnt > 0)
+		q->init_poll_cnt--;
+
+	tgt_skipped = false;
+	resume_seq = read_seqbegin(&scst_tgt_resume_lock);
 
-	list_for_each_entry(cmd, &scst_init_cmd_list, cmd_list_entry) {
+	list_for_each_entry(cmd, &q->init_cmd_list, cmd_list_entry) {
 		int rc;
 
-		if (susp && !test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))
-			continue;
 		if (!test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags)) {
-			spin_unlock_irq(&scst_init_lock);
+			if (susp)
+				continue;
+			if (scst_tgt_cmds_suspended(cmd->tgt)) {
+				tgt_skipped = true;
+				continue;
+			}
+			/*
+			 * If a target was resumed after its commands were
+			 * skipped in this pass, this cmd might be a later one
+			 * of that target. Restart, so the skipped ones go
+			 * first.
+			 */
+			if (tgt_skipped &&
+			    read_seqretry(&scst_tgt_resume_lock, resume_seq))
+				goto restart;
+		}
+		if (!test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags)) {
+			spin_unlock_irq(&q->init_lock);
 			rc = __scst_init_cmd(cmd);
-			spin_lock_irq(&scst_init_lock);
-			if (rc > 0) {
+			spin_lock_irq(&q->init_lock);
+			if (unlikely(rc == SCST_LUN_NEED_TGT_DEV)) {
+				list_del(&cmd->cmd_list_entry);
+				spin_unlock_irq(&q->init_lock);
+				scst_queue_lazy_tgt_dev_cmd(cmd);
+				spin_lock_irq(&q->init_lock);
+				goto restart;
+			} else if (rc > 0) {
 				TRACE_MGMT_DBG("%s",
 					"FLAG SUSPENDED set, restarting");
 				goto restart;
@@ -5259,6 +5548,7 @@ restart:
 			TRACE_MGMT_DBG("Aborting not inited cmd %p (tag %llu)",
 				       cmd, (unsigned long long int)cmd->tag);
 			scst_set_cmd_abnormal_done_state(cmd);
+			scst_lazy_cmd_inited(cmd);
 		}
 
 		/*
@@ -5277,7 +5567,7 @@ restart:
 		TRACE_DBG("Deleting cmd %p from init cmd list", cmd);
 		smp_wmb(); /* enforce the required order */
 		list_del(&cmd->cmd_list_entry);
-		spin_unlock(&scst_init_lock);
+		spin_unlock(&q->init_lock);
 
 		spin_lock(&cmd->cmd_threads->cmd_list_lock);
 		TRACE_DBG("Adding cmd %p to active cmd list", cmd);
@@ -5290,49 +5580,58 @@ restart:
 		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 		spin_unlock(&cmd->cmd_threads->cmd_list_lock);
 
-		spin_lock(&scst_init_lock);
+		spin_lock(&q->init_lock);
 		goto restart;
 	}
 
+	/*
+	 * Anything left not during global suspending belongs to suspended
+	 * targets, so don't spin on it until something changes.
+	 */
+	q->init_tgt_susp_blocked = !susp && !list_empty(&q->init_cmd_list);
+
 	TRACE_EXIT();
 	return;
 }
 
-static inline int test_init_cmd_list(void)
+static inline int test_init_cmd_list(struct scst_init_queue *q)
 {
-	int res = (!list_empty(&scst_init_cmd_list) &&
-		   !test_bit(SCST_FLAG_SUSPENDED, &scst_flags)) ||
+	int res = (!list_empty(&q->init_cmd_list) &&
+		   !test_bit(SCST_FLAG_SUSPENDED, &scst_flags) &&
+		   !q->init_tgt_susp_blocked) ||
 		  unlikely(kthread_should_stop()) ||
-		  (scst_init_poll_cnt > 0);
+		  (q->init_poll_cnt > 0);
 	return res;
 }
 
 int scst_init_thread(void *arg)
 {
+	struct scst_init_queue *q = arg;
+
 	TRACE_ENTRY();
 
-	PRINT_INFO("Init thread started");
+	PRINT_INFO("Init thread %s started", current->comm);
 
 	current->flags |= PF_NOFREEZE;
 
 	set_user_nice(current, -10);
 
-	spin_lock_irq(&scst_init_lock);
+	spin_lock_irq(&q->init_lock);
 	while (!kthread_should_stop()) {
-		wait_event_locked(scst_init_cmd_list_waitQ,
-				  test_init_cmd_list(),
-				  lock_irq, scst_init_lock);
-		scst_do_job_init();
+		wait_event_locked(q->init_cmd_list_waitQ,
+				  test_init_cmd_list(q),
+				  lock_irq, q->init_lock);
+		scst_do_job_init(q);
 	}
-	spin_unlock_irq(&scst_init_lock);
+	spin_unlock_irq(&q->init_lock);
 
 	/*
 	 * If kthread_should_stop() is true, we are guaranteed to be
-	 * on the module unload, so scst_init_cmd_list must be empty.
+	 * on the module unload, so init_cmd_list must be empty.
 	 */
-	sBUG_ON(!list_empty(&scst_init_cmd_list));
+	sBUG_ON(!list_empty(&q->init_cmd_list));
 
-	PRINT_INFO("Init thread finished");
+	PRINT_INFO("Init thread %s finished", current->comm);
 
 	TRACE_EXIT();
 	return 0;
@@ -5628,196 +5927,285 @@ static void scst_do_job_active(struct list_head *cmd_list,
 static inline int test_cmd_threads(struct scst_cmd_thread_t *thr)
 {
 	int res = !list_empty(&thr->thr_active_cmd_list) ||
+		  unlikely(READ_ONCE(thr->thr_retiring)) ||
 		  !list_empty(&thr->thr_cmd_threads->active_cmd_list) ||
+		  (atomic_read(&thr->thr_cmd_threads->nr_backlogged_threads) > 0) ||
 		  unlikely(kthread_should_stop()) ||
 		  tm_dbg_is_release();
 	return res;
 }
 
-int scst_cmd_thread(void *arg)
+/* No locks */
+static struct scst_cmd *scst_thr_dequeue_cmd(struct scst_cmd_thread_t *thr)
 {
-	struct scst_cmd_thread_t *thr = arg;
-	struct scst_cmd_threads *p_cmd_threads = thr->thr_cmd_threads;
-	bool someth_done, p_locked, thr_locked;
+	struct scst_cmd *cmd = NULL;
 
-	TRACE_ENTRY();
+	if (list_empty(&thr->thr_active_cmd_list))
+		goto out;
 
-	TRACE(TRACE_MINOR, "Processing thread %s started", current->comm);
+	spin_lock_irq(&thr->thr_cmd_list_lock);
+	if (!list_empty(&thr->thr_active_cmd_list)) {
+		cmd = list_first_entry(&thr->thr_active_cmd_list,
+				typeof(*cmd), cmd_list_entry);
+		TRACE_DBG("Deleting cmd %p from thr active cmd list", cmd);
+		list_del(&cmd->cmd_list_entry);
+		if (thr->thr_active_cmd_cnt-- == SCST_CMD_THR_STEAL_MIN)
+			atomic_dec(&thr->thr_cmd_threads->nr_backlogged_threads);
+	}
+	spin_unlock_irq(&thr->thr_cmd_list_lock);
 
-#if 0
-	set_user_nice(current, 10);
-#endif
-	current->flags |= PF_NOFREEZE;
+out:
+	return cmd;
+}
 
-	scst_ioctx_get(p_cmd_threads);
+/*
+ * Takes the most recently queued command from a sibling thread, which
+ * has at least SCST_CMD_THR_STEAL_MIN commands waiting on its own list.
+ * Stolen command is then assigned to thr.
+ *
+ * No locks.
+ */
+static struct scst_cmd *scst_steal_cmd(struct scst_cmd_thread_t *thr)
+{
+	struct scst_cmd_threads *p_cmd_threads = thr->thr_cmd_threads;
+	struct scst_cmd_thread_t *t;
+	struct scst_cmd *cmd = NULL;
 
-	wake_up_all(&p_cmd_threads->ioctx_wq);
+	if (atomic_read(&p_cmd_threads->nr_backlogged_threads) == 0)
+		goto out;
 
-	spin_lock_irq(&p_cmd_threads->cmd_list_lock);
-	spin_lock(&thr->thr_cmd_list_lock);
-	while (!kthread_should_stop()) {
-		if (!test_cmd_threads(thr)) {
-			DEFINE_WAIT(wait);
+	spin_lock(&p_cmd_threads->thr_lock);
+	list_for_each_entry(t, &p_cmd_threads->threads_list,
+			    thread_list_entry) {
+		if ((t == thr) ||
+		    (READ_ONCE(t->thr_active_cmd_cnt) < SCST_CMD_THR_STEAL_MIN))
+			continue;
 
-			do {
-				prepare_to_wait_exclusive_head(
-					&p_cmd_threads->cmd_list_waitQ,
-					&wait, TASK_INTERRUPTIBLE);
-				if (test_cmd_threads(thr))
-					break;
-				spin_unlock(&thr->thr_cmd_list_lock);
-				spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
-				schedule();
-				spin_lock_irq(&p_cmd_threads->cmd_list_lock);
-				spin_lock(&thr->thr_cmd_list_lock);
-			} while (!test_cmd_threads(thr));
-			finish_wait(&p_cmd_threads->cmd_list_waitQ, &wait);
+		spin_lock_irq(&t->thr_cmd_list_lock);
+		if (t->thr_active_cmd_cnt >= SCST_CMD_THR_STEAL_MIN) {
+			cmd = list_entry(t->thr_active_cmd_list.prev,
+					typeof(*cmd), cmd_list_entry);
+			list_del(&cmd->cmd_list_entry);
+			if (t->thr_active_cmd_cnt-- == SCST_CMD_THR_STEAL_MIN)
+				atomic_dec(&p_cmd_threads->nr_backlogged_threads);
+			atomic_inc(&thr->thr_assigned_cmds);
+			atomic_dec(&t->thr_assigned_cmds);
+			cmd->cmd_thr = thr;
+		}
+		spin_unlock_irq(&t->thr_cmd_list_lock);
+
+		if (cmd != NULL) {
+			TRACE_DBG("Thread %p stole cmd %p from thread %p", thr,
+				cmd, t);
+			break;
 		}
+	}
+	spin_unlock(&p_cmd_threads->thr_lock);
 
-		if (tm_dbg_is_release()) {
-			spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
-			tm_dbg_check_released_cmds();
-			spin_lock_irq(&p_cmd_threads->cmd_list_lock);
+out:
+	return cmd;
+}
+
+/*
+ * Processes commands from the shared and own lists of thr, and steals them
+ * from the busy siblings, if there's nothing else to do. Returns true, if
+ * something was done. A retiring thread processes only its own list.
+ *
+ * No locks.
+ */
+static bool scst_cmd_thread_process(struct scst_cmd_thread_t *thr)
+{
+	struct scst_cmd_threads *p_cmd_threads = thr->thr_cmd_threads;
+	struct scst_cmd *cmd;
+	bool someth_done = false;
+	bool retiring = READ_ONCE(thr->thr_retiring);
+	int thr_cnt;
+
+	/*
+	 * Idea of this code is to have local queue be more prioritized
+	 * comparing to the more global queue as 2:1, as well as the
+	 * local processing not touching the more global data for writes
+	 * during its iterations when the more global queue is empty.
+	 * Why 2:1? 2 is average number of intermediate commands states
+	 * reaching this point here.
+	 */
+	if (!retiring && !list_empty(&p_cmd_threads->active_cmd_list)) {
+		cmd = NULL;
+		spin_lock_irq(&p_cmd_threads->cmd_list_lock);
+		if (!list_empty(&p_cmd_threads->active_cmd_list)) {
+			cmd = list_first_entry(&p_cmd_threads->active_cmd_list,
+					typeof(*cmd), cmd_list_entry);
+			TRACE_DBG("Deleting cmd %p from active cmd list", cmd);
+			list_del(&cmd->cmd_list_entry);
+		}
+		spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
+
+		if (cmd != NULL) {
+			if (cmd->cmd_thr == NULL) {
+				TRACE_DBG("Assigning thread %p on cmd %p",
+					thr, cmd);
+				atomic_inc(&thr->thr_assigned_cmds);
+				cmd->cmd_thr = thr;
+			}
+
+			scst_process_active_cmd(cmd, false);
+			someth_done = true;
 		}
+	}
 
-		/*
-		 * Idea of this code is to have local queue be more prioritized
-		 * comparing to the more global queue as 2:1, as well as the
-		 * local processing not touching the more global data for writes
-		 * during its iterations when the more global queue is empty.
-		 * Why 2:1? 2 is average number of intermediate commands states
-		 * reaching this point here.
-		 */
+	for (thr_cnt = 0; thr_cnt < 2; thr_cnt++) {
+		cmd = scst_thr_dequeue_cmd(thr);
+		if (cmd == NULL)
+			break;
+		scst_process_active_cmd(cmd, false);
+		someth_done = true;
+	}
 
-		p_locked = true;
-		thr_locked = true;
-		do {
-			int thr_cnt;
+	if (!someth_done && !retiring) {
+		cmd = scst_steal_cmd(thr);
+		if (cmd != NULL) {
+			scst_process_active_cmd(cmd, false);
+			someth_done = true;
+		}
+	}
 
-			someth_done = false;
-again:
-			if (!list_empty(&p_cmd_threads->active_cmd_list)) {
-				struct scst_cmd *cmd;
+	return someth_done;
+}
 
-				if (!p_locked) {
-					if (thr_locked) {
-						spin_unlock_irq(&thr->thr_cmd_list_lock);
-						thr_locked = false;
-					}
-					spin_lock_irq(&p_cmd_threads->cmd_list_lock);
-					p_locked = true;
-					goto again;
-				}
+/*
+ * Polls for new commands for scst_poll_ns before going to sleep. Returns
+ * true, if there are commands to process.
+ */
+static bool scst_cmd_thread_poll(struct scst_cmd_thread_t *thr)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+	struct scst_cmd_threads *p_cmd_threads = thr->thr_cmd_threads;
+	struct timespec ts;
+	ktime_t end, kt;
+	int rc;
 
-				cmd = list_first_entry(&p_cmd_threads->active_cmd_list,
-							typeof(*cmd), cmd_list_entry);
+	if ((scst_poll_ns == 0) || READ_ONCE(thr->thr_retiring))
+		goto out;
 
-				TRACE_DBG("Deleting cmd %p from active cmd list", cmd);
-				list_del(&cmd->cmd_list_entry);
+	rc = __getnstimeofday(&ts);
+	if (unlikely(rc != 0)) {
+		WARN_ON_ONCE(rc);
+		goto out;
+	}
 
-				if (thr_locked) {
-					spin_unlock(&thr->thr_cmd_list_lock);
-					thr_locked = false;
-				}
-				spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
-				p_locked = false;
+	end = timespec_to_ktime(ts);
+	end = ktime_add_ns(end, scst_poll_ns);
 
-				if (cmd->cmd_thr == NULL) {
-					TRACE_DBG("Assigning thread %p on cmd %p",
-						thr, cmd);
-					cmd->cmd_thr = thr;
-				}
+	do {
+		barrier();
+		if (!list_empty(&p_cmd_threads->active_cmd_list) ||
+		    !list_empty(&thr->thr_active_cmd_list)) {
+			TRACE_DBG("Poll successful");
+			return true;
+		}
+		cpu_relax();
+		rc = __getnstimeofday(&ts);
+		if (unlikely(rc != 0)) {
+			WARN_ON_ONCE(rc);
+			goto out;
+		}
+		kt = timespec_to_ktime(ts);
+	} while (ktime_before(kt, end));
 
-				scst_process_active_cmd(cmd, false);
-				someth_done = true;
-			}
+out:
+#endif
+	return false;
+}
 
-			if (thr_locked && p_locked) {
-				/* We need to maintain order of locks and unlocks */
-				spin_unlock(&thr->thr_cmd_list_lock);
-				spin_unlock(&p_cmd_threads->cmd_list_lock);
-				spin_lock(&thr->thr_cmd_list_lock);
-				p_locked = false;
-			} else if (!thr_locked) {
-				if (p_locked) {
-					spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
-					p_locked = false;
-				}
-				spin_lock_irq(&thr->thr_cmd_list_lock);
-				thr_locked = true;
-			}
+/*
+ * Called by a thread, which the pool tuner asked to retire. Finishes the
+ * commands already assigned to the thread, then reports it retired and
+ * waits for kthread_stop(). Assigned commands are freed without waking us
+ * up, hence the polling.
+ */
+static void scst_cmd_thread_retire(struct scst_cmd_thread_t *thr)
+{
+	TRACE(TRACE_MINOR, "Processing thread %s retiring", current->comm);
 
-			thr_cnt = 0;
-			while (!list_empty(&thr->thr_active_cmd_list)) {
-				struct scst_cmd *cmd = list_first_entry(
-							&thr->thr_active_cmd_list,
-							typeof(*cmd), cmd_list_entry);
+	/* We might have consumed an exclusive wake up meant for siblings */
+	wake_up(&thr->thr_cmd_threads->cmd_list_waitQ);
 
-				TRACE_DBG("Deleting cmd %p from thr active cmd list", cmd);
-				list_del(&cmd->cmd_list_entry);
+	while (!kthread_should_stop()) {
+		while (scst_cmd_thread_process(thr))
+			;
 
-				spin_unlock_irq(&thr->thr_cmd_list_lock);
-				thr_locked = false;
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!list_empty(&thr->thr_active_cmd_list) ||
+		    kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+		if (!thr->thr_retired &&
+		    (atomic_read(&thr->thr_assigned_cmds) == 0)) {
+			TRACE_DBG("Thread %p retired", thr);
+			WRITE_ONCE(thr->thr_retired, true);
+		}
+		schedule_timeout(thr->thr_retired ? MAX_SCHEDULE_TIMEOUT :
+						    HZ/10);
+	}
+	__set_current_state(TASK_RUNNING);
+	return;
+}
 
-				scst_process_active_cmd(cmd, false);
+int scst_cmd_thread(void *arg)
+{
+	struct scst_cmd_thread_t *thr = arg;
+	struct scst_cmd_threads *p_cmd_threads = thr->thr_cmd_threads;
 
-				someth_done = true;
+	TRACE_ENTRY();
 
-				if (++thr_cnt == 2)
-					break;
-				else {
-					spin_lock_irq(&thr->thr_cmd_list_lock);
-					thr_locked = true;
-				}
-			}
-		} while (someth_done);
+	TRACE(TRACE_MINOR, "Processing thread %s started", current->comm);
 
-		EXTRACHECKS_BUG_ON(p_locked);
+#if 0
+	set_user_nice(current, 10);
+#endif
+	current->flags |= PF_NOFREEZE;
 
-		if (thr_locked) {
-			spin_unlock_irq(&thr->thr_cmd_list_lock);
-			thr_locked = false;
-		}
+	scst_ioctx_get(p_cmd_threads);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
-		if (scst_poll_ns > 0) {
-			struct timespec ts;
-			ktime_t end, kt;
-			int rc;
+	wake_up_all(&p_cmd_threads->ioctx_wq);
 
-			rc = __getnstimeofday(&ts);
-			if (unlikely(rc != 0)) {
-				WARN_ON_ONCE(rc);
-				goto go;
-			}
+	while (!kthread_should_stop()) {
+		if (unlikely(READ_ONCE(thr->thr_retiring))) {
+			scst_cmd_thread_retire(thr);
+			break;
+		}
 
-			end = timespec_to_ktime(ts);
-			end = ktime_add_ns(end, scst_poll_ns);
+		/*
+		 * No need to hold cmd_list_lock for waiting: producers add
+		 * commands before waking up either cmd_list_waitQ or this
+		 * thread, and prepare_to_wait_exclusive_head() sets the task
+		 * state before the lists are rechecked.
+		 */
+		if (!test_cmd_threads(thr)) {
+			DEFINE_WAIT(wait);
 
+			WRITE_ONCE(thr->thr_waiting, true);
 			do {
-				barrier();
-				if (!list_empty(&p_cmd_threads->active_cmd_list) ||
-				    !list_empty(&thr->thr_active_cmd_list)) {
-					TRACE_DBG("Poll successful");
-					goto again;
-				}
-				cpu_relax();
-				rc = __getnstimeofday(&ts);
-				if (unlikely(rc != 0)) {
-					WARN_ON_ONCE(rc);
-					goto go;
-				}
-				kt = timespec_to_ktime(ts);
-			} while (ktime_before(kt, end));
+				prepare_to_wait_exclusive_head(
+					&p_cmd_threads->cmd_list_waitQ,
+					&wait, TASK_INTERRUPTIBLE);
+				if (test_cmd_threads(thr))
+					break;
+				schedule();
+			} while (!test_cmd_threads(thr));
+			finish_wait(&p_cmd_threads->cmd_list_waitQ, &wait);
+			WRITE_ONCE(thr->thr_waiting, false);
 		}
 
-go:
-#endif
-		spin_lock_irq(&p_cmd_threads->cmd_list_lock);
-		spin_lock(&thr->thr_cmd_list_lock);
+		if (tm_dbg_is_release())
+			tm_dbg_check_released_cmds();
+
+		do {
+			while (scst_cmd_thread_process(thr))
+				;
+		} while (scst_cmd_thread_poll(thr));
 	}
-	spin_unlock(&thr->thr_cmd_list_lock);
-	spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
 
 	scst_ioctx_put(p_cmd_threads);
 
@@ -5843,8 +6231,8 @@ void scst_cmd_tasklet(long p)
 
 /*
  * Returns 0 on success, or > 0 if SCST_FLAG_SUSPENDED set and
- * SCST_FLAG_SUSPENDING - not. No locks, protection is done by the
- * suspended activity.
+ * SCST_FLAG_SUSPENDING - not, or the same for the mcmd's target.
+ * No locks, protection is done by the suspended activity.
  */
 static int scst_get_mgmt(struct scst_mgmt_cmd *mcmd)
 {
@@ -5852,10 +6240,13 @@ static int scst_get_mgmt(struct scst_mgmt_cmd *mcmd)
 
 	TRACE_ENTRY();
 
+	scst_tgt_get(mcmd->sess->tgt);
 	mcmd->cpu_cmd_counter = scst_get();
 
-	if (unlikely(test_bit(SCST_FLAG_SUSPENDED, &scst_flags) &&
-		     !test_bit(SCST_FLAG_SUSPENDING, &scst_flags))) {
+	if (unlikely((test_bit(SCST_FLAG_SUSPENDED, &scst_flags) &&
+		      !test_bit(SCST_FLAG_SUSPENDING, &scst_flags)) ||
+		     scst_tgt_mgmt_suspended(mcmd->sess->tgt))) {
+		scst_tgt_put(mcmd->sess->tgt);
 		scst_put(mcmd->cpu_cmd_counter);
 		TRACE_MGMT_DBG("%s", "FLAG SUSPENDED set, skipping");
 		res = 1;
@@ -5875,6 +6266,7 @@ out:
 static int scst_mgmt_translate_lun(struct scst_mgmt_cmd *mcmd)
 {
 	struct scst_tgt_dev *tgt_dev;
+	bool lazy_done = false;
 	int res;
 
 	TRACE_ENTRY();
@@ -5882,6 +6274,7 @@ static int scst_mgmt_translate_lun(struct scst_mgmt_cmd *mcmd)
 	TRACE_DBG("Finding tgt_dev for mgmt cmd %p (lun %lld)", mcmd,
 	      (unsigned long long int)mcmd->lun);
 
+again:
 	res = scst_get_mgmt(mcmd);
 	if (unlikely(res != 0))
 		goto out;
@@ -5892,8 +6285,19 @@ static int scst_mgmt_translate_lun(struct scst_mgmt_cmd *mcmd)
 		mcmd->mcmd_tgt_dev = tgt_dev;
 		res = 0;
 	} else {
+		bool lazy = mcmd->sess->sess_lazy_tgt_devs && !lazy_done &&
+			scst_acg_has_lun(mcmd->sess->acg, mcmd->lun);
+
+		scst_tgt_put(mcmd->sess->tgt);
 		scst_put(mcmd->cpu_cmd_counter);
 		res = -1;
+
+		/* TM thread can sleep, so allocate the tgt_dev right here */
+		if (lazy &&
+		    (scst_sess_alloc_lazy_tgt_dev(mcmd->sess, mcmd->lun) == 0)) {
+			lazy_done = true;
+			goto again;
+		}
 	}
 
 out:
@@ -6216,10 +6620,12 @@ void scst_abort_cmd(struct scst_cmd *cmd, struct scst_mgmt_cmd *mcmd,
 		scst_cm_abort_ec_cmd(cmd);
 
 	if (cmd->tgt_dev == NULL) {
-		spin_lock_irqsave(&scst_init_lock, flags);
-		scst_init_poll_cnt++;
-		spin_unlock_irqrestore(&scst_init_lock, flags);
-		wake_up(&scst_init_cmd_list_waitQ);
+		struct scst_init_queue *q = scst_sess_init_queue(cmd->sess);
+
+		spin_lock_irqsave(&q->init_lock, flags);
+		q->init_poll_cnt++;
+		spin_unlock_irqrestore(&q->init_lock, flags);
+		wake_up(&q->init_cmd_list_waitQ);
 	}
 
 	if (!cmd->finished && call_dev_task_mgmt_fn_received &&
@@ -6716,8 +7122,10 @@ static int scst_mgmt_cmd_init(struct scst_mgmt_cmd *mcmd)
 		}
 		__scst_cmd_get(cmd);
 		tgt_dev = cmd->tgt_dev;
-		if (tgt_dev != NULL)
+		if (tgt_dev != NULL) {
+			scst_tgt_get(sess->tgt);
 			mcmd->cpu_cmd_counter = scst_get();
+		}
 		spin_unlock_irq(&sess->sess_list_lock);
 		TRACE_DBG("Cmd to abort %p for tag %llu found (tgt_dev %p)",
 			cmd, (unsigned long long int)mcmd->tag, tgt_dev);
@@ -7638,9 +8046,10 @@ int scst_tm_thread(void *arg)
 			rc = scst_process_mgmt_cmd(mcmd);
 			spin_lock_irq(&scst_mcmd_lock);
 			if (rc > 0) {
-				if (test_bit(SCST_FLAG_SUSPENDED, &scst_flags) &&
-				    !test_bit(SCST_FLAG_SUSPENDING,
-						&scst_flags)) {
+				if ((test_bit(SCST_FLAG_SUSPENDED, &scst_flags) &&
+				     !test_bit(SCST_FLAG_SUSPENDING,
+						&scst_flags)) ||
+				    scst_tgt_mgmt_suspended(mcmd->sess->tgt)) {
 					TRACE_MGMT_DBG("Adding mgmt cmd %p to "
 						"head of delayed mgmt cmd list",
 						mcmd);
@@ -7933,9 +8342,48 @@ static bool wildcmp(const char *wild, const char *string)
 	return __wildcmp(wild, string, 0);
 }
 
+unsigned int scst_acg_lookup_gen;
+
+/*
+ * Precomputes how acn->name should be matched, so the most common names
+ * without wildcards or with only a trailing '*' don't need wildcmp().
+ */
+void scst_acn_compile(struct scst_acn *acn)
+{
+	const char *name = acn->name;
+	int len = strlen(name);
+
+	if (strpbrk(name, "*?!") == NULL) {
+		acn->acn_match_type = SCST_ACN_MATCH_EXACT;
+	} else if ((len > 0) && (name[len-1] == '*') &&
+		   (strpbrk(name, "?!") == NULL) &&
+		   (memchr(name, '*', len-1) == NULL)) {
+		acn->acn_match_type = SCST_ACN_MATCH_PREFIX;
+		acn->acn_prefix_len = len - 1;
+	} else
+		acn->acn_match_type = SCST_ACN_MATCH_WILDCARD;
+
+	TRACE_DBG("acn %s: match type %d", name, acn->acn_match_type);
+	return;
+}
+
+static bool scst_acn_match(const struct scst_acn *acn,
+	const char *initiator_name)
+{
+	switch (acn->acn_match_type) {
+	case SCST_ACN_MATCH_EXACT:
+		return strcasecmp(acn->name, initiator_name) == 0;
+	case SCST_ACN_MATCH_PREFIX:
+		return strncasecmp(acn->name, initiator_name,
+				acn->acn_prefix_len) == 0;
+	default:
+		return wildcmp(acn->name, initiator_name);
+	}
+}
+
 #ifdef CONFIG_SCST_PROC
 
-/* scst_mutex supposed to be held */
+/* scst_mutex or rcu_read_lock() supposed to be held */
 static struct scst_acg *scst_find_acg_by_name_wild(const char *initiator_name)
 {
 	struct scst_acg *acg, *res = NULL;
@@ -7943,9 +8391,9 @@ static struct scst_acg *scst_find_acg_by_name_wild(const char *initiator_name)
 
 	TRACE_ENTRY();
 
-	list_for_each_entry(acg, &scst_acg_list, acg_list_entry) {
-		list_for_each_entry(n, &acg->acn_list, acn_list_entry) {
-			if (wildcmp(n->name, initiator_name)) {
+	list_for_each_entry_rcu(acg, &scst_acg_list, acg_list_entry) {
+		list_for_each_entry_rcu(n, &acg->acn_list, acn_list_entry) {
+			if (scst_acn_match(n, initiator_name)) {
 				TRACE_DBG("Access control group %s found",
 					acg->acg_name);
 				res = acg;
@@ -7959,14 +8407,14 @@ out:
 	return res;
 }
 
-/* scst_mutex supposed to be held */
+/* scst_mutex or rcu_read_lock() supposed to be held */
 static struct scst_acg *scst_find_acg_by_name(const char *acg_name)
 {
 	struct scst_acg *acg, *res = NULL;
 
 	TRACE_ENTRY();
 
-	list_for_each_entry(acg, &scst_acg_list, acg_list_entry) {
+	list_for_each_entry_rcu(acg, &scst_acg_list, acg_list_entry) {
 		if (strcmp(acg->acg_name, acg_name) == 0) {
 			TRACE_DBG("Access control group %s found",
 				acg->acg_name);
@@ -7982,11 +8430,167 @@ out:
 
 #else /* CONFIG_SCST_PROC */
 
-/* scst_mutex supposed to be held */
+/*
+ * Index of the names of all ACGs of a target. Names without wildcards are
+ * hashed, the remaining patterns are kept in the lookup order, so a lookup
+ * doesn't need to match the initiator name against every name of every
+ * ACG. Immutable after it's published in tgt->tgt_acn_index.
+ */
+struct scst_acn_index_entry {
+	const struct scst_acn *acn;
+	/* Position of acn in the order, in which ACG lists are walked */
+	int order;
+	/* Index of the next entry in the same hash bucket or -1 */
+	int next;
+};
+
+struct scst_acn_index {
+	struct rcu_head rcu_head;
+	unsigned int hash_mask;
+	/* Index of the first entry of each hash bucket or -1 */
+	int *hash;
+	/* Entries for patterns in the lookup order */
+	int wild_cnt;
+	struct scst_acn_index_entry *wild;
+	/* Entries for names without wildcards first, then wild */
+	struct scst_acn_index_entry entries[0];
+};
+
+#define SCST_ACN_INDEX_MIN_HASH_SIZE	16
+
+/* ACN names are case insensitive */
+static unsigned int scst_acn_hash(const char *name)
+{
+	unsigned int h = 0;
+
+	while (*name)
+		h = h * 31 + tolower(*name++);
+
+	return h;
+}
+
+/*
+ * Rebuilds the ACN index of tgt after its ACGs or their names changed.
+ * Inside a configuration batch the index is dropped and rebuilt once at
+ * the batch commit.
+ *
+ * scst_mutex supposed to be held.
+ */
+void scst_tgt_update_acn_index(struct scst_tgt *tgt)
+{
+	struct scst_acn_index *idx = NULL, *old;
+	struct scst_acn_index_entry *ent;
+	struct scst_acg *acg;
+	struct scst_acn *acn;
+	int cnt = 0, exact_cnt = 0, e = 0, w = 0, order = 0, hash_size;
+
+	TRACE_ENTRY();
+
+	lockdep_assert_held(&scst_mutex);
+
+	if (scst_cfg_batch_active) {
+		tgt->tgt_acn_index_stale = true;
+		goto publish;
+	}
+	tgt->tgt_acn_index_stale = false;
+
+	list_for_each_entry(acg, &tgt->tgt_acg_list, acg_list_entry) {
+		list_for_each_entry(acn, &acg->acn_list, acn_list_entry) {
+			cnt++;
+			if (acn->acn_match_type == SCST_ACN_MATCH_EXACT)
+				exact_cnt++;
+		}
+	}
+
+	if (cnt == 0)
+		goto publish;
+
+	hash_size = roundup_pow_of_two(max_t(int, exact_cnt,
+					SCST_ACN_INDEX_MIN_HASH_SIZE));
+
+	idx = kzalloc(sizeof(*idx) + cnt * sizeof(idx->entries[0]) +
+		hash_size * sizeof(idx->hash[0]), GFP_KERNEL);
+	if (idx == NULL) {
+		PRINT_WARNING("Unable to allocate names index of target %s "
+			"(%d names), ACG lookups will be slower", tgt->tgt_name,
+			cnt);
+		goto publish;
+	}
+
+	idx->hash_mask = hash_size - 1;
+	idx->hash = (int *)&idx->entries[cnt];
+	memset(idx->hash, -1, hash_size * sizeof(idx->hash[0]));
+	idx->wild_cnt = cnt - exact_cnt;
+	idx->wild = &idx->entries[exact_cnt];
+
+	list_for_each_entry(acg, &tgt->tgt_acg_list, acg_list_entry) {
+		list_for_each_entry(acn, &acg->acn_list, acn_list_entry) {
+			if (acn->acn_match_type == SCST_ACN_MATCH_EXACT) {
+				unsigned int h = scst_acn_hash(acn->name) &
+							idx->hash_mask;
+
+				ent = &idx->entries[e];
+				ent->next = idx->hash[h];
+				idx->hash[h] = e;
+				e++;
+			} else {
+				ent = &idx->wild[w++];
+				ent->next = -1;
+			}
+			ent->acn = acn;
+			ent->order = order++;
+		}
+	}
+
+	TRACE_DBG("Target %s: names index with %d names, %d patterns",
+		tgt->tgt_name, exact_cnt, idx->wild_cnt);
+
+publish:
+	old = rcu_dereference_protected(tgt->tgt_acn_index,
+				lockdep_is_held(&scst_mutex));
+	rcu_assign_pointer(tgt->tgt_acn_index, idx);
+	if (old != NULL)
+		kfree_rcu(old, rcu_head);
+
+	TRACE_EXIT();
+	return;
+}
+
+/* rcu_read_lock() supposed to be held */
+static struct scst_acg *scst_acn_index_find_acg(
+	const struct scst_acn_index *idx, const char *initiator_name)
+{
+	const struct scst_acn_index_entry *ent, *found = NULL;
+	int i;
+
+	for (i = idx->hash[scst_acn_hash(initiator_name) & idx->hash_mask];
+	     i >= 0; i = ent->next) {
+		ent = &idx->entries[i];
+		if (((found == NULL) || (ent->order < found->order)) &&
+		    (strcasecmp(ent->acn->name, initiator_name) == 0))
+			found = ent;
+	}
+
+	/* Patterns before the found name in the lookup order take precedence */
+	for (i = 0; i < idx->wild_cnt; i++) {
+		ent = &idx->wild[i];
+		if ((found != NULL) && (ent->order > found->order))
+			break;
+		if (scst_acn_match(ent->acn, initiator_name)) {
+			found = ent;
+			break;
+		}
+	}
+
+	return (found != NULL) ? found->acn->acg : NULL;
+}
+
+/* scst_mutex or rcu_read_lock() supposed to be held */
 static struct scst_acg *scst_find_tgt_acg_by_name_wild(struct scst_tgt *tgt,
 	const char *initiator_name)
 {
 	struct scst_acg *acg, *res = NULL;
+	struct scst_acn_index *idx;
 	struct scst_acn *n;
 
 	TRACE_ENTRY();
@@ -7994,9 +8598,18 @@ static struct scst_acg *scst_find_tgt_acg_by_name_wild(struct scst_tgt *tgt,
 	if (initiator_name == NULL)
 		goto out;
 
-	list_for_each_entry(acg, &tgt->tgt_acg_list, acg_list_entry) {
-		list_for_each_entry(n, &acg->acn_list, acn_list_entry) {
-			if (wildcmp(n->name, initiator_name)) {
+	idx = rcu_dereference(tgt->tgt_acn_index);
+	if (idx != NULL) {
+		res = scst_acn_index_find_acg(idx, initiator_name);
+		if (res != NULL)
+			TRACE_DBG("Access control group %s found",
+				res->acg_name);
+		goto out;
+	}
+
+	list_for_each_entry_rcu(acg, &tgt->tgt_acg_list, acg_list_entry) {
+		list_for_each_entry_rcu(n, &acg->acn_list, acn_list_entry) {
+			if (scst_acn_match(n, initiator_name)) {
 				TRACE_DBG("Access control group %s found",
 					acg->acg_name);
 				res = acg;
@@ -8012,7 +8625,11 @@ out:
 
 #endif /* CONFIG_SCST_PROC */
 
-/* Must be called under scst_mutex */
+/*
+ * Must be called under rcu_read_lock(). The returned acg is only valid
+ * until rcu_read_unlock(), unless scst_mutex is held or
+ * scst_acg_lookup_gen is rechecked under it.
+ */
 static struct scst_acg *__scst_find_acg(struct scst_tgt *tgt,
 	const char *initiator_name)
 {
@@ -8040,7 +8657,13 @@ static struct scst_acg *__scst_find_acg(struct scst_tgt *tgt,
 /* Must be called under scst_mutex */
 struct scst_acg *scst_find_acg(const struct scst_session *sess)
 {
-	return __scst_find_acg(sess->tgt, sess->initiator_name);
+	struct scst_acg *acg;
+
+	rcu_read_lock();
+	acg = __scst_find_acg(sess->tgt, sess->initiator_name);
+	rcu_read_unlock();
+
+	return acg;
 }
 
 /**
@@ -8056,17 +8679,21 @@ bool scst_initiator_has_luns(struct scst_tgt *tgt, const char *initiator_name)
 
 	TRACE_ENTRY();
 
-	mutex_lock(&scst_mutex);
+	/*
+	 * It's only a hint for the target driver, so a racing configuration
+	 * change doesn't matter and we don't need scst_mutex.
+	 */
+	rcu_read_lock();
 
 	acg = __scst_find_acg(tgt, initiator_name);
 
 	res = !list_empty(&acg->acg_dev_list);
 
+	rcu_read_unlock();
+
 	if (!res)
 		scst_event_queue_negative_luns_inquiry(tgt, initiator_name);
 
-	mutex_unlock(&scst_mutex);
-
 	TRACE_EXIT_RES(res);
 	return res;
 }
@@ -8114,13 +8741,29 @@ static int scst_init_session(struct scst_session *sess)
 	int res = 0;
 	struct scst_cmd *cmd, *cmd_tmp;
 	struct scst_mgmt_cmd *mcmd, *tm;
+	struct scst_acg *acg;
+	unsigned int gen;
 	int mwake = 0;
 
 	TRACE_ENTRY();
 
+	/*
+	 * Look the ACG up before taking scst_mutex, so concurrent logins
+	 * don't serialize on matching the initiator name against all ACNs.
+	 * If ACGs or ACNs changed meanwhile, look it up again.
+	 */
+	gen = READ_ONCE(scst_acg_lookup_gen);
+	smp_rmb();
+	rcu_read_lock();
+	acg = __scst_find_acg(sess->tgt, sess->initiator_name);
+	rcu_read_unlock();
+
 	mutex_lock(&scst_mutex);
 
-	sess->acg = scst_find_acg(sess);
+	if (likely(gen == scst_acg_lookup_gen))
+		sess->acg = acg;
+	else
+		sess->acg = scst_find_acg(sess);
 
 	PRINT_INFO("Using security group \"%s\" for initiator \"%s\" "
 		"(target %s)", sess->acg->acg_name, sess->initiator_name,
@@ -8519,16 +9162,15 @@ static struct scst_cmd *__scst_find_cmd_by_tag(struct scst_session *sess,
 	uint64_t tag, bool to_abort)
 {
 	struct scst_cmd *cmd, *res = NULL;
+	struct list_head *head;
 
 	TRACE_ENTRY();
 
-	/* ToDo: hash list */
-
-	TRACE_DBG("%s (sess=%p, tag=%llu)", "Searching in sess cmd list",
+	TRACE_DBG("%s (sess=%p, tag=%llu)", "Searching in sess cmd tag hash",
 		  sess, (unsigned long long int)tag);
 
-	list_for_each_entry(cmd, &sess->sess_cmd_list,
-			sess_cmd_list_entry) {
+	head = &sess->sess_cmd_tag_hash[SESS_CMD_TAG_HASH_FN(tag)];
+	list_for_each_entry(cmd, head, sess_cmd_tag_hash_entry) {
 		if ((cmd->tag == tag) && likely(!cmd->internal)) {
 			/*
 			 * We must not count done commands, because
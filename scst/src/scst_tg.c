@@ -509,16 +509,16 @@ static int (*scst_alua_filter[])(struct scst_cmd *cmd) = {
 };
 
 /*
- * Check whether the tgt_dev ALUA filter is consistent with the target group
- * ALUA state.
+ * Check whether the tgt_dev ALUA target group is consistent with the device
+ * group and target group configuration and whether the target group ALUA
+ * filter is consistent with its ALUA state.
  */
 static void scst_check_alua_invariant(void)
 {
 	struct scst_device *dev;
 	struct scst_tgt_dev *tgt_dev;
 	struct scst_dev_group *dg;
-	struct scst_target_group *tg;
-	enum scst_tg_state expected_state;
+	struct scst_target_group *tg, *alua_tg;
 
 #if 0
 	lockdep_assert_held(&scst_mutex); /* scst_dev_list, dev_tgt_dev_list */
@@ -535,48 +535,39 @@ static void scst_check_alua_invariant(void)
 			tg = dg ?
 			    __lookup_tg_by_tgt(dg, tgt_dev->acg_dev->acg->tgt) :
 			    NULL;
-			expected_state = tg ? tg->state :
-				SCST_TG_STATE_OPTIMIZED;
-			if (tgt_dev->alua_filter !=
-				   scst_alua_filter[expected_state]) {
-				PRINT_ERROR("LUN %s/%s/%s/%lld/%s: ALUA filter"
-					" %p <> %p",
+			alua_tg = rcu_access_pointer(tgt_dev->alua_tg);
+			if (alua_tg != tg) {
+				PRINT_ERROR("LUN %s/%s/%s/%lld/%s: ALUA target"
+					" group %p <> %p",
 					tgt_dev->acg_dev->acg->tgt->tgt_name,
 					tgt_dev->acg_dev->acg->acg_name ? :
 					"(default)",
 					tgt_dev->sess->initiator_name,
 					tgt_dev->lun,
 					tgt_dev->dev->virt_name ? : "(null)",
-					tgt_dev->alua_filter,
-					scst_alua_filter[expected_state]);
+					alua_tg, tg);
+			} else if (tg &&
+				   tg->alua_filter != scst_alua_filter[tg->state]) {
+				PRINT_ERROR("Target group %s/%s: ALUA filter"
+					" %p <> %p", tg->dg->name, tg->name,
+					tg->alua_filter,
+					scst_alua_filter[tg->state]);
 			}
 		}
 	}
 }
 
-/* Update the ALUA filter of a tgt_dev */
-static void scst_update_tgt_dev_alua_filter(struct scst_tgt_dev *tgt_dev,
-					    enum scst_tg_state state)
-{
-	lockdep_assert_held(&scst_dg_mutex);
-
-	tgt_dev->alua_filter = scst_alua_filter[state];
-}
-
-/* Update the ALUA filter after an ALUA state change and generate UA */
-static void scst_tg_change_tgt_dev_state(struct scst_tgt_dev *tgt_dev,
-					 enum scst_tg_state state,
-					 bool gen_ua)
+/*
+ * Set the target group whose ALUA filter applies to a tgt_dev. A target group
+ * is freed only after an RCU grace period, so the command path can use it
+ * under rcu_read_lock() even if it is being removed concurrently.
+ */
+static void scst_update_tgt_dev_alua_tg(struct scst_tgt_dev *tgt_dev,
+					struct scst_target_group *tg)
 {
 	lockdep_assert_held(&scst_dg_mutex);
 
-	TRACE_MGMT_DBG("ALUA state of tgt_dev %p has changed (gen_ua %d)",
-		tgt_dev, gen_ua);
-
-	scst_update_tgt_dev_alua_filter(tgt_dev, state);
-	if (gen_ua)
-		scst_gen_aen_or_ua(tgt_dev,
-			SCST_LOAD_SENSE(scst_sense_asym_access_state_changed));
+	rcu_assign_pointer(tgt_dev->alua_tg, tg);
 }
 
 /* Initialize ALUA state of LUN tgt_dev */
@@ -590,7 +581,7 @@ void scst_tg_init_tgt_dev(struct scst_tgt_dev *tgt_dev)
 	if (dg) {
 		tg = __lookup_tg_by_tgt(dg, tgt_dev->acg_dev->acg->tgt);
 		if (tg) {
-			scst_update_tgt_dev_alua_filter(tgt_dev, tg->state);
+			scst_update_tgt_dev_alua_tg(tgt_dev, tg);
 			scst_check_alua_invariant();
 		}
 	}
@@ -598,8 +589,8 @@ void scst_tg_init_tgt_dev(struct scst_tgt_dev *tgt_dev)
 }
 
 /*
- * Update the ALUA filter of all tgt_devs associated with target group @tg
- * and target @tgt.
+ * Make target group @tg the ALUA target group of all tgt_devs associated with
+ * target group @tg and target @tgt.
  */
 static void scst_update_tgt_alua_filter(struct scst_target_group *tg,
 					struct scst_tgt *tgt)
@@ -613,8 +604,7 @@ static void scst_update_tgt_alua_filter(struct scst_target_group *tg,
 		list_for_each_entry(tgt_dev, &dgd->dev->dev_tgt_dev_list,
 				    dev_tgt_dev_list_entry) {
 			if (tgt_dev->acg_dev->acg->tgt == tgt)
-				scst_update_tgt_dev_alua_filter(tgt_dev,
-								tg->state);
+				scst_update_tgt_dev_alua_tg(tgt_dev, tg);
 		}
 	}
 
@@ -622,8 +612,8 @@ static void scst_update_tgt_alua_filter(struct scst_target_group *tg,
 }
 
 /*
- * Reset the ALUA filter of all tgt_devs associated with target group @tg
- * and target @tgt.
+ * Reset the ALUA target group of all tgt_devs associated with target group
+ * @tg and target @tgt.
  */
 static void scst_reset_tgt_alua_filter(struct scst_target_group *tg,
 				       struct scst_tgt *tgt)
@@ -637,8 +627,7 @@ static void scst_reset_tgt_alua_filter(struct scst_target_group *tg,
 		list_for_each_entry(tgt_dev, &dgd->dev->dev_tgt_dev_list,
 				    dev_tgt_dev_list_entry) {
 			if (tgt_dev->acg_dev->acg->tgt == tgt)
-				scst_update_tgt_dev_alua_filter(tgt_dev,
-						      SCST_TG_STATE_OPTIMIZED);
+				scst_update_tgt_dev_alua_tg(tgt_dev, NULL);
 		}
 	}
 
@@ -771,7 +760,8 @@ static void scst_release_tg(struct kobject *kobj)
 
 	tg = container_of(kobj, struct scst_target_group, kobj);
 	kfree(tg->name);
-	kfree(tg);
+	/* The command path might still be looking at tg->alua_filter */
+	kfree_rcu(tg, rcu_head);
 }
 
 static struct kobj_type scst_tg_ktype = {
@@ -805,6 +795,8 @@ int scst_tg_add(struct scst_dev_group *dg, const char *name)
 		goto out_put;
 	tg->dg = dg;
 	tg->state = SCST_TG_STATE_OPTIMIZED;
+	tg->alua_filter = scst_alua_filter[tg->state];
+	tg->state_changed = jiffies;
 	INIT_LIST_HEAD(&tg->tgt_list);
 
 	res = mutex_lock_interruptible(&scst_dg_mutex);
@@ -948,10 +940,34 @@ out_fail:
 	goto out_unlock;
 }
 
+/* Update the ALUA state change statistics of @tg */
+static void scst_tg_update_state_stats(struct scst_target_group *tg,
+				       enum scst_tg_state old_state)
+{
+	unsigned long now = jiffies;
+	unsigned int ms;
+
+	lockdep_assert_held(&scst_dg_mutex);
+
+	if (old_state == SCST_TG_STATE_TRANSITIONING) {
+		ms = jiffies_to_msecs(now - tg->state_changed);
+		tg->transitions++;
+		tg->last_transition_ms = ms;
+		if (ms > tg->max_transition_ms)
+			tg->max_transition_ms = ms;
+	}
+	tg->state_changed = now;
+	tg->state_changes++;
+}
+
 /*
- * Update the ALUA filter of those LUNs (tgt_dev) whose target port is a member
- * of target group @tg and that export a device that is a member of the device
- * group @tg->dg.
+ * Change the ALUA state of target group @tg. Since the command path finds
+ * the ALUA filter through the target group of a LUN (tgt_dev), publishing the
+ * new filter in @tg is sufficient to make the new state visible on all LUNs
+ * whose target port is a member of @tg and that export a device that is a
+ * member of the device group @tg->dg. These LUNs are only visited to notify
+ * the dev handlers and to establish the ASYMMETRIC ACCESS STATE CHANGED unit
+ * attention, which isn't done for the transitioning state.
  */
 static void __scst_tg_set_state(struct scst_target_group *tg,
 				enum scst_tg_state state)
@@ -959,10 +975,8 @@ static void __scst_tg_set_state(struct scst_target_group *tg,
 	struct scst_dg_dev *dg_dev;
 	struct scst_device *dev;
 	struct scst_tgt_dev *tgt_dev;
-	struct scst_tg_tgt *tg_tgt;
-	struct scst_tgt *tgt;
 	enum scst_tg_state old_state = tg->state;
-	bool dev_changed;
+	bool dev_changed, gen_ua;
 
 	sBUG_ON(state >= ARRAY_SIZE(scst_alua_filter));
 	lockdep_assert_held(&scst_dg_mutex);
@@ -971,30 +985,36 @@ static void __scst_tg_set_state(struct scst_target_group *tg,
 		return;
 
 	tg->state = state;
+	WRITE_ONCE(tg->alua_filter, scst_alua_filter[state]);
+	scst_tg_update_state_stats(tg, old_state);
 
 	list_for_each_entry(dg_dev, &tg->dg->dev_list, entry) {
 		dev = dg_dev->dev;
+		if ((state == SCST_TG_STATE_TRANSITIONING) &&
+		    (dev->handler->on_alua_state_change_start == NULL) &&
+		    (dev->handler->on_alua_state_change_finish == NULL))
+			continue;
 		dev_changed = false;
 		list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
 				    dev_tgt_dev_list_entry) {
-			tgt = tgt_dev->sess->tgt;
-			list_for_each_entry(tg_tgt, &tg->tgt_list, entry) {
-				if (tg_tgt->tgt == tgt) {
-					bool gen_ua = (state != SCST_TG_STATE_TRANSITIONING);
-
-					if ((dev->handler->on_alua_state_change_start != NULL) && !dev_changed) {
-						dev->handler->on_alua_state_change_start(dev, old_state, state);
-						dev_changed = true;
-					}
-
-					if ((tg->dg->stpg_rel_tgt_id == tgt_dev->sess->tgt->rel_tgt_id) &&
-					    tid_equal(tg->dg->stpg_transport_id, tgt_dev->sess->transport_id))
-						gen_ua = false;
-					scst_tg_change_tgt_dev_state(tgt_dev,
-						state, gen_ua);
-					break;
-				}
+			if (rcu_access_pointer(tgt_dev->alua_tg) != tg)
+				continue;
+
+			if ((dev->handler->on_alua_state_change_start != NULL) && !dev_changed) {
+				dev->handler->on_alua_state_change_start(dev, old_state, state);
+				dev_changed = true;
 			}
+
+			gen_ua = (state != SCST_TG_STATE_TRANSITIONING);
+			if ((tg->dg->stpg_rel_tgt_id == tgt_dev->sess->tgt->rel_tgt_id) &&
+			    tid_equal(tg->dg->stpg_transport_id, tgt_dev->sess->transport_id))
+				gen_ua = false;
+
+			TRACE_MGMT_DBG("ALUA state of tgt_dev %p has changed "
+				"(gen_ua %d)", tgt_dev, gen_ua);
+			if (gen_ua)
+				scst_gen_aen_or_ua(tgt_dev,
+					SCST_LOAD_SENSE(scst_sense_asym_access_state_changed));
 		}
 		if ((dev->handler->on_alua_state_change_finish != NULL) && dev_changed)
 			dev->handler->on_alua_state_change_finish(dev, old_state, state);
@@ -1002,8 +1022,13 @@ static void __scst_tg_set_state(struct scst_target_group *tg,
 
 	scst_check_alua_invariant();
 
-	PRINT_INFO("Changed ALUA state of %s/%s into %s", tg->dg->name,
-		   tg->name, scst_alua_state_name(state));
+	if (old_state == SCST_TG_STATE_TRANSITIONING)
+		PRINT_INFO("Changed ALUA state of %s/%s into %s (transitioning "
+			"took %u ms)", tg->dg->name, tg->name,
+			scst_alua_state_name(state), tg->last_transition_ms);
+	else
+		PRINT_INFO("Changed ALUA state of %s/%s into %s", tg->dg->name,
+			   tg->name, scst_alua_state_name(state));
 }
 
 int scst_tg_set_state(struct scst_target_group *tg, enum scst_tg_state state)
@@ -1039,8 +1064,6 @@ static void __scst_gen_alua_state_changed_ua(struct scst_target_group *tg)
 	struct scst_dg_dev *dg_dev;
 	struct scst_device *dev;
 	struct scst_tgt_dev *tgt_dev;
-	struct scst_tg_tgt *tg_tgt;
-	struct scst_tgt *tgt;
 
 	lockdep_assert_held(&scst_dg_mutex);
 
@@ -1048,14 +1071,9 @@ static void __scst_gen_alua_state_changed_ua(struct scst_target_group *tg)
 		dev = dg_dev->dev;
 		list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
 				    dev_tgt_dev_list_entry) {
-			tgt = tgt_dev->sess->tgt;
-			list_for_each_entry(tg_tgt, &tg->tgt_list, entry) {
-				if (tg_tgt->tgt == tgt) {
-					scst_gen_aen_or_ua(tgt_dev,
+			if (rcu_access_pointer(tgt_dev->alua_tg) == tg)
+				scst_gen_aen_or_ua(tgt_dev,
 			SCST_LOAD_SENSE(scst_sense_asym_access_state_changed));
-					break;
-				}
-			}
 		}
 	}
 }
@@ -1099,8 +1117,8 @@ out:
  */
 
 /*
- * Update the ALUA filter of all tgt_devs associated with device group @dg
- * and device @dev.
+ * Update the ALUA target group of all tgt_devs associated with device group
+ * @dg and device @dev.
  */
 static void scst_update_dev_alua_filter(struct scst_dev_group *dg,
 					struct scst_device *dev)
@@ -1114,15 +1132,15 @@ static void scst_update_dev_alua_filter(struct scst_dev_group *dg,
 			    dev_tgt_dev_list_entry) {
 		tg = __lookup_tg_by_tgt(dg, tgt_dev->acg_dev->acg->tgt);
 		if (tg)
-			scst_update_tgt_dev_alua_filter(tgt_dev, tg->state);
+			scst_update_tgt_dev_alua_tg(tgt_dev, tg);
 	}
 
 	scst_check_alua_invariant();
 }
 
 /*
- * Reset the ALUA filter of all tgt_devs associated with device @dev. Note:
- * each device is member of at most one device group.
+ * Reset the ALUA target group of all tgt_devs associated with device @dev.
+ * Note: each device is member of at most one device group.
  */
 static void scst_reset_dev_alua_filter(struct scst_device *dev)
 {
@@ -1132,8 +1150,7 @@ static void scst_reset_dev_alua_filter(struct scst_device *dev)
 
 	list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
 			    dev_tgt_dev_list_entry)
-		scst_update_tgt_dev_alua_filter(tgt_dev,
-						SCST_TG_STATE_OPTIMIZED);
+		scst_update_tgt_dev_alua_tg(tgt_dev, NULL);
 
 	scst_check_alua_invariant();
 }
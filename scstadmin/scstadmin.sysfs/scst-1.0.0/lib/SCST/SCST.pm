@@ -59,6 +59,7 @@ SCST_VERSION_IO  => 'version',
 SCST_TRACE_IO    => 'trace_level',
 SCST_RESYNC_IO   => 'resync_size',
 SCST_T10_IO      => 't10_dev_id',
+SCST_CFG_BATCH_IO => 'config_batch',
 
 # Module return codes
 SCST_C_FATAL_ERROR          => 2,
@@ -542,6 +543,28 @@ sub setScstAttribute {
 			     SCST_C_ATTRIBUTE_STATIC);
 }
 
+sub configBatchSupported {
+	my $self = shift;
+
+	return (-f make_path(SCST_ROOT_DIR(), SCST_CFG_BATCH_IO)) ? TRUE : FALSE;
+}
+
+sub beginConfigBatch {
+	my $self = shift;
+	my $timeout = shift;
+
+	my $cmd = "begin";
+	$cmd .= " $timeout" if (defined($timeout));
+
+	return $self->setScstAttribute(SCST_CFG_BATCH_IO, $cmd);
+}
+
+sub commitConfigBatch {
+	my $self = shift;
+
+	return $self->setScstAttribute(SCST_CFG_BATCH_IO, "commit");
+}
+
 sub drivers {
 	my $self = shift;
 	my $dHandle = new IO::Handle;
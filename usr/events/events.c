@@ -73,6 +73,14 @@ static struct scst_event allowed_events[MAX_ALLOWED_EVENTS];
 static int allowed_events_num;
 static int non_blocking;
 
+/* Number of events fetched per SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI */
+#define EVENTS_PER_CALL		64
+#define EVENT_RECORD_SIZE	10240
+static uint8_t events_buf[EVENTS_PER_CALL * EVENT_RECORD_SIZE]
+	__attribute__((aligned(8)));
+static struct scst_event_notify_done notify_done[EVENTS_PER_CALL];
+static int notify_done_cnt;
+
 static void usage(void)
 {
 	printf("Usage: %s [OPTIONS]\n", app_name);
@@ -85,9 +93,9 @@ static void usage(void)
 #endif
 }
 
-static void handle_tm_received(struct scst_event_user *event_user)
+static void handle_tm_received(struct scst_event *event)
 {
-	struct scst_event_tm_fn_received_payload *p = (struct scst_event_tm_fn_received_payload *)event_user->out_event.payload;
+	struct scst_event_tm_fn_received_payload *p = (struct scst_event_tm_fn_received_payload *)event->payload;
 
 	printf("fn %d, device %s\n", p->fn, p->device_name);
 
@@ -99,8 +107,7 @@ int main(int argc, char **argv)
 	int res = 0, i;
 	int ch, longindex;
 	int event_fd;
-	uint8_t event_user_buf[10240];
-	struct scst_event_user *event_user = (struct scst_event_user *)event_user_buf;
+	struct scst_event_get_multi m;
 	struct pollfd pl;
 
 	setlinebuf(stdout);
@@ -203,29 +210,42 @@ int main(int argc, char **argv)
 	}
 
 	while (1) {
-		memset(event_user_buf, 0, sizeof(event_user_buf));
-		event_user->max_event_size = sizeof(event_user_buf);
-		res = ioctl(event_fd, SCST_EVENT_GET_NEXT_EVENT, event_user);
+		memset(&m, 0, sizeof(m));
+		m.pnotify_done = (unsigned long)notify_done;
+		m.notify_done_cnt = notify_done_cnt;
+		m.pevents = (unsigned long)events_buf;
+		m.event_size = EVENT_RECORD_SIZE;
+		/*
+		 * Send pending replies right away without fetching events,
+		 * otherwise they would wait until the next event arrives
+		 */
+		m.events_cnt = (notify_done_cnt > 0) ? 0 : EVENTS_PER_CALL;
+		res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI, &m);
+		if (m.notify_done_done > 0) {
+			notify_done_cnt -= m.notify_done_done;
+			memmove(notify_done, &notify_done[m.notify_done_done],
+				notify_done_cnt * sizeof(notify_done[0]));
+		}
 		if (res != 0) {
 			res = errno;
 			switch (res) {
 			case ESRCH:
 			case EBUSY:
-				TRACE_MGMT_DBG("SCST_EVENT_GET_NEXT_EVENT returned "
-					"%d (%s)", res, strerror(res));
+				TRACE_MGMT_DBG("SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI "
+					"returned %d (%s)", res, strerror(res));
 				/* go through */
 			case EINTR:
 				continue;
 			case EAGAIN:
-				TRACE_DBG("SCST_EVENT_GET_NEXT_EVENT, returned "
-					"EAGAIN (%d)", res);
+				TRACE_DBG("SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI, "
+					"returned EAGAIN (%d)", res);
 				if (non_blocking)
 					break;
 				else
 					continue;
 			default:
-				PRINT_ERROR("SCST_EVENT_GET_NEXT_EVENT failed: %s (res %d)",
-					strerror(errno), res);
+				PRINT_ERROR("SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI "
+					"failed: %s (res %d)", strerror(errno), res);
 				goto out_done;
 			}
 again_poll:
@@ -256,40 +276,33 @@ again_poll:
 
 		}
 
-		PRINT_INFO("\nevent_code %d, issuer_name %s",
-			event_user->out_event.event_code,
-			event_user->out_event.issuer_name);
-		if (event_user->out_event.payload_len != 0)
-			PRINT_BUFFER("payoad", event_user->out_event.payload,
-				event_user->out_event.payload_len);
-		PRINT_INFO("%s", "");
-
-		if (event_user->out_event.event_code == 0x12345) {
-			struct scst_event_notify_done d;
-
-			PRINT_INFO("%s", "Press any key to send reply to event "
-				"0x12345");
-			getchar();
-
-			memset(&d, 0, sizeof(d));
-			d.event_id = event_user->out_event.event_id;
-			d.status = -19;
-			res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE, &d);
-			if (res != 0)
-				PRINT_ERROR("SCST_EVENT_NOTIFY_DONE failed: %s "
-					"(res %d)", strerror(errno), res);
-		} else if (event_user->out_event.event_code == SCST_EVENT_TM_FN_RECEIVED)
-			handle_tm_received(event_user);
-		else if (event_user->out_event.event_code == SCST_EVENT_TM_FN_RECEIVED) {
-			struct scst_event_notify_done d;
-
-			memset(&d, 0, sizeof(d));
-			d.event_id = event_user->out_event.event_id;
-			d.status = -20;
-			res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE, &d);
-			if (res != 0)
-				PRINT_ERROR("SCST_EVENT_NOTIFY_DONE failed: %s "
-					"(res %d)", strerror(errno), res);
+		TRACE_DBG("Got %d events", m.events_cnt);
+
+		for (i = 0; i < m.events_cnt; i++) {
+			struct scst_event *event = (struct scst_event *)
+				&events_buf[i * EVENT_RECORD_SIZE];
+
+			PRINT_INFO("\nevent_code %d, issuer_name %s",
+				event->event_code, event->issuer_name);
+			if (event->payload_len != 0)
+				PRINT_BUFFER("payoad", event->payload,
+					event->payload_len);
+			PRINT_INFO("%s", "");
+
+			if ((event->event_code == 0x12345) &&
+			    (notify_done_cnt < EVENTS_PER_CALL)) {
+				struct scst_event_notify_done *d;
+
+				PRINT_INFO("%s", "Press any key to send reply "
+					"to event 0x12345");
+				getchar();
+
+				d = &notify_done[notify_done_cnt++];
+				memset(d, 0, sizeof(*d));
+				d->event_id = event->event_id;
+				d->status = -19;
+			} else if (event->event_code == SCST_EVENT_TM_FN_RECEIVED)
+				handle_tm_received(event);
 		}
 
 #if 0
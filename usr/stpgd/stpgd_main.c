@@ -17,6 +17,7 @@
 #include <syslog.h>
 #include <signal.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "version.h"
 #include "debug.h"
@@ -25,6 +26,7 @@
 char *app_name;
 
 #define DEFAULT_TRANSITION_TIME 17
+#define DEFAULT_WORKERS 16
 
 #if defined(DEBUG) || defined(TRACING)
 
@@ -53,10 +55,12 @@ unsigned long trace_flag = DEFAULT_LOG_FLAGS;
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
 
 int transition_timeout = DEFAULT_TRANSITION_TIME;
+int workers = DEFAULT_WORKERS;
 
 static struct option const long_options[] = {
 	{"path", required_argument, 0, 'p'},
 	{"timeout", required_argument, 0, 't'},
+	{"workers", required_argument, 0, 'w'},
 	{"foreground", no_argument, 0, 'f'},
 #if defined(DEBUG) || defined(TRACING)
 	{"debug", required_argument, 0, 'd'},
@@ -69,6 +73,33 @@ static struct option const long_options[] = {
 int stpg_init_report_pipe[2];
 char *stpg_path;
 
+static int stpg_event_fd;
+
+/*
+ * Events fetched per SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI and the initial
+ * size of each event record. Records grow, if an event doesn't fit.
+ */
+#define STPG_EVENTS_PER_CALL	16
+#define STPG_EVENT_RECORD_SIZE	(64*1024)
+
+/*
+ * STPG event queued for a worker thread. Events of the same device group
+ * are run one at a time in the order they were received, events of
+ * different device groups run concurrently on up to "workers" threads.
+ */
+struct stpg_job {
+	struct stpg_job *next;
+	struct timespec queued;
+	char dg_name[64];
+	struct scst_event *event;
+};
+
+static pthread_mutex_t stpg_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stpg_jobs_cond = PTHREAD_COND_INITIALIZER;
+/* Protected by stpg_jobs_mutex */
+static struct stpg_job *stpg_pending_jobs;
+static struct stpg_job *stpg_active_jobs;
+
 static void usage(int status)
 {
 	if (status != 0)
@@ -79,6 +110,8 @@ static void usage(int status)
 		printf("  -f, --foreground	make the program run in the foreground\n");
 		printf("  -p, --path		absolute path to the STPG script\n");
 		printf("  -t, --timeout		transition timeout\n");
+		printf("  -w, --workers		max number of device groups "
+			"transitioned concurrently\n");
 #if defined(DEBUG) || defined(TRACING)
 		printf("  -d, --debug=level     debug tracing level\n");
 #endif
@@ -86,7 +119,7 @@ static void usage(int status)
 	}
 }
 
-static void stpg_handle_tm_received(struct scst_event_user *event_user)
+static void stpg_handle_tm_received(const struct scst_event *event)
 {
 	/*
 	 * Put code to abort state transition here, if this STPG cmd,
@@ -146,23 +179,22 @@ int invoke_stpg(const uint8_t *device_name,
 		"%s %s %s %s %s", stpg_path, args[1], args[2], args[3],
 		args[4], args[5], env[1], env[2], env[3], env[4], env[5]);
 
+	/*
+	 * Other threads might hold the trace or syslog locks at the time of
+	 * fork(), so the child must not log anything.
+	 */
 	c_pid = fork();
 	if (c_pid == 0) {
-		ret = setpgid(getpid(), getpid());
-		if (ret < 0) {
-			res = -errno;
-			PRINT_ERROR("setgid failed %d (%s)", ret, strerror(-ret));
-		}
-		TRACE_DBG("pgid %d (pid %d)", getpgid(getpid()), getpid());
-		ret = execve(stpg_path, args, env);
-		if (ret < 0) {
-			res = -errno;
-			PRINT_ERROR("EXEC failed %d (%s)", ret, strerror(-ret));
-		}
-		exit(0);
+		setpgid(0, 0);
+		execve(stpg_path, args, env);
+		_exit(127);
 	} else if (c_pid < 0) {
 		res = -errno;
 		PRINT_ERROR("fork() failed: %d (%s)", res, strerror(-res));
+	} else {
+		/* Also here to not race with killpg() in handle_stpg_received() */
+		setpgid(c_pid, c_pid);
+		TRACE_DBG("Started pid %d", c_pid);
 	}
 
 	*out_pid = c_pid;
@@ -195,7 +227,7 @@ int wait_until_finished(pid_t pid, unsigned long deadline, int *status, int chil
 			}
 			break;
 		}
-		sleep(0.1);
+		usleep(100 * 1000);
 		time(&end);
 		elapsed = difftime(end, start);
 	} while (elapsed < deadline);
@@ -204,9 +236,9 @@ int wait_until_finished(pid_t pid, unsigned long deadline, int *status, int chil
 	return res;
 }
 
-int handle_stpg_received(struct scst_event_user *event_user)
+int handle_stpg_received(const struct scst_event *event)
 {
-	const struct scst_event_stpg_payload *p = (struct scst_event_stpg_payload *)event_user->out_event.payload;
+	const struct scst_event_stpg_payload *p = (struct scst_event_stpg_payload *)event->payload;
 	int num, k;
 	int res = 0;
 	pid_t pids[p->stpg_descriptors_cnt];
@@ -272,18 +304,206 @@ int handle_stpg_received(struct scst_event_user *event_user)
 	return res;
 }
 
+static long stpg_elapsed_ms(const struct timespec *start,
+	const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000 +
+		(end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Sends cnt replies in one SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI without
+ * fetching any events, so it never blocks.
+ */
+static int stpg_notify_done_multi(const struct scst_event_notify_done *d,
+	int cnt)
+{
+	struct scst_event_get_multi m;
+	int res = 0;
+
+	while (cnt > 0) {
+		memset(&m, 0, sizeof(m));
+		m.pnotify_done = (unsigned long)d;
+		m.notify_done_cnt = cnt;
+		res = ioctl(stpg_event_fd, SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI,
+			&m);
+		if (res != 0) {
+			res = -errno;
+			if (res == -EINTR)
+				continue;
+			PRINT_ERROR("SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI failed: "
+				"%s (res %d)", strerror(-res), res);
+			break;
+		}
+		d += m.notify_done_done;
+		cnt -= m.notify_done_done;
+	}
+	return res;
+}
+
+static int stpg_notify_done(uint32_t event_id, int status)
+{
+	struct scst_event_notify_done d;
+
+	memset(&d, 0, sizeof(d));
+	d.event_id = event_id;
+	d.status = status;
+	return stpg_notify_done_multi(&d, 1);
+}
+
+/* stpg_jobs_mutex supposed to be held */
+static bool stpg_dg_active(const char *dg_name)
+{
+	struct stpg_job *j;
+
+	for (j = stpg_active_jobs; j != NULL; j = j->next)
+		if (strcmp(j->dg_name, dg_name) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * stpg_jobs_mutex supposed to be held. Returns the oldest pending job whose
+ * device group has no job in progress and moves it to the active list.
+ */
+static struct stpg_job *stpg_get_job(void)
+{
+	struct stpg_job **pp, *job;
+
+	for (pp = &stpg_pending_jobs; *pp != NULL; pp = &(*pp)->next) {
+		job = *pp;
+		if (stpg_dg_active(job->dg_name))
+			continue;
+		*pp = job->next;
+		job->next = stpg_active_jobs;
+		stpg_active_jobs = job;
+		return job;
+	}
+	return NULL;
+}
+
+/* stpg_jobs_mutex supposed to be held */
+static void stpg_put_job(struct stpg_job *job)
+{
+	struct stpg_job **pp;
+
+	for (pp = &stpg_active_jobs; *pp != job; pp = &(*pp)->next)
+		;
+	*pp = job->next;
+}
+
+static void *stpg_worker(void *arg)
+{
+	struct stpg_job *job;
+	struct timespec start, end;
+	int status;
+
+	while (1) {
+		pthread_mutex_lock(&stpg_jobs_mutex);
+		while ((job = stpg_get_job()) == NULL)
+			pthread_cond_wait(&stpg_jobs_cond, &stpg_jobs_mutex);
+		pthread_mutex_unlock(&stpg_jobs_mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		status = handle_stpg_received(job->event);
+		stpg_notify_done(job->event->event_id, status);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		PRINT_INFO("STPG event %u for device group %s completed with "
+			"status %d in %ld ms (%ld ms queued)", job->event->event_id,
+			job->dg_name, status, stpg_elapsed_ms(&start, &end),
+			stpg_elapsed_ms(&job->queued, &start));
+
+		pthread_mutex_lock(&stpg_jobs_mutex);
+		stpg_put_job(job);
+		/* The next job of this device group might be runnable now */
+		pthread_cond_broadcast(&stpg_jobs_cond);
+		pthread_mutex_unlock(&stpg_jobs_mutex);
+
+		free(job);
+	}
+
+	return NULL;
+}
+
+static int stpg_queue_job(const struct scst_event *event)
+{
+	const struct scst_event_stpg_payload *p =
+		(struct scst_event_stpg_payload *)event->payload;
+	size_t event_size = sizeof(*event) + event->payload_len;
+	struct stpg_job *job, **pp;
+	int res = 0;
+
+	job = malloc(sizeof(*job) + event_size);
+	if (job == NULL) {
+		res = -ENOMEM;
+		PRINT_ERROR("Unable to allocate STPG job (size %zd)",
+			sizeof(*job) + event_size);
+		goto out;
+	}
+
+	memset(job, 0, sizeof(*job));
+	clock_gettime(CLOCK_MONOTONIC, &job->queued);
+	job->event = (struct scst_event *)(job + 1);
+	memcpy(job->event, event, event_size);
+	/* All descriptors of an STPG event belong to the same device group */
+	if (p->stpg_descriptors_cnt > 0)
+		memcpy(job->dg_name, p->stpg_descriptors[0].dg_name,
+			sizeof(job->dg_name) - 1);
+
+	TRACE_DBG("Queuing STPG event %u for device group %s", event->event_id,
+		job->dg_name);
+
+	pthread_mutex_lock(&stpg_jobs_mutex);
+	for (pp = &stpg_pending_jobs; *pp != NULL; pp = &(*pp)->next)
+		;
+	*pp = job;
+	pthread_cond_signal(&stpg_jobs_cond);
+	pthread_mutex_unlock(&stpg_jobs_mutex);
+
+out:
+	return res;
+}
+
+static int stpg_start_workers(void)
+{
+	pthread_t thread;
+	int i, res = 0;
+
+	for (i = 0; i < workers; i++) {
+		res = pthread_create(&thread, NULL, stpg_worker, NULL);
+		if (res != 0) {
+			PRINT_ERROR("pthread_create() failed: %s", strerror(res));
+			res = -res;
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	return res;
+}
+
 static int stpg_event_loop(void)
 {
-	int res = 0, status;
-	int event_fd;
-	uint8_t event_user_buf[1024*1024];
-	pid_t c_pid = 0;
+	int res = 0;
+	int event_fd, i;
+	int32_t event_size = STPG_EVENT_RECORD_SIZE;
+	uint8_t *events_buf;
+	struct scst_event_get_multi m;
+	struct scst_event_notify_done notify_done[STPG_EVENTS_PER_CALL];
+	int notify_done_cnt;
 	struct pollfd pl;
-	struct scst_event_user *event_user =
-		(struct scst_event_user *)event_user_buf;
 	struct scst_event e1;
 	bool first_error = true;
 
+	events_buf = malloc(STPG_EVENTS_PER_CALL * event_size);
+	if (events_buf == NULL) {
+		res = -ENOMEM;
+		PRINT_ERROR("Unable to allocate events buffer (size %d)",
+			STPG_EVENTS_PER_CALL * event_size);
+		goto out;
+	}
+
 	event_fd = open(SCST_EVENT_DEV, O_RDWR);
 	if (event_fd < 0) {
 		res = -errno;
@@ -291,6 +511,11 @@ static int stpg_event_loop(void)
 			SCST_EVENT_DEV, strerror(-res));
 		goto out;
 	}
+	stpg_event_fd = event_fd;
+
+	res = stpg_start_workers();
+	if (res != 0)
+		goto out;
 
 	close(stpg_init_report_pipe[0]);
 
@@ -334,25 +559,45 @@ static int stpg_event_loop(void)
 	}
 
 	while (1) {
-		memset(event_user_buf, 0, sizeof(event_user_buf));
-		event_user->max_event_size = sizeof(event_user_buf);
-		res = ioctl(event_fd, SCST_EVENT_GET_NEXT_EVENT, event_user);
+		memset(&m, 0, sizeof(m));
+		m.pevents = (unsigned long)events_buf;
+		m.event_size = event_size;
+		m.events_cnt = STPG_EVENTS_PER_CALL;
+		res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI, &m);
 		if (res != 0) {
 			res = -errno;
 			switch (-res) {
 			case ESRCH:
 			case EBUSY:
-				TRACE_MGMT_DBG("SCST_EVENT_GET_NEXT_EVENT "
-					"returned %d (%s)", res, strerror(res));
+				TRACE_MGMT_DBG("SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI "
+					"returned %d (%s)", res, strerror(-res));
 				/* go through */
 			case EINTR:
 				continue;
 			case EAGAIN:
-				TRACE_DBG("SCST_EVENT_GET_NEXT_EVENT, "
+				TRACE_DBG("SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI, "
 					"returned EAGAIN (%d)", -res);
 				continue;
+			case ENOSPC:
+			{
+				uint8_t *b;
+
+				TRACE_MGMT_DBG("Growing event records to %d "
+					"bytes", m.event_size);
+				b = realloc(events_buf,
+					STPG_EVENTS_PER_CALL * m.event_size);
+				if (b == NULL) {
+					PRINT_ERROR("Unable to grow events "
+						"buffer (size %d)",
+						STPG_EVENTS_PER_CALL * m.event_size);
+					goto out;
+				}
+				events_buf = b;
+				event_size = m.event_size;
+				continue;
+			}
 			default:
-				PRINT_ERROR("SCST_EVENT_GET_NEXT_EVENT "
+				PRINT_ERROR("SCST_EVENT_NOTIFY_DONE_AND_GET_MULTI "
 					"failed: %d (%s)", res, strerror(-res));
 				if (!first_error)
 					goto out;
@@ -361,7 +606,7 @@ static int stpg_event_loop(void)
 			}
 			first_error = true;
 again_poll:
-			res = poll(&pl, 1, c_pid > 0 ? 1 : 0);
+			res = poll(&pl, 1, -1);
 			if (res > 0)
 				continue;
 			else if (res == 0)
@@ -384,62 +629,54 @@ again_poll:
 			}
 		}
 		first_error = true;
+
+		TRACE_DBG("Got %d events", m.events_cnt);
+
+		notify_done_cnt = 0;
+		for (i = 0; i < m.events_cnt; i++) {
+			const struct scst_event *event = (struct scst_event *)
+				&events_buf[i * event_size];
 #ifdef DEBUG
-		PRINT_INFO("event_code %d, issuer_name %s",
-			event_user->out_event.event_code,
-			event_user->out_event.issuer_name);
+			PRINT_INFO("event_code %d, issuer_name %s",
+				event->event_code, event->issuer_name);
 #endif
-		if (event_user->out_event.payload_len != 0)
-			TRACE_BUFFER("payload", event_user->out_event.payload,
-				event_user->out_event.payload_len);
+			if (event->payload_len != 0)
+				TRACE_BUFFER("payload", event->payload,
+					event->payload_len);
 
-		if (event_user->out_event.event_code == SCST_EVENT_STPG_USER_INVOKE) {
-			c_pid = fork();
-			if (c_pid == -1)
-				PRINT_ERROR("Failed to fork: %d", c_pid);
-			else if (c_pid == 0) {
-				struct scst_event_notify_done d;
-
-				signal(SIGCHLD, SIG_DFL);
+			if (event->event_code == SCST_EVENT_STPG_USER_INVOKE) {
+				res = stpg_queue_job(event);
+				if (res != 0) {
+					struct scst_event_notify_done *d =
+						&notify_done[notify_done_cnt++];
 
-				status = handle_stpg_received(event_user);
+					memset(d, 0, sizeof(*d));
+					d->event_id = event->event_id;
+					d->status = res;
+				}
+			} else if (event->event_code == SCST_EVENT_TM_FN_RECEIVED)
+				stpg_handle_tm_received(event);
+			else
+				PRINT_ERROR("Unknown event %d received",
+					event->event_code);
+		}
 
-				memset(&d, 0, sizeof(d));
-				d.event_id = event_user->out_event.event_id;
-				d.status = status;
-				res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE, &d);
-				if (res != 0) {
-					res = -errno;
-					PRINT_ERROR("SCST_EVENT_NOTIFY_DONE "
-						"failed: %s (res %d)",
-						strerror(-res), res);
-				} else
-					PRINT_INFO("STPG event completed with status %d", status);
-				exit(res);
-			}
-		} else if (event_user->out_event.event_code == SCST_EVENT_TM_FN_RECEIVED)
-			stpg_handle_tm_received(event_user);
-		else
-			PRINT_ERROR("Unknown event %d received", event_user->out_event.event_code);
+		/*
+		 * Reply to the failed events right away instead of with the
+		 * next fetch, which might block until the next event arrives
+		 */
+		if (notify_done_cnt > 0)
+			stpg_notify_done_multi(notify_done, notify_done_cnt);
 	}
 out:
+	free(events_buf);
 	return res;
 }
 
-void sig_chld(int signal)
-{
-	/* Check just in case */
-	if (signal == SIGCHLD) {
-		TRACE_DBG("Cleanup zombie (pid %d)", getpid());
-		wait(NULL);
-	}
-}
-
 int main(int argc, char **argv)
 {
 	int res = 0, ch, longindex;
 	pid_t pid;
-	struct sigaction sa;
 
 	setlinebuf(stdout);
 
@@ -452,14 +689,6 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	sa.sa_handler = &sig_chld;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-	if (sigaction(SIGCHLD, &sa, 0) == -1) {
-		PRINT_ERROR("sigaction() failed: %d/%s", errno, strerror(errno));
-		exit(1);
-	}
-
 	/*
 	 * Otherwise we could die in some later write() during the event_loop()
 	 * instead of getting EPIPE!
@@ -472,7 +701,7 @@ int main(int argc, char **argv)
 
 	app_name = argv[0];
 
-	while ((ch = getopt_long(argc, argv, "+d:fp:t:hv",
+	while ((ch = getopt_long(argc, argv, "+d:fp:t:w:hv",
 			long_options, &longindex)) >= 0) {
 		switch (ch) {
 		case 'p':
@@ -497,6 +726,14 @@ int main(int argc, char **argv)
 				goto out_done;
 			}
 			break;
+		case 'w':
+			workers = strtol(optarg, (char **)NULL, 0);
+			if (workers <= 0) {
+				printf("Invalid number of workers %d\n", workers);
+				res = -EINVAL;
+				goto out_done;
+			}
+			break;
 		case 'h':
 			usage(0);
 			goto out_done;